@@ -14,6 +14,8 @@
 
 /**
  * CSC369 Assignment 1 - a1fs driver implementation.
+ *
+ * The file system operations; see ops.h. main() is in mount.c.
  */
 
 #include <errno.h>
@@ -22,15 +24,23 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <libgen.h>
+#include <linux/falloc.h>
 
 // Using 2.9.x FUSE API
 #define FUSE_USE_VERSION 29
 #include <fuse.h>
 
 #include "a1fs.h"
+#include "copy.h"
+#include "csum.h"
+#include "defrag.h"
 #include "fs_ctx.h"
+#include "group.h"
 #include "options.h"
 #include "map.h"
+#include "ops.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 //NOTE: All path arguments are absolute paths within the a1fs file system and
 // start with a '/' that corresponds to the a1fs root directory.
@@ -44,39 +54,61 @@
 // FUSE callbacks as "/dir".
 
 
-/**
- * Initialize the file system.
- *
- * Called when the file system is mounted. NOTE: we are not using the FUSE
- * init() callback since it doesn't support returning errors. This function must
- * be called explicitly before fuse_main().
- *
- * @param fs    file system context to initialize.
- * @param opts  command line options.
- * @return      true on success; false on failure.
- */
-static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
+bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
 {
 	// Nothing to initialize if only printing help or version
 	if (opts->help || opts->version) return true;
 
-	size_t size;
-	void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
+	size_t size, stripe_unit;
+	if (!volume_stripe_unit(opts->img_paths, opts->n_images, &stripe_unit)) return false;
+	void *image = opts->cache_size ?
+	              bcache_open(&fs->cache, opts->img_paths, opts->n_images, stripe_unit,
+	                          A1FS_BLOCK_SIZE, opts->cache_size, opts->direct, &size) :
+	              map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
 	if (!image) return false;
 
-	return fs_ctx_init(fs, image, size, opts);
+	if (!fs_ctx_init(fs, image, size, opts)) {
+		if (opts->cache_size) {
+			bcache_close(&fs->cache);
+		} else {
+			munmap(image, size);
+		}
+		fs->image = NULL;
+		return false;
+	}
+	// Opened here rather than in a1fs_start(): the daemon runs in "/", where a
+	// relative path would no longer point where the user meant
+	if (opts->trace && !trace_open(opts->trace)) {
+		a1fs_destroy(fs);
+		return false;
+	}
+	return true;
 }
 
-/**
- * Cleanup the file system.
- *
- * Called when the file system is unmounted. Must cleanup all the resources
- * created in a1fs_init().
- */
-static void a1fs_destroy(void *ctx)
+void a1fs_destroy(void *ctx)
 {
 	fs_ctx *fs = (fs_ctx*)ctx;
 	if (fs->image) {
+		// Wait for the blocks being punched and free them
+		reclaim_reap(&fs->reclaim, true);
+		csum_flush(fs->image);
+		stats_dump_stop(&fs->stats_dump);
+		trace_close();
+		if (fs->opts->verbose) {
+			readahead_report(&fs->readahead, stderr);
+			stats_report(stderr);
+		}
+		if (fs->cache.base) {
+			// Dirty units only exist in the cache; write them back even
+			// without --sync
+			if (bcache_writeback(&fs->cache, fs->image, fs->size, fs->opts->sync) < 0) {
+				perror("bcache_writeback");
+			}
+			if (fs->opts->verbose) bcache_report(&fs->cache, stderr);
+			fs_ctx_destroy(fs);
+			bcache_close(&fs->cache);
+			return;
+		}
 		if (fs->opts->sync && (msync(fs->image, fs->size, MS_SYNC) < 0)) {
 			perror("msync");
 		}
@@ -85,12 +117,82 @@ static void a1fs_destroy(void *ctx)
 	}
 }
 
-/** Get file system context. */
+/** Get file system context. Only for the FUSE callbacks; the operations
+ * themselves take it as an argument (see ops.h). */
 static fs_ctx *get_fs(void)
 {
 	return (fs_ctx*)fuse_get_context()->private_data;
 }
 
+/** -errno for a failed path lookup (find_inode_path()). */
+static int lookup_errno(int result)
+{
+	if (result == -2) return -ENOTDIR;
+	if (result == -3) return -EIO;
+	return -ENOENT;
+}
+
+void a1fs_start(fs_ctx *fs)
+{
+	if (fs->cache.base) bcache_start(&fs->cache);
+	fs_ctx_populate(fs);
+	if (fs->opts->verbose && fs->opts->stats_interval > 0 &&
+	    !stats_dump_start(&fs->stats_dump, fs->opts->stats_interval, stderr)) {
+		fprintf(stderr, "a1fs: failed to start the statistics dump\n");
+	}
+}
+
+/**
+ * FUSE init() callback: a1fs_start() in the FUSE daemon, which may be a child
+ * of the process that called a1fs_init().
+ *
+ * @param conn  unused.
+ * @return      the file system context, passed on to destroy().
+ */
+static void *a1fs_fuse_init(struct fuse_conn_info *conn)
+{
+	(void)conn;// unused
+	fs_ctx *fs = get_fs();
+	a1fs_start(fs);
+	return fs;
+}
+
+
+// The statistics file (STATS_FILE, see stats.h) lives in the root directory
+// without a directory entry: it isn't listed, can't be changed, and hides a
+// real file of the same name
+
+static bool is_stats_file(const char *path)
+{
+	return strcmp(path, STATS_FILE) == 0;
+}
+
+static void stats_file_refresh(fs_ctx *fs)
+{
+	fs->stats_len = stats_format(fs->stats_text, sizeof(fs->stats_text), "");
+}
+
+static int stats_file_getattr(fs_ctx *fs, struct stat *st)
+{
+	stats_file_refresh(fs);
+	st->st_mode = S_IFREG | 0444;
+	st->st_nlink = 1;
+	st->st_size = fs->stats_len;
+	clock_gettime(CLOCK_REALTIME, &st->st_mtim);
+	return 0;
+}
+
+/** The text is taken anew by a read from the start, and then read on from the
+ * same snapshot. */
+static int stats_file_read(fs_ctx *fs, char *buf, size_t size, off_t offset)
+{
+	if (offset == 0) stats_file_refresh(fs);
+	if ((uint64_t)offset >= fs->stats_len) return 0;
+	if (size > fs->stats_len - offset) size = fs->stats_len - offset;
+	memcpy(buf, fs->stats_text + offset, size);
+	return size;
+}
+
 
 /**
  * Get file system statistics.
@@ -101,24 +203,25 @@ static fs_ctx *get_fs(void)
  * The following fields can be ignored: f_fsid, f_flag.
  * All remaining fields are required.
  *
+ * @param fs    file system context.
  * @param path  path to any file in the file system. Can be ignored.
  * @param st    pointer to the struct statvfs that receives the result.
  * @return      0 on success; -errno on error.
  */
-static int a1fs_statfs(const char *path, struct statvfs *st)
+static int a1fs_statfs(fs_ctx *fs, const char *path, struct statvfs *st)
 {
 	(void)path;// unused
-	fs_ctx *fs = get_fs();
 
 	memset(st, 0, sizeof(*st));
-	st->f_bsize   = A1FS_BLOCK_SIZE;
-	st->f_frsize  = A1FS_BLOCK_SIZE;
+	st->f_bsize   = block_size(fs->image);
+	st->f_frsize  = block_size(fs->image);
 	//TODO: fill in the rest of required fields based on the information stored
 	// in the superblock
 	a1fs_superblock *sb = (a1fs_superblock *)(fs->image);
 	st->f_blocks = sb->blocks_count;
-	st->f_bfree = sb->free_blocks_count;
-	st->f_bavail = sb->free_blocks_count;
+	// blocks waiting in the reclaim queue are as good as free
+	st->f_bfree = sb->free_blocks_count + fs->reclaim.pending;
+	st->f_bavail = sb->free_blocks_count + fs->reclaim.pending;
 	st->f_files = sb->inodes_count;
 	st->f_ffree = sb->free_inodes_count;
 	st->f_favail = sb->free_inodes_count;
@@ -141,31 +244,31 @@ static int a1fs_statfs(const char *path, struct statvfs *st)
  *   ENOENT        a component of the path does not exist.
  *   ENOTDIR       a component of the path prefix is not a directory.
  *
+ * @param fs    file system context.
  * @param path  path to a file or directory.
  * @param st    pointer to the struct stat that receives the result.
  * @return      0 on success; -errno on error;
  */
-static int a1fs_getattr(const char *path, struct stat *st)
+static int a1fs_getattr(fs_ctx *fs, const char *path, struct stat *st)
 {
 	if (strlen(path) >= A1FS_PATH_MAX) return -ENAMETOOLONG;
-	fs_ctx *fs = get_fs();
 
 	memset(st, 0, sizeof(*st));
+	if (is_stats_file(path)) return stats_file_getattr(fs, st);
 
 	//TODO
 	char * sb = (char *) fs->image;
 	a1fs_inode *inode;
-	int result = find_inode_path(path, sb, &inode);
-	if(result == -1){
-		return -ENOENT ;
-	}
-	if(result == -2){
-		return -ENOTDIR;
+	// Only the inode itself; its extent record stays out of the cache
+	int result = find_inode_attrs(path, sb, &inode);
+	if(result != 0){
+		return lookup_errno(result);
 	}
 	st->st_mode = inode->mode;
 	st->st_nlink = inode->links;
 	st->st_size = inode->size;
-	st->st_blocks = total_datablock_for_inode(inode) * A1FS_BLOCK_SIZE / 512;// change here
+	st->st_blocks = total_datablock_for_inode(fs->image, inode) * block_size(fs->image) / 512 +
+	                (inode->tail.length + 511) / 512;
 	st->st_mtim = inode->mtime;
 	return 0;
 	// return -ENOSYS;
@@ -183,6 +286,7 @@ static int a1fs_getattr(const char *path, struct stat *st)
  * Errors:
  *   ENOMEM  not enough memory (e.g. a filler() call failed).
  *
+ * @param fs      file system context.
  * @param path    path to the directory.
  * @param buf     buffer that receives the result.
  * @param filler  function that needs to be called for each directory entry.
@@ -191,16 +295,21 @@ static int a1fs_getattr(const char *path, struct stat *st)
  * @param fi      unused.
  * @return        0 on success; -errno on error.
  */
-static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+static int a1fs_readdir(fs_ctx *fs, const char *path, void *buf, fuse_fill_dir_t filler,
                         off_t offset, struct fuse_file_info *fi)
 {
 	(void)offset;// unused
 	(void)fi;// unused
-	fs_ctx *fs = get_fs();
 	char * sb = (char *) fs->image;
 	a1fs_inode *inode;
-	find_inode_path(path, sb, &inode);
-	int result = read_entries(filler, sb, inode, buf);
+	int result = find_inode_path(path, sb, &inode);
+	if(result != 0){
+		return lookup_errno(result);
+	}
+	result = read_entries(filler, sb, inode, buf);
+	if(result == -3){
+		return -EIO;
+	}
 	if(result == -1 || filler(buf, "." , NULL, 0) != 0 || filler(buf, ".." , NULL, 0) != 0){
 		return -ENOMEM;
 	}
@@ -226,13 +335,15 @@ static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
  *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *   ENOSPC  not enough free space in the file system.
  *
+ * @param fs    file system context.
  * @param path  path to the directory to create.
  * @param mode  file mode bits.
  * @return      0 on success; -errno on error.
  */
-static int a1fs_mkdir(const char *path, mode_t mode)
+static int a1fs_mkdir(fs_ctx *fs, const char *path, mode_t mode)
 {
-	fs_ctx *fs = get_fs();
+	if (is_stats_file(path)) return -EEXIST;
+	if (fs->corrupt) return -EROFS;
     char *image = fs->image;
 	char new_path[A1FS_PATH_MAX];
     strcpy(new_path, path);
@@ -243,16 +354,25 @@ static int a1fs_mkdir(const char *path, mode_t mode)
     strcpy(filename, basename(new_path));
     strcpy(parentPath, dirname(new_path));
 
-	// find available inode
-    a1fs_ino_t inode_bit_available = empty_inode_bitmap(image);
+	a1fs_inode *parent;
+	int result = find_inode_path(parentPath, image, &parent);
+	if(result != 0){
+		return lookup_errno(result);
+	}
+
+	// find available inode, Orlov-style
+    a1fs_ino_t inode_bit_available = empty_inode_bitmap(image, parent, true);
     if (inode_bit_available == 0) {
 		return -ENOSPC;
 	}
     toggle_inode_bit(image, inode_bit_available);
+    group_dir_changed(image, inode_bit_available, 1);
 	a1fs_ino_t inodeNum = inode_bit_available+1;
 	
     /*Initiating an inode*/
     a1fs_inode *new_inode = find_inode_num(image, inodeNum);
+    memset(new_inode, 0, sizeof(a1fs_inode));
+    clear_inode_extents(image, new_inode);
     new_inode->mode = mode | S_IFDIR;
     new_inode->links = 2;
     new_inode->size = (2*sizeof(a1fs_dentry));
@@ -261,10 +381,14 @@ static int a1fs_mkdir(const char *path, mode_t mode)
     clock_gettime(CLOCK_REALTIME, &new_inode->mtime);
     
     /*Update the parent diretory*/
-	a1fs_inode *parent;
-	find_inode_path(parentPath, image, &parent);
     parent->links += 1;
-     int result = change_parent(image, parent, filename, inodeNum);
+     result = change_parent(image, parent, filename, inodeNum);
+     csum_update_inode(image, new_inode);
+     csum_update_inode(image, parent);
+     csum_flush(image);
+     if(result == -3){
+         return -EIO;
+     }
      if(result == -1){
          return -ENOSPC;
      }
@@ -282,12 +406,14 @@ static int a1fs_mkdir(const char *path, mode_t mode)
  * Errors:
  *   ENOTEMPTY  the directory is not empty.
  *
+ * @param fs    file system context.
  * @param path  path to the directory to remove.
  * @return      0 on success; -errno on error.
  */
-static int a1fs_rmdir(const char *path)
+static int a1fs_rmdir(fs_ctx *fs, const char *path)
 {
-	fs_ctx *fs = get_fs();
+	if (is_stats_file(path)) return -ENOTDIR;
+	if (fs->corrupt) return -EROFS;
 
 	//TODO: remove the directory at given path (only if it's empty)
     char *image = fs->image;
@@ -297,23 +423,34 @@ static int a1fs_rmdir(const char *path)
     char filename[A1FS_NAME_MAX];
     strcpy(filename, basename(pathA));
 	a1fs_inode *inode_to_remove;
-    find_inode_path(path, image, &inode_to_remove);
+    int result = find_inode_path(path, image, &inode_to_remove);
+    if(result != 0){
+        return lookup_errno(result);
+    }
 
     if (inode_to_remove->links != 2) {
          return -ENOTEMPTY;
      }
 
+    char parentPath[A1FS_PATH_MAX];
+    strcpy(parentPath, dirname(pathA));
+	a1fs_inode *parent;
+    result = find_inode_path(parentPath, image, &parent);
+    if(result != 0){
+        return lookup_errno(result);
+    }
+
 	a1fs_ino_t inodeNum = inode_to_remove->inode_num;
 	toggle_inode_bit(image, inodeNum-1);
+	group_dir_changed(image, inodeNum-1, -1);
+	trim_blocks(image, inode_to_remove, 0);
     
     /*update parent*/
-    char parentPath[A1FS_PATH_MAX];
-    strcpy(parentPath, dirname(pathA));
-	a1fs_inode *parent;
-    find_inode_path(parentPath, image, &parent);
     parent->links -= 1;
 	parent->size -= sizeof(a1fs_dentry);
 	remove_entry(image, parent, filename);
+	csum_update_inode(image, parent);
+	csum_flush(image);
 	return 0;
 }
 
@@ -331,16 +468,18 @@ static int a1fs_rmdir(const char *path)
  *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *   ENOSPC  not enough free space in the file system.
  *
+ * @param fs    file system context.
  * @param path  path to the file to create.
  * @param mode  file mode bits.
  * @param fi    unused.
  * @return      0 on success; -errno on error.
  */
-static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+static int a1fs_create(fs_ctx *fs, const char *path, mode_t mode, struct fuse_file_info *fi)
 {
 	(void)fi;// unused
 	assert(S_ISREG(mode));
-		fs_ctx *fs = get_fs();
+	if (is_stats_file(path)) return -EEXIST;
+	if (fs->corrupt) return -EROFS;
     char *image = fs->image;
 	char pathA[A1FS_PATH_MAX];
     strcpy(pathA, path);
@@ -348,8 +487,16 @@ static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     char filename[A1FS_NAME_MAX];
     strcpy(filename, basename(pathA));
 
-	// find available inode
-    a1fs_ino_t inode_bit_available = empty_inode_bitmap(image);
+	a1fs_inode *parent;
+    char parentPath[A1FS_PATH_MAX];
+    strcpy(parentPath, dirname(pathA));
+	int result = find_inode_path(parentPath, image, &parent);
+	if(result != 0){
+		return lookup_errno(result);
+	}
+
+	// find available inode, in the parent's group
+    a1fs_ino_t inode_bit_available = empty_inode_bitmap(image, parent, false);
     if (inode_bit_available == 0) {
 		return -ENOSPC;
 	}
@@ -358,6 +505,8 @@ static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	
     /*Initiating an inode*/
     a1fs_inode *new_inode = find_inode_num(image, inodeNum);
+    memset(new_inode, 0, sizeof(a1fs_inode));
+    clear_inode_extents(image, new_inode);
     new_inode->mode = mode;
     new_inode->links = 1;
     new_inode->size = 0;
@@ -366,11 +515,13 @@ static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     clock_gettime(CLOCK_REALTIME, &new_inode->mtime);
     
     /*Update the parent diretory*/
-	a1fs_inode *parent;
-    char parentPath[A1FS_PATH_MAX];
-    strcpy(parentPath, dirname(pathA));
-	find_inode_path(parentPath, image, &parent);
-    int result = change_parent(image, parent, filename, inodeNum);
+    result = change_parent(image, parent, filename, inodeNum);
+    csum_update_inode(image, new_inode);
+    csum_update_inode(image, parent);
+    csum_flush(image);
+	if(result == -3){
+		return -EIO;
+	}
 	if(result == -1){
 		return -ENOSPC;
 	}
@@ -385,12 +536,14 @@ static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
  *
+ * @param fs    file system context.
  * @param path  path to the file to remove.
  * @return      0 on success; -errno on error.
  */
-static int a1fs_unlink(const char *path)
+static int a1fs_unlink(fs_ctx *fs, const char *path)
 {
-	fs_ctx *fs = get_fs();
+	if (is_stats_file(path)) return -EPERM;
+	if (fs->corrupt) return -EROFS;
 
 	//TODO: remove the file at given path
 	char *image = fs->image;
@@ -400,23 +553,31 @@ static int a1fs_unlink(const char *path)
     strcpy(filename, basename(pathA));
 
 	a1fs_inode *inode_to_remove;
-    find_inode_path(path, image, &inode_to_remove);
+    int result = find_inode_path(path, image, &inode_to_remove);
+    if(result != 0){
+        return lookup_errno(result);
+    }
+	a1fs_inode *parent;
+    char parentPath[A1FS_PATH_MAX];
+    strcpy(parentPath, dirname(pathA));
+    result = find_inode_path(parentPath, image, &parent);
+    if(result != 0){
+        return lookup_errno(result);
+    }
+
 	a1fs_ino_t inodeNum = inode_to_remove->inode_num;
 	toggle_inode_bit(image, inodeNum-1);
     
 	for(a1fs_blk_t i = 0; i< inode_to_remove->i_blocks; i++){
-		a1fs_extent extent = inode_to_remove->i_block[i];
-		for(a1fs_blk_t j = extent.start; j < extent.start + extent.count; j++){
-			toggle_block_bit(image, j);
-			}
+		a1fs_extent extent = inode_extent(image, inode_to_remove, i);
+		free_blocks(image, extent.start, extent.count);
 		}
+	tail_release(image, inode_to_remove);
     /*update parent*/
-	a1fs_inode *parent;
-    char parentPath[A1FS_PATH_MAX];
-    strcpy(parentPath, dirname(pathA));
-    find_inode_path(parentPath, image, &parent);
 	parent->size -= sizeof(a1fs_dentry);
 	remove_entry(image, parent, filename);
+	csum_update_inode(image, parent);
+	csum_flush(image);
 	return 0;
 }
 
@@ -439,13 +600,15 @@ static int a1fs_unlink(const char *path)
  *   ENOTEMPTY  destination is a non-empty directory.
  *   ENOSPC     not enough free space in the file system.
  *
+ * @param fs    file system context.
  * @param from  original file path.
  * @param to    new file path.
  * @return      0 on success; -errno on error.
  */
-static int a1fs_rename(const char *from, const char *to)
+static int a1fs_rename(fs_ctx *fs, const char *from, const char *to)
 {
-	fs_ctx *fs = get_fs();
+	if (is_stats_file(from) || is_stats_file(to)) return -EPERM;
+	if (fs->corrupt) return -EROFS;
 
 	//TODO: move the inode (file or directory) at given source path to the
 	// destination path, according to the description above
@@ -466,11 +629,28 @@ static int a1fs_rename(const char *from, const char *to)
     strcpy(toParentPath, dirname(toC));
 
 
+    /*all the lookups come first, so that a corrupt or missing path changes nothing*/
     a1fs_inode *toParentInode;
-    find_inode_path(toParentPath, image, &toParentInode);
+    int result = find_inode_path(toParentPath, image, &toParentInode);
+    if(result != 0){
+        return lookup_errno(result);
+    }
+    a1fs_inode *inode;
+    result = find_inode_path(from, image, &inode);
+    if(result != 0){
+        return lookup_errno(result);
+    }
+    a1fs_inode *fromParInode;
+    result = find_inode_path(fromParentPath, image, &fromParInode);
+    if(result != 0){
+        return lookup_errno(result);
+    }
 
     a1fs_inode *newInode;
     int find = find_inode_path(to, image, &newInode);
+    if(find != 0 && find != -1){
+        return lookup_errno(find);
+    }
     if(find == 0){
         if(S_ISREG(newInode->mode) && newInode->size != 0){
             return -ENOTEMPTY;
@@ -478,23 +658,36 @@ static int a1fs_rename(const char *from, const char *to)
         else if(S_ISDIR(newInode->mode) && newInode->size != 2*sizeof(a1fs_dentry)){
             return -ENOTEMPTY;
         }
-        toParentInode->links --;
+        if(S_ISDIR(newInode->mode)){
+            toParentInode->links --;
+        }
+        toParentInode->size -= sizeof(a1fs_dentry);
         remove_entry(image, toParentInode, newFileName);
+        /*free the replaced inode*/
+        toggle_inode_bit(image, newInode->inode_num-1);
+        if(S_ISDIR(newInode->mode)){
+            group_dir_changed(image, newInode->inode_num-1, -1);
+        }
+        trim_blocks(image, newInode, 0);
+        tail_release(image, newInode);
     }
 
-    a1fs_inode *inode;
-	find_inode_path(from, image, &inode);
-
-    if(change_parent(image, toParentInode, newFileName, inode->inode_num) == -1){
-        return -ENOSPC;
+    result = change_parent(image, toParentInode, newFileName, inode->inode_num);
+    if(result != 0){
+        csum_update_inode(image, toParentInode);
+        csum_flush(image);
+        return result == -3 ? -EIO : -ENOSPC;
     }
-    toParentInode->links ++;
 
-    a1fs_inode *fromParInode;
-    find_inode_path(fromParentPath, image, &fromParInode);
+    if(S_ISDIR(inode->mode)){
+        toParentInode->links ++;
+        fromParInode->links --;
+    }
     fromParInode->size -= sizeof(a1fs_dentry);
     remove_entry(image, fromParInode, filename);
-
+    csum_update_inode(image, toParentInode);
+    csum_update_inode(image, fromParInode);
+    csum_flush(image);
 
 	return 0;
 }
@@ -510,24 +703,84 @@ static int a1fs_rename(const char *from, const char *to)
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists.
  *
+ * @param fs    file system context.
  * @param path  path to the file or directory.
  * @param tv    timestamps array. See "man 2 utimensat" for details.
  * @return      0 on success; -errno on failure.
  */
-static int a1fs_utimens(const char *path, const struct timespec tv[2])
+static int a1fs_utimens(fs_ctx *fs, const char *path, const struct timespec tv[2])
 {
-	fs_ctx *fs = get_fs();
+	if (is_stats_file(path)) return -EPERM;
+	if (fs->corrupt) return -EROFS;
 
 	//TODO: update the modification timestamp (mtime) in the inode for given
 	// path with either the time passed as argument or the current time,
 	// according to the utimensat man page
 	char *sb = fs->image;
 	a1fs_inode *inode;
-	find_inode_path(path,sb,&inode);
+	int result = find_inode_path(path,sb,&inode);
+	if(result != 0){
+		return lookup_errno(result);
+	}
 	inode->mtime = tv[0];
+	csum_update_inode(sb, inode);
 	return 0;
 }
 
+/**
+ * Set the size of a file, allocating zeroed blocks or freeing blocks as needed.
+ *
+ * The partial last block of a small file is kept packed in a shared tail block
+ * (see tail_pack()). The tail is resized in place when possible; otherwise it
+ * is moved back into a block of its own for the resize and packed again after.
+ *
+ * @param image  pointer to the start of the image.
+ * @param inode  inode of the file.
+ * @param size   new file size in bytes.
+ * @return       0 on success; -ENOSPC if there is not enough free space.
+ */
+static int resize_file(char *image, a1fs_inode *inode, uint64_t size)
+{
+    size_t bs = block_size(image);
+    uint64_t ext_bytes = (uint64_t)total_datablock_for_inode(image, inode) * bs;
+    if (inode->tail.block != 0) {
+        if (size > ext_bytes && size <= A1FS_TAIL_FILE_BLOCKS * bs &&
+            tail_resize(image, inode, size - ext_bytes) == 0) {
+            inode->size = size;
+            return 0;
+        }
+        if (size <= ext_bytes) {
+            tail_release(image, inode);
+        } else if (tail_unpack(image, inode) != 0) {
+            return -ENOSPC;
+        }
+        ext_bytes = (uint64_t)total_datablock_for_inode(image, inode) * bs;
+    }
+
+    a1fs_blk_t have = ext_bytes / bs;
+    a1fs_blk_t need = align_up(size, bs) / bs;
+    if (size < inode->size) {
+        /*blocks reserved past the end by fallocate() go with the shrink*/
+        trim_blocks(image, inode, need);
+    } else {
+        /*zero the stale bytes past the old end of file in its last block*/
+        uint64_t end = align_up(inode->size, bs);
+        if (end > size) end = size;
+        if (end > ext_bytes) end = ext_bytes;
+        if (inode->size < end && !file_unwritten(image, inode, inode->size)) {
+            uint64_t len;
+            char *start = file_span(image, inode, inode->size, &len);
+            memset(start, 0, end - inode->size);
+        }
+        if (need > have && alloc_blocks(image, inode, need - have) != 0) {
+            return -ENOSPC;
+        }
+    }
+    inode->size = size;
+    tail_pack(image, inode);
+    return 0;
+}
+
 /**
  * Change the size of a file.
  *
@@ -542,150 +795,31 @@ static int a1fs_utimens(const char *path, const struct timespec tv[2])
  *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *   ENOSPC  not enough free space in the file system.
  *
+ * @param fs    file system context.
  * @param path  path to the file to set the size.
  * @param size  new file size in bytes.
  * @return      0 on success; -errno on error.
  */
-static int a1fs_truncate(const char *path, off_t size)
+static int a1fs_truncate(fs_ctx *fs, const char *path, off_t size)
 {
-    fs_ctx *fs = get_fs();
-    /*(void) path;*/
-    /*(void) size;*/
-    /*(void) fs;*/
-    
-	/*return -ENOSYS;*/
-    
+    if (is_stats_file(path)) return -EPERM;
+    if (fs->corrupt) return -EROFS;
 
 	//TODO: set new file size, possibly "zeroing out" the uninitialized range
     char *image = fs -> image;
     a1fs_inode *inode;
-    
-    find_inode_path(path, image, &inode);
-    
-    uint64_t oldsize = inode->size;
-    inode->size = size;
-    
-    a1fs_blk_t extra = 0;
-    a1fs_blk_t i_extent = 0;
-
-    /*required_blocks is the total number of block occupied by th truncated*/
-    a1fs_blk_t required_blocks;
-    if (size % A1FS_BLOCK_SIZE != 0) {
-        required_blocks = size/A1FS_BLOCK_SIZE + 1;
-    }
-    else{
-        required_blocks = size/A1FS_BLOCK_SIZE;
-    }
-    a1fs_extent *current_extent;
-    /*indicated size is 0 - making a size of 0 bytes*/
-    if(size == 0){
-        for(a1fs_blk_t i = 0; i< inode->i_blocks; i++){
-            a1fs_extent *extent = &(inode->i_block[i]);
-            for(a1fs_blk_t j = extent->start; j < extent->start + extent->count; j++){
-                toggle_block_bit(image, j);
-            }
-        }
-        inode->i_blocks = 0;
-        return 0;
+    int result = find_inode_path(path, image, &inode);
+    if (result != 0) {
+        return lookup_errno(result);
     }
-    
 
-    /*Size must be truncated indicated size is smaller*/
-    else if (oldsize >= (uint64_t) size) {
-        /*Size more than multiple of blocks*/
-        
-        while (required_blocks != 0) {
-            current_extent = &(inode->i_block[i_extent]);
-            if (required_blocks <= current_extent->count) {
-                extra = required_blocks;
-                required_blocks = 0;
-            }
-            else {
-                required_blocks -= current_extent->count;
-                i_extent += 1;
-            }
-        }
-        char *last_block = find_data_block(image, current_extent->start + extra - 1);
-        a1fs_blk_t extent_left = inode->i_blocks - i_extent - 1;
-        a1fs_blk_t count_left = current_extent->count - extra;
-        uint64_t offset = size % A1FS_BLOCK_SIZE;
-        
-        if (offset) {
-            memset((char *) last_block + offset, 0, A1FS_BLOCK_SIZE - offset);
-        }
-        
-        while(count_left) {
-            toggle_block_bit(image, 
-                    (a1fs_blk_t) current_extent->start + extra);
-            extra ++;
-            count_left--;
-        }
-        
-        a1fs_blk_t block;
-        while(extent_left) {
-            extra = 0;
-            i_extent ++;
-            current_extent = &(inode->i_block[i_extent]);
-            required_blocks = current_extent->count;
-            while (required_blocks) {
-                block = current_extent->start+extra;
-                toggle_block_bit(image, block);
-                required_blocks--;
-                extra ++;
-            }
-            i_extent --;
-        }
-        return 0;
-    }
-    
-    else {
-        a1fs_blk_t current_blocks = total_datablock_for_inode(inode);
-        a1fs_blk_t extents = inode->i_blocks;
-        a1fs_blk_t remaining_blocks = required_blocks - current_blocks;
-        uint64_t current_size = oldsize;
-        a1fs_blk_t i = 0;
-        /*char *last_block;*/
-        
-        /*Certain blocks allocated by file*/
-        if (extents > 0) {
-            current_extent = &(inode->i_block[extents - 1]); 
-            a1fs_blk_t last_block_num = current_extent->start + current_extent->count -1;
-            while (i < remaining_blocks) {
-                if (check_block_bitmap(image, last_block_num + 1 + i)) {
-                    break;
-                }
-                i++;
-            }
-            current_extent->count += i;
-            uint64_t start_offset = oldsize%A1FS_BLOCK_SIZE;
-            if (remaining_blocks == 0) {
-                null_padding_helper(image, 1, last_block_num, oldsize, size, 0);
-            } else {
-                null_padding_helper(image, 1, last_block_num, oldsize, 
-                        oldsize + ((i+1)*A1FS_BLOCK_SIZE - start_offset), 0);
-                current_size +=  (i+1)*A1FS_BLOCK_SIZE - start_offset;
-            }
-        } 
-
-        
-        /*left overs*/
-        remaining_blocks -= i;
-        
-        if (remaining_blocks) {
-            a1fs_blk_t free_blocks_idx = empty_block_bitmap(image);
-            if(free_blocks_idx == 0) {
-                return -ENOSPC;
-            }
-            current_extent = get_new_extent(inode);
-            if (current_extent == NULL) {
-                return -ENOSPC;
-            }
-            current_extent->start = free_blocks_idx;
-            current_extent->count = remaining_blocks;
-            null_padding_helper(image, 0, free_blocks_idx, current_size, size, 1);
-        }
-        return 0;
+    result = resize_file(image, inode, size);
+    if (result == 0) {
+        clock_gettime(CLOCK_REALTIME, &inode->mtime);
     }
+    csum_update_inode(image, inode);
+    csum_flush(image);
+    return result;
 }
 
 
@@ -700,6 +834,7 @@ static int a1fs_truncate(const char *path, off_t size)
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
  *
+ * @param fs      file system context.
  * @param path    path to the file to read from.
  * @param buf     pointer to the buffer that receives the data.
  * @param size    buffer size (number of bytes requested).
@@ -708,69 +843,51 @@ static int a1fs_truncate(const char *path, off_t size)
  * @return        number of bytes read on success; 0 if offset is beyond EOF;
  *                -errno on error.
  */
-static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
+static int a1fs_read(fs_ctx *fs, const char *path, char *buf, size_t size, off_t offset,
                      struct fuse_file_info *fi)
 {
     (void)fi;// unused
-    fs_ctx *fs = get_fs();
+    if (is_stats_file(path)) return stats_file_read(fs, buf, size, offset);
 
 	//TODO: read data from the file at given offset into the buffer
     char *image = fs->image;
     a1fs_inode *inode;
     
     /*finding the inode of the given path*/
-    find_inode_path(path, image, &inode);
+    int result = find_inode_path(path, image, &inode);
+    if (result != 0) {
+        return lookup_errno(result);
+    }
     
     /*offset(where reading starts) larger than file size - unable to read*/
     if((uint64_t) offset >= inode->size) {
         return 0;
     }
-    
-    a1fs_blk_t offset_block = (a1fs_blk_t) (offset / A1FS_BLOCK_SIZE) + 1; 
-    uint64_t offset_position = (uint64_t) offset % A1FS_BLOCK_SIZE;
-    a1fs_blk_t offset_extent = 0;    /*extent at which offset starts*/
-    a1fs_blk_t offset_index = offset_block;     /*The indicator for where in the extent the offset starts*/
-    a1fs_extent *current_extent;
-    
-    /*this while block gives us the extent where offset starts from*/
-    while (1) {
-        current_extent = &(inode->i_block[offset_extent]); 
-        if (offset_index <= current_extent->count) {
-            offset_index -= 1;
-            break;
+    if (size > inode->size - offset) {
+        size = inode->size - offset;
+    }
+    /*prefetch what a sequential reader will ask for next; --random opts out*/
+    if (!fs->opts->random) {
+        readahead_read(&fs->readahead, image, inode, offset, size);
+    }
+
+    /*copy one contiguous run of the file (an extent or the tail) at a time*/
+    size_t bytes_read = 0;
+    while (bytes_read < size) {
+        uint64_t len;
+        char *start = file_span(image, inode, offset + bytes_read, &len);
+        if (len > size - bytes_read) {
+            len = size - bytes_read;
+        }
+        /*reserved but never written blocks read as zeros*/
+        if (file_unwritten(image, inode, offset + bytes_read)) {
+            memset(buf + bytes_read, 0, len);
         } else {
-            offset_index -= current_extent->count; 
-            offset_extent += 1;
+            memcpy(buf + bytes_read, start, len);
         }
+        bytes_read += len;
     }
-    
-    char *start = find_data_block(image, current_extent->start + offset_index) + offset_position;
-    size_t bytes_left = inode->size - offset;
-    size_t bytes_in_extent = (current_extent->count - offset_index)*A1FS_BLOCK_SIZE - offset_position; 
-    size_t bytes_read = 0; 
-    
-    
-    if (bytes_left >= size) {
-        bytes_left = size;
-    } 
-    
-    /*more bytes to be read after reading till the end of the extent*/
-    while (bytes_in_extent < bytes_left) {
-       memcpy(buf + bytes_read, start, bytes_in_extent);
-       
-       bytes_left -= bytes_in_extent;
-       bytes_read += bytes_in_extent;
-       
-       offset_extent++;
-       current_extent = &(inode->i_block[offset_extent]); 
-       start = find_data_block(image, current_extent->start);
-       bytes_in_extent = current_extent->count * A1FS_BLOCK_SIZE;
-    }
-    /*read the byte_left amount within the extent and it is over*/
-    memcpy(buf + bytes_read, start, bytes_left);
-    bytes_read += bytes_left;
-    bytes_left = 0;
-    
+    stats_add(STATS_BYTES_READ, bytes_read);
     return bytes_read;
 }
 
@@ -785,6 +902,7 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
  *
+ * @param fs      file system context.
  * @param path    path to the file to write to.
  * @param buf     pointer to the buffer containing the data.
  * @param size    buffer size (number of bytes requested).
@@ -792,106 +910,305 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
  * @param fi      unused.
  * @return        number of bytes written on success; -errno on error.
  */
-static int a1fs_write(const char *path, const char *buf, size_t size,
+static int a1fs_write(fs_ctx *fs, const char *path, const char *buf, size_t size,
                       off_t offset, struct fuse_file_info *fi)
 {
 	(void)fi;// unused
-	fs_ctx *fs = get_fs();
+	if (is_stats_file(path)) return -EPERM;
+	if (fs->corrupt) return -EROFS;
 
 	//TODO: write data from the buffer into the file at given offset, possibly
 	// "zeroing out" the uninitialized range
-    char *sb = fs->image;
-    a1fs_superblock *superblock = (a1fs_superblock *) sb;
+    char *image = fs->image;
     a1fs_inode *inode;
-    find_inode_path(path, sb, &inode);
-    if(inode->size < offset + size && a1fs_truncate(path, offset+size) != 0){
-        return -ENOSPC;
-    }
-    else{
-        a1fs_blk_t totalBlock = (a1fs_blk_t)offset / A1FS_BLOCK_SIZE + 1;
-        a1fs_blk_t totalExtend = 0;
-        a1fs_blk_t leftCount = 0;
-        a1fs_extent *ext;
-        while(1){
-            ext = &(inode->i_block[totalExtend]);
-            if(totalBlock <= ext->count){
-                leftCount = totalBlock;
-                break;
-            }
-            else{
-                totalExtend += 1;
-                totalBlock -= ext->count;
-            }
+    int result = find_inode_path(path, image, &inode);
+    if (result != 0) {
+        return lookup_errno(result);
+    }
+    if (inode->size < offset + size) {
+        result = resize_file(image, inode, offset + size);
+        if (result != 0) {
+            csum_update_inode(image, inode);
+            csum_flush(image);
+            return result;
         }
-        uint64_t remain = (uint64_t)offset % A1FS_BLOCK_SIZE;
-        char *start = sb + (superblock->first_data_block + ext->start + leftCount -1)*A1FS_BLOCK_SIZE + remain;
-        size_t spaceLeft = (ext->count - leftCount + 1) * A1FS_BLOCK_SIZE - remain;
-        if(spaceLeft < size){
-            memcpy(start, buf, spaceLeft);
-            size_t written = spaceLeft;
-            size -= spaceLeft;
-            totalExtend += 1;
-            if(totalExtend == 27){
-                return written;
-            }
-            ext = &(inode->i_block[totalExtend]);
-            while(1){
-                spaceLeft = (ext->count) * A1FS_BLOCK_SIZE;
-                start = sb + (superblock->first_data_block + ext->start) * A1FS_BLOCK_SIZE;
-                if(size > spaceLeft){
-                    memcpy(start, buf+written, spaceLeft);
-                    written += spaceLeft;
-                    size -= spaceLeft;
-                    totalExtend += 1;
-                    if(totalExtend == 27){
-                        return written;
-                    }
-                    ext = &(inode->i_block[totalExtend]);
-                }
-                else{
-                    memcpy(start, buf+written, spaceLeft);
-                    break;
-                }
-
-            }
-        return written;
+    }
+
+    write_unwritten(image, inode, offset, size);
+    size_t written = 0;
+    while (written < size) {
+        uint64_t len;
+        char *start = file_span(image, inode, offset + written, &len);
+        if (len > size - written) {
+            len = size - written;
         }
-        else{
-            memcpy(start, buf, size);
-            return size;
+        /*large copies bypass the CPU caches; see copy.h*/
+        copy_to_image(start, buf + written, len);
+        written += len;
+    }
+    clock_gettime(CLOCK_REALTIME, &inode->mtime);
+    csum_update_inode(image, inode);
+    csum_flush(image);
+    stats_add(STATS_BYTES_WRITTEN, written);
+    return written;
+}
+
+/**
+ * Allocate space for a file.
+ *
+ * Implements the fallocate() system call with mode 0 (extend the file size if
+ * needed) or FALLOC_FL_KEEP_SIZE. The blocks are reserved in as few contiguous
+ * runs as possible and marked unwritten, so they read as zeros without being
+ * zeroed here; the cost is proportional to the number of extents, not the
+ * length. Blocks are zeroed when first written to.
+ *
+ * Errors:
+ *   EOPNOTSUPP  unsupported mode (e.g. punching holes).
+ *   EINVAL      negative offset or non-positive length.
+ *   ENOSPC      not enough free space or extent slots in the file.
+ *
+ * @param fs      file system context.
+ * @param path    path to the file.
+ * @param mode    0 or FALLOC_FL_KEEP_SIZE.
+ * @param offset  start of the range to allocate.
+ * @param length  length of the range to allocate.
+ * @param fi      unused.
+ * @return        0 on success; -errno on error.
+ */
+static int a1fs_fallocate(fs_ctx *fs, const char *path, int mode, off_t offset,
+                          off_t length, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	if (is_stats_file(path)) return -EPERM;
+	if (mode & ~FALLOC_FL_KEEP_SIZE) return -EOPNOTSUPP;
+	if (offset < 0 || length <= 0) return -EINVAL;
+	if (fs->corrupt) return -EROFS;
+
+    char *image = fs->image;
+    a1fs_inode *inode;
+    int result = find_inode_path(path, image, &inode);
+    if (result != 0) {
+        return lookup_errno(result);
+    }
+    if (!S_ISREG(inode->mode)) {
+        return -EINVAL;
+    }
+
+    size_t bs = block_size(image);
+    uint64_t end = (uint64_t)offset + length;
+    result = 0;
+    /*only blocks past the ones the file already has need reserving; a packed
+     *tail is the block right after them, so it must be back in a block of
+     *its own before any are reserved, or they would come in front of it*/
+    a1fs_blk_t have = total_datablock_for_inode(image, inode);
+    a1fs_blk_t need = align_up(end, bs) / bs;
+    if (inode->tail.block != 0 && need > have) {
+        if (tail_unpack(image, inode) != 0) {
+            result = -ENOSPC;
         }
+        have = total_datablock_for_inode(image, inode);
+    }
+    if (result == 0 && need > have && reserve_blocks(image, inode, need - have) != 0) {
+        result = -ENOSPC;
+    }
+    if (result == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && end > inode->size) {
+        result = resize_file(image, inode, end);
+        clock_gettime(CLOCK_REALTIME, &inode->mtime);
+    }
+    if (inode->size % bs != 0) {
+        tail_pack(image, inode);
+    }
+    csum_update_inode(image, inode);
+    csum_flush(image);
+    return result;
+}
+
+/**
+ * Handle an a1fs-specific ioctl on an open file.
+ *
+ * Only A1FS_IOC_DEFRAG (see defrag.h) is supported. Each call moves at most
+ * max_blocks blocks; throttling is left to the caller (a1fs-defrag), which
+ * repeats the ioctl until the file is in one run.
+ *
+ * Errors:
+ *   ENOTTY  unknown command.
+ *   EINVAL  not a regular file.
+ *   ENOSPC  no free run long enough to hold the file.
+ *
+ * @param fs     file system context.
+ * @param path   path to the file.
+ * @param cmd    ioctl command.
+ * @param arg    unused.
+ * @param fi     unused.
+ * @param flags  FUSE_IOCTL_* flags.
+ * @param data   in/out argument buffer.
+ * @return       0 on success; -errno on error.
+ */
+static int a1fs_ioctl(fs_ctx *fs, const char *path, int cmd, void *arg,
+                      struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+	(void)arg;// unused
+	(void)fi;// unused
+	if (flags & FUSE_IOCTL_COMPAT) return -ENOSYS;
+	if ((unsigned int)cmd != A1FS_IOC_DEFRAG || is_stats_file(path)) return -ENOTTY;
 
+    char *image = fs->image;
+    a1fs_defrag_args *args = (a1fs_defrag_args*)data;
+    a1fs_inode *inode;
+    int result = find_inode_path(path, image, &inode);
+    if (result != 0) {
+        return lookup_errno(result);
+    }
+    if (!S_ISREG(inode->mode)) {
+        return -EINVAL;
     }
+    args->extents_before = inode->i_blocks;
+    args->blocks_moved = 0;
+    if (!(args->flags & A1FS_DEFRAG_QUERY) && inode->i_blocks > 1) {
+        if (fs->corrupt) return -EROFS;
+        a1fs_blk_t limit = args->max_blocks ? args->max_blocks : A1FS_DEFRAG_CHUNK;
+        a1fs_blk_t moved;
+        if (defrag_inode(image, inode, limit, &moved) != 0) {
+            csum_flush(image);
+            return -ENOSPC;
+        }
+        args->blocks_moved = moved;
+        csum_update_inode(image, inode);
+        csum_flush(image);
+    }
+    args->extents_after = inode->i_blocks;
+    args->blocks_placed = defrag_placed(image, inode);
+    args->blocks_total = total_datablock_for_inode(image, inode);
+    return 0;
 }
 
 
-static struct fuse_operations a1fs_ops = {
-	.destroy  = a1fs_destroy,
-	.statfs   = a1fs_statfs,
-	.getattr  = a1fs_getattr,
-	.readdir  = a1fs_readdir,
-	.mkdir    = a1fs_mkdir,
-	.rmdir    = a1fs_rmdir,
-	.create   = a1fs_create,
-	.unlink   = a1fs_unlink,
-	.rename   = a1fs_rename,
-	.utimens  = a1fs_utimens,
-	.truncate = a1fs_truncate,
-	.read     = a1fs_read,
-	.write    = a1fs_write,
-};
+/** Inputs of A1FS_IOC_DEFRAG, recorded in the trace so that a1fs-replay runs
+ * the same request (e.g. a query rather than a defragmentation). */
+static uint64_t defrag_trace_flags(int cmd, const void *data)
+{
+	if ((unsigned int)cmd != A1FS_IOC_DEFRAG || !data) return 0;
+	return ((const a1fs_defrag_args*)data)->flags;
+}
 
-int main(int argc, char *argv[])
+static uint64_t defrag_trace_max(int cmd, const void *data)
 {
-	a1fs_opts opts = {0};// defaults are all 0
-	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-	if (!a1fs_opt_parse(&args, &opts)) return 1;
-
-	fs_ctx fs = {0};
-	if (!a1fs_init(&fs, &opts)) {
-		fprintf(stderr, "Failed to mount the file system\n");
-		return 1;
-	}
+	if ((unsigned int)cmd != A1FS_IOC_DEFRAG || !data) return 0;
+	return ((const a1fs_defrag_args*)data)->max_blocks;
+}
+
 
-	return fuse_main(args.argc, args.argv, &a1fs_ops, &fs);
+/** The block cache failed to bring in part of the image during an operation,
+ * which was cut short (see bcache_recover). One that changes the image may
+ * have done so halfway, so no further changes are allowed, as on corruption. */
+static int cache_failed(fs_ctx *fs, stats_op op)
+{
+	if (op != STATS_STATFS && op != STATS_GETATTR && op != STATS_READDIR && op != STATS_READ) {
+		fprintf(stderr, "a1fs: I/O error during an update; no further changes allowed\n");
+		fs->corrupt = true;
+	}
+	return -EIO;
 }
+
+// Every operation is timed into the statistics (see stats.h), and recorded into
+// the trace with --trace (see trace.h), by a wrapper, so that the
+// implementations don't have to account for it on each return path. With the
+// block cache, it also sets the recovery point for I/O errors. The last
+// argument lists what goes into the trace: path, new path, offset, size, mode.
+// The FUSE callback (name##_fuse) passes on the context from fuse_get_context().
+#define A1FS_UNPACK(...) __VA_ARGS__
+#define A1FS_TIMED(name, op, params, args, trace)                          \
+	static int name##_timed(fs_ctx *fs, A1FS_UNPACK params)                \
+	{                                                                      \
+		uint64_t start = stats_now();                                      \
+		sigjmp_buf recover;                                                \
+		int ret;                                                           \
+		if (fs->cache.base && sigsetjmp(recover, 0) != 0) {                \
+			ret = cache_failed(fs, op);                                    \
+		} else {                                                           \
+			bcache_recover = fs->cache.base ? &recover : NULL;             \
+			ret = name(fs, A1FS_UNPACK args);                              \
+		}                                                                  \
+		bcache_recover = NULL;                                             \
+		uint64_t ns = stats_op_done(op, start, ret);                       \
+		if (trace_active) trace_op(op, start, ns, ret, A1FS_UNPACK trace); \
+		return ret;                                                        \
+	}                                                                      \
+	static int name##_fuse params                                          \
+	{                                                                      \
+		return name##_timed(get_fs(), A1FS_UNPACK args);                   \
+	}
+
+A1FS_TIMED(a1fs_statfs, STATS_STATFS, (const char *path, struct statvfs *st), (path, st),
+           (path, NULL, 0, 0, 0))
+A1FS_TIMED(a1fs_getattr, STATS_GETATTR, (const char *path, struct stat *st), (path, st),
+           (path, NULL, 0, 0, 0))
+A1FS_TIMED(a1fs_readdir, STATS_READDIR,
+           (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+            struct fuse_file_info *fi),
+           (path, buf, filler, offset, fi), (path, NULL, offset, 0, 0))
+A1FS_TIMED(a1fs_mkdir, STATS_MKDIR, (const char *path, mode_t mode), (path, mode),
+           (path, NULL, 0, 0, mode))
+A1FS_TIMED(a1fs_rmdir, STATS_RMDIR, (const char *path), (path), (path, NULL, 0, 0, 0))
+A1FS_TIMED(a1fs_create, STATS_CREATE,
+           (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi),
+           (path, NULL, 0, 0, mode))
+A1FS_TIMED(a1fs_unlink, STATS_UNLINK, (const char *path), (path), (path, NULL, 0, 0, 0))
+A1FS_TIMED(a1fs_rename, STATS_RENAME, (const char *from, const char *to), (from, to),
+           (from, to, 0, 0, 0))
+A1FS_TIMED(a1fs_utimens, STATS_UTIMENS,
+           (const char *path, const struct timespec tv[2]), (path, tv), (path, NULL, 0, 0, 0))
+A1FS_TIMED(a1fs_truncate, STATS_TRUNCATE, (const char *path, off_t size), (path, size),
+           (path, NULL, size, 0, 0))
+A1FS_TIMED(a1fs_read, STATS_READ,
+           (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+           (path, buf, size, offset, fi), (path, NULL, offset, size, 0))
+A1FS_TIMED(a1fs_write, STATS_WRITE,
+           (const char *path, const char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi),
+           (path, buf, size, offset, fi), (path, NULL, offset, size, 0))
+A1FS_TIMED(a1fs_ioctl, STATS_IOCTL,
+           (const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+            unsigned int flags, void *data),
+           (path, cmd, arg, fi, flags, data),
+           (path, NULL, defrag_trace_flags(cmd, data), defrag_trace_max(cmd, data), cmd))
+A1FS_TIMED(a1fs_fallocate, STATS_FALLOCATE,
+           (const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi),
+           (path, mode, offset, length, fi), (path, NULL, offset, length, mode))
+
+
+const struct fuse_operations a1fs_ops = {
+	.init     = a1fs_fuse_init,
+	.destroy  = a1fs_destroy,
+	.statfs   = a1fs_statfs_fuse,
+	.getattr  = a1fs_getattr_fuse,
+	.readdir  = a1fs_readdir_fuse,
+	.mkdir    = a1fs_mkdir_fuse,
+	.rmdir    = a1fs_rmdir_fuse,
+	.create   = a1fs_create_fuse,
+	.unlink   = a1fs_unlink_fuse,
+	.rename   = a1fs_rename_fuse,
+	.utimens  = a1fs_utimens_fuse,
+	.truncate = a1fs_truncate_fuse,
+	.read     = a1fs_read_fuse,
+	.write    = a1fs_write_fuse,
+	.ioctl    = a1fs_ioctl_fuse,
+	.fallocate = a1fs_fallocate_fuse,
+};
+
+const a1fs_operations a1fs_lib_ops = {
+	.statfs   = a1fs_statfs_timed,
+	.getattr  = a1fs_getattr_timed,
+	.readdir  = a1fs_readdir_timed,
+	.mkdir    = a1fs_mkdir_timed,
+	.rmdir    = a1fs_rmdir_timed,
+	.create   = a1fs_create_timed,
+	.unlink   = a1fs_unlink_timed,
+	.rename   = a1fs_rename_timed,
+	.utimens  = a1fs_utimens_timed,
+	.truncate = a1fs_truncate_timed,
+	.read     = a1fs_read_timed,
+	.write    = a1fs_write_timed,
+	.ioctl    = a1fs_ioctl_timed,
+	.fallocate = a1fs_fallocate_timed,
+};
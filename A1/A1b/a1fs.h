@@ -25,18 +25,39 @@
 
 
 /**
- * a1fs block size in bytes. You are not allowed to change this value.
+ * Smallest (and default) a1fs block size in bytes. You are not allowed to
+ * change this value.
  *
  * The block size is the unit of space allocation. Each file (and directory)
  * must occupy an integral number of blocks. Each of the file systems metadata
  * partitions, e.g. superblock, inode/block bitmaps, inode table (but not an
  * individual inode) must also occupy an integral number of blocks.
+ *
+ * The block size of an image is chosen by mkfs.a1fs, from A1FS_BLOCK_SIZE up
+ * to A1FS_BLOCK_SIZE_MAX, and recorded in the superblock; see
+ * a1fs_block_size(). The image size need only be a multiple of
+ * A1FS_BLOCK_SIZE; a partial last block is left unused.
  */
 #define A1FS_BLOCK_SIZE 4096
+/** Largest a1fs block size in bytes; tail offsets must fit in 16 bits. */
+#define A1FS_BLOCK_SIZE_MAX 65536
+/** Largest valid a1fs_superblock.log_block_size. */
+#define A1FS_LOG_BLOCK_SIZE_MAX 4
+
+static_assert(A1FS_BLOCK_SIZE << A1FS_LOG_BLOCK_SIZE_MAX == A1FS_BLOCK_SIZE_MAX,
+              "invalid maximum block size");
 
-#define NUM_BLOCK 27
-/** Block number (block pointer) type. */
-typedef uint32_t a1fs_blk_t;
+/** Number of extents that fit in an inode's extent record. */
+#define NUM_BLOCK 31
+/** Number of extents that fit in an extent record of an A1FS_FEATURE_64BIT image. */
+#define NUM_BLOCK_64 20
+/**
+ * Block number (block pointer) type. Stored in 32 bits on disk, or 48 bits if
+ * the image has A1FS_FEATURE_64BIT.
+ */
+typedef uint64_t a1fs_blk_t;
+/** Largest number of blocks in an A1FS_FEATURE_64BIT image. */
+#define A1FS_BLOCKS_MAX_64 (1ul << 48)
 
 /** Inode number type. */
 typedef uint32_t a1fs_ino_t;
@@ -45,6 +66,79 @@ typedef uint32_t a1fs_ino_t;
 /** Magic value that can be used to identify an a1fs image. */
 #define A1FS_MAGIC 0xC5C369A1C5C369A1ul
 
+/**
+ * Feature flags (superblock->features).
+ *
+ * A1FS_FEATURE_CSUM  metadata blocks and inodes carry CRC32C checksums. The
+ *                    superblock, each inode and each extent record store
+ *                    their own; bitmap and directory blocks have theirs in
+ *                    the checksum table, one uint32_t per image block indexed
+ *                    by block number.
+ *
+ * A1FS_FEATURE_LAZY_INIT  the inode bitmap, data bitmap, inode chunk map and
+ *                         inode table (with its extent table) are only
+ *                         initialized (zeroed) up to their *_init marks; blocks
+ *                         past a mark are zeroed on first use. Cleared once
+ *                         all four are fully initialized.
+ *
+ * A1FS_FEATURE_GROUPS  the data blocks and inodes are split into block groups,
+ *                      described by the group descriptor table; see
+ *                      a1fs_group_desc.
+ *
+ * A1FS_FEATURE_64BIT  extents hold 48-bit block numbers and lengths
+ *                     (a1fs_extent48 instead of a1fs_extent32), so an extent
+ *                     record has room for NUM_BLOCK_64 of them. Set by mkfs.a1fs for
+ *                     images of 2^32 blocks or more. Packed tails keep 32-bit
+ *                     block numbers; tail blocks come from the first 2^32
+ *                     data blocks.
+ *
+ * A1FS_FEATURE_STRIPED  the image is a volume striped over stripe_count image
+ *                       files of equal size: its stripe units (stripe_unit
+ *                       bytes each) go to the files round-robin, starting
+ *                       with the file holding the superblock. The files must
+ *                       be given in the same order every time; only the
+ *                       block cache backend can access such a volume.
+ *
+ * A1FS_FEATURE_DYN_INODES  mkfs.a1fs reserves no inode table: it is allocated
+ *                          from the data area in inode chunks as inodes are
+ *                          needed. Chunk c holds the inodes (by bitmap index)
+ *                          [c * n, (c + 1) * n), n = block size / inode size:
+ *                          A1FS_INODE_CHUNK_BLOCKS contiguous data blocks, one
+ *                          block of inodes followed by their extent records.
+ *                          Entry c of the inode chunk map (inode_chunk_map) is
+ *                          the data block the chunk starts at, 0 if it is not
+ *                          allocated yet. inodes_count is the most inodes the
+ *                          image can have, and the fixed inode and extent
+ *                          tables are empty. Chunks stay allocated once their
+ *                          inodes are freed.
+ *
+ * A1FS_FEATURE_EXTENT_TABLE  inodes are 64-byte attribute records, and their
+ *                            extents are in separate extent records (the
+ *                            extent table, or the inode chunks with
+ *                            A1FS_FEATURE_DYN_INODES); see a1fs_inode. Images
+ *                            without it have the extents in the inode and
+ *                            can't be mounted by this driver.
+ *
+ * Every feature changes the on-disk format: a driver must refuse an image with
+ * a flag it doesn't know (one not in A1FS_FEATURES_SUPPORTED), or without one
+ * it requires (A1FS_FEATURES_REQUIRED).
+ */
+#define A1FS_FEATURE_CSUM      0x1ul
+#define A1FS_FEATURE_LAZY_INIT 0x2ul
+#define A1FS_FEATURE_GROUPS    0x4ul
+#define A1FS_FEATURE_64BIT     0x8ul
+#define A1FS_FEATURE_STRIPED   0x10ul
+#define A1FS_FEATURE_DYN_INODES 0x20ul
+#define A1FS_FEATURE_EXTENT_TABLE 0x40ul
+
+/** Features this driver knows how to handle. */
+#define A1FS_FEATURES_SUPPORTED (A1FS_FEATURE_CSUM | A1FS_FEATURE_LAZY_INIT | \
+                                 A1FS_FEATURE_GROUPS | A1FS_FEATURE_64BIT | \
+                                 A1FS_FEATURE_STRIPED | A1FS_FEATURE_DYN_INODES | \
+                                 A1FS_FEATURE_EXTENT_TABLE)
+/** Features this driver can't do without. */
+#define A1FS_FEATURES_REQUIRED A1FS_FEATURE_EXTENT_TABLE
+
 /** a1fs superblock. */
 typedef struct a1fs_superblock {
 	/** Must match A1FS_MAGIC. */
@@ -61,6 +155,30 @@ typedef struct a1fs_superblock {
 	uint64_t datablock_bitmap;		/* the starting block of the data bitmap block */
 	uint64_t first_inode_block;		/* the starting block of the inode table block */
 	uint64_t first_data_block;		/* the starting block of the data block */
+	uint64_t tail_block;			/* data block currently open for tail packing (0 if none) */
+	uint64_t features;				/* A1FS_FEATURE_* flags */
+	uint64_t csum_table;			/* the starting block of the checksum table */
+	uint64_t inode_bitmap_init;		/* number of initialized inode bitmap blocks */
+	uint64_t block_bitmap_init;		/* number of initialized data bitmap blocks */
+	uint64_t inode_table_init;		/* number of initialized inode table blocks (each with
+	                                   its A1FS_EXTENT_TABLE_RATIO extent table blocks) */
+	uint64_t group_desc;			/* the starting block of the group descriptor table */
+	uint64_t groups_count;			/* number of block groups */
+	uint64_t blocks_per_group;		/* data blocks in each group (the last may have fewer) */
+	uint64_t inodes_per_group;		/* inodes in each group (the last may have fewer) */
+	uint64_t log_block_size;		/* block size is A1FS_BLOCK_SIZE << log_block_size */
+	uint64_t stripe_count;			/* number of image files of a striped volume */
+	uint64_t stripe_unit;			/* bytes per stripe unit of a striped volume */
+	uint32_t checksum;				/* CRC32C of the superblock (with this field 0) */
+	uint32_t pad;
+
+	// Fields added after the format was first released go below, in order,
+	// each with the feature flag that gives it meaning
+	uint64_t extent_table;			/* the starting block of the inode extent table
+	                                   (A1FS_FEATURE_EXTENT_TABLE) */
+	uint64_t inode_chunk_map;		/* the starting block of the inode chunk map
+	                                   (A1FS_FEATURE_DYN_INODES) */
+	uint64_t chunk_map_init;		/* number of initialized inode chunk map blocks */
 
 } a1fs_superblock;
 
@@ -68,8 +186,44 @@ typedef struct a1fs_superblock {
 static_assert(sizeof(a1fs_superblock) <= A1FS_BLOCK_SIZE,
               "superblock is too large");
 
+/** Block size of an image in bytes. */
+static inline uint32_t a1fs_block_size(const a1fs_superblock *sb)
+{
+	return (uint32_t)A1FS_BLOCK_SIZE << sb->log_block_size;
+}
+
+
+/**
+ * Block group descriptor.
+ *
+ * A group has as many data blocks as one block of the data bitmap covers
+ * (8 * block size). Group g owns data blocks
+ * [g * blocks_per_group, (g + 1) * blocks_per_group), i.e. block g of the
+ * data bitmap, and inodes (by bitmap index)
+ * [g * inodes_per_group, (g + 1) * inodes_per_group), i.e. a contiguous slice
+ * of the inode bitmap and the inode table. New inodes are placed in the group
+ * of their parent directory and their data near the start of that group, so
+ * the metadata and data of a subtree stay within a small region.
+ */
+typedef struct a1fs_group_desc {
+	/** Number of free data blocks in the group. */
+	uint32_t free_blocks;
+	/** Number of free inodes in the group. */
+	uint32_t free_inodes;
+	/** Number of directories in the group. */
+	uint32_t dirs;
+	uint32_t pad;
+
+} a1fs_group_desc;
+
+static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_group_desc) == 0,
+              "invalid group descriptor size");
 
-/** Extent - a contiguous range of blocks. */
+
+/**
+ * Extent - a contiguous range of blocks. This is the in-memory form; inodes
+ * store a1fs_extent32 or a1fs_extent48 (see inode_extent() in util.h).
+ */
 typedef struct a1fs_extent {
 	/** Starting block of the extent. */
 	a1fs_blk_t start;
@@ -78,8 +232,77 @@ typedef struct a1fs_extent {
 
 } a1fs_extent;
 
+/** On-disk extent of images without A1FS_FEATURE_64BIT. */
+typedef struct a1fs_extent32 {
+	uint32_t start;
+	uint32_t count;
+
+} a1fs_extent32;
+
+/** On-disk extent of A1FS_FEATURE_64BIT images. */
+typedef struct a1fs_extent48 {
+	uint32_t start_lo;
+	uint16_t start_hi;
+	uint16_t count_hi;
+	uint32_t count_lo;
 
-/** a1fs inode. */
+} a1fs_extent48;
+
+static_assert(sizeof(a1fs_extent48) == 12, "invalid 48-bit extent size");
+
+
+/**
+ * Tail descriptor - the partial last block of a small file, packed together
+ * with the tails of other files into a shared data block.
+ */
+typedef struct a1fs_tail {
+	/** Data block holding the tail; 0 if the file has no packed tail. */
+	uint32_t block;
+	/** Byte offset of the tail within the block. */
+	uint16_t offset;
+	/** Tail length in bytes. */
+	uint16_t length;
+
+} a1fs_tail;
+
+/**
+ * Header at the start of every shared tail block. Tails are appended to the
+ * block that is currently open for packing (superblock->tail_block); the space
+ * of released tails is only reclaimed once the whole block becomes unused.
+ */
+typedef struct a1fs_tail_header {
+	/** Number of live tails stored in the block. */
+	uint32_t refs;
+	/** Bytes handed out so far, including this header. */
+	uint32_t used;
+
+} a1fs_tail_header;
+
+/**
+ * Only files up to this many blocks get their partial last block packed into a
+ * tail; larger files keep whole blocks so that appends don't keep moving the
+ * tail.
+ */
+#define A1FS_TAIL_FILE_BLOCKS 4
+
+
+/**
+ * a1fs inode.
+ *
+ * Only the attributes that path lookup, getattr() and readdir() need are kept
+ * here, in one 64-byte cache line; the extents are in a separate extent table
+ * (see a1fs_inode_extents). A scan of the inode table reads 64 inodes per
+ * 4 KiB block.
+ *
+ * Layout, in bytes (no padding):
+ *
+ *    0 mode         4 links        8 size        16 mtime (16)
+ *   32 inode_num   36 i_blocks    40 i_nblocks   48 tail (8)
+ *   56 i_csum      60 i_unwritten
+ *
+ * Every byte is in use; a new field needs an incompatible feature flag and a
+ * new layout.
+ */
 typedef struct a1fs_inode {
 	/** File mode. */
 	mode_t mode;
@@ -104,21 +327,45 @@ typedef struct a1fs_inode {
 	 */
 	struct timespec mtime;
 
-	//TODO: add necessary fields
-	//NOTE: You might have to add padding (e.g. a dummy char array field) at the
-	// end of the struct in order to satisfy the assertion below. Try to keep
-	// the size of this struct minimal, but don't worry about the "wasted space"
-	// introduced by the required padding. 128 x 3
-	a1fs_ino_t inode_num;
-	uint32_t i_blocks;			      /* how many blocks have been allocated to this file */
-	a1fs_extent i_block[NUM_BLOCK];		  /* Pointers to blocks */
-	//uint32_t extra[24];				  /* Padding */
+	a1fs_ino_t inode_num;			  /* this inode's number (1-based) */
+	uint32_t i_blocks;			      /* how many extents the file has */
+	uint64_t i_nblocks;				  /* data blocks in the extents (sum of their counts) */
+	a1fs_tail tail;					  /* packed partial last block, if any */
+	uint32_t i_csum;				  /* CRC32C of the inode (with this field 0) */
+	uint32_t i_unwritten;			  /* bit i set: extent i is reserved (fallocate) and reads as zeros */
 
 } a1fs_inode;
 
-// A single block must fit an integral number of inodes
+// One cache line; a single block must fit an integral number of inodes
+static_assert(sizeof(a1fs_inode) == 64, "invalid inode size");
 static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
 
+/**
+ * Extent record of an inode. Inode i has record i of the extent table, which
+ * starts at superblock->extent_table and is A1FS_EXTENT_TABLE_RATIO times the
+ * size of the inode table (or of its inode chunk, with
+ * A1FS_FEATURE_DYN_INODES). Slots past the inode's i_blocks are zero.
+ */
+typedef struct a1fs_inode_extents {
+	union {
+		a1fs_extent32 i_block[NUM_BLOCK];	  /* Pointers to blocks; see inode_extent() */
+		a1fs_extent48 i_block64[NUM_BLOCK_64];  /* ... on A1FS_FEATURE_64BIT images */
+	};
+	uint32_t e_csum;				  /* CRC32C of the record (with this field 0) */
+	uint32_t pad;
+
+} a1fs_inode_extents;
+
+/** Extent table blocks per inode table block. */
+#define A1FS_EXTENT_TABLE_RATIO (sizeof(a1fs_inode_extents) / sizeof(a1fs_inode))
+
+/** Blocks in an inode chunk of an A1FS_FEATURE_DYN_INODES image. */
+#define A1FS_INODE_CHUNK_BLOCKS (1 + A1FS_EXTENT_TABLE_RATIO)
+
+static_assert(sizeof(a1fs_inode_extents) == 256, "invalid extent record size");
+static_assert(sizeof(((a1fs_inode_extents*)0)->i_block64) <=
+              sizeof(((a1fs_inode_extents*)0)->i_block), "48-bit extents don't fit in a record");
+
 
 /** Maximum file name (path component) length. Includes the null terminator. */
 #define A1FS_NAME_MAX 252
@@ -0,0 +1,597 @@
+/**
+ * CSC369 Assignment 1 - block cache backend implementation.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bcache.h"
+
+
+/** Frame state flags. */
+enum {
+	/** The unit was modified since it was last written back. */
+	BCACHE_DIRTY = 0x1,
+	/** The unit was accessed since the CLOCK hand last passed it. */
+	BCACHE_REF   = 0x2,
+	/** Access to the unit is removed so that its next use is noticed. */
+	BCACHE_OFF   = 0x4,
+	/** The unit is being read in by bcache_prefetch(); the hand skips it. */
+	BCACHE_BUSY  = 0x8,
+	/** The frame holds no unit (reading it in failed); the hand takes it. */
+	BCACHE_FREE  = 0x10,
+};
+
+__thread sigjmp_buf *bcache_recover;
+
+/** The cache whose reservation the fault handler serves; there is only one
+ * SIGSEGV handler, so bcache_open() refuses a second cache while it is set. */
+static bcache *active;
+/** SIGSEGV disposition before bcache_open(). */
+static struct sigaction old_action;
+
+
+static void shard_lock(bcache_shard *s)
+{
+	while (atomic_flag_test_and_set_explicit(&s->lock, memory_order_acquire)) {
+		// spin; faults are short, and only mkfs.a1fs -j has several threads
+	}
+}
+
+static void shard_unlock(bcache_shard *s)
+{
+	atomic_flag_clear_explicit(&s->lock, memory_order_release);
+}
+
+/**
+ * Cut the access that faulted short after an I/O error: jump to the recovery
+ * point of the thread (see bcache_recover), or abort if it has none. Call
+ * without a shard lock held.
+ */
+static void fail(bcache *c, const char *msg)
+{
+	// Only async-signal-safe calls here
+	(void)!write(STDERR_FILENO, msg, strlen(msg));
+	atomic_fetch_add_explicit(&c->errors, 1, memory_order_relaxed);
+	if (bcache_recover) siglongjmp(*bcache_recover, 1);
+	abort();
+}
+
+static char *unit_addr(const bcache *c, uint64_t unit)
+{
+	return c->base + unit * c->unit;
+}
+
+/** Number of bytes of a unit that are in the image file. */
+static size_t unit_len(const bcache *c, uint64_t unit)
+{
+	size_t off = unit * c->unit;
+	return c->size - off < c->unit ? c->size - off : c->unit;
+}
+
+static uint32_t bucket_of(const bcache *c, uint64_t unit)
+{
+	return (unit / BCACHE_SHARDS) & (c->nbuckets - 1);
+}
+
+/**
+ * Image file and offset in it of byte off of the image; *len is cut at the
+ * end of the stripe unit.
+ */
+static int stripe_map(const bcache *c, uint64_t off, size_t *len, off_t *file_off)
+{
+	if (c->nfiles == 1) {
+		*file_off = off;
+		return c->fds[0];
+	}
+	uint64_t stripe = off / c->stripe_unit;
+	size_t within = off % c->stripe_unit;
+	if (*len > c->stripe_unit - within) *len = c->stripe_unit - within;
+	*file_off = stripe / c->nfiles * c->stripe_unit + within;
+	return c->fds[stripe % c->nfiles];
+}
+
+/** Read or write bytes [off, off + len) of the image. Returns 0 or -errno. */
+static int image_io(bcache *c, bool write, uint64_t off, size_t len)
+{
+	while (len > 0) {
+		size_t n = len;
+		off_t file_off;
+		int fd = stripe_map(c, off, &n, &file_off);
+		ssize_t ret = write ? pwrite(fd, c->base + off, n, file_off) :
+		                      pread(fd, c->base + off, n, file_off);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret < 0) return -errno;
+		if (ret == 0) return -EIO;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/** Queue a read or write of [off, off + len) on the ring, a request per piece. */
+static int image_queue(bcache *c, bool write, uint64_t off, size_t len)
+{
+	while (len > 0) {
+		size_t n = len;
+		off_t file_off;
+		int fd = stripe_map(c, off, &n, &file_off);
+		int ret = write ? uring_write(&c->ring, fd, c->base + off, n, file_off) :
+		                  uring_read(&c->ring, fd, c->base + off, n, file_off);
+		if (ret < 0) return ret;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/** Give a frame's unit the access its state calls for. Returns 0 or -1 (it can
+ * fail with ENOMEM when there are too many memory areas). */
+static int set_prot(const bcache *c, const bcache_frame *f)
+{
+	int prot = (f->flags & BCACHE_OFF)   ? PROT_NONE :
+	           (f->flags & BCACHE_DIRTY) ? PROT_READ | PROT_WRITE : PROT_READ;
+	return mprotect(unit_addr(c, f->unit), c->unit, prot);
+}
+
+/** Write a dirty unit back and make it read-only (clean). */
+static bool write_unit(bcache *c, bcache_shard *s, bcache_frame *f)
+{
+	// Read-only while it is written: the kernel needs read access, and a write
+	// by another thread must fault (and wait for the shard) rather than tear it
+	if (mprotect(unit_addr(c, f->unit), c->unit, PROT_READ) != 0) return false;
+	if (image_io(c, true, f->unit * c->unit, unit_len(c, f->unit)) < 0) {
+		// Still dirty; the next write must not fault (to mark it dirty again)
+		set_prot(c, f);
+		return false;
+	}
+	f->flags &= ~BCACHE_DIRTY;
+	s->writebacks++;
+	set_prot(c, f);
+	return true;
+}
+
+static int32_t find_frame(const bcache *c, const bcache_shard *s, uint64_t unit)
+{
+	for (int32_t i = s->buckets[bucket_of(c, unit)]; i >= 0; i = s->frames[i].next) {
+		if (s->frames[i].unit == unit) return i;
+	}
+	return -1;
+}
+
+static void remove_frame(const bcache *c, bcache_shard *s, int32_t i)
+{
+	int32_t *link = &s->buckets[bucket_of(c, s->frames[i].unit)];
+	while (*link != i) link = &s->frames[*link].next;
+	*link = s->frames[i].next;
+}
+
+/** Drop the contents of a unit. Access is removed first, so that another
+ * thread can't see the unit zeroed; it faults and waits for the shard instead. */
+static int drop_unit(const bcache *c, uint64_t unit)
+{
+	char *addr = unit_addr(c, unit);
+	if (mprotect(addr, c->unit, PROT_NONE) != 0) return -1;
+	return madvise(addr, c->unit, MADV_DONTNEED);
+}
+
+/** Give up on the unit of a frame whose read failed, and free the frame. */
+static void drop_frame(bcache *c, bcache_shard *s, bcache_frame *f)
+{
+	remove_frame(c, s, f - s->frames);
+	drop_unit(c, f->unit);
+	f->flags = BCACHE_FREE;
+}
+
+/**
+ * Get a free frame, evicting a unit with the CLOCK hand if there is none.
+ * Dirty units whose writeback fails are kept. Returns -1 if the hand went
+ * around three times (enough to take every second chance back) without
+ * freeing a frame.
+ */
+static int32_t get_frame(bcache *c, bcache_shard *s)
+{
+	if (s->nused < c->frames) return s->nused++;
+	for (uint32_t n = 0; n < 3 * c->frames; n++) {
+		int32_t i = s->hand;
+		bcache_frame *f = &s->frames[i];
+		s->hand = (s->hand + 1) % c->frames;
+		if (f->flags & BCACHE_FREE) return i;
+		// Taking access away would make the read into the unit fail (EFAULT)
+		if (f->flags & BCACHE_BUSY) continue;
+		if (f->flags & BCACHE_REF) {
+			// Second chance; the next access faults and sets BCACHE_REF again
+			f->flags = (f->flags & ~BCACHE_REF) | BCACHE_OFF;
+			if (set_prot(c, f) != 0) f->flags &= ~BCACHE_OFF;
+			continue;
+		}
+		if ((f->flags & BCACHE_DIRTY) && !write_unit(c, s, f)) continue;
+		if (drop_unit(c, f->unit) != 0) continue;
+		remove_frame(c, s, i);
+		s->evictions++;
+		return i;
+	}
+	return -1;
+}
+
+/**
+ * Take a frame for a unit that is not in the cache and make the unit writable
+ * for reading it in. The caller reads it and then calls set_prot(), or
+ * drop_frame() if the read fails. Returns NULL if no frame could be freed.
+ */
+static bcache_frame *new_frame(bcache *c, bcache_shard *s, uint64_t unit)
+{
+	int32_t i = get_frame(c, s);
+	if (i < 0) return NULL;
+	bcache_frame *f = &s->frames[i];
+	if (mprotect(unit_addr(c, unit), c->unit, PROT_READ | PROT_WRITE) != 0) {
+		f->flags = BCACHE_FREE;
+		return NULL;
+	}
+	f->unit = unit;
+	f->flags = BCACHE_REF;
+	uint32_t b = bucket_of(c, unit);
+	f->next = s->buckets[b];
+	s->buckets[b] = i;
+	s->misses++;
+	return f;
+}
+
+/** Read a unit into a new frame. Returns false if it is not in the cache. */
+static bool read_unit(bcache *c, bcache_shard *s, uint64_t unit)
+{
+	bcache_frame *f = new_frame(c, s, unit);
+	if (!f) return false;
+	if (image_io(c, false, unit * c->unit, unit_len(c, unit)) < 0 || set_prot(c, f) != 0) {
+		drop_frame(c, s, f);
+		return false;
+	}
+	return true;
+}
+
+static void on_fault(int sig, siginfo_t *info, void *uctx)
+{
+	(void)sig;// unused
+	(void)uctx;// unused
+	bcache *c = active;
+	char *addr = (char*)info->si_addr;
+	if (!c || addr < c->base || addr >= c->base + c->map_size) {
+		// Not ours; the faulting instruction is retried with the previous
+		// disposition (by default, the process is killed)
+		sigaction(SIGSEGV, &old_action, NULL);
+		return;
+	}
+
+	int saved_errno = errno;
+	uint64_t unit = (addr - c->base) / c->unit;
+	bcache_shard *s = &c->shards[unit % BCACHE_SHARDS];
+	shard_lock(s);
+	int32_t i = find_frame(c, s, unit);
+	bool ok;
+	if (i < 0) {
+		ok = read_unit(c, s, unit);
+	} else {
+		bcache_frame *f = &s->frames[i];
+		uint8_t flags = f->flags;
+		if (f->flags & BCACHE_OFF) {
+			// Used again after the CLOCK hand passed it
+			f->flags &= ~BCACHE_OFF;
+		} else {
+			// Write to a clean unit
+			f->flags |= BCACHE_DIRTY;
+		}
+		f->flags |= BCACHE_REF;
+		ok = set_prot(c, f) == 0;
+		if (!ok) f->flags = flags;
+	}
+	shard_unlock(s);
+	errno = saved_errno;
+	// Returning would only fault again
+	if (!ok) fail(c, "bcache: failed to bring in a unit of the image\n");
+}
+
+
+void *bcache_open(bcache *c, const char *const *paths, int count, size_t stripe_unit,
+                  size_t block_size, size_t cap, bool direct, size_t *size)
+{
+	memset(c, 0, sizeof(*c));
+	if (active) {
+		fprintf(stderr, "Only one image per process can use the block cache\n");
+		return NULL;
+	}
+	if (count > 1 && (stripe_unit == 0 || (stripe_unit & (stripe_unit - 1)) != 0)) {
+		fprintf(stderr, "Invalid stripe unit %zu\n", stripe_unit);
+		return NULL;
+	}
+	if (cap < BCACHE_CAP_MIN) {
+		fprintf(stderr, "Cache size must be at least %lu bytes\n", BCACHE_CAP_MIN);
+		return NULL;
+	}
+
+	c->fds = malloc(count * sizeof(*c->fds));
+	if (!c->fds) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+	size_t file_size = 0;
+	while (c->nfiles < count) {
+		const char *path = paths[c->nfiles];
+		int fd = open(path, O_RDWR | (direct ? O_DIRECT : 0));
+		if (fd < 0) {
+			perror(path);
+			goto fail;
+		}
+		c->fds[c->nfiles++] = fd;
+		struct stat st;
+		if (fstat(fd, &st) < 0) {
+			perror("fstat");
+			goto fail;
+		}
+		if (c->nfiles > 1 && (size_t)st.st_size != file_size) {
+			fprintf(stderr, "%s: the files of a striped image must be the same size\n", path);
+			goto fail;
+		}
+		file_size = st.st_size;
+	}
+	if (count > 1) {
+		if (file_size % stripe_unit != 0) {
+			fprintf(stderr, "Image file size is not a multiple of the stripe unit\n");
+			goto fail;
+		}
+		c->stripe_unit = stripe_unit;
+	}
+	c->size = file_size * count;
+	if (c->size == 0) {
+		fprintf(stderr, "Image file is empty\n");
+		goto fail;
+	}
+	if (c->size % block_size != 0) {
+		fprintf(stderr, "Image file size is not a multiple of block size\n");
+		goto fail;
+	}
+
+	// Larger units for larger caches, to keep the number of frames bounded
+	c->unit = BCACHE_UNIT;
+	while (cap / c->unit > BCACHE_FRAMES_MAX) c->unit *= 2;
+	c->map_size = (c->size + c->unit - 1) / c->unit * c->unit;
+	c->frames = cap / c->unit / BCACHE_SHARDS;
+	c->nbuckets = 1;
+	while (c->nbuckets < c->frames * 2) c->nbuckets *= 2;
+	for (int i = 0; i < BCACHE_SHARDS; i++) {
+		bcache_shard *s = &c->shards[i];
+		atomic_flag_clear(&s->lock);
+		s->frames = calloc(c->frames, sizeof(*s->frames));
+		s->buckets = malloc(c->nbuckets * sizeof(*s->buckets));
+		if (!s->frames || !s->buckets) {
+			fprintf(stderr, "Out of memory\n");
+			goto fail;
+		}
+		memset(s->buckets, 0xff, c->nbuckets * sizeof(*s->buckets));
+	}
+
+	c->batch = malloc(c->frames * BCACHE_SHARDS * sizeof(*c->batch));
+	if (!c->batch) {
+		fprintf(stderr, "Out of memory\n");
+		goto fail;
+	}
+	if (direct || count > 1) {
+		c->has_ring = uring_init(&c->ring, BCACHE_RING_ENTRIES);
+		if (!c->has_ring) perror("io_uring_setup; using pread()/pwrite()");
+	}
+
+	// Reserve the address space for the whole image; units are filled in on
+	// first access. Refuse images that can't fit up front with a clear reason
+	// rather than a bare ENOMEM from mmap()
+	struct rlimit as;
+	if (c->map_size > BCACHE_SIZE_MAX) {
+		fprintf(stderr, "Image of %zu GiB is larger than the block cache can address (%lu GiB)\n",
+		        c->size >> 30, BCACHE_SIZE_MAX >> 30);
+		goto fail;
+	}
+	if (getrlimit(RLIMIT_AS, &as) == 0 && as.rlim_cur != RLIM_INFINITY &&
+	    c->map_size > as.rlim_cur) {
+		fprintf(stderr, "Image of %zu MiB needs as much address space, more than the "
+		        "limit of %lu MiB (ulimit -v)\n", c->size >> 20, (unsigned long)(as.rlim_cur >> 20));
+		goto fail;
+	}
+	void *base = mmap(NULL, c->map_size, PROT_NONE,
+	                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Failed to reserve %zu MiB of address space for the image: %s\n",
+		        c->map_size >> 20, strerror(errno));
+		goto fail;
+	}
+	c->base = base;
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = on_fault;
+	// SA_NODEFER: fail() may leave the handler with siglongjmp(), which
+	// would otherwise leave SIGSEGV blocked (sigsetjmp() without the mask is
+	// cheaper than with it, so it is not restored that way)
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGSEGV, &sa, &old_action) < 0) {
+		perror("sigaction");
+		goto fail;
+	}
+	active = c;
+	*size = c->size;
+	return c->base;
+
+fail:
+	bcache_close(c);
+	return NULL;
+}
+
+static int compare_units(const void *a, const void *b)
+{
+	uint64_t x = (*(bcache_frame *const*)a)->unit, y = (*(bcache_frame *const*)b)->unit;
+	return (x > y) - (x < y);
+}
+
+/** Write len bytes of the image at off, through the ring if it is used. */
+static int write_run(bcache *c, uint64_t off, size_t len)
+{
+	c->runs++;
+	return c->use_ring ? image_queue(c, true, off, len) : image_io(c, true, off, len);
+}
+
+int bcache_writeback(bcache *c, void *addr, size_t len, bool sync)
+{
+	uint64_t first = ((char*)addr - c->base) / c->unit;
+	uint64_t end = ((char*)addr - c->base + len + c->unit - 1) / c->unit;
+
+	// Adjacent units are in different shards; collect the dirty ones from all
+	// shards (which stay locked until they are written) to write them in runs
+	size_t n = 0;
+	int ret = 0;
+	for (int i = 0; i < BCACHE_SHARDS; i++) {
+		bcache_shard *s = &c->shards[i];
+		shard_lock(s);
+		for (uint32_t j = 0; j < s->nused; j++) {
+			bcache_frame *f = &s->frames[j];
+			if (!(f->flags & BCACHE_DIRTY) || f->unit < first || f->unit >= end) continue;
+			// Clean from now on: a write during writeback would tear it, and
+			// the kernel needs read access to write it out
+			uint8_t flags = f->flags;
+			f->flags &= ~(BCACHE_DIRTY | BCACHE_OFF);
+			if (set_prot(c, f) != 0) {
+				// Still writable, so it can't be written back safely
+				ret = -errno;
+				f->flags = flags;
+				continue;
+			}
+			s->writebacks++;
+			c->batch[n++] = f;
+		}
+	}
+	qsort(c->batch, n, sizeof(*c->batch), compare_units);
+
+	for (size_t i = 0; i < n && ret == 0; ) {
+		uint64_t start = c->batch[i]->unit, unit = start;
+		size_t run = 0;
+		do {
+			run += unit_len(c, unit);
+			unit++;
+			i++;
+		} while (i < n && c->batch[i]->unit == unit && run + unit_len(c, unit) <= BCACHE_RUN_MAX);
+		ret = write_run(c, start * c->unit, run);
+	}
+	if (c->use_ring) {
+		int err = uring_wait(&c->ring);
+		if (ret == 0) ret = err;
+	}
+	for (int i = 0; i < c->nfiles && ret == 0 && sync; i++) {
+		if (fdatasync(c->fds[i]) < 0) ret = -errno;
+	}
+
+	if (ret < 0) {
+		// Keep everything dirty; some of it may not have been written
+		for (size_t i = 0; i < n; i++) {
+			c->batch[i]->flags |= BCACHE_DIRTY;
+			set_prot(c, c->batch[i]);
+		}
+	}
+	for (int i = 0; i < BCACHE_SHARDS; i++) shard_unlock(&c->shards[i]);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
+
+void bcache_prefetch(bcache *c, void *addr, size_t len)
+{
+	uint64_t first = ((char*)addr - c->base) / c->unit;
+	uint64_t end = ((char*)addr - c->base + len + c->unit - 1) / c->unit;
+	// Few enough that reading them in can't evict one another
+	size_t limit = c->frames * BCACHE_SHARDS / 4;
+
+	bool queued = c->use_ring;
+	size_t n = 0;
+	for (uint64_t unit = first; unit < end && n < limit; unit++) {
+		bcache_shard *s = &c->shards[unit % BCACHE_SHARDS];
+		shard_lock(s);
+		bcache_frame *f;
+		if (find_frame(c, s, unit) < 0 && (f = new_frame(c, s, unit)) != NULL) {
+			f->flags |= BCACHE_BUSY;
+			if (queued && image_queue(c, false, unit * c->unit, unit_len(c, unit)) < 0) {
+				// Read everything synchronously below
+				queued = false;
+			}
+			c->batch[n++] = f;
+		}
+		shard_unlock(s);
+	}
+	if (n == 0) return;
+
+	if (c->use_ring && uring_wait(&c->ring) < 0) queued = false;
+	for (size_t i = 0; i < n; i++) {
+		bcache_frame *f = c->batch[i];
+		bool ok = queued || image_io(c, false, f->unit * c->unit, unit_len(c, f->unit)) == 0;
+		bcache_shard *s = &c->shards[f->unit % BCACHE_SHARDS];
+		shard_lock(s);
+		f->flags &= ~BCACHE_BUSY;
+		// Only a hint; the error comes up if the unit is used (and faults)
+		if (!ok || set_prot(c, f) != 0) drop_frame(c, s, f);
+		shard_unlock(s);
+	}
+	c->prefetched += n;
+}
+
+void bcache_start(bcache *c)
+{
+	if (!c->has_ring || c->use_ring) return;
+	c->use_ring = uring_start(&c->ring);
+	if (!c->use_ring) fprintf(stderr, "Failed to start the io_uring reaper; using pread()/pwrite()\n");
+}
+
+void bcache_close(bcache *c)
+{
+	if (active == c) {
+		sigaction(SIGSEGV, &old_action, NULL);
+		active = NULL;
+	}
+	if (c->has_ring) uring_destroy(&c->ring);
+	if (c->base) munmap(c->base, c->map_size);
+	for (int i = 0; i < BCACHE_SHARDS; i++) {
+		free(c->shards[i].frames);
+		free(c->shards[i].buckets);
+	}
+	free(c->batch);
+	for (int i = 0; i < c->nfiles; i++) close(c->fds[i]);
+	free(c->fds);
+	memset(c, 0, sizeof(*c));
+}
+
+void bcache_report(const bcache *c, FILE *out)
+{
+	uint64_t misses = 0, evictions = 0, writebacks = 0;
+	for (int i = 0; i < BCACHE_SHARDS; i++) {
+		misses += c->shards[i].misses;
+		evictions += c->shards[i].evictions;
+		writebacks += c->shards[i].writebacks;
+	}
+	fprintf(out, "bcache: %u x %zu KiB frames, %lu misses (%lu prefetched), %lu evictions, "
+	        "%lu writebacks (%lu runs), %lu failed accesses\n", c->frames * BCACHE_SHARDS,
+	        c->unit / 1024, (unsigned long)misses, (unsigned long)c->prefetched,
+	        (unsigned long)evictions, (unsigned long)writebacks, (unsigned long)c->runs,
+	        (unsigned long)atomic_load(&c->errors));
+	if (c->nfiles > 1) {
+		fprintf(out, "bcache: striped over %d files, %zu KiB stripe unit\n", c->nfiles,
+		        c->stripe_unit / 1024);
+	}
+	if (c->use_ring) {
+		fprintf(out, "bcache: io_uring: %lu requests in %lu submits\n",
+		        (unsigned long)c->ring.requests, (unsigned long)c->ring.submits);
+	}
+}
@@ -0,0 +1,205 @@
+/**
+ * CSC369 Assignment 1 - block cache backend header file.
+ *
+ * An alternative to mapping the whole image file (map_file()) that caps the
+ * memory a1fs uses for the image and keeps the caching policy in a1fs. The
+ * rest of the file system keeps accessing the image through plain pointers:
+ * bcache_open() only reserves address space for it (PROT_NONE), and the
+ * SIGSEGV handler fills a unit of BCACHE_UNIT bytes (or more, for large caches)
+ * with pread() on first access and maps it read-only. A write to a read-only
+ * unit marks it dirty and makes it writable.
+ *
+ * The resident units are kept in BCACHE_SHARDS shards by unit number, each
+ * with its own lock, hash table, frames and CLOCK hand, so that faults in
+ * different shards don't contend. When a shard is full, its hand sweeps the
+ * frames: a referenced unit loses its access (so that its next use faults and
+ * marks it referenced again) and gets a second chance; an unreferenced one is
+ * written back with pwrite() if dirty and dropped.
+ *
+ * The image can be a volume striped over several files (A1FS_FEATURE_STRIPED):
+ * all I/O goes through stripe_map(), which splits it at stripe unit boundaries
+ * and sends each piece to its file.
+ *
+ * With the direct flag the image files are opened with O_DIRECT, so that their
+ * data isn't cached twice (in the page cache and here). With direct, or with
+ * more than one file, bcache_writeback() and bcache_prefetch() submit their
+ * I/O through io_uring (see uring.h) after bcache_start(), keeping many
+ * requests in flight on all the files instead of transferring one unit at a
+ * time.
+ *
+ * An I/O error in the fault handler can't be returned to the faulting code.
+ * Instead the handler jumps to the recovery point the thread set with
+ * bcache_recover (a1fs sets one around each operation, which then fails with
+ * EIO), or aborts the process if there is none (a mapping would get SIGBUS).
+ * Eviction keeps a dirty unit whose writeback fails and tries another, and a
+ * unit that fails to be prefetched is just left out.
+ *
+ * The whole image is reserved up front, so it must fit in the address space:
+ * bcache_open() refuses images over BCACHE_SIZE_MAX or the RLIMIT_AS limit.
+ * Only one cache can be open in a process, since there is one SIGSEGV handler.
+ */
+
+#pragma once
+
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "uring.h"
+
+
+/** Cache size used when none is given. */
+#define BCACHE_CAP_DEFAULT (256ul * 1024 * 1024)
+/** Smallest cache unit, in bytes; a multiple of every a1fs block size. */
+#define BCACHE_UNIT (64 * 1024)
+/** Number of shards. */
+#define BCACHE_SHARDS 16
+/** Smallest cache size: two frames per shard, so that copying between two
+ * units of the same shard doesn't evict the one being copied from. */
+#define BCACHE_CAP_MIN (2ul * BCACHE_SHARDS * BCACHE_UNIT)
+/** Largest write bcache_writeback() makes of a run of adjacent dirty units. */
+#define BCACHE_RUN_MAX (4 * 1024 * 1024)
+/** io_uring submission queue size for writeback. */
+#define BCACHE_RING_ENTRIES 256
+/** Largest image the cache takes: half of the 128 TiB of user address space
+ * of x86-64, leaving the rest to the process. */
+#define BCACHE_SIZE_MAX (64ul << 40)
+/** Most frames in the cache; every unit can split the reservation into two
+ * more memory areas, and there can only be so many (vm.max_map_count). */
+#define BCACHE_FRAMES_MAX (16 * 1024)
+
+/** A resident unit of the image. */
+typedef struct bcache_frame {
+	/** Unit number (offset in the image / unit size). */
+	uint64_t unit;
+	/** Next frame in the same hash chain; -1 if none. */
+	int32_t next;
+	/** BCACHE_* frame state flags. */
+	uint8_t flags;
+
+} bcache_frame;
+
+/** A shard of the cache: the units with unit % BCACHE_SHARDS == its index. */
+typedef struct bcache_shard {
+	/** Protects the shard; a spin lock so that the fault handler can take it. */
+	atomic_flag lock;
+	/** Frames owned by the shard. */
+	bcache_frame *frames;
+	/** Number of frames in use. */
+	uint32_t nused;
+	/** Heads of the hash chains; -1 if empty. */
+	int32_t *buckets;
+	/** CLOCK hand. */
+	uint32_t hand;
+
+	/** Number of units read in. */
+	uint64_t misses;
+	/** Number of units dropped to make room. */
+	uint64_t evictions;
+	/** Number of dirty units written back. */
+	uint64_t writebacks;
+
+} bcache_shard;
+
+/** Block cache state of a mounted image. */
+typedef struct bcache {
+	/** Start of the address space reserved for the image; NULL if unused. */
+	char *base;
+	/** Image size in bytes. */
+	size_t size;
+	/** Size of the reservation: the image size rounded up to a whole unit. */
+	size_t map_size;
+	/** Image file descriptors, in stripe order. */
+	int *fds;
+	int nfiles;
+	/** Stripe unit in bytes; 0 if there is only one file. */
+	size_t stripe_unit;
+	/** Unit size in bytes. */
+	size_t unit;
+
+	/** Frames per shard. */
+	uint32_t frames;
+	/** Hash buckets per shard (a power of 2). */
+	uint32_t nbuckets;
+	bcache_shard shards[BCACHE_SHARDS];
+
+	/** Frames being written back or read in; room for every frame. */
+	bcache_frame **batch;
+	/** Writes of dirty runs by bcache_writeback(). */
+	uint64_t runs;
+	/** Units read in by bcache_prefetch(). */
+	uint64_t prefetched;
+	/** Accesses cut short by an I/O error (see bcache_recover). */
+	_Atomic uint64_t errors;
+	/** ring is set up; batched I/O goes through it once started (use_ring). */
+	bool has_ring;
+	bool use_ring;
+	uring ring;
+
+} bcache;
+
+
+/**
+ * Where the fault handler jumps (with siglongjmp(), value 1) when it can't
+ * bring in the unit that the calling thread accessed. Set it with
+ * sigsetjmp(buf, 0) around code that accesses the image and reset it to NULL
+ * after; while it is NULL such an error aborts the process. The code that was
+ * cut short may have left the image half modified.
+ */
+extern __thread sigjmp_buf *bcache_recover;
+
+/**
+ * Open an image through the block cache.
+ *
+ * The image is made of count files of equal size, striped in units of
+ * stripe_unit bytes (a power of 2 that divides the file size) if there is
+ * more than one. Image size must be a non-zero multiple of the block_size. At
+ * most about cap bytes of the image are kept in memory; cap must be at least
+ * BCACHE_CAP_MIN. Fails if another cache is open, or if the image doesn't fit
+ * in the address space (see BCACHE_SIZE_MAX).
+ *
+ * @param c            cache state to initialize.
+ * @param paths        image file paths, in stripe order.
+ * @param count        number of image files.
+ * @param stripe_unit  stripe unit in bytes; ignored for a single file.
+ * @param block_size   file system block size.
+ * @param cap          memory cap in bytes.
+ * @param direct       open the files with O_DIRECT and use io_uring.
+ * @param size         pointer to the variable that will be set to image size.
+ * @return             pointer to the image in memory on success; NULL on failure.
+ */
+void *bcache_open(bcache *c, const char *const *paths, int count, size_t stripe_unit,
+                  size_t block_size, size_t cap, bool direct, size_t *size);
+
+/**
+ * Start using io_uring for batched I/O, if bcache_open() set it up; until
+ * then it goes through pread()/pwrite(). Call in the process that will use the
+ * cache: the io_uring completion thread doesn't survive fork().
+ */
+void bcache_start(bcache *c);
+
+/**
+ * Write the dirty units overlapping [addr, addr + len) back to the image file,
+ * adjacent units in one write of up to BCACHE_RUN_MAX bytes. If sync is set,
+ * also wait for the file data to reach the disk. Units whose write failed stay
+ * dirty.
+ *
+ * @return  0 on success; -1 on failure (with errno set).
+ */
+int bcache_writeback(bcache *c, void *addr, size_t len, bool sync);
+
+/**
+ * Read the units overlapping [addr, addr + len) that are not in the cache,
+ * all at once (in parallel over the files of a striped image), up to a
+ * quarter of the cache. Only call from the thread that uses the image.
+ */
+void bcache_prefetch(bcache *c, void *addr, size_t len);
+
+/** Release the cache. Dirty units not written back are lost. */
+void bcache_close(bcache *c);
+
+/** Print the cache statistics. */
+void bcache_report(const bcache *c, FILE *out);
@@ -0,0 +1,549 @@
+/**
+ * CSC369 Assignment 1 - a1fs-bench: benchmark the file system in-process.
+ *
+ * Formats a temporary image, mounts it with a1fs_init() and calls the
+ * operations in a1fs_lib_ops directly (see ops.h), without the kernel and FUSE in
+ * between, so that the file system code can be measured and profiled on hosts
+ * that can't mount it. Every workload gets a freshly formatted image; its setup
+ * is not timed, and each of its operations is timed on its own.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "format.h"
+#include "fs_ctx.h"
+#include "map.h"
+#include "ops.h"
+#include "options.h"
+
+
+/** Directories the create workload spreads its files over. */
+#define BENCH_CREATE_DIRS 64
+/** Depth of the file stat-deep looks up. */
+#define BENCH_DEPTH 32
+/** Request size of the random read/write workloads. */
+#define BENCH_RANDOM_IO 4096
+/** Size of the files churn creates. */
+#define BENCH_CHURN_SIZE 1024
+/** Number of files churn keeps around. */
+#define BENCH_CHURN_LIVE 256
+
+
+/** Command line options. */
+typedef struct bench_opts {
+	/** Operations per workload. */
+	uint64_t ops;
+	/** Image size in bytes. */
+	size_t image_size;
+	/** File size of the read/write workloads. */
+	size_t file_size;
+	/** Request size of the sequential workloads. */
+	size_t io_size;
+	/** Entries in the bigdir directory. */
+	uint64_t dir_entries;
+	/** Formatting parameters. */
+	format_opts format;
+	/** Block cache size; 0 to map the image. */
+	size_t cache_size;
+	/** Open the image with O_DIRECT (with a block cache). */
+	bool direct;
+	/** Directory for the temporary image. */
+	const char *tmp_dir;
+	/** Random seed. */
+	uint64_t seed;
+	/** Print help and exit. */
+	bool help;
+
+} bench_opts;
+
+/** State of the workload being run. */
+typedef struct bench_ctx {
+	const bench_opts *opts;
+	/** Temporary image path. */
+	char image[4096];
+	/** Mounted file system. */
+	fs_ctx fs;
+	a1fs_opts fs_opts;
+	/** Data written by the write workloads (and read into by the others). */
+	char *buf;
+	/** xorshift state. */
+	uint64_t rng;
+
+} bench_ctx;
+
+/** A workload: untimed setup, then ops timed operations. */
+typedef struct bench_workload {
+	const char *name;
+	/** Prepare the file system; returns false on failure. */
+	bool (*setup)(bench_ctx *b);
+	/** Operation i; returns a negative errno on failure. */
+	int (*op)(bench_ctx *b, uint64_t i);
+	/** Bytes transferred by each operation (0 for metadata workloads). */
+	size_t (*op_bytes)(const bench_opts *opts);
+
+} bench_workload;
+
+
+static const char *help_str = "\
+Usage: %s [options] [workload...]\n\
+\n\
+Run a1fs workloads in-process, without a FUSE mount: format a temporary\n\
+image, mount it with the driver code and call its operations directly.\n\
+Prints the throughput and latency percentiles of each workload as JSON.\n\
+Runs all of the workloads if none are given.\n\
+\n\
+Workloads:\n\
+    create      create empty files spread over %d directories\n\
+    stat-deep   stat a file %d directories deep\n\
+    seq-write   write a file of -f bytes sequentially, -r bytes at a time\n\
+    seq-read    read a file of -f bytes sequentially, -r bytes at a time\n\
+    rand-write  write %d bytes at random offsets of a file of -f bytes\n\
+    rand-read   read %d bytes at random offsets of a file of -f bytes\n\
+    bigdir      stat random entries of a directory of -e files\n\
+    churn       create a %d-byte file and remove the oldest of %d\n\
+\n\
+Options:\n\
+    -n num   operations per workload (default 10000)\n\
+    -s size  image size in bytes (default 256 MiB)\n\
+    -f size  file size of the read/write workloads (default 64 MiB)\n\
+    -r size  request size of the sequential workloads (default 128 KiB)\n\
+    -e num   entries of the bigdir directory (default 10000)\n\
+    -b size  block size in bytes (default %d)\n\
+    -i num   number of inodes (default: inode table allocated on demand)\n\
+    -c size  access the image through a block cache of size bytes\n\
+    -D       with -c, open the image with O_DIRECT\n\
+    -d dir   directory for the temporary image (default $TMPDIR or /tmp)\n\
+    -S seed  random seed (default 1)\n\
+    -h       print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname, BENCH_CREATE_DIRS, BENCH_DEPTH, BENCH_RANDOM_IO,
+	        BENCH_RANDOM_IO, BENCH_CHURN_SIZE, BENCH_CHURN_LIVE, A1FS_BLOCK_SIZE);
+}
+
+static bool parse_num(const char *arg, uint64_t *n)
+{
+	char *end;
+	errno = 0;
+	*n = strtoull(arg, &end, 10);
+	return end != arg && *end == '\0' && errno == 0;
+}
+
+static bool parse_size(const char *arg, size_t *size)
+{
+	uint64_t n;
+	if (!parse_num(arg, &n)) return false;
+	*size = n;
+	return true;
+}
+
+static bool parse_args(int argc, char *argv[], bench_opts *opts)
+{
+	int o;
+	bool ok = true;
+	while ((o = getopt(argc, argv, "n:s:f:r:e:b:i:c:Dd:S:h")) != -1) {
+		switch (o) {
+			case 'n': ok = ok && parse_num(optarg, &opts->ops); break;
+			case 's': ok = ok && parse_size(optarg, &opts->image_size); break;
+			case 'f': ok = ok && parse_size(optarg, &opts->file_size); break;
+			case 'r': ok = ok && parse_size(optarg, &opts->io_size); break;
+			case 'e': ok = ok && parse_num(optarg, &opts->dir_entries); break;
+			case 'b': ok = ok && parse_size(optarg, &opts->format.block_size); break;
+			case 'i': ok = ok && parse_size(optarg, &opts->format.n_inodes); break;
+			case 'c': ok = ok && parse_size(optarg, &opts->cache_size); break;
+			case 'D': opts->direct = true; break;
+			case 'd': opts->tmp_dir = optarg; break;
+			case 'S': ok = ok && parse_num(optarg, &opts->seed); break;
+
+			case 'h': opts->help = true; return true;// skip other arguments
+			default : return false;
+		}
+	}
+	if (!ok) return false;
+
+	size_t bs = opts->format.block_size;
+	if (bs < A1FS_BLOCK_SIZE || bs > A1FS_BLOCK_SIZE_MAX || (bs & (bs - 1)) != 0) {
+		fprintf(stderr, "Invalid block size\n");
+		return false;
+	}
+	if (opts->ops == 0 || opts->io_size == 0 || opts->dir_entries == 0 ||
+	    opts->file_size < opts->io_size || opts->file_size < BENCH_RANDOM_IO) {
+		fprintf(stderr, "Invalid workload size\n");
+		return false;
+	}
+	if (opts->image_size < 2 * bs || opts->image_size % A1FS_BLOCK_SIZE != 0) {
+		fprintf(stderr, "Invalid image size\n");
+		return false;
+	}
+	return true;
+}
+
+
+static uint64_t next_random(bench_ctx *b)
+{
+	b->rng ^= b->rng << 13;
+	b->rng ^= b->rng >> 7;
+	b->rng ^= b->rng << 17;
+	return b->rng;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static struct fuse_file_info no_fi;
+
+static int create_file(bench_ctx *b, const char *path)
+{
+	return a1fs_lib_ops.create(&b->fs, path, S_IFREG | 0644, &no_fi);
+}
+
+/** Write a whole file of size bytes (creating it), in large requests. */
+static bool write_file(bench_ctx *b, const char *path, size_t size)
+{
+	if (create_file(b, path) < 0) return false;
+	size_t chunk = b->opts->io_size;
+	for (size_t off = 0; off < size; off += chunk) {
+		size_t len = size - off < chunk ? size - off : chunk;
+		if (a1fs_lib_ops.write(&b->fs, path, b->buf, len, off, &no_fi) != (int)len) return false;
+	}
+	return true;
+}
+
+
+/* Workloads */
+
+static bool setup_create(bench_ctx *b)
+{
+	char path[64];
+	for (int d = 0; d < BENCH_CREATE_DIRS; d++) {
+		snprintf(path, sizeof(path), "/d%02d", d);
+		if (a1fs_lib_ops.mkdir(&b->fs, path, 0755) < 0) return false;
+	}
+	return true;
+}
+
+static int op_create(bench_ctx *b, uint64_t i)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/d%02lu/f%lu", (unsigned long)(i % BENCH_CREATE_DIRS),
+	         (unsigned long)i);
+	return create_file(b, path);
+}
+
+/** Path of the file stat-deep looks up. */
+static char deep_path[BENCH_DEPTH * 4 + 8];
+
+static bool setup_stat_deep(bench_ctx *b)
+{
+	deep_path[0] = '\0';
+	for (int d = 0; d < BENCH_DEPTH; d++) {
+		char name[8];
+		snprintf(name, sizeof(name), "/l%02d", d);
+		strcat(deep_path, name);
+		if (a1fs_lib_ops.mkdir(&b->fs, deep_path, 0755) < 0) return false;
+	}
+	strcat(deep_path, "/f");
+	return create_file(b, deep_path) == 0;
+}
+
+static int op_stat_deep(bench_ctx *b, uint64_t i)
+{
+	(void)i;
+	struct stat st;
+	return a1fs_lib_ops.getattr(&b->fs, deep_path, &st);
+}
+
+static bool setup_seq_write(bench_ctx *b)
+{
+	return create_file(b, "/seq") == 0;
+}
+
+/** Sequential requests go round the file; the first pass allocates it. */
+static int op_seq_write(bench_ctx *b, uint64_t i)
+{
+	uint64_t n = b->opts->file_size / b->opts->io_size;
+	int ret = a1fs_lib_ops.write(&b->fs, "/seq", b->buf, b->opts->io_size, i % n * b->opts->io_size, &no_fi);
+	return ret < 0 ? ret : 0;
+}
+
+static bool setup_seq_read(bench_ctx *b)
+{
+	return write_file(b, "/seq", b->opts->file_size);
+}
+
+static int op_seq_read(bench_ctx *b, uint64_t i)
+{
+	uint64_t n = b->opts->file_size / b->opts->io_size;
+	int ret = a1fs_lib_ops.read(&b->fs, "/seq", b->buf, b->opts->io_size, i % n * b->opts->io_size, &no_fi);
+	return ret < 0 ? ret : 0;
+}
+
+static size_t seq_bytes(const bench_opts *opts)
+{
+	return opts->io_size;
+}
+
+static bool setup_random(bench_ctx *b)
+{
+	return write_file(b, "/rand", b->opts->file_size);
+}
+
+static int op_rand_write(bench_ctx *b, uint64_t i)
+{
+	(void)i;
+	uint64_t off = next_random(b) % (b->opts->file_size / BENCH_RANDOM_IO) * BENCH_RANDOM_IO;
+	int ret = a1fs_lib_ops.write(&b->fs, "/rand", b->buf, BENCH_RANDOM_IO, off, &no_fi);
+	return ret < 0 ? ret : 0;
+}
+
+static int op_rand_read(bench_ctx *b, uint64_t i)
+{
+	(void)i;
+	uint64_t off = next_random(b) % (b->opts->file_size / BENCH_RANDOM_IO) * BENCH_RANDOM_IO;
+	int ret = a1fs_lib_ops.read(&b->fs, "/rand", b->buf, BENCH_RANDOM_IO, off, &no_fi);
+	return ret < 0 ? ret : 0;
+}
+
+static size_t random_bytes(const bench_opts *opts)
+{
+	(void)opts;
+	return BENCH_RANDOM_IO;
+}
+
+static bool setup_bigdir(bench_ctx *b)
+{
+	if (a1fs_lib_ops.mkdir(&b->fs, "/big", 0755) < 0) return false;
+	char path[64];
+	for (uint64_t i = 0; i < b->opts->dir_entries; i++) {
+		snprintf(path, sizeof(path), "/big/f%lu", (unsigned long)i);
+		if (create_file(b, path) < 0) return false;
+	}
+	return true;
+}
+
+static int op_bigdir(bench_ctx *b, uint64_t i)
+{
+	(void)i;
+	char path[64];
+	struct stat st;
+	snprintf(path, sizeof(path), "/big/f%lu",
+	         (unsigned long)(next_random(b) % b->opts->dir_entries));
+	return a1fs_lib_ops.getattr(&b->fs, path, &st);
+}
+
+static bool setup_churn(bench_ctx *b)
+{
+	return a1fs_lib_ops.mkdir(&b->fs, "/churn", 0755) == 0;
+}
+
+static int op_churn(bench_ctx *b, uint64_t i)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/churn/f%lu", (unsigned long)i);
+	int ret = create_file(b, path);
+	if (ret < 0) return ret;
+	ret = a1fs_lib_ops.write(&b->fs, path, b->buf, BENCH_CHURN_SIZE, 0, &no_fi);
+	if (ret < 0) return ret;
+	if (i < BENCH_CHURN_LIVE) return 0;
+	snprintf(path, sizeof(path), "/churn/f%lu", (unsigned long)(i - BENCH_CHURN_LIVE));
+	return a1fs_lib_ops.unlink(&b->fs, path);
+}
+
+static const bench_workload workloads[] = {
+	{"create",     setup_create,    op_create,     NULL},
+	{"stat-deep",  setup_stat_deep, op_stat_deep,  NULL},
+	{"seq-write",  setup_seq_write, op_seq_write,  seq_bytes},
+	{"seq-read",   setup_seq_read,  op_seq_read,   seq_bytes},
+	{"rand-write", setup_random,    op_rand_write, random_bytes},
+	{"rand-read",  setup_random,    op_rand_read,  random_bytes},
+	{"bigdir",     setup_bigdir,    op_bigdir,     NULL},
+	{"churn",      setup_churn,     op_churn,      NULL},
+};
+
+#define N_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+
+/* Running the workloads */
+
+/** Format the image afresh and mount it. */
+static bool mount_fresh(bench_ctx *b)
+{
+	// Dropping the old contents leaves a sparse file that reads as zeros
+	if (truncate(b->image, 0) < 0 || truncate(b->image, b->opts->image_size) < 0) {
+		perror(b->image);
+		return false;
+	}
+	size_t size;
+	void *image = map_file(b->image, A1FS_BLOCK_SIZE, &size);
+	if (!image) return false;
+	format_opts format = b->opts->format;
+	format.zero = true;
+	bool ok = format_image(image, size, &format);
+	munmap(image, size);
+	if (!ok) {
+		fprintf(stderr, "Failed to format the image\n");
+		return false;
+	}
+
+	memset(&b->fs, 0, sizeof(b->fs));
+	memset(&b->fs_opts, 0, sizeof(b->fs_opts));
+	b->fs_opts.img_path = b->image;
+	b->fs_opts.img_paths[0] = b->image;
+	b->fs_opts.n_images = 1;
+	b->fs_opts.cache_size = b->opts->cache_size;
+	b->fs_opts.direct = b->opts->direct;
+	if (!a1fs_init(&b->fs, &b->fs_opts)) {
+		fprintf(stderr, "Failed to mount the file system\n");
+		return false;
+	}
+	a1fs_start(&b->fs);
+	return true;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+/** Latency at quantile q (out of 1000) of the sorted latencies. */
+static uint64_t percentile(const uint64_t *lat, uint64_t n, uint64_t q)
+{
+	uint64_t i = n * q / 1000;
+	return lat[i < n ? i : n - 1];
+}
+
+static bool run_workload(bench_ctx *b, const bench_workload *w, uint64_t *lat, bool first)
+{
+	const bench_opts *opts = b->opts;
+	b->rng = opts->seed ? opts->seed : 1;
+	if (!mount_fresh(b)) return false;
+	if (!w->setup(b)) {
+		fprintf(stderr, "%s: setup failed\n", w->name);
+		a1fs_destroy(&b->fs);
+		return false;
+	}
+
+	uint64_t errors = 0;
+	uint64_t start = now_ns();
+	for (uint64_t i = 0; i < opts->ops; i++) {
+		uint64_t t = now_ns();
+		if (w->op(b, i) < 0) errors++;
+		lat[i] = now_ns() - t;
+	}
+	double seconds = (now_ns() - start) * 1e-9;
+	a1fs_destroy(&b->fs);
+
+	qsort(lat, opts->ops, sizeof(*lat), compare_u64);
+	printf("%s\t\t{\n", first ? "" : ",\n");
+	printf("\t\t\t\"name\": \"%s\",\n", w->name);
+	printf("\t\t\t\"ops\": %lu,\n", (unsigned long)opts->ops);
+	printf("\t\t\t\"errors\": %lu,\n", (unsigned long)errors);
+	printf("\t\t\t\"seconds\": %.6f,\n", seconds);
+	printf("\t\t\t\"ops_per_sec\": %.1f,\n", opts->ops / seconds);
+	if (w->op_bytes) {
+		printf("\t\t\t\"mib_per_sec\": %.1f,\n",
+		       opts->ops * w->op_bytes(opts) / seconds / (1024 * 1024));
+	}
+	printf("\t\t\t\"latency_ns\": {\"p50\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}\n",
+	       (unsigned long)percentile(lat, opts->ops, 500),
+	       (unsigned long)percentile(lat, opts->ops, 990),
+	       (unsigned long)percentile(lat, opts->ops, 999),
+	       (unsigned long)lat[opts->ops - 1]);
+	printf("\t\t}");
+	fflush(stdout);
+	return true;
+}
+
+
+int main(int argc, char *argv[])
+{
+	bench_opts opts = {0};
+	opts.ops = 10000;
+	opts.image_size = 256ul * 1024 * 1024;
+	opts.file_size = 64ul * 1024 * 1024;
+	opts.io_size = 128 * 1024;
+	opts.dir_entries = 10000;
+	opts.format.block_size = A1FS_BLOCK_SIZE;
+	opts.seed = 1;
+	if (!parse_args(argc, argv, &opts)) {
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help) {
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	// The workloads to run, in the order given
+	const bench_workload *run[N_WORKLOADS];
+	size_t nrun = 0;
+	for (int i = optind; i < argc; i++) {
+		size_t w = 0;
+		while (w < N_WORKLOADS && strcmp(argv[i], workloads[w].name) != 0) w++;
+		if (w == N_WORKLOADS || nrun == N_WORKLOADS) {
+			fprintf(stderr, "Unknown workload %s\n", argv[i]);
+			print_help(stderr, argv[0]);
+			return 1;
+		}
+		run[nrun++] = &workloads[w];
+	}
+	if (nrun == 0) {
+		for (; nrun < N_WORKLOADS; nrun++) run[nrun] = &workloads[nrun];
+	}
+
+	static bench_ctx b;
+	b.opts = &opts;
+	const char *dir = opts.tmp_dir ? opts.tmp_dir : getenv("TMPDIR");
+	snprintf(b.image, sizeof(b.image), "%s/a1fs-bench.XXXXXX", dir ? dir : "/tmp");
+	int fd = mkstemp(b.image);
+	if (fd < 0) {
+		perror(b.image);
+		return 1;
+	}
+	close(fd);
+
+	size_t buf_size = opts.file_size > opts.io_size ? opts.file_size : opts.io_size;
+	b.buf = malloc(buf_size);
+	uint64_t *lat = calloc(opts.ops, sizeof(*lat));
+	int ret = 1;
+	if (!b.buf || !lat) {
+		fprintf(stderr, "Out of memory\n");
+		goto end;
+	}
+	for (size_t i = 0; i < buf_size; i++) b.buf[i] = 'a' + i % 26;
+
+	printf("{\n");
+	printf("\t\"image\": {\"size\": %lu, \"block_size\": %lu, \"backend\": \"%s\"},\n",
+	       (unsigned long)opts.image_size, (unsigned long)opts.format.block_size,
+	       opts.cache_size ? (opts.direct ? "cache-direct" : "cache") : "mmap");
+	printf("\t\"workloads\": [\n");
+	for (size_t i = 0; i < nrun; i++) {
+		if (!run_workload(&b, run[i], lat, i == 0)) goto end;
+	}
+	printf("\n\t]\n}\n");
+	ret = 0;
+
+end:
+	free(lat);
+	free(b.buf);
+	unlink(b.image);
+	return ret;
+}
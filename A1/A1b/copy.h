@@ -0,0 +1,39 @@
+/**
+ * CSC369 Assignment 1 - image copy routines header file.
+ *
+ * a1fs_write() copies file data into the image, where it is not read again
+ * soon: a plain memcpy() pulls every destination line into the CPU caches
+ * first, so a large write evicts the working set of everything else on the
+ * machine, and spends memory bandwidth reading lines it overwrites whole.
+ * copy_to_image() sends copies of at least COPY_STREAM_MIN bytes around the
+ * caches with non-temporal stores (AVX2 or SSE2, picked at startup by CPU
+ * feature detection), and uses memcpy() for the rest.
+ *
+ * FUSE splits writes into requests of at most max_write bytes (128 KiB by
+ * default), so the threshold has to be below that for streaming writes to
+ * benefit. a1fs-copybench measures the crossover on a given machine.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+
+/** Smallest copy done with non-temporal stores, in bytes. */
+#define COPY_STREAM_MIN (64 * 1024)
+
+
+/**
+ * Copy len bytes from src to dst in the image, bypassing the CPU caches for
+ * large copies. The buffers must not overlap.
+ */
+void copy_to_image(void *dst, const void *src, size_t len);
+
+/**
+ * Copy len bytes with non-temporal stores regardless of the size (memcpy() if
+ * the CPU has no streaming stores). For benchmarking.
+ */
+void copy_stream(void *dst, const void *src, size_t len);
+
+/** Name of the streaming store implementation in use ("avx2", "sse2" or "none"). */
+const char *copy_stream_impl(void);
@@ -0,0 +1,196 @@
+/**
+ * CSC369 Assignment 1 - a1fs-copybench: find where streaming copies pay off.
+ *
+ * Copies a fixed amount of data in chunks of each size from 4 KiB up, with
+ * memcpy() and with copy_stream(), into a destination area much larger than
+ * the CPU caches (like writes spread over an image). For each chunk size it
+ * reports the copy throughput, and the time it then takes to read a small
+ * working set that was cached before the copies: the cost the copies impose
+ * on everything else running on the machine.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "copy.h"
+
+
+/** Bytes copied per measurement. */
+#define BENCH_TOTAL (256ul * 1024 * 1024)
+/** Default size of the destination area. */
+#define BENCH_AREA (256ul * 1024 * 1024)
+/** Size of the working set that should stay cached. */
+#define BENCH_VICTIM (1024 * 1024)
+/** Smallest chunk size. */
+#define BENCH_CHUNK_MIN 4096
+/** Cache line size assumed when touching the working set. */
+#define BENCH_LINE 64
+/** Lines of the working set are visited this many lines apart (mod its size),
+ * which is odd and more than a page, so that the prefetchers don't hide misses. */
+#define BENCH_STRIDE 4099
+
+
+static const char *help_str = "\
+Usage: %s [options]\n\
+\n\
+Compare memcpy() with the non-temporal copies a1fs uses for large writes\n\
+into the image, for chunk sizes from 4 KiB up. A destination area that fits\n\
+in the caches shows the cost of streaming data that is read again soon.\n\
+\n\
+Options:\n\
+    -a size destination area size in bytes (default 256 MiB)\n\
+    -m size largest chunk size in bytes (default 16 MiB)\n\
+    -w size size of the working set to keep cached (default 1 MiB)\n\
+    -h      print help and exit\n\
+";
+
+typedef void copy_fn(void *dst, const void *src, size_t len);
+
+/** Results for one copy routine and chunk size. */
+typedef struct bench_result {
+	/** Copy throughput in bytes per second. */
+	double rate;
+	/** Time to read the working set afterwards, in seconds. */
+	double victim;
+
+} bench_result;
+
+
+/** Keeps the working set reads from being optimized out. */
+static volatile uint64_t sink;
+
+
+static void plain_copy(void *dst, const void *src, size_t len)
+{
+	memcpy(dst, src, len);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** Read one word of every cache line of buf, in a scattered order. */
+static void touch(const char *buf, size_t len)
+{
+	size_t lines = len / BENCH_LINE;
+	uint64_t sum = 0;
+	for (size_t i = 0; i < lines; i++) {
+		sum += *(const uint64_t*)(buf + (i * BENCH_STRIDE % lines) * BENCH_LINE);
+	}
+	sink += sum;
+}
+
+static bench_result run(copy_fn *copy, char *area, size_t area_size, const char *src,
+                        size_t chunk, const char *victim, size_t victim_size)
+{
+	bench_result r;
+	// Bring the working set into the caches, then copy over it
+	touch(victim, victim_size);
+	touch(victim, victim_size);
+	size_t off = 0;
+	double start = now();
+	for (size_t done = 0; done < BENCH_TOTAL; done += chunk) {
+		if (off + chunk > area_size) off = 0;
+		copy(area + off, src, chunk);
+		off += chunk;
+	}
+	r.rate = BENCH_TOTAL / (now() - start);
+
+	start = now();
+	touch(victim, victim_size);
+	r.victim = now() - start;
+	return r;
+}
+
+static bool parse_size(const char *arg, size_t *size)
+{
+	char *end;
+	unsigned long long n = strtoull(arg, &end, 10);
+	if (end == arg || *end != '\0' || n == 0) return false;
+	*size = n;
+	return true;
+}
+
+static void print_size(size_t size)
+{
+	if (size >= 1024 * 1024) {
+		printf("%6zu MiB", size / (1024 * 1024));
+	} else {
+		printf("%6zu KiB", size / 1024);
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	size_t area_size = BENCH_AREA, max_chunk = 16 * 1024 * 1024, victim_size = BENCH_VICTIM;
+	int o;
+	bool ok = true;
+	while ((o = getopt(argc, argv, "a:hm:w:")) != -1) {
+		switch (o) {
+			case 'a': ok = ok && parse_size(optarg, &area_size); break;
+			case 'm': ok = ok && parse_size(optarg, &max_chunk); break;
+			case 'w': ok = ok && parse_size(optarg, &victim_size); break;
+			case 'h': printf(help_str, argv[0]); return 0;
+			default : ok = false; break;
+		}
+	}
+	if (!ok || victim_size < BENCH_LINE) {
+		fprintf(stderr, help_str, argv[0]);
+		return 1;
+	}
+	// Every chunk size must fit in the area
+	if (max_chunk > area_size) max_chunk = area_size;
+
+	char *area = NULL, *src = NULL, *victim = NULL;
+	if (posix_memalign((void**)&area, 4096, area_size) != 0 ||
+	    posix_memalign((void**)&src, 4096, max_chunk) != 0 ||
+	    posix_memalign((void**)&victim, 4096, victim_size) != 0) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	// Fault everything in up front so that page faults are not measured
+	memset(area, 1, area_size);
+	memset(src, 2, max_chunk);
+	memset(victim, 3, victim_size);
+
+	printf("streaming stores: %s, threshold in a1fs: %d KiB\n",
+	       copy_stream_impl(), COPY_STREAM_MIN / 1024);
+	printf("     chunk   memcpy GB/s  stream GB/s   working set re-read (us):"
+	       " after memcpy  after stream\n");
+
+	// Smallest chunk size from which streaming is at least as fast
+	size_t crossover = 0;
+	for (size_t chunk = BENCH_CHUNK_MIN; chunk <= max_chunk; chunk *= 2) {
+		bench_result plain = run(plain_copy, area, area_size, src, chunk, victim, victim_size);
+		bench_result stream = run(copy_stream, area, area_size, src, chunk, victim, victim_size);
+		print_size(chunk);
+		printf("   %11.2f  %11.2f   %39.1f  %12.1f\n", plain.rate * 1e-9, stream.rate * 1e-9,
+		       plain.victim * 1e6, stream.victim * 1e6);
+		if (stream.rate < plain.rate) {
+			crossover = 0;
+		} else if (crossover == 0) {
+			crossover = chunk;
+		}
+	}
+
+	if (crossover) {
+		printf("streaming is faster from ");
+		print_size(crossover);
+		printf(" up\n");
+	} else {
+		printf("streaming is not faster at any size tested\n");
+	}
+	free(victim);
+	free(src);
+	free(area);
+	return 0;
+}
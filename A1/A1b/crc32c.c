@@ -0,0 +1,99 @@
+/**
+ * CSC369 Assignment 1 - CRC32C (Castagnoli) checksum implementation.
+ */
+
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+
+/** CRC32C polynomial, bit-reflected. */
+#define CRC32C_POLY 0x82F63B78u
+
+/** Slicing-by-8 lookup tables; table[0] is the plain bytewise table. */
+static uint32_t crc_table[8][256];
+
+/** Implementation selected for this CPU. Operates on the inverted crc. */
+static uint32_t (*crc_impl)(uint32_t crc, const unsigned char *p, size_t len);
+
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	// Process 8 bytes at a time once the pointer is aligned
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; len--) {
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t w;
+		memcpy(&w, p, sizeof(w));
+		w ^= crc;
+		crc = crc_table[7][w & 0xff] ^
+		      crc_table[6][(w >> 8) & 0xff] ^
+		      crc_table[5][(w >> 16) & 0xff] ^
+		      crc_table[4][(w >> 24) & 0xff] ^
+		      crc_table[3][(w >> 32) & 0xff] ^
+		      crc_table[2][(w >> 40) & 0xff] ^
+		      crc_table[1][(w >> 48) & 0xff] ^
+		      crc_table[0][w >> 56];
+	}
+#endif
+	for (; len > 0; len--) {
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c = crc;
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; len--) {
+		c = _mm_crc32_u8((uint32_t)c, *p++);
+	}
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t w;
+		memcpy(&w, p, sizeof(w));
+		c = _mm_crc32_u64(c, w);
+	}
+	for (; len > 0; len--) {
+		c = _mm_crc32_u8((uint32_t)c, *p++);
+	}
+	return (uint32_t)c;
+}
+#endif
+
+// Build the tables and pick the implementation before main() runs
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		}
+		crc_table[0][i] = c;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int t = 1; t < 8; t++) {
+			uint32_t prev = crc_table[t - 1][i];
+			crc_table[t][i] = (prev >> 8) ^ crc_table[0][prev & 0xff];
+		}
+	}
+
+	crc_impl = crc32c_sw;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) crc_impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	return ~crc_impl(~crc, (const unsigned char *)buf, len);
+}
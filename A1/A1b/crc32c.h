@@ -0,0 +1,23 @@
+/**
+ * CSC369 Assignment 1 - CRC32C (Castagnoli) checksum header file.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * Compute the CRC32C checksum of a buffer.
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU supports it, and a portable
+ * slicing-by-8 table implementation otherwise. Checksums can be computed
+ * piecewise by passing the result for the previous piece as crc.
+ *
+ * @param crc  checksum of the preceding data; 0 for the first piece.
+ * @param buf  pointer to the data.
+ * @param len  data length in bytes.
+ * @return     checksum of all the data so far.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
@@ -0,0 +1,199 @@
+/**
+ * CSC369 Assignment 1 - a1fs metadata checksums implementation.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "crc32c.h"
+#include "csum.h"
+#include "fs_ctx.h"
+#include "stats.h"
+#include "util.h"
+
+
+static bool csum_enabled(char *image)
+{
+	return (((a1fs_superblock*)image)->features & A1FS_FEATURE_CSUM) != 0;
+}
+
+/** Checksum of a structure, treating its checksum field as zero. */
+static uint32_t csum_struct(const void *p, size_t size, size_t field)
+{
+	static const uint32_t zero = 0;
+	const char *c = p;
+	uint32_t crc = crc32c(0, c, field);
+	crc = crc32c(crc, &zero, sizeof(zero));
+	return crc32c(crc, c + field + sizeof(zero), size - field - sizeof(zero));
+}
+
+static uint32_t *csum_entry(char *image, uint64_t block)
+{
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	return (uint32_t*)(image + sb->csum_table * a1fs_block_size(sb)) + block;
+}
+
+/** Checksum of a whole block. */
+static uint32_t csum_block(char *image, uint64_t block)
+{
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	size_t size = a1fs_block_size(sb);
+	return crc32c(0, image + block * size, size);
+}
+
+static bool test_bit(const unsigned char *map, uint64_t i)
+{
+	return (map[i / 8] & (1 << (i % 8))) != 0;
+}
+
+static void set_bit(unsigned char *map, uint64_t i)
+{
+	map[i / 8] |= 1 << (i % 8);
+}
+
+static void report(char *image, const char *what, uint64_t num)
+{
+	fs_ctx *fs = fs_ctx_of(image);
+	fprintf(stderr, "a1fs: checksum mismatch in %s %lu\n", what,
+	        (unsigned long)num);
+	if (fs) fs->corrupt = true;
+}
+
+
+void csum_update_sb(char *image)
+{
+	if (!csum_enabled(image)) return;
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	sb->checksum = csum_struct(sb, sizeof(*sb),
+	                           offsetof(a1fs_superblock, checksum));
+}
+
+bool csum_verify_sb(char *image)
+{
+	if (!csum_enabled(image)) return true;
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	return sb->checksum == csum_struct(sb, sizeof(*sb),
+	                                   offsetof(a1fs_superblock, checksum));
+}
+
+void csum_update_inode(char *image, a1fs_inode *inode)
+{
+	if (!csum_enabled(image)) return;
+	inode->i_csum = csum_struct(inode, sizeof(*inode),
+	                            offsetof(a1fs_inode, i_csum));
+	a1fs_inode_extents *rec = inode_extents(image, inode);
+	rec->e_csum = csum_struct(rec, sizeof(*rec), offsetof(a1fs_inode_extents, e_csum));
+
+	fs_ctx *fs = fs_ctx_of(image);
+	uint64_t index = inode_index(image, inode);
+	if (fs && index < ((a1fs_superblock*)image)->inodes_count) {
+		set_bit(fs->inode_verified, index);
+		set_bit(fs->extents_verified, index);
+	}
+}
+
+bool csum_verify_inode(char *image, a1fs_inode *inode)
+{
+	if (!csum_enabled(image)) return true;
+	fs_ctx *fs = fs_ctx_of(image);
+	uint64_t index = inode_index(image, inode);
+	if (index >= ((a1fs_superblock*)image)->inodes_count) {
+		// Not where its inode number says it is
+		report(image, "inode", inode->inode_num);
+		return false;
+	}
+	if (fs && test_bit(fs->inode_verified, index)) {
+		stats_add(STATS_VERIFY_HITS, 1);
+		return true;
+	}
+	stats_add(STATS_VERIFY_MISSES, 1);
+
+	if (inode->i_csum != csum_struct(inode, sizeof(*inode),
+	                                 offsetof(a1fs_inode, i_csum))) {
+		report(image, "inode", index + 1);
+		return false;
+	}
+	if (fs) set_bit(fs->inode_verified, index);
+	return true;
+}
+
+bool csum_verify_extents(char *image, a1fs_inode *inode)
+{
+	if (!csum_enabled(image)) return true;
+	fs_ctx *fs = fs_ctx_of(image);
+	uint64_t index = inode_index(image, inode);
+	if (index >= ((a1fs_superblock*)image)->inodes_count) {
+		report(image, "extents of inode", inode->inode_num);
+		return false;
+	}
+	if (fs && test_bit(fs->extents_verified, index)) {
+		stats_add(STATS_VERIFY_HITS, 1);
+		return true;
+	}
+	stats_add(STATS_VERIFY_MISSES, 1);
+
+	a1fs_inode_extents *rec = inode_extents(image, inode);
+	if (rec->e_csum != csum_struct(rec, sizeof(*rec),
+	                               offsetof(a1fs_inode_extents, e_csum))) {
+		report(image, "extents of inode", index + 1);
+		return false;
+	}
+	if (fs) set_bit(fs->extents_verified, index);
+	return true;
+}
+
+static void csum_update_block(char *image, uint64_t block)
+{
+	*csum_entry(image, block) = csum_block(image, block);
+}
+
+void csum_touch_block(char *image, uint64_t block)
+{
+	if (!csum_enabled(image)) return;
+	fs_ctx *fs = fs_ctx_of(image);
+	if (!fs) {
+		csum_update_block(image, block);
+		return;
+	}
+
+	// The new contents are trusted from now on
+	set_bit(fs->csum_verified, block);
+	for (size_t i = fs->csum_npending; i > 0; i--) {
+		if (fs->csum_pending[i - 1] == block) return;
+	}
+	if (fs->csum_npending == FS_CSUM_PENDING_MAX) {
+		csum_update_block(image, fs->csum_pending[--fs->csum_npending]);
+	}
+	fs->csum_pending[fs->csum_npending++] = block;
+}
+
+bool csum_verify_block(char *image, uint64_t block)
+{
+	if (!csum_enabled(image)) return true;
+	fs_ctx *fs = fs_ctx_of(image);
+	if (fs && test_bit(fs->csum_verified, block)) {
+		stats_add(STATS_VERIFY_HITS, 1);
+		return true;
+	}
+	stats_add(STATS_VERIFY_MISSES, 1);
+
+	if (*csum_entry(image, block) != csum_block(image, block)) {
+		report(image, "block", block);
+		return false;
+	}
+	if (fs) set_bit(fs->csum_verified, block);
+	return true;
+}
+
+void csum_flush(char *image)
+{
+	if (!csum_enabled(image)) return;
+	fs_ctx *fs = fs_ctx_of(image);
+	if (fs) {
+		for (size_t i = 0; i < fs->csum_npending; i++) {
+			csum_update_block(image, fs->csum_pending[i]);
+		}
+		fs->csum_npending = 0;
+	}
+	csum_update_sb(image);
+}
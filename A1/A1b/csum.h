@@ -0,0 +1,72 @@
+/**
+ * CSC369 Assignment 1 - a1fs metadata checksums header file.
+ *
+ * All functions are no-ops (or always succeed) on images formatted without
+ * A1FS_FEATURE_CSUM. In the mounted file system checksums are verified lazily,
+ * the first time a block or inode is accessed after mount, and the checksums
+ * of blocks modified by an operation are recomputed once when it completes.
+ *
+ * The updates are deferred, not incremental: a modified bitmap or directory
+ * block is summed again in full by csum_flush(), however little of it
+ * changed. An operation that touches a block many times (e.g. a bitmap while
+ * allocating a long run) pays for one pass over it instead of one per change.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** Recompute the superblock checksum. */
+void csum_update_sb(char *image);
+
+/** Verify the superblock checksum. */
+bool csum_verify_sb(char *image);
+
+/** Recompute the checksums of an inode and its extent record after they were
+ * modified. */
+void csum_update_inode(char *image, a1fs_inode *inode);
+
+/**
+ * Verify the checksum of an in-use inode.
+ *
+ * @return  true if the checksum matches; false (and the file system is marked
+ *          as corrupt) otherwise.
+ */
+bool csum_verify_inode(char *image, a1fs_inode *inode);
+
+/**
+ * Verify the checksum of the extent record of an in-use inode. Kept apart from
+ * csum_verify_inode() so that reading the attributes doesn't touch the record.
+ *
+ * @return  true if the checksum matches; false (and the file system is marked
+ *          as corrupt) otherwise.
+ */
+bool csum_verify_extents(char *image, a1fs_inode *inode);
+
+/**
+ * Record that a bitmap or directory block was modified.
+ *
+ * In the mounted file system the checksum is recomputed by csum_flush() at the
+ * end of the operation, so that a block modified many times is only summed
+ * once. Otherwise (e.g. in mkfs.a1fs) it is recomputed right away.
+ *
+ * @param block  absolute block number.
+ */
+void csum_touch_block(char *image, uint64_t block);
+
+/**
+ * Verify the checksum of a bitmap or directory block.
+ *
+ * @param block  absolute block number.
+ * @return       true if the checksum matches; false (and the file system is
+ *               marked as corrupt) otherwise.
+ */
+bool csum_verify_block(char *image, uint64_t block);
+
+/** Recompute the checksums of all touched blocks, each over the whole block,
+ * and of the superblock. */
+void csum_flush(char *image);
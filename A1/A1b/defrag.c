@@ -0,0 +1,251 @@
+/**
+ * CSC369 Assignment 1 - a1fs online defragmenter.
+ *
+ * Walks the given files and directories in a mounted a1fs, asks the driver for
+ * the number of extents of each regular file (A1FS_IOC_DEFRAG with
+ * A1FS_DEFRAG_QUERY), and then defragments the files with the most extents
+ * first. Each file is moved a chunk per ioctl, and the rate at which data is
+ * moved is limited between chunks, so that the single threaded driver keeps up
+ * with foreground I/O.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "defrag.h"
+
+
+/** Command line options. */
+typedef struct defrag_opts {
+	/** Minimum number of extents for a file to be defragmented. */
+	unsigned min_extents;
+	/** Maximum data rate in MiB/s; 0 for unlimited. */
+	double rate;
+	/** Blocks moved per ioctl; 0 for the driver's default. */
+	uint32_t chunk;
+	/** Print help and exit. */
+	bool help;
+	/** Only report, don't move anything. */
+	bool dry_run;
+	/** Verbose output. */
+	bool verbose;
+
+} defrag_opts;
+
+/** A fragmented file found by the walk. */
+typedef struct defrag_file {
+	char *path;
+	uint32_t extents;
+
+} defrag_file;
+
+
+static const char *help_str = "\
+Usage: %s [options] path...\n\
+\n\
+Defragment the files in a mounted a1fs, moving each into a single extent.\n\
+Directories are walked recursively; files with the most extents go first.\n\
+\n\
+Options:\n\
+    -e num  only defragment files with at least num extents (default: 2)\n\
+    -r num  move at most num MiB/s (default: 32; 0 - unlimited)\n\
+    -c num  move at most num blocks per request (default: 1024)\n\
+    -n      dry run; only report fragmented files\n\
+    -h      print help and exit\n\
+    -v      verbose output\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+static bool parse_args(int argc, char *argv[], defrag_opts *opts)
+{
+	int o;
+	while ((o = getopt(argc, argv, "e:r:c:hnv")) != -1) {
+		switch (o) {
+			case 'e': opts->min_extents = strtoul(optarg, NULL, 10); break;
+			case 'r': opts->rate        = strtod(optarg, NULL);      break;
+			case 'c': opts->chunk       = strtoul(optarg, NULL, 10); break;
+
+			case 'h': opts->help    = true; return true;// skip other arguments
+			case 'n': opts->dry_run = true; break;
+			case 'v': opts->verbose = true; break;
+
+			case '?': return false;
+			default : assert(false);
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "Missing path\n");
+		return false;
+	}
+	if (opts->min_extents < 2) opts->min_extents = 2;
+	if (opts->rate < 0) opts->rate = 0;
+	return true;
+}
+
+
+// State of the walk; nftw() callbacks take no user data
+static defrag_opts *walk_opts;
+static defrag_file *files;
+static size_t nfiles, files_cap;
+static size_t nexamined;
+
+static int walk_cb(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	(void)ftw;// unused
+	if (type != FTW_F || !S_ISREG(st->st_mode)) return 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return 0;
+	}
+	a1fs_defrag_args args = {.flags = A1FS_DEFRAG_QUERY};
+	int ret = ioctl(fd, A1FS_IOC_DEFRAG, &args);
+	int err = errno;
+	close(fd);
+	if (ret < 0) {
+		// Not in an a1fs; nothing to do anywhere under this path
+		fprintf(stderr, "%s: %s\n", path, strerror(err));
+		return err == ENOTTY ? 1 : 0;
+	}
+	nexamined++;
+	if (args.extents_before < walk_opts->min_extents) return 0;
+
+	if (nfiles == files_cap) {
+		size_t cap = files_cap ? files_cap * 2 : 256;
+		defrag_file *tmp = realloc(files, cap * sizeof(*files));
+		if (!tmp) return -1;
+		files = tmp;
+		files_cap = cap;
+	}
+	files[nfiles].path = strdup(path);
+	if (!files[nfiles].path) return -1;
+	files[nfiles++].extents = args.extents_before;
+	return 0;
+}
+
+static int compare_files(const void *a, const void *b)
+{
+	const defrag_file *x = a, *y = b;
+	return (x->extents < y->extents) - (x->extents > y->extents);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Sleep as long as needed to keep the data moved so far under the rate. */
+static void throttle(const defrag_opts *opts, double start, uint64_t bytes)
+{
+	if (opts->rate == 0) return;
+	double ahead = bytes / (opts->rate * 1024 * 1024) - (now() - start);
+	if (ahead > 0) {
+		struct timespec ts = {(time_t)ahead, (long)((ahead - (time_t)ahead) * 1e9)};
+		nanosleep(&ts, NULL);
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	defrag_opts opts = {0};// defaults are all 0
+	opts.rate = 32;
+	if (!parse_args(argc, argv, &opts)) {
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help) {
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	walk_opts = &opts;
+	for (int i = optind; i < argc; i++) {
+		if (nftw(argv[i], walk_cb, 16, FTW_PHYS | FTW_MOUNT) < 0) {
+			perror(argv[i]);
+			return 1;
+		}
+	}
+	qsort(files, nfiles, sizeof(*files), compare_files);
+
+	int ret = 0;
+	size_t ndone = 0, nfailed = 0;
+	uint64_t extents_before = 0, extents_after = 0, moved = 0, moved_bytes = 0;
+	double start = now();
+	for (size_t i = 0; i < nfiles; i++) {
+		if (opts.dry_run) {
+			printf("%s: %u extents\n", files[i].path, files[i].extents);
+			continue;
+		}
+
+		int fd = open(files[i].path, O_RDONLY);
+		// The block size of the image is reported by statvfs()
+		struct statvfs vfs;
+		uint64_t bsize = fd >= 0 && fstatvfs(fd, &vfs) == 0 ? vfs.f_bsize : A1FS_BLOCK_SIZE;
+		// One chunk per ioctl, until the whole file is in one run
+		uint32_t file_before = 0, file_moved = 0;
+		a1fs_defrag_args args = {.max_blocks = opts.chunk};
+		bool failed = fd < 0;
+		for (bool first = true; !failed; first = false) {
+			if (ioctl(fd, A1FS_IOC_DEFRAG, &args) < 0) {
+				failed = true;
+				break;
+			}
+			if (first) file_before = args.extents_before;
+			file_moved += args.blocks_moved;
+			moved_bytes += (uint64_t)args.blocks_moved * bsize;
+			throttle(&opts, start, moved_bytes);
+			if (args.blocks_moved == 0 || args.blocks_placed >= args.blocks_total) break;
+		}
+		moved += file_moved;
+		if (failed) {
+			// Typically ENOSPC: no free run long enough; smaller files may fit
+			fprintf(stderr, "%s: %s\n", files[i].path, strerror(errno));
+			nfailed++;
+			ret = 1;
+		} else {
+			if (opts.verbose) {
+				printf("%s: %u -> %u extents, %u blocks moved\n", files[i].path,
+				       file_before, args.extents_after, file_moved);
+			}
+			ndone++;
+			extents_before += file_before;
+			extents_after += args.extents_after;
+		}
+		if (fd >= 0) close(fd);
+	}
+
+	printf("%zu files examined, %zu fragmented", nexamined, nfiles);
+	if (!opts.dry_run) {
+		printf(", %zu defragmented (%lu -> %lu extents, %lu blocks moved), %zu failed",
+		       ndone, (unsigned long)extents_before, (unsigned long)extents_after,
+		       (unsigned long)moved, nfailed);
+	}
+	printf("\n");
+
+	for (size_t i = 0; i < nfiles; i++) free(files[i].path);
+	free(files);
+	return ret;
+}
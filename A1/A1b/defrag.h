@@ -0,0 +1,47 @@
+/**
+ * CSC369 Assignment 1 - a1fs defragmentation ioctl interface.
+ *
+ * Shared by the driver and the a1fs-defrag tool. The ioctl is issued on an
+ * open regular file in a mounted a1fs; the driver copies a bounded chunk of
+ * the file's blocks into a contiguous run of free blocks, then switches the
+ * inode over to it and frees the old blocks. Each call continues where the
+ * previous one stopped: the blocks at the start of the file that already form
+ * one run are left in place, and the rest is moved right after them when it
+ * fits there, or else the file starts over in a run that holds all of it. The
+ * caller repeats the ioctl until blocks_placed reaches blocks_total, so that
+ * the single-threaded file system is never busy with one file for long.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+
+/** Only report the number of extents; don't move anything. */
+#define A1FS_DEFRAG_QUERY 0x1
+
+/** Number of blocks moved per call when max_blocks is 0. */
+#define A1FS_DEFRAG_CHUNK 1024
+
+/** A1FS_IOC_DEFRAG argument (in and out). */
+typedef struct a1fs_defrag_args {
+	/** A1FS_DEFRAG_* flags (in). */
+	uint32_t flags;
+	/** Number of extents before and after (out). */
+	uint32_t extents_before;
+	uint32_t extents_after;
+	/** Number of blocks copied (out). */
+	uint32_t blocks_moved;
+	/** Most blocks to copy in this call; 0 for A1FS_DEFRAG_CHUNK (in). */
+	uint32_t max_blocks;
+	/** Blocks at the start of the file that are in one run, and all of the
+	 * file's blocks, after the call (out); done when they are equal. */
+	uint64_t blocks_placed;
+	uint64_t blocks_total;
+
+} a1fs_defrag_args;
+
+/** Defragment the next chunk of the file; fails with ENOSPC if there is no
+ * run long enough. */
+#define A1FS_IOC_DEFRAG _IOWR('a', 1, a1fs_defrag_args)
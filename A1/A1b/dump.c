@@ -0,0 +1,211 @@
+/**
+ * CSC369 Assignment 1 - a1fs-dump: stream the used blocks of an a1fs image.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dump.h"
+
+
+static const char *help_str = "\
+Usage: %s [options] image output\n\
+\n\
+Write the metadata and the used data blocks of an a1fs image to output\n\
+(\"-\" for stdout). Restore with a1fs-restore.\n\
+\n\
+Options:\n\
+    -D      read the image with O_DIRECT, bypassing the page cache\n\
+    -h      print help and exit\n\
+    -v      print statistics when done\n\
+";
+
+static bool read_full(int fd, void *buf, size_t len, off_t off)
+{
+	char *p = buf;
+	while (len > 0) {
+		ssize_t n = pread(fd, p, len, off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			if (n == 0) errno = EIO;
+			perror("read image");
+			return false;
+		}
+		p += n;
+		off += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			perror("write dump");
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/** Write a run header followed by the contents of its blocks. */
+static bool dump_run(int in, int out, char *buf, size_t bs, uint64_t start, uint64_t count)
+{
+	// A run of 0 blocks would end the stream
+	if (count == 0) return true;
+	a1fs_dump_run run = {start, count};
+	if (!write_full(out, &run, sizeof(run))) return false;
+
+	uint64_t off = start * bs;
+	uint64_t left = count * bs;
+	while (left > 0) {
+		size_t len = left < A1FS_DUMP_BUF_SIZE ? left : A1FS_DUMP_BUF_SIZE;
+		if (!read_full(in, buf, len, off) || !write_full(out, buf, len)) {
+			return false;
+		}
+		off += len;
+		left -= len;
+	}
+	return true;
+}
+
+static bool test_bit(const unsigned char *bitmap, uint64_t i)
+{
+	return (bitmap[i / 8] & (1 << (i % 8))) != 0;
+}
+
+int main(int argc, char *argv[])
+{
+	bool direct = false, verbose = false;
+	int o;
+	while ((o = getopt(argc, argv, "Dhv")) != -1) {
+		switch (o) {
+			case 'D': direct  = true; break;
+			case 'v': verbose = true; break;
+			case 'h': printf(help_str, argv[0]); return 0;
+			default : fprintf(stderr, help_str, argv[0]); return 1;
+		}
+	}
+	if (argc - optind != 2) {
+		fprintf(stderr, help_str, argv[0]);
+		return 1;
+	}
+
+	int in = open(argv[optind], O_RDONLY | (direct ? O_DIRECT : 0));
+	if (in < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	int out = strcmp(argv[optind + 1], "-") == 0 ? STDOUT_FILENO :
+	          open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	int ret = 1;
+	unsigned char *bitmap = NULL;
+	// Aligned so that it can be used with O_DIRECT
+	char *buf = NULL;
+	if (posix_memalign((void**)&buf, A1FS_BLOCK_SIZE, A1FS_DUMP_BUF_SIZE) != 0) {
+		fprintf(stderr, "Out of memory\n");
+		goto end;
+	}
+
+	if (!read_full(in, buf, A1FS_BLOCK_SIZE, 0)) goto end;
+	a1fs_superblock sb = *(a1fs_superblock*)buf;
+	if (sb.magic != A1FS_MAGIC || sb.log_block_size > A1FS_LOG_BLOCK_SIZE_MAX) {
+		fprintf(stderr, "%s does not contain a1fs\n", argv[optind]);
+		goto end;
+	}
+	if (sb.features & A1FS_FEATURE_STRIPED) {
+		fprintf(stderr, "%s is part of a striped volume, which is not supported\n", argv[optind]);
+		goto end;
+	}
+
+	size_t bs = a1fs_block_size(&sb);
+	a1fs_dump_header header = {A1FS_DUMP_MAGIC, A1FS_DUMP_VERSION, sb.size, bs};
+	if (!write_full(out, &header, sizeof(header))) goto end;
+
+	// Superblock, bitmaps, checksum table, inode chunk map, inode table and
+	// extent table, less the parts of them that are not initialized yet (which
+	// restore as zeros)
+	uint64_t inode_bitmap_blocks = sb.datablock_bitmap - sb.inode_bitmap;
+	uint64_t block_bitmap_blocks = sb.csum_table - sb.datablock_bitmap;
+	uint64_t chunk_map_blocks = sb.first_inode_block - sb.inode_chunk_map;
+	uint64_t inode_table_blocks = sb.extent_table - sb.first_inode_block;
+	if (sb.features & A1FS_FEATURE_LAZY_INIT) {
+		inode_bitmap_blocks = sb.inode_bitmap_init;
+		block_bitmap_blocks = sb.block_bitmap_init;
+		chunk_map_blocks = sb.chunk_map_init;
+		inode_table_blocks = sb.inode_table_init;
+	}
+	uint64_t extent_table_blocks = inode_table_blocks * A1FS_EXTENT_TABLE_RATIO;
+	if (!dump_run(in, out, buf, bs, 0, sb.inode_bitmap + inode_bitmap_blocks) ||
+	    !dump_run(in, out, buf, bs, sb.datablock_bitmap, block_bitmap_blocks) ||
+	    !dump_run(in, out, buf, bs, sb.csum_table, sb.inode_chunk_map - sb.csum_table) ||
+	    !dump_run(in, out, buf, bs, sb.inode_chunk_map, chunk_map_blocks) ||
+	    !dump_run(in, out, buf, bs, sb.first_inode_block, inode_table_blocks) ||
+	    !dump_run(in, out, buf, bs, sb.extent_table, extent_table_blocks)) {
+		goto end;
+	}
+	uint64_t dumped = sb.inode_bitmap + inode_bitmap_blocks + block_bitmap_blocks +
+	                  (sb.inode_chunk_map - sb.csum_table) + chunk_map_blocks +
+	                  inode_table_blocks + extent_table_blocks;
+
+	// Used data blocks (with the inode chunks), coalesced into runs
+	uint64_t data_blocks = sb.blocks_count - sb.first_data_block;
+	size_t bitmap_size = (data_blocks + 8 * bs - 1) / (8 * bs) * bs;
+	if (posix_memalign((void**)&bitmap, A1FS_BLOCK_SIZE, bitmap_size) != 0 ||
+	    !read_full(in, bitmap, block_bitmap_blocks * bs, sb.datablock_bitmap * bs)) {
+		goto end;
+	}
+	memset(bitmap + block_bitmap_blocks * bs, 0, bitmap_size - block_bitmap_blocks * bs);
+	uint64_t i = 0;
+	while (i < data_blocks) {
+		// Skip free blocks a word at a time
+		if (i % 64 == 0 && i + 64 <= data_blocks &&
+		    ((const uint64_t*)bitmap)[i / 64] == 0) {
+			i += 64;
+			continue;
+		}
+		if (!test_bit(bitmap, i)) {
+			i++;
+			continue;
+		}
+		uint64_t start = i;
+		while (i < data_blocks && test_bit(bitmap, i)) i++;
+		if (!dump_run(in, out, buf, bs, sb.first_data_block + start, i - start)) goto end;
+		dumped += i - start;
+	}
+
+	a1fs_dump_run end_run = {0, 0};
+	if (!write_full(out, &end_run, sizeof(end_run))) goto end;
+	if (verbose) {
+		fprintf(stderr, "Dumped %lu of %lu blocks\n", (unsigned long)dumped,
+		        (unsigned long)sb.blocks_count);
+	}
+	ret = 0;
+
+end:
+	free(bitmap);
+	free(buf);
+	close(in);
+	if (out != STDOUT_FILENO && close(out) < 0) {
+		perror("close");
+		ret = 1;
+	}
+	return ret;
+}
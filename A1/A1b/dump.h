@@ -0,0 +1,47 @@
+/**
+ * CSC369 Assignment 1 - a1fs dump stream format, shared by a1fs-dump and
+ * a1fs-restore.
+ *
+ * A dump is a header followed by a sequence of runs. Each run is a
+ * a1fs_dump_run record followed by the contents of its blocks. The stream ends
+ * with a run of 0 blocks. Only the metadata area and the data blocks marked as
+ * used in the block bitmap are dumped; everything else restores as a hole.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** Magic value identifying an a1fs dump stream. */
+#define A1FS_DUMP_MAGIC 0xC5C369A1D0D0A1F5ul
+
+/** Current version of the dump stream format. */
+#define A1FS_DUMP_VERSION 1
+
+/** Size of the buffer used for reading and writing runs. */
+#define A1FS_DUMP_BUF_SIZE (1u << 20)
+
+/** Dump stream header. */
+typedef struct a1fs_dump_header {
+	/** Must match A1FS_DUMP_MAGIC. */
+	uint64_t magic;
+	/** Must match A1FS_DUMP_VERSION. */
+	uint64_t version;
+	/** Size of the dumped image in bytes. */
+	uint64_t image_size;
+	/** Block size of the dumped image in bytes. */
+	uint64_t block_size;
+
+} a1fs_dump_header;
+
+/** Header of a run of consecutive image blocks. */
+typedef struct a1fs_dump_run {
+	/** Absolute number of the first block. */
+	uint64_t start;
+	/** Number of blocks; 0 marks the end of the stream. */
+	uint64_t count;
+
+} a1fs_dump_run;
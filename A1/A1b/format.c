@@ -0,0 +1,175 @@
+/**
+ * CSC369 Assignment 1 - a1fs formatting implementation.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "a1fs.h"
+#include "csum.h"
+#include "format.h"
+#include "group.h"
+#include "util.h"
+
+
+bool format_image(void *image, size_t size, const format_opts *opts)
+{
+	const size_t bs = opts->block_size;
+	// a partial last block is left unused
+	if(size / bs < 2){
+		return false;
+	}
+	memset(image, 0, bs);
+	a1fs_superblock *sb = (a1fs_superblock *)image;
+	sb->magic = A1FS_MAGIC;
+	sb->size = size;
+	sb->features = A1FS_FEATURE_EXTENT_TABLE;
+	while(((size_t)A1FS_BLOCK_SIZE << sb->log_block_size) < bs){
+		sb->log_block_size++;
+	}
+	sb->blocks_count = size / bs;
+	uint64_t inodesPerBlock = bs / sizeof(a1fs_inode);
+	sb->inodes_count = opts->n_inodes;
+	if(sb->inodes_count == 0){
+		// the cap only sizes the inode bitmap and the chunk map, so allow one
+		// inode per block; inode numbers are 32-bit
+		sb->features |= A1FS_FEATURE_DYN_INODES;
+		sb->inodes_count = align_up(sb->blocks_count, inodesPerBlock);
+		if(sb->inodes_count > UINT32_MAX){
+			sb->inodes_count = UINT32_MAX / inodesPerBlock * inodesPerBlock;
+		}
+	}
+	// 32-bit extents can't address the blocks past 2^32
+	if(opts->use_64bit || sb->blocks_count > UINT32_MAX){
+		sb->features |= A1FS_FEATURE_64BIT;
+	}
+	if(sb->blocks_count > A1FS_BLOCKS_MAX_64){
+		return false;
+	}
+	sb->free_inodes_count = sb->inodes_count - 1;
+
+	// one group per block of the data bitmap; the whole image is an upper
+	// bound on the data area they cover
+	uint64_t blocksPerGroup = bs * 8;
+	uint64_t numOfGroups = (sb->blocks_count + blocksPerGroup - 1) / blocksPerGroup;
+	uint64_t numOfGroupDesc = (numOfGroups * sizeof(a1fs_group_desc) + bs - 1) / bs;
+
+	uint64_t numOfInodeBm = sb->inodes_count / (bs * 8);
+	if(sb->inodes_count % (bs * 8) != 0){
+		numOfInodeBm += 1;
+	}
+	uint64_t numOfDataBm = sb->blocks_count / (bs * 8);
+	if(sb->blocks_count % (bs * 8) != 0){
+		numOfDataBm += 1;
+	}
+	uint64_t numOfCsumTable = 0;
+	if(!opts->no_csum){
+		sb->features |= A1FS_FEATURE_CSUM;
+		numOfCsumTable = (sb->blocks_count * sizeof(uint32_t) + bs - 1) / bs;
+	}
+	uint64_t numOfInodeTable = sb->inodes_count * sizeof(a1fs_inode) / bs;
+	if((sb->inodes_count * sizeof(a1fs_inode) % bs) != 0){
+		numOfInodeTable += 1;
+	}
+	uint64_t numOfChunkMap = 0;
+	if(sb->features & A1FS_FEATURE_DYN_INODES){
+		// one map entry per chunk of inodes instead of the table itself
+		numOfChunkMap = (sb->inodes_count / inodesPerBlock * sizeof(uint64_t) + bs - 1) / bs;
+		numOfInodeTable = 0;
+	}
+
+	// every inode table block has its extent records in the extent table
+	uint64_t numOfExtentTable = numOfInodeTable * A1FS_EXTENT_TABLE_RATIO;
+
+	// no more space to allocate datablock
+	uint64_t totalReserveBlock = 1 + numOfGroupDesc + numOfInodeBm + numOfDataBm + numOfCsumTable +
+	                             numOfChunkMap + numOfInodeTable + numOfExtentTable;
+	// the root inode's chunk takes data blocks too
+	uint64_t rootChunk = (sb->features & A1FS_FEATURE_DYN_INODES) ? A1FS_INODE_CHUNK_BLOCKS : 0;
+	if(totalReserveBlock + 1 + rootChunk > sb->blocks_count){
+		return false;
+	}
+	sb->group_desc = 1;
+	sb->inode_bitmap = sb->group_desc + numOfGroupDesc;
+	sb->datablock_bitmap = sb->inode_bitmap + numOfInodeBm;
+	sb->csum_table = sb->datablock_bitmap + numOfDataBm;
+	sb->inode_chunk_map = sb->csum_table + numOfCsumTable;
+	sb->first_inode_block = sb->inode_chunk_map + numOfChunkMap;
+	sb->extent_table = sb->first_inode_block + numOfInodeTable;
+	sb->first_data_block = sb->extent_table + numOfExtentTable;
+	// only the data area counts, less the reserved data block 0
+	sb->free_blocks_count = sb->blocks_count - sb->first_data_block - 1;
+	// the groups only cover the data area
+	sb->features |= A1FS_FEATURE_GROUPS;
+	sb->groups_count = (sb->blocks_count - sb->first_data_block + blocksPerGroup - 1) / blocksPerGroup;
+	sb->blocks_per_group = blocksPerGroup;
+	// the inodes are spread evenly over the groups in whole inode table blocks
+	// (whole inode chunks)
+	uint64_t inodesPerGroup = (sb->inodes_count + sb->groups_count - 1) / sb->groups_count;
+	sb->inodes_per_group = (inodesPerGroup + inodesPerBlock - 1) / inodesPerBlock * inodesPerBlock;
+	memset(image + sb->group_desc * bs, 0, numOfGroupDesc * bs);
+
+	if (opts->n_images > 1) {
+		sb->features |= A1FS_FEATURE_STRIPED;
+		sb->stripe_count = opts->n_images;
+		sb->stripe_unit = opts->stripe_unit;
+	}
+
+	// an image zeroed with -z needs no lazy initialization
+	if(!opts->zero){
+		sb->features |= A1FS_FEATURE_LAZY_INIT;
+		lazy_init(image, LAZY_INODE_TABLE, 0);
+		lazy_init(image, LAZY_INODE_BITMAP, 0);
+		lazy_init(image, LAZY_BLOCK_BITMAP, 0);
+		lazy_init(image, LAZY_CHUNK_MAP, 0);
+	} else {
+		sb->inode_bitmap_init = numOfInodeBm;
+		sb->block_bitmap_init = numOfDataBm;
+		sb->inode_table_init = numOfInodeTable;
+		sb->chunk_map_init = numOfChunkMap;
+	}
+
+	// set DataBlock bitmap first char to 1, rest to 0
+	unsigned char *DataBlockBm = (unsigned char*)(image + (sb->datablock_bitmap) * bs);
+	DataBlockBm[0] = DataBlockBm[0] | (1<<0);
+
+	// the root's inode chunk goes right after the reserved data block 0
+	if(sb->features & A1FS_FEATURE_DYN_INODES){
+		*chunk_map_entry(image, 0) = 1;
+		memset(find_data_block(image, 1), 0, A1FS_INODE_CHUNK_BLOCKS * bs);
+		for(uint64_t i = 1; i <= A1FS_INODE_CHUNK_BLOCKS; i++){
+			DataBlockBm[i / 8] |= 1 << (i % 8);
+		}
+		sb->free_blocks_count -= A1FS_INODE_CHUNK_BLOCKS;
+	}
+
+	// set inode in the inode table
+	a1fs_inode *rootInode = find_inode_num(image, 1);
+	rootInode->mode = S_IFDIR;
+	rootInode->links = 2;
+	rootInode->size = 2 * sizeof(a1fs_dentry);
+	clock_gettime(CLOCK_REALTIME,&rootInode->mtime);
+	rootInode->inode_num = 1;
+	rootInode->i_blocks = 0;
+
+	// set InodeBlock bitmap first char to 1, rest to 0
+	unsigned char *InodeBm = (unsigned char*)(image + (sb->inode_bitmap) * bs);
+	InodeBm[0] = InodeBm[0] | (1<<0);
+
+	// checksum the metadata written above
+	group_recount(image);
+	csum_update_inode(image, rootInode);
+	for(uint64_t i = 0; i < sb->inode_bitmap_init; i++){
+		csum_touch_block(image, sb->inode_bitmap + i);
+	}
+	for(uint64_t i = 0; i < sb->block_bitmap_init; i++){
+		csum_touch_block(image, sb->datablock_bitmap + i);
+	}
+	for(uint64_t i = 0; i < sb->chunk_map_init; i++){
+		csum_touch_block(image, sb->inode_chunk_map + i);
+	}
+	csum_update_sb(image);
+
+	return true;
+}
@@ -0,0 +1,49 @@
+/**
+ * CSC369 Assignment 1 - a1fs formatting header file.
+ *
+ * The formatting logic of mkfs.a1fs, for the tools that make images of their
+ * own (a1fs-bench, a1fs-test).
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/** Formatting parameters; see mkfs.a1fs for their meaning. */
+typedef struct format_opts {
+	/** Number of inodes (0 to allocate the inode table on demand). */
+	size_t n_inodes;
+	/** Block size in bytes. */
+	size_t block_size;
+	/** Number of image files; more than one for a striped volume. */
+	int n_images;
+	/** Stripe unit in bytes of a striped volume. */
+	size_t stripe_unit;
+	/** The image is all zeros already, so it needs no lazy initialization. */
+	bool zero;
+	/** Don't checksum metadata. */
+	bool no_csum;
+	/** Use 64-bit extents even if the image doesn't need them. */
+	bool use_64bit;
+
+} format_opts;
+
+
+/**
+ * Format the image into a1fs.
+ *
+ * Only the superblock, the group descriptor table and the first block of each
+ * bitmap and of the inode table (or of the inode chunk map, and the root's
+ * inode chunk) are written; the rest of the metadata is initialized lazily as
+ * it is first used, and data blocks are zeroed when allocated. This keeps
+ * formatting time independent of the image size.
+ *
+ * @param image  pointer to the start of the image.
+ * @param size   image size in bytes.
+ * @param opts   formatting parameters.
+ * @return       true on success;
+ *               false on error, e.g. options are invalid for given image size.
+ */
+bool format_image(void *image, size_t size, const format_opts *opts);
@@ -16,22 +16,142 @@
  * CSC369 Assignment 1 - File system runtime context implementation.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "csum.h"
 #include "fs_ctx.h"
+#include "map.h"
+
+
+/** The file system mounted by this process; see fs_ctx_of(). There can only be
+ * one at a time: the code that looks it up by the image pointer would find
+ * none for the other images, and would neither cache checksums nor reclaim
+ * freed blocks for them. */
+static fs_ctx *mounted;
 
+/** Bytes of metadata at the start of the image: the superblock, bitmaps and
+ * inode table (or inode chunk map) all precede the first data block. */
+static size_t meta_size(const a1fs_superblock *sb)
+{
+	return (size_t)sb->first_data_block * a1fs_block_size(sb);
+}
 
 bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, a1fs_opts *opts)
 {
+	if (mounted) {
+		fprintf(stderr, "Another image is already mounted by this process\n");
+		return false;
+	}
 	fs->image = image;
 	fs->size = size;
 	fs->opts = opts;
 
 	//TODO: check if the file system image can be mounted and initialize its
 	// runtime state
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	if (sb->magic != A1FS_MAGIC) {
+		fprintf(stderr, "Image does not contain a1fs\n");
+		return false;
+	}
+	if ((sb->features & ~A1FS_FEATURES_SUPPORTED) != 0) {
+		fprintf(stderr, "Image uses unsupported features 0x%lx\n",
+		        (unsigned long)(sb->features & ~A1FS_FEATURES_SUPPORTED));
+		return false;
+	}
+	if ((sb->features & A1FS_FEATURES_REQUIRED) != A1FS_FEATURES_REQUIRED) {
+		fprintf(stderr, "Image uses an old format without features 0x%lx; reformat it\n",
+		        (unsigned long)(~sb->features & A1FS_FEATURES_REQUIRED));
+		return false;
+	}
+	if (!csum_verify_sb(image)) {
+		fprintf(stderr, "Superblock checksum mismatch; run fsck\n");
+		return false;
+	}
+	if (sb->log_block_size > A1FS_LOG_BLOCK_SIZE_MAX ||
+	    sb->blocks_count > size / a1fs_block_size(sb)) {
+		fprintf(stderr, "Invalid block size or image truncated\n");
+		return false;
+	}
+
+	// A striped image only makes sense as the whole volume
+	uint64_t files = (sb->features & A1FS_FEATURE_STRIPED) ? sb->stripe_count : 1;
+	if (files != (fs->cache.base ? (uint64_t)fs->cache.nfiles : 1) ||
+	    (files > 1 && sb->stripe_unit != fs->cache.stripe_unit)) {
+		fprintf(stderr, "Image is striped over %lu files; give all of them in order\n",
+		        (unsigned long)files);
+		return false;
+	}
+
+	// The hints belong to the mapping, which the FUSE daemon inherits; the
+	// pages that --prefault and --mlock bring in don't, see fs_ctx_populate()
+	int advice = (opts->hugepages  ? MAP_ADV_HUGEPAGES  : 0) |
+	             (opts->sequential ? MAP_ADV_SEQUENTIAL : 0) |
+	             (opts->random     ? MAP_ADV_RANDOM     : 0);
+	if (advice != 0) {
+		map_advise(image, size, meta_size(sb), advice, opts->verbose);
+	}
+
+	if (sb->features & A1FS_FEATURE_CSUM) {
+		fs->csum_verified = calloc(sb->blocks_count / 8 + 1, 1);
+		fs->inode_verified = calloc(sb->inodes_count / 8 + 1, 1);
+		fs->extents_verified = calloc(sb->inodes_count / 8 + 1, 1);
+		if (!fs->csum_verified || !fs->inode_verified || !fs->extents_verified) {
+			fs_ctx_destroy(fs);
+			return false;
+		}
+	}
+	if (!reclaim_init(&fs->reclaim, image, opts->discard)) {
+		fs_ctx_destroy(fs);
+		return false;
+	}
+	mounted = fs;
 	return true;
 }
 
 void fs_ctx_destroy(fs_ctx *fs)
 {
 	//TODO: cleanup any resources allocated in fs_ctx_init()
-	(void)fs;
+	if (fs->reclaim.image) reclaim_destroy(&fs->reclaim);
+	free(fs->csum_verified);
+	free(fs->inode_verified);
+	free(fs->extents_verified);
+	if (mounted == fs) mounted = NULL;
+}
+
+void fs_ctx_populate(fs_ctx *fs)
+{
+	int advice = (fs->opts->prefault ? MAP_ADV_PREFAULT : 0) |
+	             (fs->opts->mlock    ? MAP_ADV_LOCK     : 0);
+	if (advice != 0) {
+		map_advise(fs->image, fs->size, meta_size((a1fs_superblock*)fs->image), advice,
+		           fs->opts->verbose);
+	}
+}
+
+fs_ctx *fs_ctx_of(const void *image)
+{
+	return (mounted && mounted->image == image) ? mounted : NULL;
+}
+
+int image_sync(void *image, void *addr, size_t len)
+{
+	fs_ctx *fs = fs_ctx_of(image);
+	if (fs && fs->cache.base) return bcache_writeback(&fs->cache, addr, len, true);
+	return msync(addr, len, MS_SYNC);
+}
+
+void image_prefetch(void *image, void *addr, size_t len)
+{
+	fs_ctx *fs = fs_ctx_of(image);
+	if (fs && fs->cache.base) {
+		bcache_prefetch(&fs->cache, addr, len);
+		return;
+	}
+	size_t page = sysconf(_SC_PAGESIZE);
+	char *start = (char*)((uintptr_t)addr & ~(uintptr_t)(page - 1));
+	madvise(start, (char*)addr + len - start, MADV_WILLNEED);
 }
@@ -19,10 +19,18 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include "bcache.h"
 #include "options.h"
+#include "readahead.h"
+#include "reclaim.h"
+#include "stats.h"
 
 
+/** Number of modified metadata blocks whose checksum update can be deferred. */
+#define FS_CSUM_PENDING_MAX 64
+
 /**
  * Mounted file system runtime state - "fs context".
  */
@@ -31,22 +39,50 @@ typedef struct fs_ctx {
 	void *image;
 	/** Image size in bytes. */
 	size_t size;
+	/** Block cache the image is accessed through, if base is set (--cache). */
+	bcache cache;
 	/** Command line options. */
 	a1fs_opts *opts;
 
 	//TODO: useful runtime state of the mounted file system should be cached
 	// here (NOT in global variables in a1fs.c)
 
+	/** Metadata blocks whose checksum has been verified since mount. */
+	unsigned char *csum_verified;
+	/** Inodes whose checksum has been verified since mount. */
+	unsigned char *inode_verified;
+	/** Inodes whose extent record checksum has been verified since mount. */
+	unsigned char *extents_verified;
+	/** Metadata blocks modified by the current operation; see csum_flush(). */
+	uint64_t csum_pending[FS_CSUM_PENDING_MAX];
+	/** Number of entries in csum_pending. */
+	size_t csum_npending;
+	/** Metadata corruption was detected; no further changes are allowed. */
+	bool corrupt;
+	/** Freed blocks whose bits are not cleared yet. */
+	reclaim reclaim;
+	/** Sequential read streams; see readahead_read(). */
+	readahead readahead;
+	/** Periodic printing of the statistics with --verbose. */
+	stats_dump stats_dump;
+	/** Text of STATS_FILE as last taken; see stats_format(). */
+	char stats_text[STATS_TEXT_MAX];
+	size_t stats_len;
+
 } fs_ctx;
 
 /**
  * Initialize file system context.
  *
+ * Only one context can be live in a process at a time (see fs_ctx_of()); it
+ * must be destroyed before another one is initialized.
+ *
  * @param fs     pointer to the context to initialize.
  * @param image  pointer to the start of the image.
  * @param size   image size in bytes.
  * @param opts   command line options.
- * @return       true on success; false on failure (e.g. invalid superblock).
+ * @return       true on success; false on failure (e.g. invalid superblock,
+ *               or another context is live).
  */
 bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, a1fs_opts *opts);
 
@@ -56,3 +92,37 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, a1fs_opts *opts);
  * Must cleanup all the resources created in fs_ctx_init().
  */
 void fs_ctx_destroy(fs_ctx *fs);
+
+/**
+ * Fault in (--prefault) and lock (--mlock) the metadata of a mapped image.
+ *
+ * Must be called by the process that serves the file system: neither the
+ * page tables of a shared mapping nor memory locks are inherited across
+ * fork(), and without -f the FUSE daemon is a child of the process that
+ * called fs_ctx_init().
+ */
+void fs_ctx_populate(fs_ctx *fs);
+
+/**
+ * Get the context of the mounted file system given its image.
+ *
+ * For code that only has the image pointer at hand (e.g. util.c). Returns NULL
+ * when the image is not mounted by this process, e.g. in mkfs.a1fs.
+ * fs_ctx_init() refuses a second live context, since this would not find it.
+ */
+fs_ctx *fs_ctx_of(const void *image);
+
+/**
+ * Write [addr, addr + len) of an image back to the image file and wait for it
+ * to reach the disk, whether the image is mapped or accessed through the
+ * block cache.
+ *
+ * @return  0 on success; -1 on failure (with errno set).
+ */
+int image_sync(void *image, void *addr, size_t len);
+
+/**
+ * Start reading [addr, addr + len) of an image in, ahead of its use:
+ * madvise(MADV_WILLNEED) on the mapping, or bcache_prefetch().
+ */
+void image_prefetch(void *image, void *addr, size_t len);
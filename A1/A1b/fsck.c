@@ -0,0 +1,954 @@
+/**
+ * CSC369 Assignment 1 - a1fs consistency checker.
+ *
+ * Checks run in three phases, the first two spread over a pool of threads:
+ *
+ *  1. Directory walk. Directories are taken from a shared queue starting at the
+ *     root; every entry bumps the reference count of its inode, and each inode
+ *     seen for the first time is marked reachable (subdirectories are queued).
+ *     A second entry with the same name in a directory is bad, as lookups
+ *     can't reach it.
+ *  2. Inode table scan, in chunks. Every reachable inode has its checksum, link
+ *     count and extents checked, and its blocks are OR-ed into the expected
+ *     block bitmap with atomic operations, which also catches blocks claimed by
+ *     more than one inode.
+ *  3. The inode chunks (A1FS_FEATURE_DYN_INODES) are added to the expected
+ *     block bitmap. The expected inode and block bitmaps, free counts, block
+ *     group descriptors and tail block reference counts are compared against
+ *     the ones on disk.
+ *
+ * With -r, all problems that can be fixed are written back to the image.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "bcache.h"
+#include "csum.h"
+#include "group.h"
+#include "map.h"
+#include "util.h"
+
+
+/** Exit codes, as in fsck(8). */
+#define FSCK_OK           0
+#define FSCK_CORRECTED    1
+#define FSCK_UNCORRECTED  4
+#define FSCK_ERROR        8
+
+/** Number of inodes handed to a thread at a time in phase 2. */
+#define FSCK_INODE_CHUNK 4096
+
+/** Problems of one kind printed individually before only counting them. */
+#define FSCK_REPORT_MAX 20
+
+
+/** Command line options. */
+typedef struct fsck_opts {
+	/** File system image file paths, in stripe order for a striped volume. */
+	const char *const *img_paths;
+	/** Number of image files. */
+	int n_images;
+	/** Number of checking threads. */
+	int threads;
+	/** Print help and exit. */
+	bool help;
+	/** Fix the problems found. */
+	bool repair;
+	/** Verbose output. */
+	bool verbose;
+
+} fsck_opts;
+
+/** A tail reference found in phase 2. */
+typedef struct fsck_tails {
+	a1fs_blk_t *blocks;
+	size_t n;
+	size_t cap;
+
+} fsck_tails;
+
+/** Checker state shared by all threads. */
+typedef struct fsck_ctx {
+	char *image;
+	a1fs_superblock *sb;
+	fsck_opts *opts;
+	uint64_t data_blocks;
+
+	/** Data blocks referenced by reachable inodes (atomic OR). */
+	uint64_t *expected_blocks;
+	/** Inodes reachable from the root, by bitmap index (atomic OR). */
+	uint64_t *reachable;
+	/** Number of directory entries referencing each inode (atomic add). */
+	uint32_t *refs;
+	/** Number of subdirectories of each directory (atomic add). */
+	uint32_t *subdirs;
+
+	/** Directory queue for phase 1. */
+	a1fs_ino_t *queue;
+	size_t queue_head;
+	size_t queue_tail;
+	/** Threads currently processing a directory. */
+	int active;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/** Next inode chunk for phase 2. */
+	uint64_t next_chunk;
+	/** Per-thread tail references from phase 2. */
+	fsck_tails *tails;
+
+	/** Problems found, and problems found and fixed. */
+	uint64_t errors;
+	uint64_t fixed;
+
+} fsck_ctx;
+
+/** Per-thread argument. */
+typedef struct fsck_thread {
+	fsck_ctx *ctx;
+	int id;
+
+} fsck_thread;
+
+
+static const char *help_str = "\
+Usage: %s [options] image [image...]\n\
+\n\
+Check the consistency of an a1fs image: bitmaps against the extents in the\n\
+inode table, link counts, directory reachability and checksums. A striped\n\
+volume is given as all of its files, in the order they were formatted in.\n\
+\n\
+Options:\n\
+    -j num  number of threads (default: number of CPUs)\n\
+    -r      repair the problems found\n\
+    -h      print help and exit\n\
+    -v      verbose output\n\
+\n\
+Exit status: 0 - no problems, 1 - all problems fixed, 4 - problems left,\n\
+8 - operational error.\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+static bool parse_args(int argc, char *argv[], fsck_opts *opts)
+{
+	int o;
+	while ((o = getopt(argc, argv, "j:hrv")) != -1) {
+		switch (o) {
+			case 'j': opts->threads = atoi(optarg); break;
+
+			case 'h': opts->help    = true; return true;// skip other arguments
+			case 'r': opts->repair  = true; break;
+			case 'v': opts->verbose = true; break;
+
+			case '?': return false;
+			default : assert(false);
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "Missing image path\n");
+		return false;
+	}
+	opts->img_paths = (const char *const *)argv + optind;
+	opts->n_images = argc - optind;
+
+	if (opts->threads <= 0) opts->threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (opts->threads <= 0) opts->threads = 1;
+	return true;
+}
+
+
+static bool test_bit(const void *map, uint64_t i)
+{
+	return (((const unsigned char*)map)[i / 8] & (1 << (i % 8))) != 0;
+}
+
+/** Number of set bits in [from, to) of a bitmap, a word at a time. */
+static uint64_t count_bits(const uint64_t *map, uint64_t from, uint64_t to)
+{
+	uint64_t n = 0;
+	for (; from < to && from % 64 != 0; from++) n += test_bit(map, from);
+	for (; from + 64 <= to; from += 64) n += __builtin_popcountll(map[from / 64]);
+	for (; from < to; from++) n += test_bit(map, from);
+	return n;
+}
+
+/** Bit i of a bitmap on disk; blocks not initialized yet read as all clear. */
+static bool disk_bit(fsck_ctx *ctx, lazy_region region, uint64_t first_block, uint64_t i)
+{
+	if (i / 8 / block_size(ctx->image) >= lazy_initialized(ctx->image, region)) return false;
+	return test_bit(get_block(ctx->image, first_block), i);
+}
+
+/** Atomically set bit i; returns whether it was already set. */
+static bool atomic_set_bit(uint64_t *map, uint64_t i)
+{
+	uint64_t mask = 1ul << (i % 64);
+	return (__atomic_fetch_or(&map[i / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+/** Report a problem; the first FSCK_REPORT_MAX of each kind are printed. */
+static void problem(fsck_ctx *ctx, unsigned *count, bool fixable, const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+static void problem(fsck_ctx *ctx, unsigned *count, bool fixable, const char *fmt, ...)
+{
+	__atomic_fetch_add(&ctx->errors, 1, __ATOMIC_RELAXED);
+	if (fixable && ctx->opts->repair) __atomic_fetch_add(&ctx->fixed, 1, __ATOMIC_RELAXED);
+
+	unsigned n = __atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+	if (n >= FSCK_REPORT_MAX && !ctx->opts->verbose) return;
+
+	char msg[512];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+	printf("%s%s\n", msg, (fixable && ctx->opts->repair) ? " (fixed)" : "");
+}
+
+static unsigned n_bad_dentry, n_bad_inode, n_bad_links, n_bad_extent, n_dup_block,
+                n_orphan, n_inode_bitmap, n_block_bitmap, n_bad_tail, n_bad_size,
+                n_bad_group, n_bad_chunk;
+
+
+/* Phase 1: directory walk */
+
+static void queue_push(fsck_ctx *ctx, a1fs_ino_t ino)
+{
+	pthread_mutex_lock(&ctx->lock);
+	ctx->queue[ctx->queue_tail++] = ino;
+	pthread_cond_signal(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/** Take a directory off the queue; 0 once the walk is complete. */
+static a1fs_ino_t queue_pop(fsck_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+	while (ctx->queue_head == ctx->queue_tail && ctx->active > 0) {
+		pthread_cond_wait(&ctx->cond, &ctx->lock);
+	}
+	a1fs_ino_t ino = 0;
+	if (ctx->queue_head < ctx->queue_tail) {
+		ino = ctx->queue[ctx->queue_head++];
+		ctx->active++;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return ino;
+}
+
+static void queue_done(fsck_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+	if (--ctx->active == 0 && ctx->queue_head == ctx->queue_tail) {
+		pthread_cond_broadcast(&ctx->cond);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static bool extent_valid(fsck_ctx *ctx, const a1fs_extent *ext)
+{
+	return ext->start > 0 && ext->count > 0 && ext->start < ctx->data_blocks &&
+	       ext->count <= ctx->data_blocks - ext->start;
+}
+
+/** Names of the live entries of a directory seen so far (open addressing). */
+typedef struct name_set {
+	const char **slots;
+	size_t mask;
+
+} name_set;
+
+static bool name_set_init(name_set *set, uint64_t max_entries)
+{
+	size_t n = 16;
+	while (n < max_entries * 2) n *= 2;
+	set->slots = calloc(n, sizeof(*set->slots));
+	set->mask = n - 1;
+	return set->slots != NULL;
+}
+
+/** Add a name to the set; returns false if it was already there. */
+static bool name_set_add(name_set *set, const char *name)
+{
+	uint64_t h = 14695981039346656037ul;// FNV-1a
+	for (const char *c = name; *c; c++) h = (h ^ (unsigned char)*c) * 1099511628211ul;
+	for (size_t i = h & set->mask;; i = (i + 1) & set->mask) {
+		if (!set->slots[i]) {
+			set->slots[i] = name;
+			return true;
+		}
+		if (strcmp(set->slots[i], name) == 0) return false;
+	}
+}
+
+static void walk_dir(fsck_ctx *ctx, a1fs_ino_t dir_ino)
+{
+	a1fs_inode *dir = find_inode_num(ctx->image, dir_ino);
+	const size_t per_block = block_size(ctx->image) / sizeof(a1fs_dentry);
+	uint32_t nblocks = dir->i_blocks <= max_extents(ctx->image) ? dir->i_blocks :
+	                   max_extents(ctx->image);
+	uint64_t live = 0;
+	bool modified = false;
+
+	// Lookups only ever reach the first entry with a given name
+	uint64_t slots = 0;
+	for (uint32_t i = 0; i < nblocks; i++) {
+		a1fs_extent ext = inode_extent(ctx->image, dir, i);
+		if (extent_valid(ctx, &ext)) slots += ext.count * per_block;
+	}
+	name_set names;
+	if (!name_set_init(&names, slots)) {
+		problem(ctx, &n_bad_dentry, false, "directory %u: out of memory checking names", dir_ino);
+	}
+
+	for (uint32_t i = 0; i < nblocks; i++) {
+		a1fs_extent extent = inode_extent(ctx->image, dir, i);
+		const a1fs_extent *ext = &extent;
+		if (!extent_valid(ctx, ext)) continue;// reported in phase 2
+		for (a1fs_blk_t b = 0; b < ext->count; b++) {
+			uint64_t block = ctx->sb->first_data_block + ext->start + b;
+			if (!csum_verify_block(ctx->image, block)) {
+				problem(ctx, &n_bad_dentry, true,
+				        "directory %u: block %lu checksum mismatch",
+				        dir_ino, (unsigned long)block);
+			}
+			a1fs_dentry *entries = (a1fs_dentry*)get_block(ctx->image, block);
+			bool block_modified = false;
+			for (size_t j = 0; j < per_block; j++) {
+				a1fs_dentry *de = &entries[j];
+				if (de->ino == 0) continue;
+
+				const char *why = NULL;
+				if (de->ino > ctx->sb->inodes_count) {
+					why = "inode number out of range";
+				} else if (memchr(de->name, '\0', A1FS_NAME_MAX) == NULL || de->name[0] == '\0') {
+					why = "invalid name";
+				} else if (!disk_bit(ctx, LAZY_INODE_BITMAP, ctx->sb->inode_bitmap, de->ino - 1)) {
+					why = "refers to a free inode";
+				} else if (find_inode_num(ctx->image, de->ino) == NULL) {
+					why = "refers to an inode in an unallocated inode chunk";
+				} else if (names.slots && !name_set_add(&names, de->name)) {
+					why = "duplicate name";
+				}
+				if (why) {
+					problem(ctx, &n_bad_dentry, true, "directory %u: block %lu entry %lu: %s",
+					        dir_ino, (unsigned long)block, (unsigned long)j, why);
+					if (ctx->opts->repair) {
+						de->ino = 0;
+						block_modified = true;
+					}
+					continue;
+				}
+
+				live++;
+				__atomic_fetch_add(&ctx->refs[de->ino - 1], 1, __ATOMIC_RELAXED);
+				a1fs_inode *child = find_inode_num(ctx->image, de->ino);
+				if (S_ISDIR(child->mode)) {
+					__atomic_fetch_add(&ctx->subdirs[dir_ino - 1], 1, __ATOMIC_RELAXED);
+				}
+				if (!atomic_set_bit(ctx->reachable, de->ino - 1) && S_ISDIR(child->mode)) {
+					queue_push(ctx, de->ino);
+				}
+			}
+			if (block_modified) {
+				csum_touch_block(ctx->image, block);
+				modified = true;
+			}
+		}
+	}
+
+	free(names.slots);
+
+	uint64_t size = (live + 2) * sizeof(a1fs_dentry);
+	if (dir->size != size) {
+		problem(ctx, &n_bad_size, true, "directory %u: size %lu, expected %lu",
+		        dir_ino, (unsigned long)dir->size, (unsigned long)size);
+		if (ctx->opts->repair) {
+			dir->size = size;
+			modified = true;
+		}
+	}
+	if (modified) csum_update_inode(ctx->image, dir);
+}
+
+static void *walk_thread(void *arg)
+{
+	fsck_ctx *ctx = ((fsck_thread*)arg)->ctx;
+	a1fs_ino_t ino;
+	while ((ino = queue_pop(ctx)) != 0) {
+		walk_dir(ctx, ino);
+		queue_done(ctx);
+	}
+	return NULL;
+}
+
+
+/* Phase 2: inode table scan */
+
+static bool add_tail(fsck_tails *tails, a1fs_blk_t block)
+{
+	if (tails->n == tails->cap) {
+		size_t cap = tails->cap ? tails->cap * 2 : 1024;
+		a1fs_blk_t *blocks = realloc(tails->blocks, cap * sizeof(*blocks));
+		if (!blocks) return false;
+		tails->blocks = blocks;
+		tails->cap = cap;
+	}
+	tails->blocks[tails->n++] = block;
+	return true;
+}
+
+/** Inode at bitmap index index; NULL if it lies past the initialized part of
+ * the inode table, or in an inode chunk that is not allocated. */
+static a1fs_inode *table_inode(fsck_ctx *ctx, uint64_t index)
+{
+	if (!dyn_inodes(ctx->image) && index * sizeof(a1fs_inode) / block_size(ctx->image) >=
+	    lazy_initialized(ctx->image, LAZY_INODE_TABLE)) {
+		return NULL;
+	}
+	return find_inode_num(ctx->image, index + 1);
+}
+
+static void check_inode(fsck_ctx *ctx, fsck_tails *tails, uint64_t index)
+{
+	a1fs_ino_t ino = index + 1;
+	bool allocated = disk_bit(ctx, LAZY_INODE_BITMAP, ctx->sb->inode_bitmap, index);
+	bool reachable = test_bit(ctx->reachable, index);
+	if (!reachable) {
+		if (allocated) {
+			problem(ctx, &n_orphan, true, "inode %u: in use but not reachable", ino);
+		}
+		return;
+	}
+
+	a1fs_inode *inode = table_inode(ctx, index);
+	if (!inode) {
+		problem(ctx, &n_bad_inode, false, "inode %u: in an %s", ino, dyn_inodes(ctx->image) ?
+		        "unallocated inode chunk" : "uninitialized inode table block");
+		return;
+	}
+	bool modified = false;
+	if (!csum_verify_inode(ctx->image, inode)) {
+		problem(ctx, &n_bad_inode, true, "inode %u: checksum mismatch", ino);
+		modified = true;
+	}
+	if (inode->inode_num != ino) {
+		problem(ctx, &n_bad_inode, true, "inode %u: inode number %u", ino, inode->inode_num);
+		if (ctx->opts->repair) {
+			inode->inode_num = ino;
+			modified = true;
+		}
+	}
+	if (!csum_verify_extents(ctx->image, inode)) {
+		problem(ctx, &n_bad_extent, true, "inode %u: extent record checksum mismatch", ino);
+		modified = true;
+	}
+	if (!S_ISDIR(inode->mode) && !S_ISREG(inode->mode)) {
+		problem(ctx, &n_bad_inode, false, "inode %u: invalid mode 0%o", ino, inode->mode);
+		return;
+	}
+
+	uint32_t links = S_ISDIR(inode->mode) ? 2 + ctx->subdirs[index] : ctx->refs[index];
+	if (S_ISDIR(inode->mode) && ctx->refs[index] > 1) {
+		problem(ctx, &n_bad_links, false, "directory %u: %u entries refer to it",
+		        ino, ctx->refs[index]);
+	}
+	if (inode->links != links) {
+		problem(ctx, &n_bad_links, true, "inode %u: link count %u, expected %u",
+		        ino, inode->links, links);
+		if (ctx->opts->repair) {
+			inode->links = links;
+			modified = true;
+		}
+	}
+
+	if (inode->i_blocks > max_extents(ctx->image)) {
+		problem(ctx, &n_bad_extent, true, "inode %u: %u extents", ino, inode->i_blocks);
+		if (ctx->opts->repair) {
+			inode->i_blocks = max_extents(ctx->image);
+			modified = true;
+		}
+	}
+	uint64_t blocks = 0;
+	for (uint32_t i = 0; i < inode->i_blocks && i < max_extents(ctx->image); i++) {
+		a1fs_extent extent = inode_extent(ctx->image, inode, i);
+		const a1fs_extent *ext = &extent;
+		if (!extent_valid(ctx, ext)) {
+			problem(ctx, &n_bad_extent, true, "inode %u: extent %u (%lu, %lu) out of range",
+			        ino, i, (unsigned long)ext->start, (unsigned long)ext->count);
+			// Drop it and everything after it
+			if (ctx->opts->repair) {
+				inode->i_blocks = i;
+				modified = true;
+			}
+			break;
+		}
+		for (a1fs_blk_t b = ext->start; b < ext->start + ext->count; b++) {
+			if (atomic_set_bit(ctx->expected_blocks, b)) {
+				problem(ctx, &n_dup_block, false, "inode %u: block %lu is also used elsewhere",
+				        ino, (unsigned long)b);
+			}
+		}
+		blocks += ext->count;
+	}
+	if (ctx->opts->repair) {
+		// Unused slots must be zero; set_inode_extent() relies on it
+		for (uint32_t i = inode->i_blocks; i < max_extents(ctx->image); i++) {
+			a1fs_extent ext = inode_extent(ctx->image, inode, i);
+			if (ext.start == 0 && ext.count == 0) continue;
+			set_inode_extent(ctx->image, inode, i, (a1fs_extent){0, 0});
+			modified = true;
+		}
+	}
+	if (inode->i_nblocks != blocks) {
+		problem(ctx, &n_bad_extent, true, "inode %u: %lu blocks recorded, %lu in its extents",
+		        ino, (unsigned long)inode->i_nblocks, (unsigned long)blocks);
+		if (ctx->opts->repair) {
+			inode->i_nblocks = blocks;
+			modified = true;
+		}
+	}
+
+	if (inode->tail.block != 0) {
+		a1fs_tail *tail = &inode->tail;
+		if (tail->block >= ctx->data_blocks ||
+		    tail->offset < sizeof(a1fs_tail_header) ||
+		    tail->offset + tail->length > block_size(ctx->image)) {
+			problem(ctx, &n_bad_tail, true, "inode %u: tail (%u, %u, %u) out of range",
+			        ino, tail->block, tail->offset, tail->length);
+			if (ctx->opts->repair) {
+				memset(tail, 0, sizeof(*tail));
+				modified = true;
+			}
+		} else if (!add_tail(tails, tail->block)) {
+			problem(ctx, &n_bad_tail, false, "out of memory recording tails");
+		}
+	}
+
+	size_t bs = block_size(ctx->image);
+	uint64_t bytes = blocks * bs + inode->tail.length;
+	// Blocks reserved with fallocate(FALLOC_FL_KEEP_SIZE) may lie past the end
+	if (S_ISREG(inode->mode) && (inode->size > bytes || (inode->i_unwritten == 0 &&
+	    align_up(inode->size, bs) < blocks * bs))) {
+		problem(ctx, &n_bad_size, true, "inode %u: size %lu but %lu bytes allocated",
+		        ino, (unsigned long)inode->size, (unsigned long)bytes);
+		if (ctx->opts->repair && inode->size > bytes) {
+			inode->size = bytes;
+			modified = true;
+		}
+	}
+
+	if (modified && ctx->opts->repair) csum_update_inode(ctx->image, inode);
+}
+
+static void *scan_thread(void *arg)
+{
+	fsck_thread *t = (fsck_thread*)arg;
+	fsck_ctx *ctx = t->ctx;
+	for (;;) {
+		uint64_t chunk = __atomic_fetch_add(&ctx->next_chunk, 1, __ATOMIC_RELAXED);
+		uint64_t first = chunk * FSCK_INODE_CHUNK;
+		if (first >= ctx->sb->inodes_count) break;
+		uint64_t last = first + FSCK_INODE_CHUNK;
+		if (last > ctx->sb->inodes_count) last = ctx->sb->inodes_count;
+		for (uint64_t i = first; i < last; i++) check_inode(ctx, &ctx->tails[t->id], i);
+	}
+	return NULL;
+}
+
+static bool run_threads(fsck_ctx *ctx, void *(*fn)(void*))
+{
+	int n = ctx->opts->threads;
+	pthread_t *tids = calloc(n, sizeof(*tids));
+	fsck_thread *args = calloc(n, sizeof(*args));
+	if (!tids || !args) {
+		free(tids);
+		free(args);
+		return false;
+	}
+	int started = 0;
+	for (; started < n; started++) {
+		args[started] = (fsck_thread){ctx, started};
+		if (pthread_create(&tids[started], NULL, fn, &args[started]) != 0) break;
+	}
+	if (started == 0) {
+		args[0] = (fsck_thread){ctx, 0};
+		fn(&args[0]);
+	}
+	for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+	free(tids);
+	free(args);
+	return true;
+}
+
+
+/* Phase 3: comparing against the bitmaps on disk */
+
+/** Check the inode chunk map, and claim the blocks of the chunks. */
+static void check_chunks(fsck_ctx *ctx)
+{
+	a1fs_superblock *sb = ctx->sb;
+	if (!dyn_inodes(ctx->image)) return;
+	for (uint64_t b = 0; b < lazy_initialized(ctx->image, LAZY_CHUNK_MAP); b++) {
+		if (!csum_verify_block(ctx->image, sb->inode_chunk_map + b)) {
+			problem(ctx, &n_bad_chunk, true, "inode chunk map block %lu: checksum mismatch",
+			        (unsigned long)(sb->inode_chunk_map + b));
+			if (ctx->opts->repair) csum_touch_block(ctx->image, sb->inode_chunk_map + b);
+		}
+	}
+
+	// Entries past the initialized part of the map are all 0
+	uint64_t *map = (uint64_t*)get_block(ctx->image, sb->inode_chunk_map);
+	uint64_t nchunks = sb->inodes_count / inodes_per_chunk(ctx->image);
+	uint64_t init = lazy_initialized(ctx->image, LAZY_CHUNK_MAP) * block_size(ctx->image) /
+	                sizeof(uint64_t);
+	for (uint64_t c = 0; c < nchunks && c < init; c++) {
+		if (map[c] == 0) continue;
+		a1fs_extent ext = {map[c], A1FS_INODE_CHUNK_BLOCKS};
+		if (!extent_valid(ctx, &ext)) {
+			// find_inode_num() treats it as unallocated, and so did phases 1 and 2
+			problem(ctx, &n_bad_chunk, true, "inode chunk %lu: block %lu out of range",
+			        (unsigned long)c, (unsigned long)map[c]);
+			if (ctx->opts->repair) {
+				map[c] = 0;
+				csum_touch_block(ctx->image, sb->inode_chunk_map +
+				                 c * sizeof(uint64_t) / block_size(ctx->image));
+			}
+			continue;
+		}
+		for (a1fs_blk_t b = ext.start; b < ext.start + ext.count; b++) {
+			if (atomic_set_bit(ctx->expected_blocks, b)) {
+				problem(ctx, &n_dup_block, false, "inode chunk %lu: block %lu is also used elsewhere",
+				        (unsigned long)c, (unsigned long)b);
+			}
+		}
+	}
+}
+
+static int compare_blocks(const void *a, const void *b)
+{
+	a1fs_blk_t x = *(const a1fs_blk_t*)a, y = *(const a1fs_blk_t*)b;
+	return (x > y) - (x < y);
+}
+
+static void check_tails(fsck_ctx *ctx)
+{
+	size_t total = 0;
+	for (int i = 0; i < ctx->opts->threads; i++) total += ctx->tails[i].n;
+	a1fs_blk_t *all = malloc((total ? total : 1) * sizeof(*all));
+	if (!all) {
+		problem(ctx, &n_bad_tail, false, "out of memory checking tails");
+		return;
+	}
+	size_t n = 0;
+	for (int i = 0; i < ctx->opts->threads; i++) {
+		memcpy(all + n, ctx->tails[i].blocks, ctx->tails[i].n * sizeof(*all));
+		n += ctx->tails[i].n;
+	}
+	qsort(all, n, sizeof(*all), compare_blocks);
+
+	for (size_t i = 0; i < n;) {
+		size_t j = i;
+		while (j < n && all[j] == all[i]) j++;
+		a1fs_blk_t block = all[i];
+		if (atomic_set_bit(ctx->expected_blocks, block)) {
+			problem(ctx, &n_dup_block, false, "tail block %lu is also used as a data block",
+			        (unsigned long)block);
+		}
+		a1fs_tail_header *header = (a1fs_tail_header*)find_data_block(ctx->image, block);
+		if (header->refs != j - i) {
+			problem(ctx, &n_bad_tail, true, "tail block %lu: %u references, expected %lu",
+			        (unsigned long)block, header->refs, (unsigned long)(j - i));
+			if (ctx->opts->repair) header->refs = j - i;
+		}
+		i = j;
+	}
+	free(all);
+
+	// The open tail block stays allocated even once all its tails are gone
+	a1fs_blk_t open = ctx->sb->tail_block;
+	if (open != 0 && open < ctx->data_blocks) atomic_set_bit(ctx->expected_blocks, open);
+}
+
+/**
+ * Compare a bitmap on disk with the expected one, fixing it if requested.
+ * Returns the number of bits set in the expected bitmap.
+ */
+static uint64_t check_bitmap(fsck_ctx *ctx, lazy_region region, uint64_t first_block,
+                             const uint64_t *expected, uint64_t nbits, const char *what,
+                             unsigned *count)
+{
+	unsigned char *bitmap = (unsigned char*)get_block(ctx->image, first_block);
+	uint64_t init_bits = lazy_initialized(ctx->image, region) * block_size(ctx->image) * 8;
+	uint64_t used = 0;
+	for (uint64_t i = 0; i < nbits; i++) {
+		// Whole words that match are the common case on large images
+		if (i % 64 == 0 && i + 64 <= nbits) {
+			uint64_t disk = i < init_bits ? ((const uint64_t*)bitmap)[i / 64] : 0;
+			if (disk == expected[i / 64]) {
+				used += __builtin_popcountll(disk);
+				i += 63;
+				continue;
+			}
+		}
+		bool want = (expected[i / 64] >> (i % 64)) & 1;
+		used += want;
+		if (want == disk_bit(ctx, region, first_block, i)) continue;
+
+		problem(ctx, count, true, "%s %lu: %s", what, (unsigned long)i,
+		        want ? "in use but marked free" : "marked in use but not referenced");
+		if (ctx->opts->repair) {
+			lazy_init(ctx->image, region, i / 8 / block_size(ctx->image));
+			bitmap[i / 8] ^= 1 << (i % 8);
+			csum_touch_block(ctx->image, first_block + i / 8 / block_size(ctx->image));
+		}
+	}
+	return used;
+}
+
+static void check_bitmaps(fsck_ctx *ctx)
+{
+	a1fs_superblock *sb = ctx->sb;
+	for (uint64_t b = sb->inode_bitmap; b < sb->csum_table; b++) {
+		lazy_region region = b < sb->datablock_bitmap ? LAZY_INODE_BITMAP : LAZY_BLOCK_BITMAP;
+		uint64_t first = b < sb->datablock_bitmap ? sb->inode_bitmap : sb->datablock_bitmap;
+		if (b - first >= lazy_initialized(ctx->image, region)) continue;
+		if (!csum_verify_block(ctx->image, b)) {
+			problem(ctx, &n_block_bitmap, true, "bitmap block %lu: checksum mismatch",
+			        (unsigned long)b);
+			if (ctx->opts->repair) csum_touch_block(ctx->image, b);
+		}
+	}
+
+	uint64_t used_inodes = check_bitmap(ctx, LAZY_INODE_BITMAP, sb->inode_bitmap,
+	                                    ctx->reachable, sb->inodes_count,
+	                                    "inode bitmap bit", &n_inode_bitmap);
+	// Data block 0 is reserved
+	atomic_set_bit(ctx->expected_blocks, 0);
+	uint64_t used_blocks = check_bitmap(ctx, LAZY_BLOCK_BITMAP, sb->datablock_bitmap,
+	                                    ctx->expected_blocks, ctx->data_blocks,
+	                                    "block", &n_block_bitmap);
+
+	if (sb->free_inodes_count != sb->inodes_count - used_inodes) {
+		problem(ctx, &n_inode_bitmap, true, "free inodes count %lu, expected %lu",
+		        (unsigned long)sb->free_inodes_count,
+		        (unsigned long)(sb->inodes_count - used_inodes));
+		if (ctx->opts->repair) sb->free_inodes_count = sb->inodes_count - used_inodes;
+	}
+	if (sb->free_blocks_count != ctx->data_blocks - used_blocks) {
+		problem(ctx, &n_block_bitmap, true, "free blocks count %lu, expected %lu",
+		        (unsigned long)sb->free_blocks_count,
+		        (unsigned long)(ctx->data_blocks - used_blocks));
+		if (ctx->opts->repair) sb->free_blocks_count = ctx->data_blocks - used_blocks;
+	}
+}
+
+/** Compare a group descriptor field with its expected value, fixing it if requested. */
+static void check_group_count(fsck_ctx *ctx, uint64_t g, const char *what, uint32_t *field,
+                              uint64_t expected)
+{
+	if (*field == expected) return;
+	problem(ctx, &n_bad_group, true, "group %lu: %s %u, expected %lu", (unsigned long)g,
+	        what, *field, (unsigned long)expected);
+	if (ctx->opts->repair) {
+		*field = expected;
+		csum_touch_block(ctx->image, ctx->sb->group_desc + g * sizeof(a1fs_group_desc) / block_size(ctx->image));
+	}
+}
+
+static void check_groups(fsck_ctx *ctx)
+{
+	a1fs_superblock *sb = ctx->sb;
+	if ((sb->features & A1FS_FEATURE_GROUPS) == 0) return;
+	if (sb->blocks_per_group == 0 || sb->groups_count == 0 ||
+	    sb->groups_count != (ctx->data_blocks + sb->blocks_per_group - 1) / sb->blocks_per_group ||
+	    sb->groups_count * sb->inodes_per_group < sb->inodes_count ||
+	    sb->group_desc + (sb->groups_count * sizeof(a1fs_group_desc) + block_size(ctx->image) - 1) /
+	    block_size(ctx->image) > sb->inode_bitmap) {
+		problem(ctx, &n_bad_group, false, "invalid block group layout");
+		return;
+	}
+	for (uint64_t b = sb->group_desc; b < sb->inode_bitmap; b++) {
+		if (!csum_verify_block(ctx->image, b)) {
+			problem(ctx, &n_bad_group, true, "group descriptor block %lu: checksum mismatch",
+			        (unsigned long)b);
+			if (ctx->opts->repair) csum_touch_block(ctx->image, b);
+		}
+	}
+
+	a1fs_group_desc *descs = (a1fs_group_desc*)get_block(ctx->image, sb->group_desc);
+	for (uint64_t g = 0; g < sb->groups_count; g++) {
+		a1fs_blk_t bfirst, bend;
+		group_blocks(ctx->image, g, &bfirst, &bend);
+		uint64_t used_blocks = count_bits(ctx->expected_blocks, bfirst, bend);
+
+		a1fs_ino_t ifirst, iend;
+		group_inodes(ctx->image, g, &ifirst, &iend);
+		uint64_t used_inodes = 0, dirs = 0;
+		for (uint64_t i = ifirst; i < iend; i++) {
+			if (!test_bit(ctx->reachable, i)) continue;
+			used_inodes++;
+			a1fs_inode *inode = table_inode(ctx, i);
+			if (inode && S_ISDIR(inode->mode)) dirs++;
+		}
+
+		check_group_count(ctx, g, "free blocks", &descs[g].free_blocks,
+		                  (bend - bfirst) - used_blocks);
+		check_group_count(ctx, g, "free inodes", &descs[g].free_inodes,
+		                  (iend - ifirst) - used_inodes);
+		check_group_count(ctx, g, "directories", &descs[g].dirs, dirs);
+	}
+}
+
+
+static int fsck(fsck_ctx *ctx)
+{
+	a1fs_superblock *sb = ctx->sb;
+	if (sb->magic != A1FS_MAGIC) {
+		fprintf(stderr, "Image does not contain a1fs\n");
+		return FSCK_ERROR;
+	}
+	if ((sb->features & ~A1FS_FEATURES_SUPPORTED) != 0) {
+		fprintf(stderr, "Image uses unsupported features 0x%lx\n",
+		        (unsigned long)(sb->features & ~A1FS_FEATURES_SUPPORTED));
+		return FSCK_ERROR;
+	}
+	if ((sb->features & A1FS_FEATURES_REQUIRED) != A1FS_FEATURES_REQUIRED) {
+		fprintf(stderr, "Image uses an old format without features 0x%lx; reformat it\n",
+		        (unsigned long)(~sb->features & A1FS_FEATURES_REQUIRED));
+		return FSCK_ERROR;
+	}
+	if (!csum_verify_sb(ctx->image)) {
+		// The layout fields are all we go by; nothing else can be trusted more
+		problem(ctx, &n_bad_inode, true, "superblock checksum mismatch");
+	}
+	if (sb->log_block_size > A1FS_LOG_BLOCK_SIZE_MAX) {
+		fprintf(stderr, "Invalid block size shift %lu\n", (unsigned long)sb->log_block_size);
+		return FSCK_ERROR;
+	}
+	ctx->data_blocks = sb->blocks_count - sb->first_data_block;
+	if (!(sb->features & A1FS_FEATURE_64BIT) && ctx->data_blocks > UINT32_MAX) {
+		fprintf(stderr, "Too many blocks for 32-bit extents\n");
+		return FSCK_ERROR;
+	}
+	if (dyn_inodes(ctx->image) &&
+	    (sb->inodes_count % inodes_per_chunk(ctx->image) != 0 ||
+	     sb->inodes_count / inodes_per_chunk(ctx->image) * sizeof(uint64_t) >
+	     (sb->first_inode_block - sb->inode_chunk_map) * block_size(ctx->image))) {
+		fprintf(stderr, "Invalid inode chunk map\n");
+		return FSCK_ERROR;
+	}
+
+	uint64_t inode_words = (sb->inodes_count + 63) / 64;
+	ctx->expected_blocks = calloc((ctx->data_blocks + 63) / 64, sizeof(uint64_t));
+	ctx->reachable = calloc(inode_words, sizeof(uint64_t));
+	ctx->refs = calloc(sb->inodes_count, sizeof(uint32_t));
+	ctx->subdirs = calloc(sb->inodes_count, sizeof(uint32_t));
+	ctx->queue = calloc(sb->inodes_count + 1, sizeof(a1fs_ino_t));
+	ctx->tails = calloc(ctx->opts->threads, sizeof(fsck_tails));
+	if (!ctx->expected_blocks || !ctx->reachable || !ctx->refs || !ctx->subdirs ||
+	    !ctx->queue || !ctx->tails) {
+		fprintf(stderr, "Out of memory\n");
+		return FSCK_ERROR;
+	}
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->cond, NULL);
+
+	if (ctx->opts->verbose) printf("Phase 1: walking directories\n");
+	atomic_set_bit(ctx->reachable, 0);
+	a1fs_inode *root = find_inode_num(ctx->image, 1);
+	if (!root || !S_ISDIR(root->mode)) {
+		fprintf(stderr, "Root inode is not a directory\n");
+		return FSCK_UNCORRECTED;
+	}
+	queue_push(ctx, 1);
+	if (!run_threads(ctx, walk_thread)) return FSCK_ERROR;
+
+	if (ctx->opts->verbose) printf("Phase 2: scanning the inode table\n");
+	if (!run_threads(ctx, scan_thread)) return FSCK_ERROR;
+
+	if (ctx->opts->verbose) printf("Phase 3: checking bitmaps and counts\n");
+	check_chunks(ctx);
+	check_tails(ctx);
+	check_bitmaps(ctx);
+	check_groups(ctx);
+
+	if (ctx->opts->repair && ctx->fixed > 0) csum_flush(ctx->image);
+
+	if (ctx->errors == 0) return FSCK_OK;
+	printf("%lu problems found, %lu fixed\n", (unsigned long)ctx->errors,
+	       (unsigned long)ctx->fixed);
+	return ctx->errors == ctx->fixed ? FSCK_CORRECTED : FSCK_UNCORRECTED;
+}
+
+
+int main(int argc, char *argv[])
+{
+	fsck_opts opts = {0};// defaults are all 0
+	if (!parse_args(argc, argv, &opts)) {
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return FSCK_ERROR;
+	}
+	if (opts.help) {
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return FSCK_OK;
+	}
+
+	// Map image file into memory; a striped volume goes through the block cache
+	size_t size, stripe_unit;
+	if (!volume_stripe_unit(opts.img_paths, opts.n_images, &stripe_unit)) return FSCK_ERROR;
+	bcache cache = {0};
+	void *image = opts.n_images > 1 ?
+	              bcache_open(&cache, opts.img_paths, opts.n_images, stripe_unit,
+	                          A1FS_BLOCK_SIZE, BCACHE_CAP_DEFAULT, false, &size) :
+	              map_file(opts.img_paths[0], A1FS_BLOCK_SIZE, &size);
+	if (image == NULL) return FSCK_ERROR;
+	if (cache.base) bcache_start(&cache);
+
+	fsck_ctx ctx = {0};
+	ctx.image = image;
+	ctx.sb = (a1fs_superblock*)image;
+	ctx.opts = &opts;
+	int ret = fsck(&ctx);
+
+	if (opts.repair && ctx.fixed > 0) {
+		if (cache.base ? bcache_writeback(&cache, image, size, true) < 0 :
+		                 msync(image, size, MS_SYNC) < 0) {
+			perror(cache.base ? "bcache_writeback" : "msync");
+			ret = FSCK_ERROR;
+		}
+	}
+
+	if (ctx.tails) {
+		for (int i = 0; i < opts.threads; i++) free(ctx.tails[i].blocks);
+	}
+	free(ctx.tails);
+	free(ctx.queue);
+	free(ctx.subdirs);
+	free(ctx.refs);
+	free(ctx.reachable);
+	free(ctx.expected_blocks);
+	if (cache.base) {
+		bcache_close(&cache);
+	} else {
+		munmap(image, size);
+	}
+	return ret;
+}
@@ -0,0 +1,258 @@
+/**
+ * CSC369 Assignment 1 - a1fs block groups implementation.
+ */
+
+#include "csum.h"
+#include "group.h"
+#include "util.h"
+
+
+static bool groups_enabled(char *image)
+{
+	return (((a1fs_superblock*)image)->features & A1FS_FEATURE_GROUPS) != 0;
+}
+
+/** Absolute block number of the descriptor of group g. */
+static uint64_t desc_block(char *image, uint64_t g)
+{
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	return sb->group_desc + g * sizeof(a1fs_group_desc) / block_size(image);
+}
+
+static uint64_t min_u64(uint64_t a, uint64_t b)
+{
+	return a < b ? a : b;
+}
+
+/** Number of set bits in [from, to) of a bitmap. */
+static uint64_t count_bits(const unsigned char *map, uint64_t from, uint64_t to)
+{
+	uint64_t n = 0;
+	for (; from < to && from % 64 != 0; from++) n += (map[from / 8] >> (from % 8)) & 1;
+	for (; from + 64 <= to; from += 64) {
+		n += __builtin_popcountll(((const uint64_t*)map)[from / 64]);
+	}
+	for (; from < to; from++) n += (map[from / 8] >> (from % 8)) & 1;
+	return n;
+}
+
+
+uint64_t group_count(char *image)
+{
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	return groups_enabled(image) ? sb->groups_count : 1;
+}
+
+a1fs_group_desc *group_desc(char *image, uint64_t g)
+{
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	if (!groups_enabled(image) || g >= sb->groups_count) return NULL;
+	if (!csum_verify_block(image, desc_block(image, g))) return NULL;
+	return (a1fs_group_desc*)get_block(image, sb->group_desc) + g;
+}
+
+uint64_t group_of_block(char *image, a1fs_blk_t block)
+{
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	if (!groups_enabled(image)) return 0;
+	return min_u64(block / sb->blocks_per_group, sb->groups_count - 1);
+}
+
+uint64_t group_of_inode(char *image, a1fs_ino_t index)
+{
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	if (!groups_enabled(image)) return 0;
+	return min_u64(index / sb->inodes_per_group, sb->groups_count - 1);
+}
+
+void group_blocks(char *image, uint64_t g, a1fs_blk_t *first, a1fs_blk_t *end)
+{
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	uint64_t data_blocks = sb->blocks_count - sb->first_data_block;
+	if (!groups_enabled(image)) {
+		*first = 0;
+		*end = data_blocks;
+		return;
+	}
+	*first = min_u64(g * sb->blocks_per_group, data_blocks);
+	*end = min_u64((g + 1) * sb->blocks_per_group, data_blocks);
+}
+
+void group_inodes(char *image, uint64_t g, a1fs_ino_t *first, a1fs_ino_t *end)
+{
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	if (!groups_enabled(image)) {
+		*first = 0;
+		*end = sb->inodes_count;
+		return;
+	}
+	*first = min_u64(g * sb->inodes_per_group, sb->inodes_count);
+	*end = min_u64((g + 1) * sb->inodes_per_group, sb->inodes_count);
+}
+
+void group_blocks_changed(char *image, a1fs_blk_t start, a1fs_blk_t count, bool used)
+{
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	while (count > 0) {
+		uint64_t g = group_of_block(image, start);
+		a1fs_blk_t n = min_u64(count, (g + 1) * sb->blocks_per_group - start);
+		a1fs_group_desc *desc = group_desc(image, g);
+		if (!desc) return;
+		if (used) {
+			desc->free_blocks -= n;
+		} else {
+			desc->free_blocks += n;
+		}
+		csum_touch_block(image, desc_block(image, g));
+		start += n;
+		count -= n;
+	}
+}
+
+void group_inode_changed(char *image, a1fs_ino_t index, bool used)
+{
+	uint64_t g = group_of_inode(image, index);
+	a1fs_group_desc *desc = group_desc(image, g);
+	if (!desc) return;
+	if (used) {
+		desc->free_inodes--;
+	} else {
+		desc->free_inodes++;
+	}
+	csum_touch_block(image, desc_block(image, g));
+}
+
+void group_dir_changed(char *image, a1fs_ino_t index, int delta)
+{
+	uint64_t g = group_of_inode(image, index);
+	a1fs_group_desc *desc = group_desc(image, g);
+	if (!desc) return;
+	desc->dirs += delta;
+	csum_touch_block(image, desc_block(image, g));
+}
+
+
+/** Group for a new file: the parent's, unless it is out of inodes or blocks. */
+static uint64_t find_group_file(char *image, uint64_t parent_group)
+{
+	uint64_t ngroups = group_count(image);
+	for (uint64_t n = 0; n < ngroups; n++) {
+		uint64_t g = (parent_group + n) % ngroups;
+		a1fs_group_desc *desc = group_desc(image, g);
+		if (!desc) return parent_group;
+		if (desc->free_inodes > 0 && desc->free_blocks > 0) return g;
+	}
+	return parent_group;
+}
+
+/** Group for a new directory; see group_find_inode(). */
+static uint64_t find_group_dir(char *image, uint64_t parent_group, bool top)
+{
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	uint64_t ngroups = group_count(image);
+	uint64_t avefreei = sb->free_inodes_count / ngroups;
+	uint64_t avefreeb = sb->free_blocks_count / ngroups;
+	uint64_t ndirs = 0;
+	for (uint64_t g = 0; g < ngroups; g++) {
+		a1fs_group_desc *desc = group_desc(image, g);
+		if (!desc) return parent_group;
+		ndirs += desc->dirs;
+	}
+
+	if (top) {
+		// Spread top-level directories out; ties go to the lowest group so
+		// that lazily initialized metadata is used up in order
+		uint64_t best = ngroups;
+		uint32_t best_dirs = UINT32_MAX;
+		for (uint64_t g = 0; g < ngroups; g++) {
+			a1fs_group_desc *desc = group_desc(image, g);
+			if (desc->free_inodes == 0 || desc->free_inodes < avefreei ||
+			    desc->free_blocks < avefreeb) {
+				continue;
+			}
+			if (desc->dirs < best_dirs) {
+				best = g;
+				best_dirs = desc->dirs;
+			}
+		}
+		if (best < ngroups) return best;
+	} else {
+		// Keep subdirectories with their parent while its group has room
+		uint64_t max_dirs = ndirs / ngroups + sb->inodes_per_group / 16;
+		uint64_t min_inodes = avefreei > sb->inodes_per_group / 4 ?
+		                      avefreei - sb->inodes_per_group / 4 : 1;
+		uint64_t min_blocks = avefreeb > sb->blocks_per_group / 4 ?
+		                      avefreeb - sb->blocks_per_group / 4 : 0;
+		for (uint64_t n = 0; n < ngroups; n++) {
+			uint64_t g = (parent_group + n) % ngroups;
+			a1fs_group_desc *desc = group_desc(image, g);
+			if (desc->dirs < max_dirs && desc->free_inodes >= min_inodes &&
+			    desc->free_blocks >= min_blocks) {
+				return g;
+			}
+		}
+	}
+
+	// Fall back to any group with at least the average number of free inodes
+	for (uint64_t n = 0; n < ngroups; n++) {
+		uint64_t g = (parent_group + n) % ngroups;
+		a1fs_group_desc *desc = group_desc(image, g);
+		if (desc->free_inodes > 0 && desc->free_inodes >= avefreei) return g;
+	}
+	return parent_group;
+}
+
+uint64_t group_find_inode(char *image, a1fs_inode *parent, bool dir)
+{
+	if (group_count(image) == 1) return 0;
+	a1fs_ino_t index = inode_index(image, parent);
+	uint64_t parent_group = group_of_inode(image, index);
+	if (!dir) return find_group_file(image, parent_group);
+	return find_group_dir(image, parent_group, index == 0);
+}
+
+a1fs_blk_t group_block_goal(char *image, a1fs_inode *inode)
+{
+	if (inode->i_blocks > 0 && inode->i_blocks <= max_extents(image)) {
+		a1fs_extent last = inode_extent(image, inode, inode->i_blocks - 1);
+		return last.start + last.count;
+	}
+	a1fs_blk_t first, end;
+	group_blocks(image, group_of_inode(image, inode_index(image, inode)), &first, &end);
+	return first;
+}
+
+void group_recount(char *image)
+{
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	if (!groups_enabled(image)) return;
+	a1fs_group_desc *descs = (a1fs_group_desc*)get_block(image, sb->group_desc);
+	const unsigned char *block_bitmap = (const unsigned char*)get_block(image, sb->datablock_bitmap);
+	const unsigned char *inode_bitmap = (const unsigned char*)get_block(image, sb->inode_bitmap);
+	// Bits past the initialized part of a bitmap are all clear
+	uint64_t block_bits = lazy_initialized(image, LAZY_BLOCK_BITMAP) * block_size(image) * 8;
+	uint64_t inode_bits = lazy_initialized(image, LAZY_INODE_BITMAP) * block_size(image) * 8;
+
+	for (uint64_t g = 0; g < sb->groups_count; g++) {
+		a1fs_group_desc *desc = &descs[g];
+		a1fs_blk_t bfirst, bend;
+		group_blocks(image, g, &bfirst, &bend);
+		uint64_t used = bfirst < block_bits ?
+		                count_bits(block_bitmap, bfirst, min_u64(bend, block_bits)) : 0;
+		desc->free_blocks = bend - bfirst - used;
+
+		a1fs_ino_t ifirst, iend;
+		group_inodes(image, g, &ifirst, &iend);
+		desc->free_inodes = iend - ifirst;
+		desc->dirs = 0;
+		for (a1fs_ino_t i = ifirst; i < iend && i < inode_bits; i++) {
+			if (!((inode_bitmap[i / 8] >> (i % 8)) & 1)) continue;
+			desc->free_inodes--;
+			a1fs_inode *inode = find_inode_num(image, i + 1);
+			if (inode && S_ISDIR(inode->mode)) desc->dirs++;
+		}
+	}
+	for (uint64_t b = desc_block(image, 0); b <= desc_block(image, sb->groups_count - 1); b++) {
+		csum_touch_block(image, b);
+	}
+}
@@ -0,0 +1,72 @@
+/**
+ * CSC369 Assignment 1 - a1fs block groups header file.
+ *
+ * The data blocks and the inodes are split into block groups (see
+ * a1fs_group_desc). The descriptors keep per-group free counts that the
+ * allocators use to pick a group without scanning the bitmaps, and to place
+ * new inodes near their parent directory and data near its inode.
+ *
+ * Images formatted without A1FS_FEATURE_GROUPS are treated as a single group
+ * without a descriptor.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** Number of block groups. */
+uint64_t group_count(char *image);
+
+/**
+ * Descriptor of group g.
+ *
+ * @return  NULL on images without block groups, or if the checksum of the
+ *          descriptor block doesn't match (the file system is then marked as
+ *          corrupt).
+ */
+a1fs_group_desc *group_desc(char *image, uint64_t g);
+
+/** Group of a data block. */
+uint64_t group_of_block(char *image, a1fs_blk_t block);
+
+/** Group of an inode, by inode bitmap index (inode number - 1). */
+uint64_t group_of_inode(char *image, a1fs_ino_t index);
+
+/** Data blocks [*first, *end) of group g. */
+void group_blocks(char *image, uint64_t g, a1fs_blk_t *first, a1fs_blk_t *end);
+
+/** Inode bitmap indices [*first, *end) of group g. */
+void group_inodes(char *image, uint64_t g, a1fs_ino_t *first, a1fs_ino_t *end);
+
+/** Account for count data blocks from start becoming used or free. */
+void group_blocks_changed(char *image, a1fs_blk_t start, a1fs_blk_t count, bool used);
+
+/** Account for an inode (by bitmap index) becoming used or free. */
+void group_inode_changed(char *image, a1fs_ino_t index, bool used);
+
+/** Account for a directory (by inode bitmap index) created (1) or removed (-1). */
+void group_dir_changed(char *image, a1fs_ino_t index, int delta);
+
+/**
+ * Choose the group to search first for a new inode in directory parent.
+ *
+ * Files go to the parent's group. Directories are spread Orlov-style:
+ * top-level ones go to the group with the fewest directories among those with
+ * at least the average number of free inodes and blocks; deeper ones stay in
+ * the parent's group unless it already holds many directories or is low on
+ * space, in which case the next suitable group is used.
+ */
+uint64_t group_find_inode(char *image, a1fs_inode *parent, bool dir);
+
+/**
+ * Data block to start searching from for the next blocks of a file: right
+ * after its last extent, or the first block of its inode's group.
+ */
+a1fs_blk_t group_block_goal(char *image, a1fs_inode *inode);
+
+/** Recompute all descriptors from the bitmaps and the inode table. */
+void group_recount(char *image);
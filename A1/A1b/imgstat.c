@@ -0,0 +1,346 @@
+/**
+ * CSC369 Assignment 1 - a1fs fragmentation and allocation analyzer.
+ *
+ * Maps an image read-only and reports, as JSON on stdout:
+ *
+ *  - files:        histogram of the number of extents per regular file;
+ *  - directories:  distribution of directory sizes (entries), log2 buckets;
+ *  - free_extents: distribution of free extent sizes (blocks), log2 buckets;
+ *  - tails:        bytes wasted in tail blocks and in partial last blocks;
+ *  - locality:     how close files are to their parent directory's blocks.
+ *
+ * The inode table and the data bitmap are each read once, in order, so the run
+ * time is linear in the image metadata size.
+ */
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "util.h"
+
+
+/** Number of log2 buckets (enough for any 64-bit count). */
+#define LOG2_BUCKETS 65
+
+/** Files within this many blocks of their parent directory count as local. */
+#define LOCAL_DISTANCE 256
+
+
+/** Counts bucketed by floor(log2(value)) + 1; bucket 0 holds zeros. */
+typedef struct log2_hist {
+	uint64_t count[LOG2_BUCKETS];
+	uint64_t max;
+
+} log2_hist;
+
+/** Results of the pass over the image. */
+typedef struct imgstat {
+	uint64_t files;
+	uint64_t extents[NUM_BLOCK + 1];
+	uint64_t fragmented;
+	uint64_t total_extents;
+
+	uint64_t dirs;
+	log2_hist dir_entries;
+
+	log2_hist free_extents;
+	uint64_t free_blocks;
+
+	uint64_t packed_files;
+	uint64_t tail_blocks;
+	uint64_t tail_live_bytes;
+	uint64_t slack_bytes;
+
+	uint64_t local_files;
+	uint64_t located_files;
+	double log2_distance_sum;
+
+} imgstat;
+
+
+static const char *help_str = "\
+Usage: %s [-h] image\n\
+\n\
+Report fragmentation and allocation statistics of an a1fs image as JSON.\n\
+The image is only read.\n\
+";
+
+static void hist_add(log2_hist *h, uint64_t value)
+{
+	int b = 0;
+	for (uint64_t v = value; v != 0; v >>= 1) b++;
+	h->count[b]++;
+	if (value > h->max) h->max = value;
+}
+
+static void print_hist(const char *name, const log2_hist *h, bool last)
+{
+	printf("\t\t\"%s\": [", name);
+	bool first = true;
+	for (int b = 0; b < LOG2_BUCKETS; b++) {
+		if (h->count[b] == 0) continue;
+		uint64_t from = b == 0 ? 0 : 1ul << (b - 1);
+		uint64_t to = b == 0 ? 0 : (b == 64 ? UINT64_MAX : (1ul << b) - 1);
+		printf("%s\n\t\t\t{\"from\": %lu, \"to\": %lu, \"count\": %lu}", first ? "" : ",",
+		       (unsigned long)from, (unsigned long)to, (unsigned long)h->count[b]);
+		first = false;
+	}
+	printf("%s]%s\n", first ? "" : "\n\t\t", last ? "" : ",");
+}
+
+static bool test_bit(const void *map, uint64_t i)
+{
+	return (((const unsigned char*)map)[i / 8] & (1 << (i % 8))) != 0;
+}
+
+static uint64_t abs_diff(uint64_t a, uint64_t b)
+{
+	return a > b ? a - b : b - a;
+}
+
+
+/** Pass over the inode table, in order. */
+static bool scan_inodes(char *image, imgstat *st)
+{
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	uint64_t data_blocks = sb->blocks_count - sb->first_data_block;
+	uint64_t bitmap_bits = lazy_initialized(image, LAZY_INODE_BITMAP) * block_size(image) * 8;
+	const void *inode_bitmap = get_block(image, sb->inode_bitmap);
+
+	// First data block of each inode and of its parent directory; compared
+	// once the pass is complete, since a parent may come after its children
+	a1fs_blk_t *first_block = calloc(sb->inodes_count, sizeof(a1fs_blk_t));
+	a1fs_blk_t *parent_block = calloc(sb->inodes_count, sizeof(a1fs_blk_t));
+	unsigned char *tail_seen = calloc(data_blocks / 8 + 1, 1);
+	if (!first_block || !parent_block || !tail_seen) {
+		fprintf(stderr, "Out of memory\n");
+		free(first_block);
+		free(parent_block);
+		free(tail_seen);
+		return false;
+	}
+
+	const size_t per_block = block_size(image) / sizeof(a1fs_dentry);
+	for (uint64_t i = 0; i < sb->inodes_count && i < bitmap_bits; i++) {
+		if (!test_bit(inode_bitmap, i)) continue;
+		a1fs_inode *inode = find_inode_num(image, i + 1);
+		if (!inode) continue;
+		uint32_t nextents = inode->i_blocks <= max_extents(image) ? inode->i_blocks :
+		                    max_extents(image);
+		if (nextents > 0) {
+			first_block[i] = inode_extent(image, inode, 0).start;
+		} else if (inode->tail.block < data_blocks) {
+			first_block[i] = inode->tail.block;
+		}
+
+		if (S_ISDIR(inode->mode)) {
+			st->dirs++;
+			hist_add(&st->dir_entries, inode->size / sizeof(a1fs_dentry) - 2);
+			if (nextents == 0) continue;
+			for (uint32_t e = 0; e < nextents; e++) {
+				a1fs_extent extent = inode_extent(image, inode, e);
+				const a1fs_extent *ext = &extent;
+				if (ext->start >= data_blocks || ext->count > data_blocks - ext->start) break;
+				const a1fs_dentry *entries = (const a1fs_dentry*)find_data_block(image, ext->start);
+				for (size_t j = 0; j < ext->count * per_block; j++) {
+					a1fs_ino_t child = entries[j].ino;
+					if (child != 0 && child <= sb->inodes_count) {
+						parent_block[child - 1] = first_block[i];
+					}
+				}
+			}
+			continue;
+		}
+		if (!S_ISREG(inode->mode)) continue;
+
+		st->files++;
+		st->extents[nextents]++;
+		st->total_extents += nextents;
+		if (nextents > 1) st->fragmented++;
+
+		if (inode->tail.block != 0 && inode->tail.block < data_blocks) {
+			st->packed_files++;
+			st->tail_live_bytes += inode->tail.length;
+			if (!test_bit(tail_seen, inode->tail.block)) {
+				tail_seen[inode->tail.block / 8] |= 1 << (inode->tail.block % 8);
+				st->tail_blocks++;
+			}
+		} else if (inode->size % block_size(image) != 0) {
+			st->slack_bytes += block_size(image) - inode->size % block_size(image);
+		}
+	}
+
+	for (uint64_t i = 0; i < sb->inodes_count; i++) {
+		if (first_block[i] == 0 || parent_block[i] == 0 || i == 0) continue;
+		uint64_t distance = abs_diff(first_block[i], parent_block[i]);
+		st->located_files++;
+		if (distance <= LOCAL_DISTANCE) st->local_files++;
+		st->log2_distance_sum += log2(1.0 + distance);
+	}
+
+	free(first_block);
+	free(parent_block);
+	free(tail_seen);
+	return true;
+}
+
+/** Pass over the data bitmap, in order. */
+static void scan_free(char *image, imgstat *st)
+{
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	uint64_t data_blocks = sb->blocks_count - sb->first_data_block;
+	uint64_t init_bits = lazy_initialized(image, LAZY_BLOCK_BITMAP) * block_size(image) * 8;
+	const void *bitmap = get_block(image, sb->datablock_bitmap);
+
+	uint64_t run = 0;
+	for (uint64_t i = 1; i < data_blocks; i++) {
+		// Blocks past the initialized part of the bitmap are all free
+		if (i < init_bits && test_bit(bitmap, i)) {
+			if (run) hist_add(&st->free_extents, run);
+			run = 0;
+		} else {
+			run++;
+			st->free_blocks++;
+		}
+	}
+	if (run) hist_add(&st->free_extents, run);
+}
+
+
+static void print_json(a1fs_superblock *sb, const imgstat *st)
+{
+	printf("{\n");
+	printf("\t\"image\": {\n");
+	printf("\t\t\"size\": %lu,\n", (unsigned long)sb->size);
+	printf("\t\t\"block_size\": %u,\n", a1fs_block_size(sb));
+	printf("\t\t\"blocks\": %lu,\n", (unsigned long)sb->blocks_count);
+	printf("\t\t\"data_blocks\": %lu,\n", (unsigned long)(sb->blocks_count - sb->first_data_block));
+	printf("\t\t\"free_blocks\": %lu,\n", (unsigned long)st->free_blocks);
+	printf("\t\t\"block_groups\": %lu,\n",
+	       (unsigned long)((sb->features & A1FS_FEATURE_GROUPS) ? sb->groups_count : 1));
+	printf("\t\t\"inodes\": %lu,\n", (unsigned long)sb->inodes_count);
+	printf("\t\t\"free_inodes\": %lu\n", (unsigned long)sb->free_inodes_count);
+	printf("\t},\n");
+
+	printf("\t\"files\": {\n");
+	printf("\t\t\"count\": %lu,\n", (unsigned long)st->files);
+	printf("\t\t\"fragmented\": %lu,\n", (unsigned long)st->fragmented);
+	printf("\t\t\"mean_extents\": %.3f,\n",
+	       st->files ? (double)st->total_extents / st->files : 0.0);
+	printf("\t\t\"extents\": {");
+	bool first = true;
+	for (int i = 0; i <= NUM_BLOCK; i++) {
+		if (st->extents[i] == 0) continue;
+		printf("%s\"%d\": %lu", first ? "" : ", ", i, (unsigned long)st->extents[i]);
+		first = false;
+	}
+	printf("}\n\t},\n");
+
+	printf("\t\"directories\": {\n");
+	printf("\t\t\"count\": %lu,\n", (unsigned long)st->dirs);
+	printf("\t\t\"max_entries\": %lu,\n", (unsigned long)st->dir_entries.max);
+	print_hist("entries", &st->dir_entries, true);
+	printf("\t},\n");
+
+	uint64_t nfree = 0;
+	for (int b = 0; b < LOG2_BUCKETS; b++) nfree += st->free_extents.count[b];
+	printf("\t\"free_extents\": {\n");
+	printf("\t\t\"count\": %lu,\n", (unsigned long)nfree);
+	printf("\t\t\"largest\": %lu,\n", (unsigned long)st->free_extents.max);
+	print_hist("blocks", &st->free_extents, true);
+	printf("\t},\n");
+
+	uint64_t tail_space = st->tail_blocks * (a1fs_block_size(sb) - sizeof(a1fs_tail_header));
+	printf("\t\"tails\": {\n");
+	printf("\t\t\"packed_files\": %lu,\n", (unsigned long)st->packed_files);
+	printf("\t\t\"tail_blocks\": %lu,\n", (unsigned long)st->tail_blocks);
+	printf("\t\t\"live_bytes\": %lu,\n", (unsigned long)st->tail_live_bytes);
+	printf("\t\t\"wasted_bytes\": %lu,\n", (unsigned long)(tail_space - st->tail_live_bytes));
+	printf("\t\t\"unpacked_slack_bytes\": %lu\n", (unsigned long)st->slack_bytes);
+	printf("\t},\n");
+
+	printf("\t\"locality\": {\n");
+	printf("\t\t\"files\": %lu,\n", (unsigned long)st->located_files);
+	printf("\t\t\"within_blocks\": %d,\n", LOCAL_DISTANCE);
+	printf("\t\t\"score\": %.4f,\n",
+	       st->located_files ? (double)st->local_files / st->located_files : 1.0);
+	printf("\t\t\"mean_log2_distance\": %.3f\n",
+	       st->located_files ? st->log2_distance_sum / st->located_files : 0.0);
+	printf("\t}\n");
+	printf("}\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	int o;
+	while ((o = getopt(argc, argv, "h")) != -1) {
+		if (o == 'h') {
+			printf(help_str, argv[0]);
+			return 0;
+		}
+		fprintf(stderr, help_str, argv[0]);
+		return 1;
+	}
+	if (optind >= argc) {
+		fprintf(stderr, help_str, argv[0]);
+		return 1;
+	}
+
+	// Read-only mapping: safe to run against a mounted image
+	int fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		close(fd);
+		return 1;
+	}
+	if (st.st_size < A1FS_BLOCK_SIZE) {
+		fprintf(stderr, "%s does not contain a1fs\n", argv[optind]);
+		close(fd);
+		return 1;
+	}
+	char *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	int ret = 1;
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	if (sb->magic == A1FS_MAGIC && (sb->features & A1FS_FEATURE_STRIPED)) {
+		fprintf(stderr, "%s is part of a striped volume, which is not supported\n", argv[optind]);
+		goto end;
+	}
+	if (sb->magic != A1FS_MAGIC || sb->size > (uint64_t)st.st_size ||
+	    sb->log_block_size > A1FS_LOG_BLOCK_SIZE_MAX) {
+		fprintf(stderr, "%s does not contain a1fs\n", argv[optind]);
+		goto end;
+	}
+	// Sequential passes; tell the kernel to read ahead
+	madvise(image, st.st_size, MADV_SEQUENTIAL);
+
+	imgstat stats = {0};
+	if (!scan_inodes(image, &stats)) goto end;
+	scan_free(image, &stats);
+	print_json(sb, &stats);
+	ret = 0;
+
+end:
+	munmap(image, st.st_size);
+	return ret;
+}
@@ -0,0 +1,438 @@
+/**
+ * CSC369 Assignment 1 - Populating a freshly formatted a1fs image from a host
+ * directory tree, implementation.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "csum.h"
+#include "group.h"
+#include "import.h"
+#include "util.h"
+
+
+/** Size of the buffer each copy thread reads through. */
+#define IMPORT_BUF_SIZE (1024 * 1024)
+
+
+/** Contents of a host file to be copied into the image. */
+typedef struct import_job {
+	/** Host file path. */
+	char *path;
+	/** Destination of the whole blocks of the file. */
+	char *data;
+	/** Number of bytes that go to data. */
+	uint64_t data_len;
+	/** Destination of the packed tail of the file (if any). */
+	char *tail;
+	/** Number of bytes that go to tail. */
+	uint64_t tail_len;
+
+} import_job;
+
+/** Import state. Blocks and inodes are handed out strictly in order. */
+typedef struct import_ctx {
+	char *image;
+	a1fs_superblock *sb;
+	/** Next free data block. */
+	a1fs_blk_t next_block;
+	/** Number of blocks in the data area. */
+	a1fs_blk_t data_blocks;
+	/** Next free inode bitmap bit (inode number - 1). */
+	a1fs_ino_t next_inode;
+	/** Tail block currently being filled (0 if none). */
+	a1fs_blk_t tail_block;
+
+	/** File contents to copy once the layout is done. */
+	import_job *jobs;
+	size_t njobs;
+	size_t cap;
+	/** Next job to be picked up by a copy thread. */
+	size_t next_job;
+	/** A copy thread failed. */
+	bool failed;
+
+	bool verbose;
+
+} import_ctx;
+
+
+static bool alloc_run(import_ctx *ctx, a1fs_blk_t count, a1fs_blk_t *start)
+{
+	if (count > ctx->data_blocks - ctx->next_block) {
+		fprintf(stderr, "Not enough space in the image\n");
+		return false;
+	}
+	*start = ctx->next_block;
+	ctx->next_block += count;
+	return true;
+}
+
+static a1fs_inode *alloc_inode(import_ctx *ctx)
+{
+	if (ctx->next_inode >= ctx->sb->inodes_count) {
+		fprintf(stderr, "Not enough inodes in the image\n");
+		return NULL;
+	}
+	a1fs_ino_t num = ++ctx->next_inode;
+	if (dyn_inodes(ctx->image)) {
+		// The first inode of a chunk brings the chunk along
+		uint64_t *entry = chunk_map_entry(ctx->image, (num - 1) / inodes_per_chunk(ctx->image));
+		if (*entry == 0) {
+			a1fs_blk_t start;
+			if (!alloc_run(ctx, A1FS_INODE_CHUNK_BLOCKS, &start)) return NULL;
+			memset(find_data_block(ctx->image, start), 0,
+			       A1FS_INODE_CHUNK_BLOCKS * block_size(ctx->image));
+			*entry = start;
+		}
+	} else {
+		lazy_init(ctx->image, LAZY_INODE_TABLE, (num - 1) * sizeof(a1fs_inode) / block_size(ctx->image));
+	}
+	a1fs_inode *inode = find_inode_num(ctx->image, num);
+	memset(inode, 0, sizeof(*inode));
+	clear_inode_extents(ctx->image, inode);
+	inode->inode_num = num;
+	return inode;
+}
+
+/** Same policy as tail_pack() in the driver, but with in-order allocation. */
+static bool alloc_tail(import_ctx *ctx, uint16_t length, a1fs_tail *tail)
+{
+	a1fs_tail_header *header = NULL;
+	if (ctx->tail_block != 0) {
+		header = (a1fs_tail_header*)find_data_block(ctx->image, ctx->tail_block);
+		if (header->used + length > block_size(ctx->image)) header = NULL;
+	}
+	if (header == NULL) {
+		if (!alloc_run(ctx, 1, &ctx->tail_block)) return false;
+		header = (a1fs_tail_header*)find_data_block(ctx->image, ctx->tail_block);
+		memset(header, 0, block_size(ctx->image));
+		header->used = sizeof(*header);
+	}
+	tail->block = ctx->tail_block;
+	tail->offset = header->used;
+	tail->length = length;
+	header->used += length;
+	header->refs++;
+	return true;
+}
+
+static bool add_job(import_ctx *ctx, const import_job *job)
+{
+	if (ctx->njobs == ctx->cap) {
+		size_t cap = ctx->cap ? ctx->cap * 2 : 1024;
+		import_job *jobs = realloc(ctx->jobs, cap * sizeof(*jobs));
+		if (!jobs) {
+			perror("realloc");
+			return false;
+		}
+		ctx->jobs = jobs;
+		ctx->cap = cap;
+	}
+	ctx->jobs[ctx->njobs++] = *job;
+	return true;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+	size_t len = strlen(dir) + strlen(name) + 2;
+	char *path = malloc(len);
+	if (path) snprintf(path, len, "%s/%s", dir, name);
+	return path;
+}
+
+static bool import_file(import_ctx *ctx, char *path, const struct stat *st,
+                        a1fs_inode *inode)
+{
+	inode->mode = S_IFREG | (st->st_mode & 07777);
+	inode->links = 1;
+	inode->size = st->st_size;
+	inode->mtime = st->st_mtim;
+
+	import_job job = {.path = path};
+	uint64_t tail_len = inode->size % block_size(ctx->image);
+	a1fs_blk_t blocks = inode->size / block_size(ctx->image);
+	// a1fs_tail holds a 32-bit block number
+	if (inode->size <= A1FS_TAIL_FILE_BLOCKS * block_size(ctx->image) && tail_len > 0 &&
+	    ctx->next_block < UINT32_MAX &&
+	    tail_len <= block_size(ctx->image) - sizeof(a1fs_tail_header)) {
+		if (!alloc_tail(ctx, tail_len, &inode->tail)) return false;
+		job.tail = tail_data(ctx->image, inode);
+		job.tail_len = tail_len;
+	} else if (tail_len > 0) {
+		blocks++;
+	}
+
+	if (blocks > 0) {
+		a1fs_blk_t start;
+		if (!alloc_run(ctx, blocks, &start)) return false;
+		set_inode_extent(ctx->image, inode, 0, (a1fs_extent){start, blocks});
+		inode->i_blocks = 1;
+		job.data = find_data_block(ctx->image, start);
+		job.data_len = inode->size - job.tail_len;
+	}
+	return add_job(ctx, &job);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/** Lay out a directory and its files, then recurse into its subdirectories. */
+static bool import_dir(import_ctx *ctx, const char *path, a1fs_inode *dir)
+{
+	DIR *d = opendir(path);
+	if (!d) {
+		perror(path);
+		return false;
+	}
+	char **names = NULL;
+	size_t n = 0, cap = 0;
+	bool ok = false;
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+			continue;
+		}
+		if (strlen(de->d_name) >= A1FS_NAME_MAX) {
+			fprintf(stderr, "%s/%s: name too long, skipped\n", path, de->d_name);
+			continue;
+		}
+		if (de->d_type != DT_REG && de->d_type != DT_DIR && de->d_type != DT_UNKNOWN) {
+			fprintf(stderr, "%s/%s: not a regular file or directory, skipped\n",
+			        path, de->d_name);
+			continue;
+		}
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			char **tmp = realloc(names, cap * sizeof(*names));
+			if (!tmp) goto end;
+			names = tmp;
+		}
+		if (!(names[n] = strdup(de->d_name))) goto end;
+		n++;
+	}
+	// Sorted order keeps the resulting image reproducible
+	qsort(names, n, sizeof(*names), compare_names);
+
+	// Directory blocks: entries are packed 16 per block, as change_parent() does
+	const size_t per_block = block_size(ctx->image) / sizeof(a1fs_dentry);
+	a1fs_blk_t blocks = (n + per_block - 1) / per_block;
+	a1fs_dentry *entries = NULL;
+	if (blocks > 0) {
+		a1fs_blk_t start;
+		if (!alloc_run(ctx, blocks, &start)) goto end;
+		set_inode_extent(ctx->image, dir, 0, (a1fs_extent){start, blocks});
+		dir->i_blocks = 1;
+		entries = (a1fs_dentry*)find_data_block(ctx->image, start);
+		memset(entries, 0, (size_t)blocks * block_size(ctx->image));
+	}
+
+	a1fs_inode **subdirs = calloc(n ? n : 1, sizeof(*subdirs));
+	char **subpaths = calloc(n ? n : 1, sizeof(*subpaths));
+	if (!subdirs || !subpaths) goto free_subdirs;
+	size_t nentries = 0, nsubdirs = 0;
+	for (size_t i = 0; i < n; i++) {
+		char *child = join_path(path, names[i]);
+		struct stat st;
+		if (!child || lstat(child, &st) < 0) {
+			perror(child ? child : "malloc");
+			free(child);
+			goto free_subdirs;
+		}
+		if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+			fprintf(stderr, "%s: not a regular file or directory, skipped\n", child);
+			free(child);
+			continue;
+		}
+		if (ctx->verbose) printf("%s\n", child);
+
+		a1fs_inode *inode = alloc_inode(ctx);
+		if (!inode) {
+			free(child);
+			goto free_subdirs;
+		}
+		entries[nentries].ino = inode->inode_num;
+		strcpy(entries[nentries].name, names[i]);
+		nentries++;
+
+		if (S_ISDIR(st.st_mode)) {
+			inode->mode = S_IFDIR | (st.st_mode & 07777);
+			inode->links = 2;
+			inode->mtime = st.st_mtim;
+			dir->links++;
+			subdirs[nsubdirs] = inode;
+			subpaths[nsubdirs++] = child;
+		} else if (!import_file(ctx, child, &st, inode)) {
+			free(child);
+			goto free_subdirs;
+		}
+	}
+	dir->size = (nentries + 2) * sizeof(a1fs_dentry);
+
+	ok = true;
+	for (size_t i = 0; i < nsubdirs; i++) {
+		if (ok) ok = import_dir(ctx, subpaths[i], subdirs[i]);
+	}
+
+free_subdirs:
+	if (subpaths) {
+		for (size_t i = 0; i < n; i++) free(subpaths[i]);
+	}
+	free(subpaths);
+	free(subdirs);
+end:
+	for (size_t i = 0; i < n; i++) free(names[i]);
+	free(names);
+	closedir(d);
+	return ok;
+}
+
+/**
+ * Read exactly len bytes, zero filling if the file got shorter. The data goes
+ * through buf (IMPORT_BUF_SIZE bytes) rather than straight into dst: in an
+ * image opened through the block cache, dst may not be mapped until touched,
+ * and read(2) fails with EFAULT instead of faulting it in.
+ */
+static bool read_full(int fd, char *dst, uint64_t len, char *buf, const char *path)
+{
+	while (len > 0) {
+		ssize_t n = read(fd, buf, len < IMPORT_BUF_SIZE ? len : IMPORT_BUF_SIZE);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror(path);
+			return false;
+		}
+		if (n == 0) {
+			memset(dst, 0, len);
+			break;
+		}
+		memcpy(dst, buf, n);
+		dst += n;
+		len -= n;
+	}
+	return true;
+}
+
+static void *copy_thread(void *arg)
+{
+	import_ctx *ctx = (import_ctx*)arg;
+	char *buf = malloc(IMPORT_BUF_SIZE);
+	if (!buf) {
+		perror("malloc");
+		__atomic_store_n(&ctx->failed, true, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	for (;;) {
+		size_t i = __atomic_fetch_add(&ctx->next_job, 1, __ATOMIC_RELAXED);
+		if (i >= ctx->njobs) break;
+
+		import_job *job = &ctx->jobs[i];
+		int fd = open(job->path, O_RDONLY);
+		if (fd < 0) {
+			perror(job->path);
+			__atomic_store_n(&ctx->failed, true, __ATOMIC_RELAXED);
+			continue;
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		if (!read_full(fd, job->data, job->data_len, buf, job->path) ||
+		    !read_full(fd, job->tail, job->tail_len, buf, job->path)) {
+			__atomic_store_n(&ctx->failed, true, __ATOMIC_RELAXED);
+		}
+		close(fd);
+	}
+	free(buf);
+	return NULL;
+}
+
+/** Mark bits [from, to) of a bitmap that has them all clear as used. */
+static void set_bits(unsigned char *bitmap, uint64_t from, uint64_t to)
+{
+	for (; from < to && from % 8 != 0; from++) bitmap[from / 8] |= 1 << (from % 8);
+	if (to - from >= 8) {
+		memset(bitmap + from / 8, 0xff, (to - from) / 8);
+		from += (to - from) / 8 * 8;
+	}
+	for (; from < to; from++) bitmap[from / 8] |= 1 << (from % 8);
+}
+
+bool import_tree(void *image, const char *dir, int threads, bool verbose)
+{
+	import_ctx ctx = {0};
+	ctx.image = image;
+	ctx.sb = (a1fs_superblock*)image;
+	ctx.data_blocks = ctx.sb->blocks_count - ctx.sb->first_data_block;
+	// Data block 0 (and the root's inode chunk), inode 1 (the root) are
+	// already in use, at the start of the data area
+	ctx.next_block = ctx.data_blocks - ctx.sb->free_blocks_count;
+	a1fs_blk_t first_block = ctx.next_block;
+	ctx.next_inode = 1;
+	ctx.verbose = verbose;
+
+	a1fs_inode *root = find_inode_num(image, 1);
+	bool ok = import_dir(&ctx, dir, root);
+
+	if (ok) {
+		if (threads < 1) threads = 1;
+		pthread_t *tids = calloc(threads, sizeof(*tids));
+		int started = 0;
+		if (tids) {
+			for (; started < threads; started++) {
+				if (pthread_create(&tids[started], NULL, copy_thread, &ctx) != 0) break;
+			}
+		}
+		// Copy on this thread too; also covers the case where none started
+		copy_thread(&ctx);
+		for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+		free(tids);
+		ok = !ctx.failed;
+	}
+
+	if (ok) {
+		a1fs_superblock *sb = ctx.sb;
+		lazy_init(image, LAZY_BLOCK_BITMAP, ctx.next_block / 8 / block_size(image));
+		lazy_init(image, LAZY_INODE_BITMAP, ctx.next_inode / 8 / block_size(image));
+		set_bits((unsigned char*)get_block(image, sb->datablock_bitmap), first_block, ctx.next_block);
+		set_bits((unsigned char*)get_block(image, sb->inode_bitmap), 1, ctx.next_inode);
+		sb->free_blocks_count -= ctx.next_block - first_block;
+		sb->free_inodes_count -= ctx.next_inode - 1;
+		sb->tail_block = ctx.tail_block;
+		group_recount(image);
+
+		for (a1fs_ino_t i = 1; i <= ctx.next_inode; i++) {
+			a1fs_inode *inode = find_inode_num(image, i);
+			csum_update_inode(image, inode);
+			if (S_ISDIR(inode->mode) && inode->i_blocks > 0) {
+				a1fs_extent ext = inode_extent(image, inode, 0);
+				for (a1fs_blk_t b = 0; b < ext.count; b++) {
+					csum_touch_block(image, sb->first_data_block + ext.start + b);
+				}
+			}
+		}
+		for (uint64_t b = 0; b < lazy_initialized(image, LAZY_INODE_BITMAP); b++) {
+			csum_touch_block(image, sb->inode_bitmap + b);
+		}
+		for (uint64_t b = 0; b < lazy_initialized(image, LAZY_BLOCK_BITMAP); b++) {
+			csum_touch_block(image, sb->datablock_bitmap + b);
+		}
+		for (uint64_t b = 0; b < lazy_initialized(image, LAZY_CHUNK_MAP); b++) {
+			csum_touch_block(image, sb->inode_chunk_map + b);
+		}
+		csum_flush(image);
+	}
+
+	for (size_t i = 0; i < ctx.njobs; i++) free(ctx.jobs[i].path);
+	free(ctx.jobs);
+	return ok;
+}
@@ -0,0 +1,28 @@
+/**
+ * CSC369 Assignment 1 - Populating a freshly formatted a1fs image from a host
+ * directory tree, header file.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+
+/**
+ * Copy a host directory tree into a freshly formatted image.
+ *
+ * Lays out inodes, directory blocks and file data directly in the mapped image
+ * in one sequential pass over the tree: every directory and file gets a single
+ * contiguous extent, and the tails of small files are packed into shared tail
+ * blocks. File contents are then copied by the given number of threads.
+ *
+ * Only regular files and directories are imported; other file types, and
+ * names that are too long, are skipped with a warning.
+ *
+ * @param image    pointer to the start of the image, formatted by mkfs().
+ * @param dir      host directory whose contents become the root directory.
+ * @param threads  number of threads copying file contents.
+ * @param verbose  print each imported path.
+ * @return         true on success; false on error (e.g. image too small).
+ */
+bool import_tree(void *image, const char *dir, int threads, bool verbose);
@@ -16,6 +16,7 @@
  * CSC369 Assignment 1 - File mapping helper implementation.
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <sys/mman.h>
@@ -69,3 +70,95 @@ end:
 	close(fd);
 	return addr;
 }
+
+bool volume_stripe_unit(const char *const *paths, int count, size_t *stripe_unit)
+{
+	int fd = open(paths[0], O_RDONLY);
+	if (fd < 0) {
+		perror(paths[0]);
+		return false;
+	}
+	a1fs_superblock sb;
+	ssize_t n = pread(fd, &sb, sizeof(sb), 0);
+	close(fd);
+	if (n != (ssize_t)sizeof(sb) || sb.magic != A1FS_MAGIC) {
+		if (count == 1) {
+			*stripe_unit = 0;
+			return true;
+		}
+		fprintf(stderr, "%s does not contain a1fs\n", paths[0]);
+		return false;
+	}
+
+	uint64_t files = (sb.features & A1FS_FEATURE_STRIPED) ? sb.stripe_count : 1;
+	if (files != (uint64_t)count) {
+		fprintf(stderr, "The image is made of %lu file(s), %d given; give all the files "
+		        "in the order they were formatted in\n", (unsigned long)files, count);
+		return false;
+	}
+	*stripe_unit = files > 1 ? sb.stripe_unit : 0;
+	return true;
+}
+
+// Report a rejected hint; see map_advise()
+static void advise_failed(const char *what, bool verbose)
+{
+	if (verbose) perror(what);
+}
+
+// Fault in and map for writing every page of [addr, addr + len)
+static void prefault(char *addr, size_t len, size_t page, bool verbose)
+{
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(addr, len, MADV_POPULATE_WRITE) == 0) return;
+	// Kernels before 5.14 don't know MADV_POPULATE_WRITE; touch the pages
+	if (errno != EINVAL) {
+		advise_failed("madvise(MADV_POPULATE_WRITE)", verbose);
+		return;
+	}
+#else
+	(void)verbose;
+#endif
+	for (size_t off = 0; off < len; off += page) {
+		(void)*(volatile char*)(addr + off);
+	}
+}
+
+void map_advise(void *addr, size_t size, size_t meta_size, int flags, bool verbose)
+{
+	char *image = (char*)addr;
+	size_t page = sysconf(_SC_PAGESIZE);
+	meta_size = align_up(meta_size, page);
+	if (meta_size > size) meta_size = size;
+
+#ifdef MADV_HUGEPAGE
+	// Must come first so that prefaulting below can already use huge pages
+	if ((flags & MAP_ADV_HUGEPAGES) && (madvise(image, size, MADV_HUGEPAGE) != 0)) {
+		advise_failed("madvise(MADV_HUGEPAGE)", verbose);
+	}
+#else
+	if ((flags & MAP_ADV_HUGEPAGES) && verbose) {
+		fprintf(stderr, "Huge pages are not supported on this system\n");
+	}
+#endif
+
+	// Metadata is looked up by index (inode numbers, bitmap words) whatever the
+	// workload, so only the data gets the sequential hint
+	if (flags & MAP_ADV_RANDOM) {
+		if (madvise(image, size, MADV_RANDOM) != 0) advise_failed("madvise(MADV_RANDOM)", verbose);
+	} else if ((flags & MAP_ADV_SEQUENTIAL) && (meta_size < size)) {
+		if (madvise(image + meta_size, size - meta_size, MADV_SEQUENTIAL) != 0) {
+			advise_failed("madvise(MADV_SEQUENTIAL)", verbose);
+		}
+	}
+
+	if (flags & MAP_ADV_LOCK) {
+		// mlock() faults the pages in, but only for reading on a shared
+		// mapping; prefault for writing first so that the first metadata
+		// update doesn't take a fault either
+		prefault(image, meta_size, page, verbose);
+		if (mlock(image, meta_size) != 0) advise_failed("mlock", verbose);
+	} else if (flags & MAP_ADV_PREFAULT) {
+		prefault(image, meta_size, page, verbose);
+	}
+}
@@ -18,6 +18,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 
 
@@ -33,3 +34,47 @@
  *                    NULL on failure.
  */
 void *map_file(const char *path, size_t block_size, size_t *size);
+
+/**
+ * Get the stripe unit of the image made of the given files from the
+ * superblock in the first one, checking that the superblock records that many
+ * files (see A1FS_FEATURE_STRIPED). A single file that doesn't contain a1fs
+ * is accepted, to be reported by the caller.
+ *
+ * @param paths        image file paths.
+ * @param count        number of image files.
+ * @param stripe_unit  pointer to the variable that will be set to the stripe
+ *                     unit in bytes; 0 if the image is not striped.
+ * @return             true on success; false on failure.
+ */
+bool volume_stripe_unit(const char *const *paths, int count, size_t *stripe_unit);
+
+/** Flags for map_advise(). */
+enum {
+	/** Fault in the metadata pages up front. */
+	MAP_ADV_PREFAULT   = 0x01,
+	/** Lock the metadata pages in memory (implies MAP_ADV_PREFAULT). */
+	MAP_ADV_LOCK       = 0x02,
+	/** Ask for transparent huge pages for the whole mapping. */
+	MAP_ADV_HUGEPAGES  = 0x04,
+	/** Data is mostly read sequentially. */
+	MAP_ADV_SEQUENTIAL = 0x08,
+	/** Data is mostly accessed randomly. */
+	MAP_ADV_RANDOM     = 0x10,
+};
+
+/**
+ * Apply memory access hints to a mapping returned by map_file().
+ *
+ * The first meta_size bytes of the mapping hold the file system metadata and
+ * the rest holds file data. The hints are only an optimization: failures
+ * (e.g. no huge page support for the file, or RLIMIT_MEMLOCK too low) are
+ * reported when verbose is set, and otherwise ignored.
+ *
+ * @param addr       pointer to the mapping.
+ * @param size       size of the mapping.
+ * @param meta_size  size of the metadata at the start of the mapping.
+ * @param flags      MAP_ADV_* flags.
+ * @param verbose    report hints that the kernel rejected.
+ */
+void map_advise(void *addr, size_t size, size_t meta_size, int flags, bool verbose);
@@ -22,18 +22,31 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
-#include <time.h>
 
 #include "a1fs.h"
+#include "bcache.h"
+#include "format.h"
+#include "import.h"
 #include "map.h"
+#include "util.h"
 
 
 /** Command line options. */
 typedef struct mkfs_opts {
-	/** File system image file path. */
-	const char *img_path;
-	/** Number of inodes. */
+	/** File system image file paths; more than one for a striped volume. */
+	const char *const *img_paths;
+	/** Number of image files. */
+	int n_images;
+	/** Stripe unit in bytes for a striped volume (0 for the default). */
+	size_t stripe_unit;
+	/** Number of inodes (0 to allocate the inode table on demand). */
 	size_t n_inodes;
+	/** Host directory to copy into the new file system (NULL if none). */
+	const char *src_dir;
+	/** Number of threads copying file contents from src_dir. */
+	int threads;
+	/** Block size in bytes (0 for the default). */
+	size_t block_size;
 
 	/** Print help and exit. */
 	bool help;
@@ -45,18 +58,33 @@ typedef struct mkfs_opts {
 	bool verbose;
 	/** Zero out image contents. */
 	bool zero;
+	/** Don't checksum metadata. */
+	bool no_csum;
+	/** Use 64-bit extents even if the image doesn't need them. */
+	bool use_64bit;
 
 } mkfs_opts;
 
 static const char *help_str = "\
-Usage: %s options image\n\
+Usage: %s options image [image...]\n\
 \n\
 Format the image file into a1fs file system. The file must exist and\n\
-its size must be a multiple of a1fs block size - %zu bytes.\n\
+its size must be a multiple of the smallest a1fs block size - %d bytes.\n\
+Given several files of equal size, format a volume striped over them; the\n\
+files must then always be given in the same order.\n\
 \n\
 Options:\n\
-    -i num  number of inodes; required argument\n\
+    -i num  number of inodes, in an inode table reserved up front; without\n\
+            it, inode table chunks are allocated from the data area as files\n\
+            are created, for up to one inode per block\n\
+    -b size block size in bytes, a power of 2 from %d to %d (default %d)\n\
+    -d dir  populate the file system with the contents of host directory dir\n\
+    -j num  number of threads copying file contents for -d (default 1)\n\
     -h      print help and exit\n\
+    -L      use 64-bit block numbers (implied for images of 2^32 blocks or more)\n\
+    -S size stripe unit in bytes of a striped volume, a power of 2 of at least\n\
+            %d (default %d)\n\
+    -n      don't checksum metadata blocks and inodes\n\
     -f      force format - overwrite existing a1fs file system\n\
     -s      sync image file contents to disk\n\
     -v      verbose output\n\
@@ -65,19 +93,26 @@ Options:\n\
 
 static void print_help(FILE *f, const char *progname)
 {
-	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE);
+	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE_MAX,
+	        A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE, BCACHE_UNIT);
 }
 
 
 static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 {
 	char o;
-	while ((o = getopt(argc, argv, "i:hfsvz")) != -1) {
+	while ((o = getopt(argc, argv, "i:b:d:j:S:hfLnsvz")) != -1) {
 		switch (o) {
 			case 'i': opts->n_inodes = strtoul(optarg, NULL, 10); break;
+			case 'b': opts->block_size = strtoul(optarg, NULL, 10); break;
+			case 'd': opts->src_dir  = optarg; break;
+			case 'j': opts->threads  = atoi(optarg); break;
+			case 'S': opts->stripe_unit = strtoul(optarg, NULL, 10); break;
 
 			case 'h': opts->help    = true; return true;// skip other arguments
 			case 'f': opts->force   = true; break;
+			case 'L': opts->use_64bit = true; break;
+			case 'n': opts->no_csum = true; break;
 			case 's': opts->sync    = true; break;
 			case 'v': opts->verbose = true; break;
 			case 'z': opts->zero    = true; break;
@@ -91,10 +126,18 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 		fprintf(stderr, "Missing image path\n");
 		return false;
 	}
-	opts->img_path = argv[optind];
+	opts->img_paths = (const char *const *)argv + optind;
+	opts->n_images = argc - optind;
 
-	if (opts->n_inodes == 0) {
-		fprintf(stderr, "Missing or invalid number of inodes\n");
+	if (opts->block_size == 0) opts->block_size = A1FS_BLOCK_SIZE;
+	if (opts->block_size < A1FS_BLOCK_SIZE || opts->block_size > A1FS_BLOCK_SIZE_MAX ||
+	    (opts->block_size & (opts->block_size - 1)) != 0) {
+		fprintf(stderr, "Invalid block size\n");
+		return false;
+	}
+	if (opts->stripe_unit == 0) opts->stripe_unit = BCACHE_UNIT;
+	if (opts->stripe_unit < A1FS_BLOCK_SIZE || (opts->stripe_unit & (opts->stripe_unit - 1)) != 0) {
+		fprintf(stderr, "Invalid stripe unit\n");
 		return false;
 	}
 	return true;
@@ -113,78 +156,6 @@ static bool a1fs_is_present(void *image)
 }
 
 
-/**
- * Format the image into a1fs.
- *
- * NOTE: Must update mtime of the root directory.
- *
- * @param image  pointer to the start of the image.
- * @param size   image size in bytes.
- * @param opts   command line options.
- * @return       true on success;
- *               false on error, e.g. options are invalid for given image size.
- */
-static bool mkfs(void *image, size_t size, mkfs_opts *opts)
-{
-	memset(image, 0 ,size);
-	a1fs_superblock *sb = (a1fs_superblock *)image;
-	sb->magic = A1FS_MAGIC;
-	sb->size = size;
-	sb->inodes_count = opts->n_inodes;
-	sb->blocks_count = size / A1FS_BLOCK_SIZE;
-	sb->free_blocks_count = sb->blocks_count - 1;
-	sb->free_inodes_count = sb->inodes_count - 1;
-
-	uint64_t numOfInodeBm = sb->inodes_count / (A1FS_BLOCK_SIZE * 8);
-	if(sb->inodes_count % (A1FS_BLOCK_SIZE * 8) != 0){
-		numOfInodeBm += 1;
-	}
-	uint64_t numOfDataBm = sb->blocks_count / (A1FS_BLOCK_SIZE * 8);
-	if(sb->blocks_count % (A1FS_BLOCK_SIZE * 8) != 0){
-		numOfDataBm += 1;
-	}
-	uint64_t numOfInodeTable = sb->inodes_count * sizeof(a1fs_inode) / A1FS_BLOCK_SIZE;
-	if((sb->inodes_count * sizeof(a1fs_inode) % A1FS_BLOCK_SIZE) != 0){
-		numOfInodeTable += 1;
-	}
-
-	// no more space to allocate datablock
-	uint64_t totalReserveBlock = 1 + numOfInodeBm + numOfDataBm + numOfInodeTable;
-	if(totalReserveBlock >= sb->blocks_count){
-		return false;
-	}
-	sb->inode_bitmap = 1;
-	sb->datablock_bitmap = sb->inode_bitmap + numOfInodeBm;
-	sb->first_inode_block = sb->datablock_bitmap + numOfDataBm;
-	sb->first_data_block = sb->first_inode_block + numOfInodeTable;
-
-	// set inode in the inode table
-	unsigned char *fisrtInode = (unsigned char*)(image + (sb->first_inode_block) * A1FS_BLOCK_SIZE);
-	memset(fisrtInode, 0, numOfInodeTable * A1FS_BLOCK_SIZE);
-
-	a1fs_inode *rootInode = (a1fs_inode *)(image+(sb->first_inode_block)*A1FS_BLOCK_SIZE);
-	rootInode->mode = S_IFDIR;
-	rootInode->links = 2;
-	rootInode->size = 2 * sizeof(a1fs_dentry);
-	clock_gettime(CLOCK_REALTIME,&rootInode->mtime);
-	rootInode->inode_num = 1;
-	rootInode->i_blocks = 0;
-	
-	// set DataBlock bitmap first char to 1, rest to 0
-	unsigned char *DataBlockBm = (unsigned char*)(image + (sb->datablock_bitmap) * A1FS_BLOCK_SIZE);
-	memset(DataBlockBm, 0, numOfDataBm * A1FS_BLOCK_SIZE);
-	DataBlockBm[0] = DataBlockBm[0] | (1<<0);
-
-	// set InodeBlock bitmap first char to 1, rest to 0
-	unsigned char *InodeBm = (unsigned char*)(image + (sb->inode_bitmap) * A1FS_BLOCK_SIZE);
-	memset(InodeBm, 0, numOfInodeBm * A1FS_BLOCK_SIZE);
-	InodeBm[0] = InodeBm[0] | (1<<0);
-
-
-	return true;
-}
-
-
 int main(int argc, char *argv[])
 {
 	mkfs_opts opts = {0};// defaults are all 0
@@ -199,10 +170,15 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
-	// Map image file into memory
+	// Map image file into memory; a striped volume goes through the block cache
 	size_t size;
-	void *image = map_file(opts.img_path, A1FS_BLOCK_SIZE, &size);
+	bcache cache = {0};
+	void *image = opts.n_images > 1 ?
+	              bcache_open(&cache, opts.img_paths, opts.n_images, opts.stripe_unit,
+	                          A1FS_BLOCK_SIZE, BCACHE_CAP_DEFAULT, false, &size) :
+	              map_file(opts.img_paths[0], A1FS_BLOCK_SIZE, &size);
 	if (image == NULL) return 1;
+	if (cache.base) bcache_start(&cache);
 
 	// Check if overwriting existing file system
 	int ret = 1;
@@ -211,20 +187,35 @@ int main(int argc, char *argv[])
 		goto end;
 	}
 
-	if (opts.zero) memset(image, 0, size);
-	if (!mkfs(image, size, &opts)) {
+	// Punching the whole image out is as good as writing zeros, and instant
+	if (opts.zero && madvise(image, size, MADV_REMOVE) < 0) memset(image, 0, size);
+	format_opts fmt = {opts.n_inodes, opts.block_size, opts.n_images, opts.stripe_unit,
+	                   opts.zero, opts.no_csum, opts.use_64bit};
+	if (!format_image(image, size, &fmt)) {
 		fprintf(stderr, "Failed to format the image\n");
 		goto end;
 	}
+	if (opts.src_dir && !import_tree(image, opts.src_dir, opts.threads, opts.verbose)) {
+		fprintf(stderr, "Failed to populate the image from %s\n", opts.src_dir);
+		goto end;
+	}
 
-	// Sync to disk if requested
-	if (opts.sync && (msync(image, size, MS_SYNC) < 0)) {
+	// Sync to disk if requested; the block cache must be written back anyway
+	if (cache.base && (bcache_writeback(&cache, image, size, opts.sync) < 0)) {
+		perror("bcache_writeback");
+		goto end;
+	}
+	if (!cache.base && opts.sync && (msync(image, size, MS_SYNC) < 0)) {
 		perror("msync");
 		goto end;
 	}
 
 	ret = 0;
 end:
-	munmap(image, size); // unmap
+	if (cache.base) {
+		bcache_close(&cache);
+	} else {
+		munmap(image, size); // unmap
+	}
 	return ret;
 }
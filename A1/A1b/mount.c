@@ -0,0 +1,25 @@
+/**
+ * CSC369 Assignment 1 - a1fs driver: mounting the file system with FUSE.
+ */
+
+#include <stdio.h>
+
+#include "fs_ctx.h"
+#include "ops.h"
+#include "options.h"
+
+
+int main(int argc, char *argv[])
+{
+	a1fs_opts opts = {0};// defaults are all 0
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (!a1fs_opt_parse(&args, &opts)) return 1;
+
+	fs_ctx fs = {0};
+	if (!a1fs_init(&fs, &opts)) {
+		fprintf(stderr, "Failed to mount the file system\n");
+		return 1;
+	}
+
+	return fuse_main(args.argc, args.argv, &a1fs_ops, &fs);
+}
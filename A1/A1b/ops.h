@@ -0,0 +1,87 @@
+/**
+ * CSC369 Assignment 1 - a1fs operations header file.
+ *
+ * The file system operations are built into liba1fs.a along with the rest of
+ * the driver, so that they can be called in-process as well as through a FUSE
+ * mount: a1fs (mount.c) hands a1fs_ops to fuse_main(), which passes the file
+ * system context to them as private_data, and a1fs-bench, a1fs-replay and
+ * a1fs-test call a1fs_lib_ops, which take it as their first argument. Either
+ * way, a1fs_init() and a1fs_start() must be called first, and the operations
+ * on a file system are called one at a time.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#define FUSE_USE_VERSION 29
+#include <fuse.h>
+
+#include "fs_ctx.h"
+#include "options.h"
+
+
+/** The file system operations, as FUSE callbacks. */
+extern const struct fuse_operations a1fs_ops;
+
+/** The operations of a1fs_ops with an explicit file system context. */
+typedef struct a1fs_operations {
+	int (*statfs)(fs_ctx *fs, const char *path, struct statvfs *st);
+	int (*getattr)(fs_ctx *fs, const char *path, struct stat *st);
+	int (*readdir)(fs_ctx *fs, const char *path, void *buf, fuse_fill_dir_t filler,
+	               off_t offset, struct fuse_file_info *fi);
+	int (*mkdir)(fs_ctx *fs, const char *path, mode_t mode);
+	int (*rmdir)(fs_ctx *fs, const char *path);
+	int (*create)(fs_ctx *fs, const char *path, mode_t mode, struct fuse_file_info *fi);
+	int (*unlink)(fs_ctx *fs, const char *path);
+	int (*rename)(fs_ctx *fs, const char *from, const char *to);
+	int (*utimens)(fs_ctx *fs, const char *path, const struct timespec tv[2]);
+	int (*truncate)(fs_ctx *fs, const char *path, off_t size);
+	int (*read)(fs_ctx *fs, const char *path, char *buf, size_t size, off_t offset,
+	            struct fuse_file_info *fi);
+	int (*write)(fs_ctx *fs, const char *path, const char *buf, size_t size, off_t offset,
+	             struct fuse_file_info *fi);
+	int (*ioctl)(fs_ctx *fs, const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+	             unsigned int flags, void *data);
+	int (*fallocate)(fs_ctx *fs, const char *path, int mode, off_t offset, off_t length,
+	                 struct fuse_file_info *fi);
+
+} a1fs_operations;
+
+/** The file system operations, for in-process callers. */
+extern const a1fs_operations a1fs_lib_ops;
+
+/**
+ * Initialize the file system.
+ *
+ * Called when the file system is mounted. NOTE: we are not using the FUSE
+ * init() callback since it doesn't support returning errors. This function must
+ * be called explicitly before fuse_main().
+ *
+ * @param fs    file system context to initialize.
+ * @param opts  command line options.
+ * @return      true on success; false on failure.
+ */
+bool a1fs_init(fs_ctx *fs, a1fs_opts *opts);
+
+/**
+ * Start the work that must run in the process serving the operations, after
+ * a1fs_init(): the block cache's io_uring (bcache_start()), faulting in and
+ * locking the metadata (--prefault, --mlock) and the --verbose statistics
+ * dump. Without -f, FUSE forks the daemon after a1fs_init(), and threads and
+ * memory locks don't survive fork(); a1fs_ops.init calls this in the daemon.
+ * In-process callers call it themselves.
+ *
+ * @param fs  the file system context.
+ */
+void a1fs_start(fs_ctx *fs);
+
+/**
+ * Cleanup the file system.
+ *
+ * Called when the file system is unmounted (a1fs_ops.destroy). Must cleanup all
+ * the resources created in a1fs_init().
+ *
+ * @param ctx  the file system context (fs_ctx).
+ */
+void a1fs_destroy(void *ctx);
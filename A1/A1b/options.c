@@ -18,9 +18,12 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "bcache.h"
 #include "options.h"
+#include "stats.h"
 
 
 // We are using the existing option parsing infrastructure in FUSE.
@@ -35,17 +38,30 @@ static const struct fuse_opt opt_spec[] = {
 	A1FS_OPT("-V"       , version),
 	A1FS_OPT("--version", version),
 
-	A1FS_OPT("--sync"   , sync   ),
-	A1FS_OPT("--verbose", verbose),
+	A1FS_OPT("--sync"      , sync      ),
+	A1FS_OPT("--verbose"   , verbose   ),
+	A1FS_OPT("--discard"   , discard   ),
+	A1FS_OPT("--prefault"  , prefault  ),
+	A1FS_OPT("--mlock"     , mlock     ),
+	A1FS_OPT("--hugepages" , hugepages ),
+	A1FS_OPT("--sequential", sequential),
+	A1FS_OPT("--random"    , random    ),
+	A1FS_OPT("--direct"    , direct    ),
+	{ "--cache=%s", offsetof(a1fs_opts, cache), 0 },
+	{ "--stats-interval=%u", offsetof(a1fs_opts, stats_interval), 0 },
+	{ "--trace=%s", offsetof(a1fs_opts, trace), 0 },
 
 	FUSE_OPT_END
 };
 
 static const char *help_str = "\
-Usage: %s image dir [options]\n\
+Usage: %s image [image...] dir [options]\n\
 \n\
 Mount a1fs image file at given mount point. Use fusermount(1) to unmount.\n\
 Only single-threaded mount is supported; -s FUSE option is implied.\n\
+A volume striped over several image files (mkfs.a1fs -S) is mounted by\n\
+giving all of them, in the order they were formatted in; it is always\n\
+accessed through the block cache (--cache).\n\
 \n\
 general options:\n\
     -o opt,[opt...]        mount options\n\
@@ -55,6 +71,28 @@ general options:\n\
 a1fs options:\n\
     --sync                 sync image file contents to disk on unmount\n\
     --verbose              verbose output; only useful in foreground mode (-f)\n\
+    --discard              punch freed blocks out of the image file, so that\n\
+                           its disk usage follows the live data\n\
+    --prefault             fault in the metadata (superblock, bitmaps, inode\n\
+                           table) at mount time\n\
+    --mlock                lock the metadata in memory; implies --prefault\n\
+    --hugepages            back the image mapping with transparent huge pages\n\
+                           where the kernel supports it for this file\n\
+    --sequential           file data is mostly read sequentially; read ahead\n\
+                           aggressively\n\
+    --random               file data is mostly accessed randomly; don't read\n\
+                           ahead\n\
+    --cache=SIZE           access the image through a block cache of at most\n\
+                           SIZE bytes (K, M or G suffix) with pread()/pwrite()\n\
+                           instead of mapping the whole image file\n\
+    --direct               with --cache, open the image with O_DIRECT and\n\
+                           write dirty blocks back through io_uring\n\
+    --stats-interval=SECS  with --verbose, print the operation statistics\n\
+                           every SECS seconds (default 10; 0 for only at\n\
+                           unmount); they can be read from /.a1fs-stats\n\
+                           in the mounted file system at any time\n\
+    --trace=FILE           record every operation into FILE, to be replayed\n\
+                           with a1fs-replay\n\
 \n\
 ";
 
@@ -64,8 +102,14 @@ static int opt_proc(void *data, const char *arg, int key, struct fuse_args *out)
 	a1fs_opts *opts = (a1fs_opts*)data;
 	(void)out;// unused
 
-	if ((key == FUSE_OPT_KEY_NONOPT) && (opts->img_path == NULL)) {
-		opts->img_path = strdup(arg);
+	// All the non-option arguments are image paths but the last one, the mount
+	// point, which is given back to FUSE once they are all parsed
+	if (key == FUSE_OPT_KEY_NONOPT) {
+		if (opts->n_images == A1FS_IMAGES_MAX) {
+			fprintf(stderr, "Too many image files\n");
+			return -1;
+		}
+		opts->img_paths[opts->n_images++] = strdup(arg);
 		return 0;
 	}
 	return 1;
@@ -74,7 +118,12 @@ static int opt_proc(void *data, const char *arg, int key, struct fuse_args *out)
 
 bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 {
+	opts->stats_interval = STATS_INTERVAL_DEFAULT;
 	if (fuse_opt_parse(args, opts, opt_spec, opt_proc) != 0) return false;
+	if (opts->n_images > 1) {
+		fuse_opt_add_arg(args, opts->img_paths[--opts->n_images]);
+	}
+	opts->img_path = opts->img_paths[0];
 
 	//NOTE: printing to stderr to keep it consistent with FUSE
 	if (opts->help) {
@@ -86,6 +135,39 @@ bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 		fuse_opt_add_arg(args, "-V");
 	}
 
+	if (opts->sequential && opts->random) {
+		fprintf(stderr, "--sequential and --random are mutually exclusive\n");
+		return false;
+	}
+	if (opts->cache) {
+		char *end;
+		unsigned long long n = strtoull(opts->cache, &end, 10);
+		switch (*end) {
+			case 'G': case 'g': n *= 1024;// fall through
+			case 'M': case 'm': n *= 1024;// fall through
+			case 'K': case 'k': n *= 1024; end++; break;
+		}
+		if ((end == opts->cache) || (*end != '\0') || (n == 0)) {
+			fprintf(stderr, "Invalid cache size %s\n", opts->cache);
+			return false;
+		}
+		if (n < BCACHE_CAP_MIN) {
+			fprintf(stderr, "Cache size must be at least %luM\n", BCACHE_CAP_MIN >> 20);
+			return false;
+		}
+		opts->cache_size = n;
+	} else if (opts->n_images > 1) {
+		opts->cache_size = BCACHE_CAP_DEFAULT;
+	} else if (opts->direct) {
+		fprintf(stderr, "--direct requires --cache\n");
+		return false;
+	}
+	// These work on the image file mapping
+	if (opts->cache_size && (opts->prefault || opts->mlock || opts->hugepages || opts->discard)) {
+		fprintf(stderr, "--cache (and striped volumes) can't be used with --prefault, "
+		                "--mlock, --hugepages or --discard\n");
+		return false;
+	}
 	if (!opts->help && !opts->version && !opts->img_path) {
 		fprintf(stderr, "Missing image path\n");
 		return false;
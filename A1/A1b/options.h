@@ -23,10 +23,17 @@
 #include <fuse_opt.h>
 
 
+/** Most image files a striped volume can be made of. */
+#define A1FS_IMAGES_MAX 64
+
 /** a1fs command line options. */
 typedef struct a1fs_opts {
-	/** a1fs image file path. */
+	/** a1fs image file path; the first file of a striped volume. */
 	const char *img_path;
+	/** Image file paths of a striped volume, in stripe order. */
+	const char *img_paths[A1FS_IMAGES_MAX];
+	/** Number of image files. */
+	int n_images;
 
 	/** Print help and exit. FUSE option. */
 	int help;
@@ -37,6 +44,29 @@ typedef struct a1fs_opts {
 	int sync;
 	/** Verbose output. Only print logging/debug info if this flag is set. */
 	int verbose;
+	/** Punch freed blocks out of the image file. */
+	int discard;
+	/** Fault in the metadata regions of the image at mount time. */
+	int prefault;
+	/** Lock the metadata regions of the image in memory. */
+	int mlock;
+	/** Ask for transparent huge pages for the image mapping. */
+	int hugepages;
+	/** File data is mostly read sequentially. */
+	int sequential;
+	/** File data is mostly accessed randomly. */
+	int random;
+	/** Block cache size argument; NULL to map the whole image. */
+	const char *cache;
+	/** Block cache size in bytes; 0 to map the whole image. Defaults to
+	 * BCACHE_CAP_DEFAULT for a striped volume. */
+	size_t cache_size;
+	/** Open the image with O_DIRECT and write back with io_uring (--cache). */
+	int direct;
+	/** Period of the statistics dump with --verbose, in seconds; 0 for none. */
+	unsigned stats_interval;
+	/** File to record the operations into; NULL for none. See trace.h. */
+	const char *trace;
 
 } a1fs_opts;
 
@@ -0,0 +1,83 @@
+/**
+ * CSC369 Assignment 1 - sequential read detection implementation.
+ */
+
+#include <stdio.h>
+
+#include "fs_ctx.h"
+#include "readahead.h"
+#include "util.h"
+
+
+static uint64_t min_u64(uint64_t a, uint64_t b)
+{
+	return a < b ? a : b;
+}
+
+/** Stream of a file, replacing the least recently used one if it has none. */
+static ra_stream *find_stream(readahead *ra, const a1fs_inode *inode)
+{
+	ra_stream *lru = &ra->streams[0];
+	for (ra_stream *s = ra->streams; s < ra->streams + RA_STREAMS; s++) {
+		if (s->inode == inode) return s;
+		if (s->used < lru->used) lru = s;
+	}
+	*lru = (ra_stream){ .inode = inode };
+	return lru;
+}
+
+/** Prefetch bytes [from, to) of a file; returns the number of bytes issued. */
+static uint64_t prefetch(char *image, a1fs_inode *inode, uint64_t from, uint64_t to)
+{
+	uint64_t issued = 0;
+	while (from < to) {
+		uint64_t len;
+		char *start = file_span(image, inode, from, &len);
+		len = min_u64(len, to - from);
+		if (!start || len == 0) break;
+		// Unwritten blocks read as zeros without touching the image
+		if (!file_unwritten(image, inode, from)) {
+			image_prefetch(image, start, len);
+			issued += len;
+		}
+		from += len;
+	}
+	return issued;
+}
+
+void readahead_read(readahead *ra, char *image, a1fs_inode *inode,
+                    uint64_t offset, uint64_t size)
+{
+	ra_stream *s = find_stream(ra, inode);
+	s->used = ++ra->clock;
+	ra->reads++;
+	uint64_t end = offset + size;
+	if (offset >= s->ahead_start && end <= s->ahead_end) ra->hits++;
+
+	if (offset != s->next) {
+		// Random access: collapse the window and forget what was prefetched
+		s->window = 0;
+		s->ahead_start = s->ahead_end = 0;
+		s->next = end;
+		return;
+	}
+	s->next = end;
+
+	// Prefetch the next window once the reader is into the second half of
+	// the current one, so that the blocks arrive before they are needed
+	if (s->window != 0 && end + s->window / 2 < s->ahead_end) return;
+	s->window = s->window ? min_u64(s->window * 2, RA_WINDOW_MAX) : RA_WINDOW_MIN;
+	uint64_t from = s->ahead_end > end ? s->ahead_end : end;
+	uint64_t to = min_u64(end + s->window, inode->size);
+	if (from >= to) return;
+	ra->bytes += prefetch(image, inode, from, to);
+	if (s->ahead_end <= offset) s->ahead_start = offset;
+	s->ahead_end = to;
+}
+
+void readahead_report(const readahead *ra, FILE *out)
+{
+	fprintf(out, "readahead: %lu reads, %lu hits (%.1f%%), %lu bytes prefetched\n",
+	        (unsigned long)ra->reads, (unsigned long)ra->hits,
+	        ra->reads ? 100.0 * ra->hits / ra->reads : 0.0, (unsigned long)ra->bytes);
+}
@@ -0,0 +1,73 @@
+/**
+ * CSC369 Assignment 1 - sequential read detection header file.
+ *
+ * The image is mapped, so a cold read faults in one page (or the kernel's
+ * fault-around batch) at a time from the image file. a1fs_read() reports
+ * every read here; a file read at the offset where its previous read ended is
+ * treated as a sequential stream, and the blocks of the next window of the
+ * file are prefetched with image_prefetch() before they are needed (with the
+ * block cache, in parallel over the files of a striped image).
+ * The window starts at RA_WINDOW_MIN, doubles each time the reader catches
+ * up with its second half, up to RA_WINDOW_MAX, and collapses on the first
+ * out-of-order read.
+ *
+ * Streams are kept per inode in a small table with LRU replacement.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "a1fs.h"
+
+
+/** Number of files whose access streams are tracked at a time. */
+#define RA_STREAMS 16
+/** Initial readahead window, in bytes. */
+#define RA_WINDOW_MIN (128 * 1024)
+/** Largest readahead window, in bytes. */
+#define RA_WINDOW_MAX (8 * 1024 * 1024)
+
+/** Access stream of one file. */
+typedef struct ra_stream {
+	/** The file's inode; NULL if the slot is unused. */
+	const a1fs_inode *inode;
+	/** File offset right after the last read. */
+	uint64_t next;
+	/** Current window in bytes; 0 while the stream doesn't look sequential. */
+	uint64_t window;
+	/** File offsets [ahead_start, ahead_end) have been prefetched. */
+	uint64_t ahead_start;
+	uint64_t ahead_end;
+	/** Value of the LRU clock when the stream was last used. */
+	uint64_t used;
+
+} ra_stream;
+
+/** Readahead state of a mounted file system. */
+typedef struct readahead {
+	ra_stream streams[RA_STREAMS];
+	/** LRU clock; incremented on every read. */
+	uint64_t clock;
+
+	/** Number of reads. */
+	uint64_t reads;
+	/** Reads that were entirely within previously prefetched ranges. */
+	uint64_t hits;
+	/** Number of bytes prefetched. */
+	uint64_t bytes;
+
+} readahead;
+
+
+/**
+ * Account for a read of size bytes at offset of a file and prefetch what is
+ * likely to be read next. Call after the file size has been checked (the read
+ * is within the file).
+ */
+void readahead_read(readahead *ra, char *image, a1fs_inode *inode,
+                    uint64_t offset, uint64_t size);
+
+/** Print the readahead statistics. */
+void readahead_report(const readahead *ra, FILE *out);
@@ -0,0 +1,150 @@
+/**
+ * CSC369 Assignment 1 - freed block reclamation implementation.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "reclaim.h"
+#include "util.h"
+
+
+static bool list_add(reclaim_list *list, reclaim_range range)
+{
+	if (list->n == list->cap) {
+		size_t cap = list->cap ? list->cap * 2 : 64;
+		reclaim_range *ranges = realloc(list->ranges, cap * sizeof(*ranges));
+		if (!ranges) return false;
+		list->ranges = ranges;
+		list->cap = cap;
+	}
+	list->ranges[list->n++] = range;
+	return true;
+}
+
+/** Punch a range out of the image; the data reads back as zeros. */
+static void punch(char *image, reclaim_range range)
+{
+	a1fs_superblock *sb = (a1fs_superblock*)image;
+	char *start = image + (sb->first_data_block + range.start) * a1fs_block_size(sb);
+	if (madvise(start, (size_t)range.count * a1fs_block_size(sb), MADV_REMOVE) < 0 &&
+	    errno != EOPNOTSUPP && errno != EINVAL) {
+		perror("madvise");
+	}
+}
+
+static void *reclaim_thread(void *arg)
+{
+	reclaim *r = (reclaim*)arg;
+	reclaim_list batch = {0};
+
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		while (r->queued.n == 0 && !r->stop) pthread_cond_wait(&r->work, &r->lock);
+		if (r->queued.n == 0) break;
+
+		// Take the whole queue so that the fs thread can keep adding to it
+		reclaim_list tmp = r->queued;
+		r->queued = batch;
+		r->queued.n = 0;
+		batch = tmp;
+		r->busy = true;
+		pthread_mutex_unlock(&r->lock);
+
+		for (size_t i = 0; i < batch.n; i++) punch(r->image, batch.ranges[i]);
+
+		pthread_mutex_lock(&r->lock);
+		for (size_t i = 0; i < batch.n; i++) {
+			if (!list_add(&r->done, batch.ranges[i])) {
+				// Leave the rest allocated; fsck can recover them
+				fprintf(stderr, "a1fs: out of memory, leaking freed blocks\n");
+				break;
+			}
+		}
+		r->busy = false;
+		pthread_cond_broadcast(&r->idle);
+	}
+	pthread_mutex_unlock(&r->lock);
+	free(batch.ranges);
+	return NULL;
+}
+
+
+bool reclaim_init(reclaim *r, void *image, bool discard)
+{
+	memset(r, 0, sizeof(*r));
+	r->image = image;
+	r->discard = discard;
+	if (pthread_mutex_init(&r->lock, NULL) != 0) return false;
+	pthread_cond_init(&r->work, NULL);
+	pthread_cond_init(&r->idle, NULL);
+	return true;
+}
+
+void reclaim_destroy(reclaim *r)
+{
+	if (r->started) {
+		pthread_mutex_lock(&r->lock);
+		r->stop = true;
+		pthread_cond_signal(&r->work);
+		pthread_mutex_unlock(&r->lock);
+		pthread_join(r->thread, NULL);
+	}
+	free(r->queued.ranges);
+	free(r->done.ranges);
+	pthread_cond_destroy(&r->idle);
+	pthread_cond_destroy(&r->work);
+	pthread_mutex_destroy(&r->lock);
+}
+
+void reclaim_free(reclaim *r, a1fs_blk_t start, a1fs_blk_t count)
+{
+	if (count == 0) return;
+	if (r->discard && !r->started) {
+		r->started = pthread_create(&r->thread, NULL, reclaim_thread, r) == 0;
+		// Without a worker, free ranges right away without punching them
+		if (!r->started) r->discard = false;
+	}
+
+	pthread_mutex_lock(&r->lock);
+	reclaim_list *q = r->discard ? &r->queued : &r->done;
+	reclaim_range *last = q->n ? &q->ranges[q->n - 1] : NULL;
+	bool queued = true;
+	// Files are usually freed from the end, so merge in both directions
+	if (last && start == last->start + last->count) {
+		last->count += count;
+	} else if (last && start + count == last->start) {
+		last->start = start;
+		last->count += count;
+	} else {
+		queued = list_add(q, (reclaim_range){start, count});
+	}
+	if (queued && r->discard) pthread_cond_signal(&r->work);
+	pthread_mutex_unlock(&r->lock);
+
+	if (queued) {
+		r->pending += count;
+	} else {
+		set_block_range(r->image, start, count, false);
+	}
+}
+
+void reclaim_reap(reclaim *r, bool wait)
+{
+	if (r->pending == 0) return;
+
+	pthread_mutex_lock(&r->lock);
+	while (wait && (r->queued.n > 0 || r->busy)) pthread_cond_wait(&r->idle, &r->lock);
+	reclaim_list done = r->done;
+	memset(&r->done, 0, sizeof(r->done));
+	pthread_mutex_unlock(&r->lock);
+
+	for (size_t i = 0; i < done.n; i++) {
+		set_block_range(r->image, done.ranges[i].start, done.ranges[i].count, false);
+		r->pending -= done.ranges[i].count;
+	}
+	free(done.ranges);
+}
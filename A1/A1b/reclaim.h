@@ -0,0 +1,87 @@
+/**
+ * CSC369 Assignment 1 - freed block reclamation header file.
+ *
+ * Data blocks freed by unlink, truncate etc. are queued here as ranges instead
+ * of being cleared in the bitmap right away, so that freeing a huge file takes
+ * time proportional to its number of extents. The bits are cleared later by
+ * reclaim_reap() on the file system thread (one range operation per range),
+ * when blocks are next allocated; statfs counts queued blocks as free.
+ *
+ * With the --discard mount option the ranges are first punched out of the
+ * image file (madvise(MADV_REMOVE) on the mapping) by a background thread, so
+ * that the disk space and page cache used by the image follow the live data.
+ * Blocks keep their bits until punched, so they can't be reallocated and
+ * written meanwhile.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** A range of data blocks. */
+typedef struct reclaim_range {
+	a1fs_blk_t start;
+	a1fs_blk_t count;
+
+} reclaim_range;
+
+/** A growable array of ranges. */
+typedef struct reclaim_list {
+	reclaim_range *ranges;
+	size_t n;
+	size_t cap;
+
+} reclaim_list;
+
+/** Reclamation state of a mounted file system. */
+typedef struct reclaim {
+	/** Pointer to the start of the image. */
+	char *image;
+
+	/** Protects the fields below. */
+	pthread_mutex_t lock;
+	/** Signalled when ranges are queued or stop is set. */
+	pthread_cond_t work;
+	/** Signalled when the worker becomes idle. */
+	pthread_cond_t idle;
+	/** Punch ranges out of the image before freeing them. */
+	bool discard;
+	/** Ranges waiting to be punched. */
+	reclaim_list queued;
+	/** Ranges (punched if discarding) whose bitmap bits are not cleared yet. */
+	reclaim_list done;
+	/** The worker is punching ranges it took off the queue. */
+	bool busy;
+	/** Tells the worker to exit once the queue is empty. */
+	bool stop;
+
+	/** The worker is started on first use (FUSE forks after mount). */
+	bool started;
+	pthread_t thread;
+	/** Blocks freed but not yet reaped; only used on the fs thread. */
+	uint64_t pending;
+
+} reclaim;
+
+
+/** Initialize reclamation state. Returns false on failure. */
+bool reclaim_init(reclaim *r, void *image, bool discard);
+
+/** Stop the worker and release the resources. Call reclaim_reap() first. */
+void reclaim_destroy(reclaim *r);
+
+/** Queue a range of data blocks (whose bits are still set) to be freed. */
+void reclaim_free(reclaim *r, a1fs_blk_t start, a1fs_blk_t count);
+
+/**
+ * Clear the bitmap bits of the blocks that are ready to be freed.
+ *
+ * @param r     reclamation state.
+ * @param wait  wait for all queued blocks to be punched first.
+ */
+void reclaim_reap(reclaim *r, bool wait);
@@ -0,0 +1,647 @@
+/**
+ * CSC369 Assignment 1 - a1fs-replay: replay an operation trace.
+ *
+ * Runs the operations recorded with the --trace mount option (see trace.h)
+ * against a file system, either in-process like a1fs-bench (mounting an image
+ * with a1fs_init() and calling a1fs_lib_ops directly) or through a mounted file
+ * system with system calls (-m). The operations are issued one at a time in
+ * the order they started, as fast as possible or at the pace they were
+ * recorded (-s). Prints the throughput, and the latency percentiles of each
+ * operation next to the recorded ones, as JSON, so that two builds of the
+ * driver (or two images) can be compared on the same workload.
+ *
+ * The trace holds no file data: writes store a fixed pattern, and reads
+ * discard what they get. In-process, namespace operations are first checked
+ * with getattr the way the VFS would (see vfs_check()). An operation whose
+ * result differs from the recorded one is counted as diverged; the file system
+ * being replayed on should start out like the traced one did (e.g. a copy of
+ * the image taken before mounting it with --trace).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defrag.h"
+#include "fs_ctx.h"
+#include "ops.h"
+#include "options.h"
+#include "trace.h"
+
+
+/** Command line options. */
+typedef struct replay_opts {
+	/** Trace file path. */
+	const char *trace;
+	/** Mount point to replay through; NULL to replay in-process. */
+	const char *mount;
+	/** Image file paths (in-process). */
+	const char *images[A1FS_IMAGES_MAX];
+	int n_images;
+	/** Keep the recorded pace instead of going as fast as possible. */
+	bool original_speed;
+	/** Block cache size (in-process); 0 to map the image. */
+	size_t cache_size;
+	/** Open the image with O_DIRECT (with a block cache). */
+	bool direct;
+	/** Print help and exit. */
+	bool help;
+
+} replay_opts;
+
+/** A loaded trace record. */
+typedef struct replay_op {
+	trace_record r;
+	/** NUL-terminated paths; to is NULL but for rename. */
+	char *path;
+	char *to;
+	/** Position in the trace file, to keep the order of equal times. */
+	size_t index;
+
+} replay_op;
+
+/** Result of replaying one operation. */
+typedef struct replay_result {
+	int ret;
+	uint64_t latency;
+
+} replay_result;
+
+
+static const char *help_str = "\
+Usage: %s [options] trace image [image...]\n\
+       %s [options] -m dir trace\n\
+\n\
+Replay an operation trace recorded with a1fs --trace=FILE. By default the\n\
+operations are run in-process on the given image (or the image files of a\n\
+striped volume), which they modify; with -m they are run through the file\n\
+system mounted at dir. Prints the throughput and the replayed and recorded\n\
+latency percentiles of each operation as JSON.\n\
+\n\
+Options:\n\
+    -m dir   replay through the file system mounted at dir\n\
+    -s       keep the recorded pace (default: as fast as possible)\n\
+    -c size  access the image through a block cache of size bytes\n\
+    -D       with -c, open the image with O_DIRECT\n\
+    -h       print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname, progname);
+}
+
+static bool parse_size(const char *arg, size_t *size)
+{
+	char *end;
+	errno = 0;
+	*size = strtoull(arg, &end, 10);
+	return end != arg && *end == '\0' && errno == 0;
+}
+
+static bool parse_args(int argc, char *argv[], replay_opts *opts)
+{
+	int o;
+	bool ok = true;
+	while ((o = getopt(argc, argv, "m:sc:Dh")) != -1) {
+		switch (o) {
+			case 'm': opts->mount = optarg; break;
+			case 's': opts->original_speed = true; break;
+			case 'c': ok = ok && parse_size(optarg, &opts->cache_size); break;
+			case 'D': opts->direct = true; break;
+
+			case 'h': opts->help = true; return true;// skip other arguments
+			default : return false;
+		}
+	}
+	if (!ok) return false;
+
+	if (optind >= argc) {
+		fprintf(stderr, "Missing trace file\n");
+		return false;
+	}
+	opts->trace = argv[optind++];
+	for (; optind < argc; optind++) {
+		if (opts->n_images == A1FS_IMAGES_MAX) {
+			fprintf(stderr, "Too many image files\n");
+			return false;
+		}
+		opts->images[opts->n_images++] = argv[optind];
+	}
+	if ((opts->mount != NULL) == (opts->n_images > 0)) {
+		fprintf(stderr, "Give either image files or a mount point (-m)\n");
+		return false;
+	}
+	return true;
+}
+
+
+/* Loading the trace */
+
+static int compare_ops(const void *a, const void *b)
+{
+	const replay_op *x = (const replay_op*)a, *y = (const replay_op*)b;
+	if (x->r.time != y->r.time) return x->r.time < y->r.time ? -1 : 1;
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+/** Read the whole file at path into a new buffer. */
+static char *read_file(const char *path, size_t *size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+	struct stat st;
+	char *data = NULL;
+	if (fstat(fd, &st) < 0 || (data = malloc(st.st_size ? st.st_size : 1)) == NULL) {
+		perror(path);
+		close(fd);
+		return NULL;
+	}
+	size_t done = 0;
+	while (done < (size_t)st.st_size) {
+		ssize_t n = read(fd, data + done, st.st_size - done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			if (n < 0) perror(path);
+			break;
+		}
+		done += n;
+	}
+	close(fd);
+	*size = done;
+	return data;
+}
+
+/**
+ * Load the trace at path and sort its records by start time.
+ *
+ * @param n  receives the number of records.
+ * @return   the records (with their paths in the same allocation, freed along
+ *           with them); NULL on failure, with an error message printed.
+ */
+static replay_op *load_trace(const char *path, size_t *n)
+{
+	size_t size;
+	char *data = read_file(path, &size);
+	if (!data) return NULL;
+
+	trace_header h;
+	if (size < sizeof(h)) {
+		fprintf(stderr, "%s: not an a1fs trace\n", path);
+		free(data);
+		return NULL;
+	}
+	memcpy(&h, data, sizeof(h));
+	if (h.magic != TRACE_MAGIC || h.version != TRACE_VERSION ||
+	    h.record_size != sizeof(trace_record)) {
+		fprintf(stderr, "%s: not an a1fs trace, or of an unsupported version\n", path);
+		free(data);
+		return NULL;
+	}
+
+	// Count the records first; each is smaller than its replay_op, whose
+	// array also holds the NUL-terminated copies of the paths
+	size_t count = 0, paths = 0, pos = sizeof(h);
+	while (pos + sizeof(trace_record) <= size) {
+		trace_record r;
+		memcpy(&r, data + pos, sizeof(r));
+		if (pos + sizeof(r) + r.path_len > size) break;
+		pos += sizeof(r) + r.path_len;
+		paths += r.path_len + 2;
+		count++;
+	}
+	if (pos != size) fprintf(stderr, "%s: truncated, replaying %zu records\n", path, count);
+
+	replay_op *ops = malloc(count * sizeof(*ops) + paths);
+	if (!ops) {
+		fprintf(stderr, "Out of memory\n");
+		free(data);
+		return NULL;
+	}
+	char *p = (char*)(ops + count);
+	pos = sizeof(h);
+	for (size_t i = 0; i < count; i++) {
+		replay_op *op = &ops[i];
+		memcpy(&op->r, data + pos, sizeof(op->r));
+		pos += sizeof(op->r);
+		op->index = i;
+		op->path = p;
+		memcpy(p, data + pos, op->r.path_len);
+		p[op->r.path_len] = '\0';
+		size_t len = strlen(p);
+		op->to = len < op->r.path_len ? p + len + 1 : NULL;
+		p += op->r.path_len + 2;
+		pos += op->r.path_len;
+	}
+	free(data);
+
+	// Each thread's records are in order, but the threads' are interleaved
+	// in chunks in the file
+	qsort(ops, count, sizeof(*ops), compare_ops);
+	*n = count;
+	return ops;
+}
+
+
+/* Replaying the operations */
+
+/** Data written by the write operations. */
+static char *payload;
+/** Data read by the read operations. */
+static char *sink;
+
+static struct fuse_file_info no_fi;
+
+static int count_entry(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	(void)name;
+	(void)st;
+	(void)off;
+	(*(uint64_t*)buf)++;
+	return 0;
+}
+
+/** Look up the directory that path is in, as the kernel does before a
+ * namespace operation: -ENOENT if it doesn't exist, -ENOTDIR if not a
+ * directory. */
+static int lookup_parent(fs_ctx *fs, const char *path)
+{
+	char parent[PATH_MAX];
+	snprintf(parent, sizeof(parent), "%s", path);
+	char *slash = strrchr(parent, '/');
+	if (!slash) return -ENOENT;
+	slash[slash == parent ? 1 : 0] = '\0';
+	struct stat st;
+	int ret = a1fs_lib_ops.getattr(fs, parent, &st);
+	if (ret != 0) return ret;
+	return S_ISDIR(st.st_mode) ? 0 : -ENOTDIR;
+}
+
+/**
+ * Check a namespace operation the way the VFS does before the file system sees
+ * it, with getattr lookups. The driver trusts the kernel with these checks
+ * (e.g. create doesn't look for an existing entry), so without them a trace
+ * replayed on an image that doesn't match it would e.g. add duplicate entries
+ * instead of failing.
+ *
+ * @return  0 if the operation can go ahead; the -errno the system call would
+ *          fail with otherwise.
+ */
+static int vfs_check(fs_ctx *fs, const replay_op *op)
+{
+	struct stat st, to_st;
+	int ret;
+	switch (op->r.op) {
+		case STATS_MKDIR:
+		case STATS_CREATE:
+			if ((ret = lookup_parent(fs, op->path)) != 0) return ret;
+			return a1fs_lib_ops.getattr(fs, op->path, &st) == 0 ? -EEXIST : 0;
+		case STATS_RMDIR:
+			if ((ret = a1fs_lib_ops.getattr(fs, op->path, &st)) != 0) return ret;
+			if (strcmp(op->path, "/") == 0) return -EBUSY;
+			return S_ISDIR(st.st_mode) ? 0 : -ENOTDIR;
+		case STATS_UNLINK:
+			if ((ret = a1fs_lib_ops.getattr(fs, op->path, &st)) != 0) return ret;
+			return S_ISDIR(st.st_mode) ? -EISDIR : 0;
+		case STATS_RENAME: {
+			const char *to = op->to ? op->to : "";
+			if ((ret = a1fs_lib_ops.getattr(fs, op->path, &st)) != 0) return ret;
+			if ((ret = lookup_parent(fs, to)) != 0) return ret;
+			// Not into itself
+			size_t len = strlen(op->path);
+			if (strncmp(to, op->path, len) == 0 && to[len] == '/') return -EINVAL;
+			if (a1fs_lib_ops.getattr(fs, to, &to_st) != 0) return 0;
+			if (S_ISDIR(st.st_mode) && !S_ISDIR(to_st.st_mode)) return -ENOTDIR;
+			if (!S_ISDIR(st.st_mode) && S_ISDIR(to_st.st_mode)) return -EISDIR;
+			return 0;
+		}
+		default:
+			return 0;
+	}
+}
+
+/** Run an operation with a1fs_lib_ops. */
+static int run_in_process(fs_ctx *fs, const replay_op *op)
+{
+	const trace_record *r = &op->r;
+	const char *path = op->path;
+	int ret = vfs_check(fs, op);
+	if (ret != 0) return ret;
+	switch (r->op) {
+		case STATS_STATFS: {
+			struct statvfs st;
+			return a1fs_lib_ops.statfs(fs, path, &st);
+		}
+		case STATS_GETATTR: {
+			struct stat st;
+			return a1fs_lib_ops.getattr(fs, path, &st);
+		}
+		case STATS_READDIR: {
+			uint64_t entries = 0;
+			return a1fs_lib_ops.readdir(fs, path, &entries, count_entry, r->offset, &no_fi);
+		}
+		case STATS_MKDIR:
+			return a1fs_lib_ops.mkdir(fs, path, r->mode);
+		case STATS_RMDIR:
+			return a1fs_lib_ops.rmdir(fs, path);
+		case STATS_CREATE:
+			return a1fs_lib_ops.create(fs, path, r->mode, &no_fi);
+		case STATS_UNLINK:
+			return a1fs_lib_ops.unlink(fs, path);
+		case STATS_RENAME:
+			return a1fs_lib_ops.rename(fs, path, op->to ? op->to : "");
+		case STATS_UTIMENS: {
+			struct timespec tv[2];
+			clock_gettime(CLOCK_REALTIME, &tv[0]);
+			tv[1] = tv[0];
+			return a1fs_lib_ops.utimens(fs, path, tv);
+		}
+		case STATS_TRUNCATE:
+			return a1fs_lib_ops.truncate(fs, path, r->offset);
+		case STATS_READ:
+			return a1fs_lib_ops.read(fs, path, sink, r->size, r->offset, &no_fi);
+		case STATS_WRITE:
+			return a1fs_lib_ops.write(fs, path, payload, r->size, r->offset, &no_fi);
+		case STATS_IOCTL: {
+			// The only command takes an a1fs_defrag_args, whose inputs are
+			// in the record
+			a1fs_defrag_args args = {.flags = r->offset, .max_blocks = r->size};
+			return a1fs_lib_ops.ioctl(fs, path, (int)r->mode, NULL, &no_fi, 0, &args);
+		}
+		case STATS_FALLOCATE:
+			return a1fs_lib_ops.fallocate(fs, path, (int)r->mode, r->offset, r->size, &no_fi);
+		default:
+			return -ENOSYS;
+	}
+}
+
+/** -errno of a failed system call that returned ret; ret otherwise. */
+static int result(long ret)
+{
+	return ret < 0 ? -errno : (int)ret;
+}
+
+/** Open path, run a read, write, ioctl or fallocate on it and close it. */
+static int run_on_file(const trace_record *r, const char *path)
+{
+	int fd = open(path, r->op == STATS_READ ? O_RDONLY : O_WRONLY);
+	if (fd < 0) return -errno;
+	int ret;
+	switch (r->op) {
+		case STATS_READ:
+			ret = result(pread(fd, sink, r->size, r->offset));
+			break;
+		case STATS_WRITE:
+			ret = result(pwrite(fd, payload, r->size, r->offset));
+			break;
+		case STATS_IOCTL: {
+			a1fs_defrag_args args = {.flags = r->offset, .max_blocks = r->size};
+			ret = result(ioctl(fd, r->mode, &args));
+			break;
+		}
+		default:
+			// fallocate() needs _GNU_SOURCE, which clashes with readahead.h
+			ret = result(syscall(SYS_fallocate, fd, (int)r->mode, (off_t)r->offset,
+			                     (off_t)r->size));
+			break;
+	}
+	close(fd);
+	return ret;
+}
+
+/** Run an operation with system calls on the file system mounted at mount. */
+static int run_mounted(const replay_op *op, const char *mount)
+{
+	const trace_record *r = &op->r;
+	// The paths in the trace start with a '/'
+	char path[PATH_MAX * 2], to[PATH_MAX * 2];
+	snprintf(path, sizeof(path), "%s%s", mount, op->path);
+	switch (r->op) {
+		case STATS_STATFS: {
+			struct statvfs st;
+			return result(statvfs(path, &st));
+		}
+		case STATS_GETATTR: {
+			struct stat st;
+			return result(lstat(path, &st));
+		}
+		case STATS_READDIR: {
+			DIR *dir = opendir(path);
+			if (!dir) return -errno;
+			errno = 0;
+			while (readdir(dir) != NULL) {}
+			int ret = -errno;
+			closedir(dir);
+			return ret;
+		}
+		case STATS_MKDIR:
+			return result(mkdir(path, r->mode));
+		case STATS_RMDIR:
+			return result(rmdir(path));
+		case STATS_CREATE: {
+			int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, r->mode);
+			if (fd < 0) return -errno;
+			close(fd);
+			return 0;
+		}
+		case STATS_UNLINK:
+			return result(unlink(path));
+		case STATS_RENAME:
+			snprintf(to, sizeof(to), "%s%s", mount, op->to ? op->to : "");
+			return result(rename(path, to));
+		case STATS_UTIMENS:
+			return result(utimensat(AT_FDCWD, path, NULL, AT_SYMLINK_NOFOLLOW));
+		case STATS_TRUNCATE:
+			return result(truncate(path, r->offset));
+		case STATS_READ:
+		case STATS_WRITE:
+		case STATS_IOCTL:
+		case STATS_FALLOCATE:
+			return run_on_file(r, path);
+		default:
+			return -ENOSYS;
+	}
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/** Sleep until the monotonic clock reaches ns. */
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {ns / 1000000000ul, ns % 1000000000ul};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+
+/* Reporting */
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+/** Latency at quantile q (out of 1000) of the sorted latencies. */
+static uint64_t percentile(const uint64_t *lat, uint64_t n, uint64_t q)
+{
+	uint64_t i = n * q / 1000;
+	return lat[i < n ? i : n - 1];
+}
+
+/** Sort the n latencies and print their percentiles as a JSON object. */
+static void print_latency(const char *name, uint64_t *lat, uint64_t n, bool last)
+{
+	qsort(lat, n, sizeof(*lat), compare_u64);
+	printf("\t\t\t\"%s\": {\"p50\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}%s\n",
+	       name, (unsigned long)percentile(lat, n, 500), (unsigned long)percentile(lat, n, 990),
+	       (unsigned long)percentile(lat, n, 999), (unsigned long)lat[n - 1], last ? "" : ",");
+}
+
+/** Print the statistics of each operation that occurs in the trace. */
+static void print_ops(const replay_op *ops, const replay_result *res, size_t n, uint64_t *lat)
+{
+	bool first = true;
+	for (int o = 0; o < STATS_OPS; o++) {
+		uint64_t count = 0, errors = 0, diverged = 0;
+		for (size_t i = 0; i < n; i++) {
+			if (ops[i].r.op != o) continue;
+			lat[count++] = res[i].latency;
+			if (res[i].ret < 0) errors++;
+			if (res[i].ret != ops[i].r.ret) diverged++;
+		}
+		if (count == 0) continue;
+
+		printf("%s\t\t{\n", first ? "" : ",\n");
+		first = false;
+		printf("\t\t\t\"name\": \"%s\",\n", stats_op_name(o));
+		printf("\t\t\t\"count\": %lu,\n", (unsigned long)count);
+		printf("\t\t\t\"errors\": %lu,\n", (unsigned long)errors);
+		printf("\t\t\t\"diverged\": %lu,\n", (unsigned long)diverged);
+		print_latency("latency_ns", lat, count, false);
+		count = 0;
+		for (size_t i = 0; i < n; i++) {
+			if (ops[i].r.op == o) lat[count++] = ops[i].r.latency;
+		}
+		print_latency("recorded_latency_ns", lat, count, true);
+		printf("\t\t}");
+	}
+	printf("\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	replay_opts opts = {0};
+	if (!parse_args(argc, argv, &opts)) {
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help) {
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	size_t n;
+	replay_op *ops = load_trace(opts.trace, &n);
+	if (!ops) return 1;
+
+	// Buffers for the largest read or write in the trace
+	size_t io_max = 1;
+	for (size_t i = 0; i < n; i++) {
+		if ((ops[i].r.op == STATS_READ || ops[i].r.op == STATS_WRITE) && ops[i].r.size > io_max) {
+			io_max = ops[i].r.size;
+		}
+	}
+	payload = malloc(io_max);
+	sink = malloc(io_max);
+	replay_result *res = calloc(n ? n : 1, sizeof(*res));
+	uint64_t *lat = calloc(n ? n : 1, sizeof(*lat));
+	int ret = 1;
+	if (!payload || !sink || !res || !lat) {
+		fprintf(stderr, "Out of memory\n");
+		goto end;
+	}
+	for (size_t i = 0; i < io_max; i++) payload[i] = 'a' + i % 26;
+
+	static fs_ctx fs;
+	static a1fs_opts fs_opts;
+	if (!opts.mount) {
+		fs_opts.img_path = opts.images[0];
+		for (int i = 0; i < opts.n_images; i++) fs_opts.img_paths[i] = opts.images[i];
+		fs_opts.n_images = opts.n_images;
+		fs_opts.cache_size = opts.cache_size;
+		fs_opts.direct = opts.direct;
+		if (opts.n_images > 1 && fs_opts.cache_size == 0) fs_opts.cache_size = BCACHE_CAP_DEFAULT;
+		if (!a1fs_init(&fs, &fs_opts)) {
+			fprintf(stderr, "Failed to mount the file system\n");
+			goto end;
+		}
+		a1fs_start(&fs);
+	}
+
+	uint64_t bytes_read = 0, bytes_written = 0, errors = 0, diverged = 0;
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < n; i++) {
+		const replay_op *op = &ops[i];
+		if (opts.original_speed) sleep_until(start + op->r.time);
+		uint64_t t = now_ns();
+		int r = opts.mount ? run_mounted(op, opts.mount) : run_in_process(&fs, op);
+		res[i].latency = now_ns() - t;
+		res[i].ret = r;
+
+		if (r < 0) errors++;
+		if (r != op->r.ret) diverged++;
+		if (r > 0 && op->r.op == STATS_READ) bytes_read += r;
+		if (r > 0 && op->r.op == STATS_WRITE) bytes_written += r;
+	}
+	double seconds = (now_ns() - start) * 1e-9;
+	if (!opts.mount) a1fs_destroy(&fs);
+
+	double span = n ? ops[n - 1].r.time * 1e-9 : 0;
+	printf("{\n");
+	printf("\t\"trace\": {\"records\": %zu, \"seconds\": %.6f},\n", n, span);
+	printf("\t\"replay\": {\n");
+	printf("\t\t\"mode\": \"%s\",\n", opts.mount ? "mount" : "in-process");
+	printf("\t\t\"speed\": \"%s\",\n", opts.original_speed ? "original" : "max");
+	printf("\t\t\"seconds\": %.6f,\n", seconds);
+	printf("\t\t\"ops_per_sec\": %.1f,\n", seconds > 0 ? n / seconds : 0);
+	printf("\t\t\"bytes_read\": %lu,\n", (unsigned long)bytes_read);
+	printf("\t\t\"bytes_written\": %lu,\n", (unsigned long)bytes_written);
+	printf("\t\t\"errors\": %lu,\n", (unsigned long)errors);
+	printf("\t\t\"diverged\": %lu\n", (unsigned long)diverged);
+	printf("\t},\n");
+	printf("\t\"ops\": [\n");
+	print_ops(ops, res, n, lat);
+	printf("\t]\n}\n");
+	ret = 0;
+
+end:
+	free(lat);
+	free(res);
+	free(sink);
+	free(payload);
+	free(ops);
+	return ret;
+}
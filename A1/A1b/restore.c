@@ -0,0 +1,154 @@
+/**
+ * CSC369 Assignment 1 - a1fs-restore: recreate an a1fs image from a dump.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dump.h"
+
+
+static const char *help_str = "\
+Usage: %s [options] input image\n\
+\n\
+Recreate an a1fs image from a dump made by a1fs-dump (input \"-\" reads\n\
+stdin). Blocks that were not dumped are left as holes in the image file.\n\
+\n\
+Options:\n\
+    -h      print help and exit\n\
+    -s      sync image file contents to disk\n\
+";
+
+/** Read exactly len bytes from the (possibly non-seekable) dump stream. */
+static bool read_full(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			if (n == 0) fprintf(stderr, "Unexpected end of dump\n");
+			else perror("read dump");
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t n = pwrite(fd, p, len, off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			perror("write image");
+			return false;
+		}
+		p += n;
+		off += n;
+		len -= n;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	bool sync = false;
+	int o;
+	while ((o = getopt(argc, argv, "hs")) != -1) {
+		switch (o) {
+			case 's': sync = true; break;
+			case 'h': printf(help_str, argv[0]); return 0;
+			default : fprintf(stderr, help_str, argv[0]); return 1;
+		}
+	}
+	if (argc - optind != 2) {
+		fprintf(stderr, help_str, argv[0]);
+		return 1;
+	}
+
+	int in = strcmp(argv[optind], "-") == 0 ? STDIN_FILENO :
+	         open(argv[optind], O_RDONLY);
+	if (in < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	int out = open(argv[optind + 1], O_WRONLY | O_CREAT, 0644);
+	if (out < 0) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	int ret = 1;
+	char *buf = malloc(A1FS_DUMP_BUF_SIZE);
+	if (!buf) {
+		fprintf(stderr, "Out of memory\n");
+		goto end;
+	}
+
+	a1fs_dump_header header;
+	if (!read_full(in, &header, sizeof(header))) goto end;
+	if (header.magic != A1FS_DUMP_MAGIC || header.version != A1FS_DUMP_VERSION ||
+	    header.block_size < A1FS_BLOCK_SIZE || header.block_size > A1FS_BLOCK_SIZE_MAX ||
+	    (header.block_size & (header.block_size - 1)) != 0) {
+		fprintf(stderr, "%s is not a supported a1fs dump\n", argv[optind]);
+		goto end;
+	}
+
+	// Start from an all-hole file of the right size
+	struct stat st;
+	if (fstat(out, &st) < 0) {
+		perror("fstat");
+		goto end;
+	}
+	if (S_ISREG(st.st_mode) &&
+	    (ftruncate(out, 0) < 0 || ftruncate(out, header.image_size) < 0)) {
+		perror("ftruncate");
+		goto end;
+	}
+
+	for (;;) {
+		a1fs_dump_run run;
+		if (!read_full(in, &run, sizeof(run))) goto end;
+		if (run.count == 0) break;
+		if ((run.start + run.count) * header.block_size > header.image_size) {
+			fprintf(stderr, "Corrupt dump: run past the end of the image\n");
+			goto end;
+		}
+
+		off_t off = run.start * header.block_size;
+		uint64_t left = run.count * header.block_size;
+		while (left > 0) {
+			size_t len = left < A1FS_DUMP_BUF_SIZE ? left : A1FS_DUMP_BUF_SIZE;
+			if (!read_full(in, buf, len) || !write_full(out, buf, len, off)) {
+				goto end;
+			}
+			off += len;
+			left -= len;
+		}
+	}
+
+	if (sync && fsync(out) < 0) {
+		perror("fsync");
+		goto end;
+	}
+	ret = 0;
+
+end:
+	free(buf);
+	if (in != STDIN_FILENO) close(in);
+	if (close(out) < 0) {
+		perror("close");
+		ret = 1;
+	}
+	return ret;
+}
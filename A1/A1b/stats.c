@@ -0,0 +1,245 @@
+/**
+ * CSC369 Assignment 1 - operation statistics implementation.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+
+__thread stats_thread *stats_self;
+
+/** Shared by the threads whose record can't be allocated; their updates may
+ * be lost, but nothing worse. */
+static stats_thread spare;
+/** Records of all the threads that recorded anything. They are never freed:
+ * a thread that exits leaves its numbers in the totals. */
+static stats_thread *threads = &spare;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Tells when a thread exits; see thread_exit(). */
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+
+static const char *op_names[STATS_OPS] = {
+	[STATS_STATFS]    = "statfs",
+	[STATS_GETATTR]   = "getattr",
+	[STATS_READDIR]   = "readdir",
+	[STATS_MKDIR]     = "mkdir",
+	[STATS_RMDIR]     = "rmdir",
+	[STATS_CREATE]    = "create",
+	[STATS_UNLINK]    = "unlink",
+	[STATS_RENAME]    = "rename",
+	[STATS_UTIMENS]   = "utimens",
+	[STATS_TRUNCATE]  = "truncate",
+	[STATS_READ]      = "read",
+	[STATS_WRITE]     = "write",
+	[STATS_IOCTL]     = "ioctl",
+	[STATS_FALLOCATE] = "fallocate",
+};
+
+static const char *counter_names[STATS_COUNTERS] = {
+	[STATS_BYTES_READ]       = "bytes_read",
+	[STATS_BYTES_WRITTEN]    = "bytes_written",
+	[STATS_LOOKUPS]          = "lookups",
+	[STATS_VERIFY_HITS]      = "verify_cache_hits",
+	[STATS_VERIFY_MISSES]    = "verify_cache_misses",
+	[STATS_BLOCKS_ALLOCATED] = "blocks_allocated",
+	[STATS_BLOCKS_FREED]     = "blocks_freed",
+	[STATS_BITS_SCANNED]     = "bitmap_bits_scanned",
+};
+
+
+const char *stats_op_name(stats_op op)
+{
+	return op < STATS_OPS ? op_names[op] : "unknown";
+}
+
+
+// FUSE starts and stops worker threads as the load changes; a new thread takes
+// over the record of one that exited rather than adding another
+static void thread_exit(void *arg)
+{
+	stats_thread *t = (stats_thread*)arg;
+	pthread_mutex_lock(&threads_lock);
+	t->unused = true;
+	pthread_mutex_unlock(&threads_lock);
+}
+
+static void make_exit_key(void)
+{
+	pthread_key_create(&exit_key, thread_exit);
+}
+
+stats_thread *stats_register(void)
+{
+	pthread_once(&exit_key_once, make_exit_key);
+	pthread_mutex_lock(&threads_lock);
+	stats_thread *t = threads;
+	while (t && !t->unused) t = t->next;
+	if (t) {
+		t->unused = false;
+	} else if ((t = calloc(1, sizeof(*t))) != NULL) {
+		t->next = threads;
+		threads = t;
+	}
+	pthread_mutex_unlock(&threads_lock);
+
+	if (!t) return &spare;
+	pthread_setspecific(exit_key, t);
+	stats_self = t;
+	return t;
+}
+
+
+static uint64_t load(const uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+/** Add the records of all the threads up into sum. */
+static void collect(stats_thread *sum)
+{
+	memset(sum, 0, sizeof(*sum));
+	pthread_mutex_lock(&threads_lock);
+	for (stats_thread *t = threads; t; t = t->next) {
+		for (int op = 0; op < STATS_OPS; op++) {
+			for (int b = 0; b < STATS_BUCKETS; b++) sum->hist[op][b] += load(&t->hist[op][b]);
+			sum->total_ns[op] += load(&t->total_ns[op]);
+			sum->errors[op] += load(&t->errors[op]);
+		}
+		for (int c = 0; c < STATS_COUNTERS; c++) sum->counters[c] += load(&t->counters[c]);
+	}
+	pthread_mutex_unlock(&threads_lock);
+}
+
+/** Largest latency that falls into bucket b. */
+static uint64_t bucket_max(unsigned b)
+{
+	if (b < STATS_SUB) return b;
+	unsigned log = b / STATS_SUB + STATS_SUB_BITS - 1;
+	uint64_t low = (uint64_t)(STATS_SUB + b % STATS_SUB) << (log - STATS_SUB_BITS);
+	return low + (1ul << (log - STATS_SUB_BITS)) - 1;
+}
+
+/** Latency that q (out of 1000) of the count operations in hist don't exceed. */
+static uint64_t percentile(const uint64_t *hist, uint64_t count, uint64_t q)
+{
+	// Rank of the operation, counting from 1
+	uint64_t rank = (count * q + 999) / 1000;
+	if (rank == 0) rank = 1;
+	uint64_t seen = 0;
+	for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen >= rank) return bucket_max(b);
+	}
+	return bucket_max(STATS_BUCKETS - 1);
+}
+
+/** snprintf() at buf + *len, keeping *len within size - 1. */
+static void append(char *buf, size_t size, size_t *len, const char *fmt, ...)
+{
+	if (*len + 1 >= size) return;
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(buf + *len, size - *len, fmt, args);
+	va_end(args);
+	if (n > 0) *len += (size_t)n < size - *len ? (size_t)n : size - *len - 1;
+}
+
+size_t stats_format(char *buf, size_t size, const char *prefix)
+{
+	size_t len = 0;
+	if (size == 0) return 0;
+	buf[0] = '\0';
+	stats_thread *sum = malloc(sizeof(*sum));
+	if (!sum) return 0;
+	collect(sum);
+
+	append(buf, size, &len, "%s%-10s %14s %10s %12s %12s %12s %12s %12s %12s\n", prefix,
+	       "op", "calls", "errors", "mean_ns", "p50_ns", "p90_ns", "p99_ns", "p999_ns", "max_ns");
+	for (int op = 0; op < STATS_OPS; op++) {
+		const uint64_t *hist = sum->hist[op];
+		uint64_t count = 0, max = 0;
+		for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+			count += hist[b];
+			if (hist[b]) max = bucket_max(b);
+		}
+		append(buf, size, &len, "%s%-10s %14lu %10lu %12lu %12lu %12lu %12lu %12lu %12lu\n",
+		       prefix, op_names[op], (unsigned long)count, (unsigned long)sum->errors[op],
+		       (unsigned long)(count ? sum->total_ns[op] / count : 0),
+		       (unsigned long)(count ? percentile(hist, count, 500) : 0),
+		       (unsigned long)(count ? percentile(hist, count, 900) : 0),
+		       (unsigned long)(count ? percentile(hist, count, 990) : 0),
+		       (unsigned long)(count ? percentile(hist, count, 999) : 0),
+		       (unsigned long)max);
+	}
+	for (int c = 0; c < STATS_COUNTERS; c++) {
+		append(buf, size, &len, "%s%-20s %20lu\n", prefix, counter_names[c],
+		       (unsigned long)sum->counters[c]);
+	}
+	free(sum);
+	return len;
+}
+
+void stats_report(FILE *out)
+{
+	char buf[STATS_TEXT_MAX];
+	stats_format(buf, sizeof(buf), "stats: ");
+	fputs(buf, out);
+	fflush(out);
+}
+
+
+static void *dump_thread(void *arg)
+{
+	stats_dump *d = (stats_dump*)arg;
+	pthread_mutex_lock(&d->lock);
+	while (!d->stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += d->interval;
+		int ret = 0;
+		while (!d->stop && ret != ETIMEDOUT) {
+			ret = pthread_cond_timedwait(&d->wake, &d->lock, &deadline);
+		}
+		if (d->stop) break;
+
+		pthread_mutex_unlock(&d->lock);
+		stats_report(d->out);
+		pthread_mutex_lock(&d->lock);
+	}
+	pthread_mutex_unlock(&d->lock);
+	return NULL;
+}
+
+bool stats_dump_start(stats_dump *d, unsigned interval, FILE *out)
+{
+	memset(d, 0, sizeof(*d));
+	d->interval = interval;
+	d->out = out;
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->wake, NULL);
+	if (pthread_create(&d->thread, NULL, dump_thread, d) != 0) {
+		pthread_cond_destroy(&d->wake);
+		pthread_mutex_destroy(&d->lock);
+		return false;
+	}
+	d->started = true;
+	return true;
+}
+
+void stats_dump_stop(stats_dump *d)
+{
+	if (!d->started) return;
+	pthread_mutex_lock(&d->lock);
+	d->stop = true;
+	pthread_cond_signal(&d->wake);
+	pthread_mutex_unlock(&d->lock);
+	pthread_join(d->thread, NULL);
+	pthread_cond_destroy(&d->wake);
+	pthread_mutex_destroy(&d->lock);
+	d->started = false;
+}
@@ -0,0 +1,201 @@
+/**
+ * CSC369 Assignment 1 - operation statistics header file.
+ *
+ * Every file system operation is timed into a latency histogram, and the code
+ * underneath counts the work it does (bytes moved, blocks allocated, bitmap
+ * bits scanned etc.). All of it goes to per-thread records, with no locks or
+ * atomic read-modify-writes on the way, so that an operation pays two clock
+ * reads and a few increments. Readers (the /.a1fs-stats file, the --verbose
+ * reports) add the records of all the threads up.
+ *
+ * The histograms are log-linear, like HdrHistogram: each power of two is split
+ * into STATS_SUB buckets, so a recorded latency is off by less than 1/STATS_SUB
+ * of its value, whatever its magnitude.
+ *
+ * The statistics belong to the process rather than to a mount; a process
+ * mounts at most one file system.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+
+/** Path of the read-only file the statistics can be read from. */
+#define STATS_FILE "/.a1fs-stats"
+
+/** Default period of the --verbose statistics dump, in seconds. */
+#define STATS_INTERVAL_DEFAULT 10
+
+/** Buckets per power of two in the latency histograms (log2). */
+#define STATS_SUB_BITS 4
+#define STATS_SUB (1 << STATS_SUB_BITS)
+/** Latencies are recorded up to 2^STATS_MAX_LOG ns (about 18 minutes). */
+#define STATS_MAX_LOG 40
+/** Number of histogram buckets: values below STATS_SUB get one each. */
+#define STATS_BUCKETS ((STATS_MAX_LOG - STATS_SUB_BITS + 1) * STATS_SUB)
+
+/** Largest size of the text statistics; see stats_format(). */
+#define STATS_TEXT_MAX 8192
+
+/** Timed file system operations. */
+typedef enum stats_op {
+	STATS_STATFS,
+	STATS_GETATTR,
+	STATS_READDIR,
+	STATS_MKDIR,
+	STATS_RMDIR,
+	STATS_CREATE,
+	STATS_UNLINK,
+	STATS_RENAME,
+	STATS_UTIMENS,
+	STATS_TRUNCATE,
+	STATS_READ,
+	STATS_WRITE,
+	STATS_IOCTL,
+	STATS_FALLOCATE,
+	STATS_OPS
+
+} stats_op;
+
+/** Event counters. */
+typedef enum stats_counter {
+	/** Bytes returned by read(). */
+	STATS_BYTES_READ,
+	/** Bytes stored by write(). */
+	STATS_BYTES_WRITTEN,
+	/** Path components looked up in directories. */
+	STATS_LOOKUPS,
+	/** Inode and block checksum verifications skipped as already done since
+	 * mount (the cache in front of every lookup step). */
+	STATS_VERIFY_HITS,
+	/** ... and done. */
+	STATS_VERIFY_MISSES,
+	/** Data block bits set in the bitmap. */
+	STATS_BLOCKS_ALLOCATED,
+	/** Data block bits cleared in the bitmap. */
+	STATS_BLOCKS_FREED,
+	/** Bitmap bits examined while searching for free inodes and blocks. */
+	STATS_BITS_SCANNED,
+	STATS_COUNTERS
+
+} stats_counter;
+
+/** Statistics recorded by one thread. */
+typedef struct stats_thread {
+	/** Latency histograms, in nanoseconds. */
+	uint64_t hist[STATS_OPS][STATS_BUCKETS];
+	/** Total latency of each operation, in nanoseconds. */
+	uint64_t total_ns[STATS_OPS];
+	/** Operations that returned an error. */
+	uint64_t errors[STATS_OPS];
+	uint64_t counters[STATS_COUNTERS];
+
+	/** All records, linked from the newest. */
+	struct stats_thread *next;
+	/** The thread exited; the record is taken over by the next new thread. */
+	bool unused;
+
+} stats_thread;
+
+
+/** The calling thread's record; NULL until it records something. */
+extern __thread stats_thread *stats_self;
+
+/** Allocate (or take over) a record for the calling thread. */
+stats_thread *stats_register(void);
+
+/** The calling thread's record. */
+static inline stats_thread *stats_local(void)
+{
+	stats_thread *t = stats_self;
+	return t ? t : stats_register();
+}
+
+/** Add to a statistic of the calling thread. Only the owner thread writes it,
+ * so a plain increment will do; the store is atomic for the readers' sake. */
+static inline void stats_inc(uint64_t *p, uint64_t n)
+{
+	__atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+/** Count n events. */
+static inline void stats_add(stats_counter c, uint64_t n)
+{
+	stats_inc(&stats_local()->counters[c], n);
+}
+
+/** Current time for timing an operation, in nanoseconds. */
+static inline uint64_t stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/** Histogram bucket of a latency. */
+static inline unsigned stats_bucket(uint64_t ns)
+{
+	if (ns < STATS_SUB) return ns;
+	unsigned log = 63 - __builtin_clzll(ns);
+	if (log >= STATS_MAX_LOG) return STATS_BUCKETS - 1;
+	return (log - STATS_SUB_BITS + 1) * STATS_SUB +
+	       ((ns >> (log - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+/**
+ * Record an operation that started at start (stats_now()) and returned ret.
+ *
+ * @return  how long the operation took, in nanoseconds.
+ */
+static inline uint64_t stats_op_done(stats_op op, uint64_t start, int ret)
+{
+	uint64_t ns = stats_now() - start;
+	stats_thread *t = stats_local();
+	stats_inc(&t->hist[op][stats_bucket(ns)], 1);
+	stats_inc(&t->total_ns[op], ns);
+	if (ret < 0) stats_inc(&t->errors[op], 1);
+	return ns;
+}
+
+/** Name of an operation, as in the statistics ("getattr" etc.). */
+const char *stats_op_name(stats_op op);
+
+/**
+ * Format the statistics of all the threads as text, one operation or counter
+ * per line, each line starting with prefix. The fields are fixed width, so
+ * the length of the text doesn't change as the numbers grow (the size that
+ * stat() reports for STATS_FILE holds when it is read).
+ *
+ * @return  length of the text (at most size - 1; the text is truncated).
+ */
+size_t stats_format(char *buf, size_t size, const char *prefix);
+
+/** Print the statistics, with "stats: " in front of each line. */
+void stats_report(FILE *out);
+
+/** Periodic printing of the statistics. */
+typedef struct stats_dump {
+	pthread_mutex_t lock;
+	/** Signalled to stop the thread. */
+	pthread_cond_t wake;
+	bool stop;
+	bool started;
+	pthread_t thread;
+	/** Period in seconds. */
+	unsigned interval;
+	FILE *out;
+
+} stats_dump;
+
+/** Start printing the statistics to out every interval seconds. Returns false
+ * if the thread can't be started. */
+bool stats_dump_start(stats_dump *d, unsigned interval, FILE *out);
+
+/** Stop the periodic printing, if it was started. */
+void stats_dump_stop(stats_dump *d);
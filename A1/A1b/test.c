@@ -0,0 +1,554 @@
+/**
+ * CSC369 Assignment 1 - a1fs-test: regression tests for the file system.
+ *
+ * Like a1fs-bench, formats a temporary image for each test, mounts it with
+ * a1fs_init() and a1fs_start() and calls the operations in a1fs_lib_ops directly.
+ * Each test is a sequence of operations with the results they must give;
+ * tests that damage the image on purpose do so through the mapping, between
+ * two mounts.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+
+#include "a1fs.h"
+#include "defrag.h"
+#include "format.h"
+#include "fs_ctx.h"
+#include "map.h"
+#include "ops.h"
+#include "options.h"
+#include "util.h"
+
+
+/** Size of the test images. */
+#define TEST_IMAGE_SIZE (16ul * 1024 * 1024)
+
+
+/** State of the test being run. */
+typedef struct test_ctx {
+	/** Temporary image path. */
+	char image[4096];
+	/** Mounted file system; only valid while mounted is set. */
+	fs_ctx fs;
+	a1fs_opts fs_opts;
+	bool mounted;
+	/** Formatting parameters. */
+	format_opts format;
+	/** Access the image through the block cache (--cache). */
+	bool cache;
+	/** The check that failed, for the report. */
+	const char *failed;
+	int line;
+
+} test_ctx;
+
+/** A test: returns false (with t->failed set) if a check fails. */
+typedef struct test_case {
+	const char *name;
+	bool (*run)(test_ctx *t);
+	/** Format the image with 48-bit extents (A1FS_FEATURE_64BIT). */
+	bool use_64bit;
+	/** Mount with the block cache. */
+	bool cache;
+
+} test_case;
+
+
+/** Fail the test unless cond holds. */
+#define CHECK(t, cond)                  \
+	do {                                \
+		if (!(cond)) {                  \
+			(t)->failed = #cond;        \
+			(t)->line = __LINE__;       \
+			return false;               \
+		}                               \
+	} while (0)
+
+
+static struct fuse_file_info no_fi;
+
+/** Byte i of the data the tests write. */
+static char pattern(uint64_t i)
+{
+	return 'a' + i % 26;
+}
+
+static int create_file(test_ctx *t, const char *path)
+{
+	return a1fs_lib_ops.create(&t->fs, path, S_IFREG | 0644, &no_fi);
+}
+
+/** Write size pattern bytes at offset. */
+static int write_pattern(test_ctx *t, const char *path, uint64_t offset, size_t size)
+{
+	char *buf = malloc(size);
+	if (!buf) return -ENOMEM;
+	for (size_t i = 0; i < size; i++) buf[i] = pattern(offset + i);
+	int ret = a1fs_lib_ops.write(&t->fs, path, buf, size, offset, &no_fi);
+	free(buf);
+	return ret;
+}
+
+/** Whether [offset, offset + size) of a file reads back as zeros. */
+static bool read_zeros(test_ctx *t, const char *path, uint64_t offset, size_t size)
+{
+	char *buf = malloc(size);
+	if (!buf) return false;
+	bool ok = a1fs_lib_ops.read(&t->fs, path, buf, size, offset, &no_fi) == (int)size;
+	for (size_t i = 0; ok && i < size; i++) ok = buf[i] == 0;
+	free(buf);
+	return ok;
+}
+
+/** Whether [offset, offset + size) of a file reads back as the pattern. */
+static bool read_pattern(test_ctx *t, const char *path, uint64_t offset, size_t size)
+{
+	char *buf = malloc(size);
+	if (!buf) return false;
+	bool ok = a1fs_lib_ops.read(&t->fs, path, buf, size, offset, &no_fi) == (int)size;
+	for (size_t i = 0; ok && i < size; i++) ok = buf[i] == pattern(offset + i);
+	free(buf);
+	return ok;
+}
+
+/** Defragment a file max_blocks at a time, as a1fs-defrag does; returns the
+ * result of the first ioctl that fails, and the last arguments in *args. */
+static int defrag_file(test_ctx *t, const char *path, uint32_t max_blocks, a1fs_defrag_args *args)
+{
+	do {
+		*args = (a1fs_defrag_args){.max_blocks = max_blocks};
+		int ret = a1fs_lib_ops.ioctl(&t->fs, path, A1FS_IOC_DEFRAG, NULL, &no_fi, 0, args);
+		if (ret != 0) return ret;
+	} while (args->blocks_moved != 0 && args->blocks_placed < args->blocks_total);
+	return 0;
+}
+
+/** The inode of a file, to look at how its blocks are laid out. */
+static a1fs_inode *file_inode(test_ctx *t, const char *path)
+{
+	a1fs_inode *inode;
+	return find_inode_path(path, t->fs.image, &inode) == 0 ? inode : NULL;
+}
+
+
+/* Mounting */
+
+/** Mount the image as it is. */
+static bool mount_image(test_ctx *t)
+{
+	memset(&t->fs, 0, sizeof(t->fs));
+	memset(&t->fs_opts, 0, sizeof(t->fs_opts));
+	t->fs_opts.img_path = t->image;
+	t->fs_opts.img_paths[0] = t->image;
+	t->fs_opts.n_images = 1;
+	t->fs_opts.cache_size = t->cache ? BCACHE_CAP_MIN : 0;
+	if (!a1fs_init(&t->fs, &t->fs_opts)) {
+		fprintf(stderr, "Failed to mount the file system\n");
+		return false;
+	}
+	a1fs_start(&t->fs);
+	t->mounted = true;
+	return true;
+}
+
+/** Unmount the image if it is mounted, so that a test that fails halfway
+ * through a remount doesn't destroy the context twice. */
+static void unmount(test_ctx *t)
+{
+	if (t->mounted) {
+		a1fs_destroy(&t->fs);
+		t->mounted = false;
+	}
+}
+
+/** Format the image afresh and mount it. */
+static bool mount_fresh(test_ctx *t)
+{
+	if (truncate(t->image, 0) < 0 || truncate(t->image, TEST_IMAGE_SIZE) < 0) {
+		perror(t->image);
+		return false;
+	}
+	size_t size;
+	void *image = map_file(t->image, A1FS_BLOCK_SIZE, &size);
+	if (!image) return false;
+	format_opts format = t->format;
+	format.block_size = A1FS_BLOCK_SIZE;
+	format.zero = true;
+	bool ok = format_image(image, size, &format);
+	munmap(image, size);
+	if (!ok) {
+		fprintf(stderr, "Failed to format the image\n");
+		return false;
+	}
+	return mount_image(t);
+}
+
+/** Unmount and mount again, e.g. to forget what was verified. */
+static bool remount(test_ctx *t)
+{
+	unmount(t);
+	return mount_image(t);
+}
+
+/** Unmount, flip a bit in the first extent of a file's extent record (behind
+ * its checksum) and mount again. */
+static bool damage_extents(test_ctx *t, const char *path)
+{
+	unmount(t);
+	size_t size;
+	char *image = map_file(t->image, A1FS_BLOCK_SIZE, &size);
+	if (!image) return false;
+	a1fs_inode *inode;
+	bool ok = find_inode_attrs(path, image, &inode) == 0;
+	if (ok) inode_extents(image, inode)->i_block[0].start ^= 0x40;
+	munmap(image, size);
+	return ok && mount_image(t);
+}
+
+
+/* Tests */
+
+/** A packed tail must stay the last block when blocks are reserved before it
+ * (without changing the size). */
+static bool test_fallocate_tail(test_ctx *t)
+{
+	struct stat st;
+	CHECK(t, create_file(t, "/f") == 0);
+	CHECK(t, write_pattern(t, "/f", 0, 100) == 100);
+	CHECK(t, a1fs_lib_ops.fallocate(&t->fs, "/f", FALLOC_FL_KEEP_SIZE, 0, 50, &no_fi) == 0);
+	CHECK(t, read_pattern(t, "/f", 0, 100));
+	CHECK(t, a1fs_lib_ops.getattr(&t->fs, "/f", &st) == 0 && st.st_size == 100);
+
+	// Past the end of the file, with and without changing the size
+	CHECK(t, a1fs_lib_ops.fallocate(&t->fs, "/f", FALLOC_FL_KEEP_SIZE, 0, 3 * A1FS_BLOCK_SIZE, &no_fi) == 0);
+	CHECK(t, read_pattern(t, "/f", 0, 100));
+	CHECK(t, a1fs_lib_ops.fallocate(&t->fs, "/f", 0, 50, 100, &no_fi) == 0);
+	CHECK(t, a1fs_lib_ops.getattr(&t->fs, "/f", &st) == 0 && st.st_size == 150);
+	CHECK(t, read_pattern(t, "/f", 0, 100));
+	CHECK(t, remount(t));
+	CHECK(t, read_pattern(t, "/f", 0, 100));
+	return true;
+}
+
+/** A file whose extent record fails its checksum can still be stat'ed (that
+ * only reads the inode), but its data can't be reached. */
+static bool test_corrupt_extents(test_ctx *t)
+{
+	struct stat st;
+	char buf[100];
+	CHECK(t, create_file(t, "/f") == 0);
+	CHECK(t, write_pattern(t, "/f", 0, 3 * A1FS_BLOCK_SIZE) == 3 * A1FS_BLOCK_SIZE);
+	CHECK(t, create_file(t, "/h") == 0);
+	CHECK(t, write_pattern(t, "/h", 0, 3 * A1FS_BLOCK_SIZE) == 3 * A1FS_BLOCK_SIZE);
+	CHECK(t, damage_extents(t, "/f"));
+
+	CHECK(t, a1fs_lib_ops.getattr(&t->fs, "/f", &st) == 0 && st.st_size == 3 * A1FS_BLOCK_SIZE);
+	CHECK(t, a1fs_lib_ops.read(&t->fs, "/f", buf, sizeof(buf), 0, &no_fi) == -EIO);
+	// Nothing can change once corruption has been found
+	CHECK(t, a1fs_lib_ops.write(&t->fs, "/f", buf, sizeof(buf), 0, &no_fi) == -EROFS);
+	CHECK(t, a1fs_lib_ops.unlink(&t->fs, "/f") == -EROFS);
+	CHECK(t, create_file(t, "/g") == -EROFS);
+
+	// Nor when the first operation to reach the extents changes the file
+	CHECK(t, damage_extents(t, "/h"));
+	CHECK(t, a1fs_lib_ops.truncate(&t->fs, "/h", 0) == -EIO);
+	CHECK(t, a1fs_lib_ops.getattr(&t->fs, "/h", &st) == 0 && st.st_size == 3 * A1FS_BLOCK_SIZE);
+	return true;
+}
+
+/** Blocks reserved past the end of a file with FALLOC_FL_KEEP_SIZE stay
+ * unwritten when the file is defragmented, so that they don't count towards
+ * its size (fsck checks that written blocks end at the size). */
+static bool test_defrag_unwritten(test_ctx *t)
+{
+	a1fs_defrag_args args;
+	struct stat st;
+	char zeros[A1FS_BLOCK_SIZE] = {0}, buf[A1FS_BLOCK_SIZE];
+	CHECK(t, create_file(t, "/f") == 0);
+	CHECK(t, write_pattern(t, "/f", A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE) == A1FS_BLOCK_SIZE);
+	// Another file in between, so that the reserved blocks are a separate run
+	CHECK(t, create_file(t, "/g") == 0);
+	CHECK(t, write_pattern(t, "/g", 0, A1FS_BLOCK_SIZE) == A1FS_BLOCK_SIZE);
+	CHECK(t, a1fs_lib_ops.fallocate(&t->fs, "/f", FALLOC_FL_KEEP_SIZE, 17332, 19316, &no_fi) == 0);
+	a1fs_inode *inode = file_inode(t, "/f");
+	CHECK(t, inode && inode->i_blocks == 2 && inode->i_unwritten == 0x2);
+
+	CHECK(t, defrag_file(t, "/f", 2, &args) == 0);
+	CHECK(t, args.blocks_placed == args.blocks_total && args.blocks_total == 9);
+	inode = file_inode(t, "/f");
+	CHECK(t, inode && inode->i_blocks == 2 && inode->i_unwritten == 0x2);
+	CHECK(t, inode_extent(t->fs.image, inode, 0).count == 2);
+	CHECK(t, a1fs_lib_ops.getattr(&t->fs, "/f", &st) == 0 && st.st_size == 2 * A1FS_BLOCK_SIZE);
+	CHECK(t, a1fs_lib_ops.read(&t->fs, "/f", buf, sizeof(buf), 0, &no_fi) == sizeof(buf));
+	CHECK(t, memcmp(buf, zeros, sizeof(buf)) == 0);
+	CHECK(t, read_pattern(t, "/f", A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE));
+	CHECK(t, remount(t));
+	CHECK(t, read_pattern(t, "/f", A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE));
+	CHECK(t, read_pattern(t, "/g", 0, A1FS_BLOCK_SIZE));
+	return true;
+}
+
+/** Writing into the middle of a reserved extent splits it into unwritten,
+ * written and unwritten pieces, and a sequential write after that grows the
+ * written piece instead of splitting again. */
+static bool test_unwritten_split(test_ctx *t)
+{
+	const size_t bs = A1FS_BLOCK_SIZE;
+	CHECK(t, create_file(t, "/f") == 0);
+	CHECK(t, a1fs_lib_ops.fallocate(&t->fs, "/f", 0, 0, 8 * bs, &no_fi) == 0);
+	a1fs_inode *inode = file_inode(t, "/f");
+	CHECK(t, inode && inode->i_blocks == 1 && inode->i_unwritten == 0x1);
+	a1fs_blk_t start = inode_extent(t->fs.image, inode, 0).start;
+
+	CHECK(t, write_pattern(t, "/f", 3 * bs, bs) == (int)bs);
+	inode = file_inode(t, "/f");
+	CHECK(t, inode && inode->i_blocks == 3 && inode->i_unwritten == 0x5);
+	CHECK(t, inode_extent(t->fs.image, inode, 0).start == start);
+	CHECK(t, inode_extent(t->fs.image, inode, 0).count == 3);
+	CHECK(t, inode_extent(t->fs.image, inode, 1).start == start + 3);
+	CHECK(t, inode_extent(t->fs.image, inode, 1).count == 1);
+	CHECK(t, inode_extent(t->fs.image, inode, 2).count == 4);
+
+	CHECK(t, write_pattern(t, "/f", 4 * bs, bs) == (int)bs);
+	inode = file_inode(t, "/f");
+	CHECK(t, inode && inode->i_blocks == 3 && inode->i_unwritten == 0x5);
+	CHECK(t, inode_extent(t->fs.image, inode, 1).count == 2);
+	CHECK(t, inode_extent(t->fs.image, inode, 2).count == 3);
+
+	CHECK(t, remount(t));
+	CHECK(t, read_zeros(t, "/f", 0, 3 * bs));
+	CHECK(t, read_pattern(t, "/f", 3 * bs, 2 * bs));
+	CHECK(t, read_zeros(t, "/f", 5 * bs, 3 * bs));
+	return true;
+}
+
+/** A fragmented file is moved into one run a bounded chunk per ioctl: the
+ * first chunk goes to a free run that holds the whole file, and the rest
+ * follows it. A query moves nothing. */
+static bool test_defrag(test_ctx *t)
+{
+	const size_t bs = A1FS_BLOCK_SIZE;
+	a1fs_defrag_args args;
+	CHECK(t, create_file(t, "/a") == 0);
+	CHECK(t, create_file(t, "/b") == 0);
+	for (int i = 0; i < 6; i++) {
+		CHECK(t, write_pattern(t, "/a", i * 2 * bs, 2 * bs) == (int)(2 * bs));
+		CHECK(t, write_pattern(t, "/b", i * 2 * bs, 2 * bs) == (int)(2 * bs));
+	}
+	a1fs_inode *inode = file_inode(t, "/a");
+	CHECK(t, inode && inode->i_blocks == 6);
+
+	args = (a1fs_defrag_args){.flags = A1FS_DEFRAG_QUERY};
+	CHECK(t, a1fs_lib_ops.ioctl(&t->fs, "/a", A1FS_IOC_DEFRAG, NULL, &no_fi, 0, &args) == 0);
+	CHECK(t, args.extents_before == 6 && args.extents_after == 6 && args.blocks_moved == 0);
+	CHECK(t, args.blocks_placed == 2 && args.blocks_total == 12);
+
+	int calls = 0;
+	do {
+		args = (a1fs_defrag_args){.max_blocks = 5};
+		CHECK(t, a1fs_lib_ops.ioctl(&t->fs, "/a", A1FS_IOC_DEFRAG, NULL, &no_fi, 0, &args) == 0);
+		CHECK(t, args.blocks_moved > 0 && args.blocks_moved <= 5);
+		calls++;
+	} while (args.blocks_placed < args.blocks_total);
+	CHECK(t, calls == 3 && args.extents_after == 1);
+	inode = file_inode(t, "/a");
+	CHECK(t, inode && inode->i_blocks == 1 && inode->i_unwritten == 0);
+	CHECK(t, read_pattern(t, "/a", 0, 12 * bs));
+	CHECK(t, read_pattern(t, "/b", 0, 12 * bs));
+
+	// Nothing left to do
+	CHECK(t, defrag_file(t, "/a", 0, &args) == 0 && args.blocks_moved == 0);
+	CHECK(t, remount(t));
+	CHECK(t, read_pattern(t, "/a", 0, 12 * bs));
+	CHECK(t, read_pattern(t, "/b", 0, 12 * bs));
+	return true;
+}
+
+/** The partial last block of small files is packed into a shared tail block,
+ * and moved back out when the file grows past what the tail can hold in
+ * place. */
+static bool test_tail_pack(test_ctx *t)
+{
+	const size_t bs = A1FS_BLOCK_SIZE;
+	struct stat st;
+	CHECK(t, create_file(t, "/s") == 0);
+	CHECK(t, write_pattern(t, "/s", 0, 100) == 100);
+	CHECK(t, create_file(t, "/t") == 0);
+	CHECK(t, write_pattern(t, "/t", 0, bs + 200) == (int)(bs + 200));
+	a1fs_inode *s = file_inode(t, "/s"), *u = file_inode(t, "/t");
+	CHECK(t, s && s->i_blocks == 0 && s->tail.block != 0 && s->tail.length == 100);
+	CHECK(t, u && u->i_nblocks == 1 && u->tail.block == s->tail.block && u->tail.length == 200);
+
+	// /t holds the last tail handed out, so it grows in place
+	CHECK(t, write_pattern(t, "/t", bs + 200, 100) == 100);
+	u = file_inode(t, "/t");
+	CHECK(t, u && u->tail.block == s->tail.block && u->tail.length == 300);
+	// /s doesn't, so it is unpacked for the write and packed again after
+	CHECK(t, write_pattern(t, "/s", 100, 2 * bs) == (int)(2 * bs));
+	s = file_inode(t, "/s");
+	CHECK(t, s && s->i_nblocks == 2 && s->tail.block != 0 && s->tail.length == 100);
+	CHECK(t, a1fs_lib_ops.getattr(&t->fs, "/s", &st) == 0 && st.st_size == (off_t)(2 * bs + 100));
+
+	CHECK(t, remount(t));
+	CHECK(t, read_pattern(t, "/s", 0, 2 * bs + 100));
+	CHECK(t, read_pattern(t, "/t", 0, bs + 300));
+	CHECK(t, a1fs_lib_ops.truncate(&t->fs, "/t", 50) == 0);
+	u = file_inode(t, "/t");
+	CHECK(t, u && u->i_blocks == 0 && u->tail.length == 50);
+	CHECK(t, read_pattern(t, "/t", 0, 50));
+	CHECK(t, a1fs_lib_ops.unlink(&t->fs, "/s") == 0);
+	CHECK(t, read_pattern(t, "/t", 0, 50));
+	return true;
+}
+
+/** On an image with 48-bit extents a file has NUM_BLOCK_64 extent slots;
+ * growing it past that fails until it is defragmented, which has to move
+ * whole extents when no slot is left to split one. */
+static bool test_extents_64bit(test_ctx *t)
+{
+	const size_t bs = A1FS_BLOCK_SIZE;
+	a1fs_defrag_args args;
+	CHECK(t, is_64bit(t->fs.image) && max_extents(t->fs.image) == NUM_BLOCK_64);
+	CHECK(t, create_file(t, "/a") == 0);
+	CHECK(t, create_file(t, "/b") == 0);
+	for (int i = 0; i < NUM_BLOCK_64; i++) {
+		CHECK(t, write_pattern(t, "/a", i * 2 * bs, 2 * bs) == (int)(2 * bs));
+		CHECK(t, write_pattern(t, "/b", i * 2 * bs, 2 * bs) == (int)(2 * bs));
+	}
+	a1fs_inode *inode = file_inode(t, "/a");
+	CHECK(t, inode && inode->i_blocks == NUM_BLOCK_64 && inode->i_nblocks == 2 * NUM_BLOCK_64);
+	const a1fs_extent48 *rec = inode_extents(t->fs.image, inode)->i_block64;
+	CHECK(t, rec[1].start_lo == inode_extent(t->fs.image, inode, 1).start && rec[1].count_lo == 2);
+	CHECK(t, write_pattern(t, "/a", NUM_BLOCK_64 * 2 * bs, bs) == -ENOSPC);
+	CHECK(t, read_pattern(t, "/a", 0, NUM_BLOCK_64 * 2 * bs));
+
+	do {
+		args = (a1fs_defrag_args){.max_blocks = 1};
+		CHECK(t, a1fs_lib_ops.ioctl(&t->fs, "/a", A1FS_IOC_DEFRAG, NULL, &no_fi, 0, &args) == 0);
+		CHECK(t, args.blocks_moved == 1 || args.blocks_moved == 2);
+	} while (args.blocks_placed < args.blocks_total);
+	CHECK(t, args.extents_after == 1);
+	CHECK(t, write_pattern(t, "/a", NUM_BLOCK_64 * 2 * bs, bs) == (int)bs);
+	CHECK(t, remount(t));
+	CHECK(t, read_pattern(t, "/a", 0, NUM_BLOCK_64 * 2 * bs + bs));
+	CHECK(t, read_pattern(t, "/b", 0, NUM_BLOCK_64 * 2 * bs));
+	return true;
+}
+
+/** Only one file system can be mounted in a process at a time, since some of
+ * its state is found by the image pointer (see fs_ctx_of()); a second mount
+ * fails instead of taking that state away from the first. */
+static bool test_second_mount(test_ctx *t)
+{
+	const size_t bs = A1FS_BLOCK_SIZE;
+	CHECK(t, create_file(t, "/f") == 0);
+	CHECK(t, write_pattern(t, "/f", 0, 6 * bs) == (int)(6 * bs));
+
+	fs_ctx other = {0};
+	a1fs_opts other_opts = t->fs_opts;
+	CHECK(t, !a1fs_init(&other, &other_opts));
+	CHECK(t, other.image == NULL);
+
+	// Freed blocks are still reclaimed and checksums still cached
+	CHECK(t, a1fs_lib_ops.unlink(&t->fs, "/f") == 0);
+	CHECK(t, create_file(t, "/g") == 0);
+	CHECK(t, write_pattern(t, "/g", 0, 6 * bs) == (int)(6 * bs));
+	CHECK(t, fs_ctx_of(t->fs.image) == &t->fs);
+	CHECK(t, remount(t));
+	CHECK(t, read_pattern(t, "/g", 0, 6 * bs));
+	return true;
+}
+
+/** With the block cache, a unit of the image that can't be read in fails the
+ * operation that needed it with EIO instead of aborting. An update cut short
+ * that way leaves the file system read-only. */
+static bool test_cache_io_error(test_ctx *t)
+{
+	const size_t bs = A1FS_BLOCK_SIZE;
+	struct stat st;
+	CHECK(t, create_file(t, "/f") == 0);
+	CHECK(t, write_pattern(t, "/f", 0, 64 * bs) == (int)(64 * bs));
+	CHECK(t, remount(t));
+
+	// Cut the image file short before the last block of the file (on a cache
+	// unit boundary), so that reading that unit in fails
+	a1fs_inode *inode = file_inode(t, "/f");
+	CHECK(t, inode && inode->i_blocks == 1);
+	a1fs_extent ext = inode_extent(t->fs.image, inode, 0);
+	const a1fs_superblock *sb = (const a1fs_superblock*)t->fs.image;
+	uint64_t last = (sb->first_data_block + ext.start + ext.count - 1) * bs;
+	CHECK(t, last / t->fs.cache.unit * t->fs.cache.unit > sb->first_data_block * bs);
+	CHECK(t, truncate(t->image, last / t->fs.cache.unit * t->fs.cache.unit) == 0);
+
+	char buf[100];
+	CHECK(t, read_pattern(t, "/f", 0, bs));
+	CHECK(t, a1fs_lib_ops.read(&t->fs, "/f", buf, sizeof(buf), 63 * bs, &no_fi) == -EIO);
+	CHECK(t, a1fs_lib_ops.getattr(&t->fs, "/f", &st) == 0 && st.st_size == (off_t)(64 * bs));
+	CHECK(t, create_file(t, "/g") == 0);
+	CHECK(t, a1fs_lib_ops.write(&t->fs, "/f", buf, sizeof(buf), 63 * bs, &no_fi) == -EIO);
+	CHECK(t, create_file(t, "/h") == -EROFS);
+	CHECK(t, t->fs.cache.errors == 2);
+	return true;
+}
+
+static const test_case tests[] = {
+	{"fallocate-tail", test_fallocate_tail, false, false},
+	{"corrupt-extents", test_corrupt_extents, false, false},
+	{"defrag-unwritten", test_defrag_unwritten, false, false},
+	{"unwritten-split", test_unwritten_split, false, false},
+	{"defrag", test_defrag, false, false},
+	{"tail-pack", test_tail_pack, false, false},
+	{"extents-64bit", test_extents_64bit, true, false},
+	{"second-mount", test_second_mount, false, false},
+	{"cache-io-error", test_cache_io_error, false, true},
+};
+
+#define N_TESTS (sizeof(tests) / sizeof(tests[0]))
+
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+	static test_ctx t;
+	const char *dir = getenv("TMPDIR");
+	snprintf(t.image, sizeof(t.image), "%s/a1fs-test.XXXXXX", dir ? dir : "/tmp");
+	int fd = mkstemp(t.image);
+	if (fd < 0) {
+		perror(t.image);
+		return 1;
+	}
+	close(fd);
+
+	// Each test on an image with a fixed inode table and on one that
+	// allocates it on demand
+	static const size_t inode_counts[] = {256, 0};
+	int failed = 0;
+	for (size_t i = 0; i < N_TESTS; i++) {
+		for (size_t n = 0; n < sizeof(inode_counts) / sizeof(inode_counts[0]); n++) {
+			memset(&t.format, 0, sizeof(t.format));
+			t.format.n_inodes = inode_counts[n];
+			t.format.use_64bit = tests[i].use_64bit;
+			t.cache = tests[i].cache;
+			t.failed = NULL;
+			bool ok = mount_fresh(&t) && tests[i].run(&t);
+			unmount(&t);
+			printf("%s %s (%s inodes)", ok ? "ok  " : "FAIL", tests[i].name,
+			       inode_counts[n] ? "fixed" : "dynamic");
+			if (t.failed) printf(": line %d: %s", t.line, t.failed);
+			printf("\n");
+			if (!ok) failed++;
+		}
+	}
+	unlink(t.image);
+	printf("%d failed\n", failed);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,182 @@
+/**
+ * CSC369 Assignment 1 - operation trace recording implementation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+
+bool trace_active = false;
+
+/** Record buffer of a thread. */
+typedef struct trace_buf {
+	char data[TRACE_BUF_SIZE];
+	size_t len;
+	/** All buffers, linked from the newest. */
+	struct trace_buf *next;
+	/** The thread exited; the buffer is taken over by the next new thread. */
+	bool unused;
+
+} trace_buf;
+
+static __thread trace_buf *self;
+
+static int trace_fd = -1;
+/** stats_now() when recording started. */
+static uint64_t trace_start;
+/** Set after a failed write; the rest of the trace is dropped. */
+static bool trace_failed;
+
+/** Protects the list of buffers and the writes to trace_fd. */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buf *bufs;
+/** Tells when a thread exits; see thread_exit(). */
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+
+
+/** Append a buffer to the trace file and empty it. Call with trace_lock held. */
+static void flush_locked(trace_buf *b)
+{
+	size_t done = 0;
+	while (!trace_failed && done < b->len) {
+		ssize_t n = write(trace_fd, b->data + done, b->len - done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			perror("trace: write");
+			trace_failed = true;
+			break;
+		}
+		done += n;
+	}
+	b->len = 0;
+}
+
+// Like the statistics records, the buffer of a thread that exits goes to the
+// next new thread; its records are written out first so that they don't wait
+// for that thread to fill the buffer up
+static void thread_exit(void *arg)
+{
+	trace_buf *b = (trace_buf*)arg;
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd >= 0) flush_locked(b);
+	b->unused = true;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void make_exit_key(void)
+{
+	pthread_key_create(&exit_key, thread_exit);
+}
+
+/** Allocate (or take over) a buffer for the calling thread. */
+static trace_buf *register_thread(void)
+{
+	pthread_once(&exit_key_once, make_exit_key);
+	pthread_mutex_lock(&trace_lock);
+	trace_buf *b = bufs;
+	while (b && !b->unused) b = b->next;
+	if (b) {
+		b->unused = false;
+	} else if ((b = malloc(sizeof(*b))) != NULL) {
+		b->len = 0;
+		b->unused = false;
+		b->next = bufs;
+		bufs = b;
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	if (!b) return NULL;
+	pthread_setspecific(exit_key, b);
+	self = b;
+	return b;
+}
+
+
+bool trace_open(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror(path);
+		return false;
+	}
+
+	trace_header h = {0};
+	h.magic = TRACE_MAGIC;
+	h.version = TRACE_VERSION;
+	h.record_size = sizeof(trace_record);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	h.start_sec = now.tv_sec;
+	h.start_nsec = now.tv_nsec;
+	if (write(fd, &h, sizeof(h)) != sizeof(h)) {
+		perror(path);
+		close(fd);
+		return false;
+	}
+
+	trace_fd = fd;
+	trace_failed = false;
+	trace_start = stats_now();
+	trace_active = true;
+	return true;
+}
+
+void trace_op(stats_op op, uint64_t start, uint64_t latency, int ret, const char *path,
+              const char *to, uint64_t offset, uint64_t size, uint32_t mode)
+{
+	trace_buf *b = self ? self : register_thread();
+	if (!b) return;
+
+	size_t path_len = strlen(path);
+	size_t to_len = to ? strlen(to) + 1 : 0;
+	// FUSE paths are at most PATH_MAX (4096) long, well within the limit
+	if (path_len + to_len > UINT16_MAX) return;
+
+	trace_record r = {
+		.time = start - trace_start,
+		.offset = offset,
+		.size = size,
+		.mode = mode,
+		.ret = ret,
+		.latency = latency > UINT32_MAX ? UINT32_MAX : latency,
+		.op = op,
+		.path_len = path_len + to_len,
+	};
+	size_t len = sizeof(r) + r.path_len;
+	if (b->len + len > sizeof(b->data)) {
+		pthread_mutex_lock(&trace_lock);
+		flush_locked(b);
+		pthread_mutex_unlock(&trace_lock);
+	}
+
+	char *p = b->data + b->len;
+	memcpy(p, &r, sizeof(r));
+	p += sizeof(r);
+	memcpy(p, path, path_len);
+	if (to) {
+		p[path_len] = '\0';
+		memcpy(p + path_len + 1, to, to_len - 1);
+	}
+	b->len += len;
+}
+
+void trace_close(void)
+{
+	if (trace_fd < 0) return;
+	// All the operations are done by now (FUSE calls destroy last)
+	trace_active = false;
+	pthread_mutex_lock(&trace_lock);
+	for (trace_buf *b = bufs; b; b = b->next) flush_locked(b);
+	if (close(trace_fd) < 0) perror("trace: close");
+	trace_fd = -1;
+	pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,99 @@
+/**
+ * CSC369 Assignment 1 - operation trace recording header file.
+ *
+ * With the --trace=FILE mount option every file system operation is appended
+ * to a binary trace: what it was, its arguments (paths, offset, size, mode),
+ * when it started, how long it took and what it returned. a1fs-replay runs a
+ * trace against an image, so that real workloads can be repeated on another
+ * build of the driver or another image.
+ *
+ * Each thread collects its records in a buffer of its own, which is appended to
+ * the file (under a lock) when it fills up, when the thread exits and at
+ * unmount; recording costs a copy into the buffer. The records of different
+ * threads are therefore not in time order in the file.
+ *
+ * File format, in host byte order: a trace_header, then records back to back,
+ * each a trace_record followed by its path_len bytes of paths. Records are not
+ * aligned.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+
+/** "A1FSTRC1" */
+#define TRACE_MAGIC 0x3143525453463141ul
+#define TRACE_VERSION 1
+
+/** Size of the per-thread record buffers. */
+#define TRACE_BUF_SIZE (256 * 1024)
+
+/** Trace file header. */
+typedef struct trace_header {
+	uint64_t magic;
+	uint32_t version;
+	/** sizeof(trace_record), as a sanity check. */
+	uint32_t record_size;
+	/** Wall clock time when recording started. */
+	int64_t start_sec;
+	int64_t start_nsec;
+
+} trace_header;
+
+/** A recorded operation. */
+typedef struct trace_record {
+	/** Start of the operation, in ns since recording started. */
+	uint64_t time;
+	/** File offset (read, write, fallocate); new size (truncate);
+	 * a1fs_defrag_args flags (ioctl). */
+	uint64_t offset;
+	/** Number of bytes (read, write); length (fallocate); a1fs_defrag_args
+	 * max_blocks (ioctl). */
+	uint64_t size;
+	/** Mode (mkdir, create, fallocate); command (ioctl). */
+	uint32_t mode;
+	/** Return value. */
+	int32_t ret;
+	/** Duration of the operation in ns, at most UINT32_MAX. */
+	uint32_t latency;
+	/** Operation, numbered as in stats.h (stats_op). */
+	uint16_t op;
+	/** Length of the path that follows, not NUL-terminated. For rename, the
+	 * new path follows the old one after a NUL. */
+	uint16_t path_len;
+
+} trace_record;
+
+
+/** Set while a trace is being recorded. */
+extern bool trace_active;
+
+/**
+ * Start recording into a new trace file at path (truncated if it exists).
+ *
+ * @return  true on success; false on failure (with an error message printed).
+ */
+bool trace_open(const char *path);
+
+/**
+ * Record an operation. Call only while trace_active is set.
+ *
+ * @param op       the operation.
+ * @param start    when it started (stats_now()).
+ * @param latency  how long it took, in ns.
+ * @param ret      what it returned.
+ * @param path     its path.
+ * @param to       new path of rename; NULL for other operations.
+ * @param offset   see trace_record.
+ * @param size     see trace_record.
+ * @param mode     see trace_record.
+ */
+void trace_op(stats_op op, uint64_t start, uint64_t latency, int ret, const char *path,
+              const char *to, uint64_t offset, uint64_t size, uint32_t mode);
+
+/** Write out the records of all the threads and close the trace file. */
+void trace_close(void);
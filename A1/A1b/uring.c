@@ -0,0 +1,248 @@
+/**
+ * CSC369 Assignment 1 - io_uring client implementation.
+ */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+
+/** user_data of the request that tells the reaper to exit. */
+#define URING_STOP UINT64_MAX
+
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/** Next free submission queue entry; NULL if the queue is full. */
+static struct io_uring_sqe *get_sqe(uring *r)
+{
+	unsigned head = atomic_load_explicit((_Atomic unsigned*)r->sq_head, memory_order_acquire);
+	unsigned tail = *r->sq_tail + r->queued;
+	if (tail - head >= r->entries) return NULL;
+	unsigned index = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = (struct io_uring_sqe*)r->sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[index] = index;
+	r->queued++;
+	return sqe;
+}
+
+/** Publish and submit the queued entries. */
+static int submit(uring *r)
+{
+	if (r->queued == 0) return 0;
+	unsigned n = r->queued;
+	pthread_mutex_lock(&r->lock);
+	r->inflight += n;
+	r->submits++;
+	pthread_mutex_unlock(&r->lock);
+	atomic_store_explicit((_Atomic unsigned*)r->sq_tail, *r->sq_tail + n, memory_order_release);
+	r->queued = 0;
+
+	while (n > 0) {
+		int ret = sys_enter(r->fd, n, 0, 0);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret < 0) {
+			int err = -errno;
+			// The entries stay in the ring; don't wait for them
+			pthread_mutex_lock(&r->lock);
+			r->inflight -= n;
+			if (r->error == 0) r->error = err;
+			pthread_cond_broadcast(&r->done);
+			pthread_mutex_unlock(&r->lock);
+			return err;
+		}
+		n -= ret;
+	}
+	return 0;
+}
+
+static void *reaper(void *arg)
+{
+	uring *r = (uring*)arg;
+	for (;;) {
+		unsigned head = *r->cq_head;
+		unsigned tail = atomic_load_explicit((_Atomic unsigned*)r->cq_tail, memory_order_acquire);
+		if (head == tail) {
+			sys_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS);
+			continue;
+		}
+
+		bool stop = false;
+		unsigned completed = 0;
+		int error = 0;
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = (struct io_uring_cqe*)r->cqes + (head & *r->cq_mask);
+			if (cqe->user_data == URING_STOP) {
+				stop = true;
+				continue;
+			}
+			// user_data is the length of the request; short ones are errors
+			if (cqe->res < 0) {
+				error = error ? error : cqe->res;
+			} else if ((uint64_t)cqe->res < cqe->user_data) {
+				error = error ? error : -EIO;
+			}
+			completed++;
+		}
+		atomic_store_explicit((_Atomic unsigned*)r->cq_head, head, memory_order_release);
+
+		pthread_mutex_lock(&r->lock);
+		r->inflight -= completed;
+		if (r->error == 0) r->error = error;
+		if (r->inflight == 0) pthread_cond_broadcast(&r->done);
+		pthread_mutex_unlock(&r->lock);
+		if (stop) return NULL;
+	}
+}
+
+
+bool uring_init(uring *r, unsigned entries)
+{
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	r->fd = sys_setup(entries, &p);
+	if (r->fd < 0) return false;
+	r->entries = p.sq_entries;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = 0;
+	}
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                  r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) goto fail;
+	r->cq_ring = r->sq_ring;
+	if (r->cq_ring_size) {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                  r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) goto fail;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	               r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) goto fail;
+
+	char *sq = (char*)r->sq_ring, *cq = (char*)r->cq_ring;
+	r->sq_head  = (unsigned*)(sq + p.sq_off.head);
+	r->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+	r->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*)(sq + p.sq_off.array);
+	r->cq_head  = (unsigned*)(cq + p.cq_off.head);
+	r->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+	r->cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+	r->cqes     = cq + p.cq_off.cqes;
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->done, NULL);
+	return true;
+
+fail:
+	if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring_size && r->cq_ring && r->cq_ring != MAP_FAILED) {
+		munmap(r->cq_ring, r->cq_ring_size);
+	}
+	if (r->sq_ring && r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	r->fd = -1;
+	return false;
+}
+
+bool uring_start(uring *r)
+{
+	if (r->started) return true;
+	r->started = pthread_create(&r->reaper, NULL, reaper, r) == 0;
+	return r->started;
+}
+
+void uring_destroy(uring *r)
+{
+	if (r->fd < 0) return;
+	if (r->started) {
+		uring_wait(r);
+		// Stop the reaper with a request of its own; if there is no room for
+		// it (entries left in the ring by a failed submit), cancel it
+		struct io_uring_sqe *sqe = get_sqe(r);
+		if (sqe) {
+			sqe->opcode = IORING_OP_NOP;
+			sqe->user_data = URING_STOP;
+		}
+		if (sqe && submit(r) == 0) {
+			pthread_join(r->reaper, NULL);
+		} else {
+			pthread_cancel(r->reaper);
+			pthread_join(r->reaper, NULL);
+		}
+	}
+	pthread_cond_destroy(&r->done);
+	pthread_mutex_destroy(&r->lock);
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring_size) munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	r->fd = -1;
+}
+
+/** Queue a read or write request. */
+static int queue(uring *r, int opcode, int fd, void *buf, size_t len, uint64_t off)
+{
+	struct io_uring_sqe *sqe = get_sqe(r);
+	if (!sqe) {
+		int ret = submit(r);
+		if (ret < 0) return ret;
+		// Wait for the ring to drain enough for a new batch
+		while (!(sqe = get_sqe(r))) {
+			pthread_mutex_lock(&r->lock);
+			if (r->inflight > 0) pthread_cond_wait(&r->done, &r->lock);
+			pthread_mutex_unlock(&r->lock);
+		}
+	}
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = len;
+	r->requests++;
+	return 0;
+}
+
+int uring_read(uring *r, int fd, void *buf, size_t len, uint64_t off)
+{
+	return queue(r, IORING_OP_READ, fd, buf, len, off);
+}
+
+int uring_write(uring *r, int fd, const void *buf, size_t len, uint64_t off)
+{
+	return queue(r, IORING_OP_WRITE, fd, (void*)buf, len, off);
+}
+
+int uring_wait(uring *r)
+{
+	int ret = submit(r);
+	pthread_mutex_lock(&r->lock);
+	while (r->inflight > 0) pthread_cond_wait(&r->done, &r->lock);
+	if (ret == 0) ret = r->error;
+	r->error = 0;
+	pthread_mutex_unlock(&r->lock);
+	return ret;
+}
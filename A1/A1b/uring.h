@@ -0,0 +1,105 @@
+/**
+ * CSC369 Assignment 1 - io_uring client header file.
+ *
+ * A minimal io_uring client on top of the raw system calls (no liburing) that
+ * reads or writes many buffers at once, possibly in several files.
+ * uring_read() and uring_write() only queue a request; the queued requests are
+ * submitted in batches, with one io_uring_enter() per full submission queue or
+ * per uring_wait(). A helper thread reaps the completions, so that the
+ * submitting thread can keep queueing while the devices work. The thread is
+ * started by uring_start() rather than uring_init(), so that an instance set
+ * up before fork() can be used in the child (threads don't survive fork()).
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** io_uring instance with its rings mapped and its completion reaper. */
+typedef struct uring {
+	/** io_uring file descriptor; -1 if not set up. */
+	int fd;
+
+	/** Submission queue ring and entries, and completion queue ring. */
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *sqes;
+	size_t sqes_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+
+	/** Submission queue fields, in the sq_ring mapping. */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	/** Completion queue fields, in the cq_ring mapping. */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	void *cqes;
+	/** Number of submission queue entries. */
+	unsigned entries;
+	/** Entries queued but not submitted yet. */
+	unsigned queued;
+
+	/** Protects the fields below. */
+	pthread_mutex_t lock;
+	/** Signalled when inflight drops to 0. */
+	pthread_cond_t done;
+	/** Requests submitted but not completed. */
+	unsigned inflight;
+	/** First error of the requests since the last uring_wait(), as -errno. */
+	int error;
+	/** Number of requests submitted, and of io_uring_enter() calls for them. */
+	uint64_t requests;
+	uint64_t submits;
+
+	/** Completion reaper; only valid if started. */
+	pthread_t reaper;
+	bool started;
+
+} uring;
+
+
+/**
+ * Set up an io_uring instance.
+ *
+ * @param r        instance to initialize.
+ * @param entries  submission queue size.
+ * @return         true on success; false if io_uring is not available.
+ */
+bool uring_init(uring *r, unsigned entries);
+
+/**
+ * Start the completion reaper. Must be called (in the process that will use
+ * the instance) before any request is queued.
+ *
+ * @return  true on success; false if the thread could not be created.
+ */
+bool uring_start(uring *r);
+
+/** Wait for the requests in flight and release the instance. */
+void uring_destroy(uring *r);
+
+/**
+ * Queue a read of len bytes at offset off of file fd into buf. The buffer
+ * must stay valid until uring_wait() returns. A short read is an error.
+ *
+ * @return  0 on success; -errno if the queue had to be submitted and that failed.
+ */
+int uring_read(uring *r, int fd, void *buf, size_t len, uint64_t off);
+
+/**
+ * Queue a write of len bytes at buf to offset off of file fd. The buffer
+ * must stay valid and unchanged until uring_wait() returns.
+ *
+ * @return  0 on success; -errno if the queue had to be submitted and that failed.
+ */
+int uring_write(uring *r, int fd, const void *buf, size_t len, uint64_t off);
+
+/**
+ * Submit the queued requests and wait for all requests to complete.
+ *
+ * @return  0 on success; the first error since the last call as -errno.
+ */
+int uring_wait(uring *r);
@@ -1,40 +1,75 @@
 #include "util.h"
+#include "copy.h"
+#include "csum.h"
+#include "fs_ctx.h"
+#include "group.h"
+#include "stats.h"
 #include <string.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
-int find_inode_path(const char *path, char *sb, a1fs_inode **inode){
+static void reap_freed(char *image, bool wait);
+static a1fs_blk_t last_free_run(char *image, a1fs_blk_t from, a1fs_blk_t to, a1fs_blk_t count);
+
+static int lookup(const char *path, char *sb, a1fs_inode **inode, bool extents){
     a1fs_inode *tempInode = find_inode_num(sb, 1); //root Inode num which is 1
-    char newPath[A1FS_NAME_MAX];
+    if(tempInode == NULL || !csum_verify_inode(sb, tempInode)){
+        return -3;
+    }
+    char newPath[A1FS_PATH_MAX];
     strcpy(newPath, path);
     char *token = strtok(newPath, "/");
     int newInodeNum;
     while(token != NULL){
+        stats_add(STATS_LOOKUPS, 1);
+        /*searching a directory reads its extents*/
+        if(!csum_verify_extents(sb, tempInode)){
+            return -3;
+        }
         newInodeNum = find_inode_name(token, sb, tempInode);
-        if(newInodeNum == -1){
-            return -1;
+        if(newInodeNum < 0){
+            return newInodeNum;
         }
         tempInode = find_inode_num(sb, newInodeNum);
+        if(tempInode == NULL || !csum_verify_inode(sb, tempInode)){
+            return -3;
+        }
         token = strtok(NULL, "/");
         if((!(S_ISDIR(tempInode->mode))&& token != NULL)){
             return -2;
         }
     }
+    if(extents && !csum_verify_extents(sb, tempInode)){
+        return -3;
+    }
     *inode = tempInode;
     return 0;
 }
 
+int find_inode_path(const char *path, char *sb, a1fs_inode **inode){
+    return lookup(path, sb, inode, true);
+}
+
+int find_inode_attrs(const char *path, char *sb, a1fs_inode **inode){
+    return lookup(path, sb, inode, false);
+}
+
 // return the ino Num
 int find_inode_name(char *name, char *image, a1fs_inode *inode){
     a1fs_superblock *sb = (a1fs_superblock *)image;
     uint32_t numExtend = inode->i_blocks;
     for(uint32_t i=0;i < numExtend;i++){
-        a1fs_extent extend = inode->i_block[i];
+        a1fs_extent extend = inode_extent(image, inode, i);
         a1fs_blk_t start = extend.start;
         a1fs_blk_t count = extend.count;
-        int numOfEntry = A1FS_BLOCK_SIZE/sizeof(a1fs_dentry);
-        a1fs_dentry *entry = (a1fs_dentry *) (image + (sb->first_data_block + start) * A1FS_BLOCK_SIZE);
+        int numOfEntry = block_size(image)/sizeof(a1fs_dentry);
+        a1fs_dentry *entry = (a1fs_dentry *) (image + (sb->first_data_block + start) * block_size(image));
         a1fs_blk_t j = 0;
         while(j < numOfEntry*count){
+            if(j % numOfEntry == 0 &&
+               !csum_verify_block(image, sb->first_data_block + start + j / numOfEntry)){
+                return -3; // -3 means the directory is corrupt
+            }
             if(strcmp(entry[j].name, name) == 0 && entry[j].ino != 0){
                 return entry[j].ino;
             }
@@ -46,28 +81,90 @@ int find_inode_name(char *name, char *image, a1fs_inode *inode){
 
 a1fs_inode *find_inode_num(char *image, a1fs_ino_t num){
     a1fs_superblock *sb = (a1fs_superblock *)image;
-    return (a1fs_inode *)(image + (sb->first_inode_block)*A1FS_BLOCK_SIZE + sizeof(a1fs_inode)*(num-1));
+    if(dyn_inodes(image)){
+        /*one lookup in the chunk map; entries past its initialized part are 0*/
+        uint64_t index = (uint64_t)num - 1;
+        uint64_t chunk = index / inodes_per_chunk(image);
+        if(num == 0 || index >= sb->inodes_count ||
+           chunk * sizeof(uint64_t) / block_size(image) >= lazy_initialized(image, LAZY_CHUNK_MAP)){
+            return NULL;
+        }
+        uint64_t start = ((uint64_t *)get_block(image, sb->inode_chunk_map))[chunk];
+        if(start == 0 || start + A1FS_INODE_CHUNK_BLOCKS > sb->blocks_count - sb->first_data_block){
+            return NULL;
+        }
+        return (a1fs_inode *)find_data_block(image, start) + index % inodes_per_chunk(image);
+    }
+    return (a1fs_inode *)(image + (sb->first_inode_block)*block_size(image) + sizeof(a1fs_inode)*(num-1));
 }
 
-a1fs_blk_t total_datablock_for_inode(a1fs_inode *inode){
-  a1fs_blk_t total = 0;
-  for(uint32_t i = 0; i < inode->i_blocks; i++){
-    total += inode->i_block[i].count;
-  }
-  return total;
+a1fs_ino_t inode_index(char *image, a1fs_inode *inode){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    if(!dyn_inodes(image)){
+        return inode - (a1fs_inode *)get_block(image, sb->first_inode_block);
+    }
+    /*chunks can be anywhere, so go by the inode number, but only if it is right*/
+    if(find_inode_num(image, inode->inode_num) != inode){
+        return sb->inodes_count;
+    }
+    return inode->inode_num - 1;
+}
+
+uint64_t *chunk_map_entry(char *image, uint64_t chunk){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    lazy_init(image, LAZY_CHUNK_MAP, chunk * sizeof(uint64_t) / block_size(image));
+    return (uint64_t *)get_block(image, sb->inode_chunk_map) + chunk;
+}
+
+int alloc_inode_chunk(char *image, a1fs_ino_t index){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    uint64_t chunk = index / inodes_per_chunk(image);
+    uint64_t *entry = chunk_map_entry(image, chunk);
+    uint64_t block = sb->inode_chunk_map + chunk * sizeof(uint64_t) / block_size(image);
+    if(!csum_verify_block(image, block)){
+        return -1;
+    }
+    if(*entry != 0){
+        return 0;
+    }
+    reap_freed(image, false);
+    /*from the top of the group down, away from the data that grows up from its
+     *start: a chunk right after a file or directory would fragment it*/
+    a1fs_blk_t first, end;
+    group_blocks(image, group_of_inode(image, index), &first, &end);
+    a1fs_blk_t start = last_free_run(image, first, end, A1FS_INODE_CHUNK_BLOCKS);
+    if(start == 0){
+        start = find_free_run(image, A1FS_INODE_CHUNK_BLOCKS, first);
+    }
+    if(start == 0 || set_block_range(image, start, A1FS_INODE_CHUNK_BLOCKS, true) != 0){
+        return -1;
+    }
+    memset(find_data_block(image, start), 0, A1FS_INODE_CHUNK_BLOCKS * block_size(image));
+    *entry = start;
+    csum_touch_block(image, block);
+    return 0;
+}
+
+a1fs_blk_t total_datablock_for_inode(char *image, a1fs_inode *inode){
+  (void)image;
+  return inode->i_nblocks;
 }
 
 int read_entries(fuse_fill_dir_t filler, char *image, a1fs_inode *inode, void *buf){
     a1fs_superblock *sb = (a1fs_superblock *)image;
     uint32_t numExtend = inode->i_blocks;
     for(uint32_t i=0;i < numExtend;i++){
-        a1fs_extent extend = inode->i_block[i];
+        a1fs_extent extend = inode_extent(image, inode, i);
         a1fs_blk_t start = extend.start;
         a1fs_blk_t count = extend.count;
-        int numOfEntry = A1FS_BLOCK_SIZE/sizeof(a1fs_dentry);
-        a1fs_dentry *entry = (a1fs_dentry *) (image + (sb->first_data_block + start) * A1FS_BLOCK_SIZE);
+        int numOfEntry = block_size(image)/sizeof(a1fs_dentry);
+        a1fs_dentry *entry = (a1fs_dentry *) (image + (sb->first_data_block + start) * block_size(image));
         a1fs_blk_t j = 0;
         while(j < numOfEntry*count){
+            if(j % numOfEntry == 0 &&
+               !csum_verify_block(image, sb->first_data_block + start + j / numOfEntry)){
+                return -3;
+            }
             if(entry[j].ino != 0){
                 if(filler(buf, entry[j].name , NULL, 0) != 0) {
                     return -1;}
@@ -78,39 +175,90 @@ int read_entries(fuse_fill_dir_t filler, char *image, a1fs_inode *inode, void *b
     return 0;
 }
 
-//finding the first inode bit availabe from inode bitmap
-a1fs_ino_t empty_inode_bitmap(char *image){
+/*first clear bit in [from, to) of a bitmap region, initializing and verifying
+ *its blocks as they are reached; to if there is none (or the bitmap is corrupt)*/
+static uint64_t first_clear_bit(char *image, lazy_region region, uint64_t first_block,
+                                uint64_t from, uint64_t to){
+    const unsigned char *bitmap = (const unsigned char *)get_block(image, first_block);
+    uint64_t block_bits = 8 * block_size(image);
+    for(uint64_t i = from; i < to; i++){
+        if(i == from || (i & (block_bits - 1)) == 0){
+            lazy_init(image, region, i / block_bits);
+            if(!csum_verify_block(image, first_block + i / block_bits)){
+                stats_add(STATS_BITS_SCANNED, i - from);
+                return to;
+            }
+        }
+        if(i % 64 == 0 && i + 64 <= to){
+            /*a word at a time: skip it if full, or take its lowest clear bit*/
+            uint64_t word = ((const uint64_t *)bitmap)[i / 64];
+            if(word == UINT64_MAX){
+                i += 63;
+                continue;
+            }
+            stats_add(STATS_BITS_SCANNED, i + 64 - from);
+            return i + __builtin_ctzll(~word);
+        }
+        if((bitmap[i / 8] & (1 << (i % 8))) == 0){
+            stats_add(STATS_BITS_SCANNED, i + 1 - from);
+            return i;
+        }
+    }
+    stats_add(STATS_BITS_SCANNED, to - from);
+    return to;
+}
+
+//finding the first free inode bit, starting from the group chosen for the new inode
+a1fs_ino_t empty_inode_bitmap(char *image, a1fs_inode *parent, bool dir){
     a1fs_superblock *sb = (a1fs_superblock *)image;
-    char *bitmap = image + sb->inode_bitmap*A1FS_BLOCK_SIZE;
-    a1fs_ino_t total_size = sb-> inodes_count;
-    a1fs_ino_t byte = 0;
-    a1fs_ino_t bit = 1;
-    while(total_size){
-        if(bit == 8){
-            byte += 1;
-            bit = 0;
+    uint64_t ngroups = group_count(image);
+    uint64_t goal = group_find_inode(image, parent, dir);
+    for(uint64_t n = 0; n < ngroups; n++){
+        uint64_t g = (goal + n) % ngroups;
+        a1fs_group_desc *desc = group_desc(image, g);
+        if(desc && desc->free_inodes == 0){
+            continue;
         }
-        if((bitmap[byte]&(1<<bit)) == 0){
-            return byte*8 + bit;
+        a1fs_ino_t first, end;
+        group_inodes(image, g, &first, &end);
+        if(first == 0){
+            first = 1; // the root
+        }
+        uint64_t i = first_clear_bit(image, LAZY_INODE_BITMAP, sb->inode_bitmap, first, end);
+        if(i < end){
+            // the caller fills in the inode, so its table block must be ready
+            if(dyn_inodes(image)){
+                if(alloc_inode_chunk(image, i) != 0){
+                    continue; // no room for a new chunk here; try another group
+                }
+            } else {
+                lazy_init(image, LAZY_INODE_TABLE, i * sizeof(a1fs_inode) / block_size(image));
+            }
+            return i;
         }
-        bit ++;
-        total_size --;
     }
     return 0;
 }
 
 int toggle_inode_bit(char *image, a1fs_ino_t num){
     a1fs_superblock *sb = (a1fs_superblock *)image;
-    unsigned char *inode_bitmap = (unsigned char *)(image + sb->inode_bitmap*A1FS_BLOCK_SIZE);
+    unsigned char *inode_bitmap = (unsigned char *)(image + sb->inode_bitmap*block_size(image));
     a1fs_blk_t byte = 0;
     int bit = 0;
     byte = num / 8;
     bit = num % 8;
+    lazy_init(image, LAZY_INODE_BITMAP, byte / block_size(image));
+    if(!csum_verify_block(image, sb->inode_bitmap + byte / block_size(image))){
+        return -1;
+    }
     inode_bitmap[byte] = inode_bitmap[byte]^(1<<bit);
+    csum_touch_block(image, sb->inode_bitmap + byte / block_size(image));
     if ((inode_bitmap[byte] & (1<<bit)) == 0) {
         sb->free_inodes_count++;
+        group_inode_changed(image, num, false);
     } else {
         sb->free_inodes_count--;
+        group_inode_changed(image, num, true);
     }
     return 0;
 }
@@ -119,92 +267,467 @@ int toggle_inode_bit(char *image, a1fs_ino_t num){
 int toggle_block_bit(char *image, a1fs_blk_t num){
     a1fs_superblock *sb = (a1fs_superblock *)image;
     unsigned char *block_bitmap = (unsigned char *)
-        (image + sb->datablock_bitmap*A1FS_BLOCK_SIZE);
+        (image + sb->datablock_bitmap*block_size(image));
     a1fs_blk_t byte = 0;
     int bit = 0;
     byte = num / 8;
     bit = num % 8;
+    lazy_init(image, LAZY_BLOCK_BITMAP, byte / block_size(image));
+    if(!csum_verify_block(image, sb->datablock_bitmap + byte / block_size(image))){
+        return -1;
+    }
     block_bitmap[byte] = block_bitmap[byte]^(1<<bit);
+    csum_touch_block(image, sb->datablock_bitmap + byte / block_size(image));
     if ((block_bitmap[byte] & (1<<bit)) == 0) {
         sb->free_blocks_count++;
+        group_blocks_changed(image, num, 1, false);
+        stats_add(STATS_BLOCKS_FREED, 1);
     } else {
         sb->free_blocks_count--;
+        group_blocks_changed(image, num, 1, true);
+        stats_add(STATS_BLOCKS_ALLOCATED, 1);
+    }
+    return 0;
+}
+
+
+int set_block_range(char *image, a1fs_blk_t start, a1fs_blk_t count, bool used){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    unsigned char *block_bitmap = (unsigned char *)
+        (image + sb->datablock_bitmap*block_size(image));
+    if(count == 0){
+        return 0;
+    }
+    uint64_t first = start / 8 / block_size(image);
+    uint64_t last = (start + count - 1) / 8 / block_size(image);
+    lazy_init(image, LAZY_BLOCK_BITMAP, last);
+    for(uint64_t b = first; b <= last; b++){
+        if(!csum_verify_block(image, sb->datablock_bitmap + b)){
+            return -1;
+        }
+    }
+    a1fs_blk_t i = start, end = start + count;
+    /*partial bytes at both ends, whole bytes (memset) in between*/
+    for(; i < end && i % 8 != 0; i++){
+        block_bitmap[i / 8] ^= 1 << (i % 8);
+    }
+    if(end - i >= 8){
+        memset(block_bitmap + i / 8, used ? 0xff : 0, (end - i) / 8);
+        i += (end - i) / 8 * 8;
+    }
+    for(; i < end; i++){
+        block_bitmap[i / 8] ^= 1 << (i % 8);
     }
+    for(uint64_t b = first; b <= last; b++){
+        csum_touch_block(image, sb->datablock_bitmap + b);
+    }
+    if(used){
+        sb->free_blocks_count -= count;
+    } else {
+        sb->free_blocks_count += count;
+    }
+    group_blocks_changed(image, start, count, used);
+    stats_add(used ? STATS_BLOCKS_ALLOCATED : STATS_BLOCKS_FREED, count);
     return 0;
 }
 
+void free_blocks(char *image, a1fs_blk_t start, a1fs_blk_t count){
+    fs_ctx *fs = fs_ctx_of(image);
+    if(fs){
+        reclaim_free(&(fs->reclaim), start, count);
+        return;
+    }
+    set_block_range(image, start, count, false);
+}
+
+/*clear the bits of blocks that the reclaim queue is done with*/
+static void reap_freed(char *image, bool wait){
+    fs_ctx *fs = fs_ctx_of(image);
+    if(fs){
+        reclaim_reap(&(fs->reclaim), wait);
+    }
+}
+
+/*first run of count free data blocks starting in [from, to); 0 if none. Full
+ *groups are skipped using their descriptors, and the bitmap is read a word at
+ *a time where possible, so that large images are searched quickly. The bits
+ *examined are added to *scanned*/
+static a1fs_blk_t scan_free_run(char *image, a1fs_blk_t from, a1fs_blk_t to, a1fs_blk_t count,
+                                uint64_t *scanned){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    const unsigned char *bitmap = (const unsigned char *)
+        (image + sb->datablock_bitmap*block_size(image));
+    a1fs_blk_t data_blocks = sb->blocks_count - sb->first_data_block;
+    uint64_t init_bits = lazy_initialized(image, LAZY_BLOCK_BITMAP) * block_size(image) * 8;
+    uint64_t word_limit = init_bits < data_blocks ? init_bits : data_blocks;
+    bool groups = group_count(image) > 1;
+    a1fs_blk_t run = 0;
+    for(a1fs_blk_t i = from; i < data_blocks && i - run < to;){
+        if(i >= init_bits){
+            /*the rest of the bitmap is not initialized, so all free*/
+            return data_blocks - (i - run) >= count ? i - run : 0;
+        }
+        if(groups && i % sb->blocks_per_group == 0){
+            a1fs_group_desc *desc = group_desc(image, group_of_block(image, i));
+            if(desc && desc->free_blocks == 0){
+                run = 0;
+                i += sb->blocks_per_group;
+                continue;
+            }
+        }
+        if(i % 64 == 0 && i + 64 <= word_limit){
+            uint64_t word = ((const uint64_t *)bitmap)[i / 64];
+            *scanned += 64;
+            if(word == UINT64_MAX){
+                run = 0;
+                i += 64;
+                continue;
+            }
+            if(word == 0){
+                if(run + 64 >= count){
+                    return i - run;
+                }
+                run += 64;
+                i += 64;
+                continue;
+            }
+        }
+        (*scanned)++;
+        if(bitmap[i / 8] & (1 << (i % 8))){
+            run = 0;
+        }
+        else if(++run == count){
+            return i - count + 1;
+        }
+        i++;
+    }
+    return 0;
+}
+
+static a1fs_blk_t free_run(char *image, a1fs_blk_t from, a1fs_blk_t to, a1fs_blk_t count){
+    uint64_t scanned = 0;
+    a1fs_blk_t start = scan_free_run(image, from, to, count, &scanned);
+    stats_add(STATS_BITS_SCANNED, scanned);
+    return start;
+}
+
+/*last run of count free data blocks inside [from, to); 0 if none. The bits
+ *examined are added to *scanned*/
+static a1fs_blk_t scan_last_free_run(char *image, a1fs_blk_t from, a1fs_blk_t to, a1fs_blk_t count,
+                                     uint64_t *scanned){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    const unsigned char *bitmap = (const unsigned char *)
+        (image + sb->datablock_bitmap*block_size(image));
+    a1fs_blk_t data_blocks = sb->blocks_count - sb->first_data_block;
+    uint64_t init_bits = lazy_initialized(image, LAZY_BLOCK_BITMAP) * block_size(image) * 8;
+    if(from == 0){
+        from = 1;
+    }
+    if(to > data_blocks){
+        to = data_blocks;
+    }
+    if(to < from + count){
+        return 0;
+    }
+    if(to - count >= init_bits){
+        /*the end of the bitmap is not initialized yet, so all free*/
+        return to - count;
+    }
+    a1fs_blk_t run = 0;
+    for(a1fs_blk_t i = to; i-- > from;){
+        if(i % 64 == 63 && i - 63 >= from && i < init_bits){
+            uint64_t word = ((const uint64_t *)bitmap)[i / 64];
+            *scanned += 64;
+            if(word == UINT64_MAX){
+                run = 0;
+                i -= 63;
+                continue;
+            }
+            if(word == 0){
+                if(run + 64 >= count){
+                    return i + run + 1 - count;
+                }
+                run += 64;
+                i -= 63;
+                continue;
+            }
+        }
+        (*scanned)++;
+        if(i < init_bits && (bitmap[i / 8] & (1 << (i % 8)))){
+            run = 0;
+        }
+        else if(++run == count){
+            return i;
+        }
+    }
+    return 0;
+}
+
+static a1fs_blk_t last_free_run(char *image, a1fs_blk_t from, a1fs_blk_t to, a1fs_blk_t count){
+    uint64_t scanned = 0;
+    a1fs_blk_t start = scan_last_free_run(image, from, to, count, &scanned);
+    stats_add(STATS_BITS_SCANNED, scanned);
+    return start;
+}
+
+a1fs_blk_t find_free_run(char *image, a1fs_blk_t count, a1fs_blk_t goal){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    a1fs_blk_t data_blocks = sb->blocks_count - sb->first_data_block;
+    if(goal == 0 || goal >= data_blocks){
+        goal = 1;
+    }
+    a1fs_blk_t start = free_run(image, goal, data_blocks, count);
+    if(start == 0 && goal > 1){
+        /*wrap around to the runs that start before the goal*/
+        start = free_run(image, 1, goal, count);
+    }
+    return start;
+}
+
+a1fs_blk_t defrag_placed(char *image, a1fs_inode *inode){
+    if(inode->i_blocks == 0){
+        return 0;
+    }
+    a1fs_extent first = inode_extent(image, inode, 0);
+    a1fs_blk_t placed = first.count;
+    for(uint32_t i = 1; i < inode->i_blocks; i++){
+        a1fs_extent ext = inode_extent(image, inode, i);
+        if(ext.start != first.start + placed){
+            break;
+        }
+        placed += ext.count;
+    }
+    return placed;
+}
+
+/*append a piece to a new extent list, merging it into the last one when they
+ *are physically contiguous and both (un)written. Returns -1 if full*/
+static int defrag_append(a1fs_extent *ext, bool *unwritten, uint32_t *n, uint32_t max,
+                         a1fs_extent piece, bool piece_unwritten){
+    if(piece.count == 0){
+        return 0;
+    }
+    if(*n > 0 && unwritten[*n - 1] == piece_unwritten &&
+       ext[*n - 1].start + ext[*n - 1].count == piece.start){
+        ext[*n - 1].count += piece.count;
+        return 0;
+    }
+    if(*n == max){
+        return -1;
+    }
+    ext[*n] = piece;
+    unwritten[*n] = piece_unwritten;
+    (*n)++;
+    return 0;
+}
+
+int defrag_inode(char *image, a1fs_inode *inode, a1fs_blk_t limit, a1fs_blk_t *moved){
+    *moved = 0;
+    a1fs_blk_t blocks = total_datablock_for_inode(image, inode);
+    a1fs_blk_t placed = defrag_placed(image, inode);
+    if(placed == blocks){
+        return 0;
+    }
+    reap_freed(image, false);
+    /*continue right after the placed blocks if the rest fits there, or else
+     *start over in a free run that holds the whole file*/
+    a1fs_blk_t from = placed;
+    a1fs_blk_t dst = inode_extent(image, inode, 0).start + placed;
+    if(free_run(image, dst, dst + 1, blocks - placed) != dst){
+        a1fs_blk_t first, end;
+        group_blocks(image, group_of_inode(image, inode->inode_num - 1), &first, &end);
+        from = 0;
+        dst = find_free_run(image, blocks, first);
+        if(dst == 0){
+            return -1;
+        }
+    }
+    a1fs_blk_t n = blocks - from;
+    if(limit != 0 && limit < n){
+        n = limit;
+    }
+    /*a chunk that ends inside an extent splits it; with no extent to spare,
+     *move the rest of that extent too*/
+    if(inode->i_blocks == max_extents(image)){
+        a1fs_blk_t pos = 0;
+        for(uint32_t i = 0; i < inode->i_blocks && pos < from + n; i++){
+            pos += inode_extent(image, inode, i).count;
+        }
+        n = pos - from;
+    }
+    if(set_block_range(image, dst, n, true) != 0){
+        return -1;
+    }
+
+    /*the new extents: the blocks before the chunk, the chunk at dst, and the
+     *blocks after it, with the sources of the chunk to be freed afterwards*/
+    a1fs_extent ext[NUM_BLOCK], old[NUM_BLOCK];
+    bool unwritten[NUM_BLOCK];
+    uint32_t next = 0, nold = 0;
+    uint32_t max = max_extents(image);
+    size_t bs = block_size(image);
+    a1fs_blk_t pos = 0;
+    int ret = 0;
+    for(uint32_t i = 0; i < inode->i_blocks && ret == 0; i++){
+        a1fs_extent e = inode_extent(image, inode, i);
+        bool u = (inode->i_unwritten >> i) & 1;
+        /*the part of this extent inside the chunk is [lo, hi)*/
+        a1fs_blk_t lo = from > pos ? from - pos : 0;
+        a1fs_blk_t hi = from + n > pos ? from + n - pos : 0;
+        if(lo > e.count) lo = e.count;
+        if(hi > e.count) hi = e.count;
+        if(hi < lo) hi = lo;
+        ret |= defrag_append(ext, unwritten, &next, max, (a1fs_extent){e.start, lo}, u);
+        if(hi > lo){
+            /*unwritten blocks stay unwritten (they may be past the end of the
+             *file), so there is nothing to copy*/
+            if(!u){
+                copy_to_image(find_data_block(image, dst + (pos + lo - from)),
+                              find_data_block(image, e.start + lo), (size_t)(hi - lo) * bs);
+            }
+            ret |= defrag_append(ext, unwritten, &next, max,
+                                 (a1fs_extent){dst + (pos + lo - from), hi - lo}, u);
+            old[nold++] = (a1fs_extent){e.start + lo, hi - lo};
+        }
+        ret |= defrag_append(ext, unwritten, &next, max,
+                             (a1fs_extent){e.start + hi, e.count - hi}, u);
+        pos += e.count;
+    }
+    if(ret != 0){
+        set_block_range(image, dst, n, false);
+        return -1;
+    }
+    /*the copy must be on disk before the inode points at it*/
+    image_sync(image, find_data_block(image, dst), (size_t)n * bs);
+
+    clear_inode_extents(image, inode);
+    inode->i_unwritten = 0;
+    for(uint32_t i = 0; i < next; i++){
+        set_inode_extent(image, inode, i, ext[i]);
+        inode->i_unwritten |= unwritten[i] ? 1u << i : 0;
+    }
+    inode->i_blocks = next;
+    for(uint32_t i = 0; i < nold; i++){
+        free_blocks(image, old[i].start, old[i].count);
+    }
+    *moved = n;
+    return 0;
+}
 
-a1fs_blk_t empty_block_bitmap(char *image){
+
+a1fs_blk_t empty_block_bitmap(char *image, a1fs_blk_t goal){
   a1fs_superblock *sb = (a1fs_superblock *) image;
-  char *bitmap = image + sb->datablock_bitmap *A1FS_BLOCK_SIZE;
-  a1fs_blk_t bit_map_size = sb-> blocks_count;
-  a1fs_blk_t byte = 0;
-  a1fs_blk_t bit = 1;
-  while(bit_map_size){
-    if(bit == 8){
-      byte += 1;
-      bit = 0;
-    }
-    if((bitmap[byte]&(1<<bit)) == 0){
-        return byte*8 + bit;
-        }
-    bit ++;
-    bit_map_size --;
+  a1fs_blk_t data_blocks = sb->blocks_count - sb->first_data_block;
+  reap_freed(image, false);
+  if(goal == 0 || goal >= data_blocks){
+    goal = 1;
+  }
+  /*the goal's group is visited twice: from the goal on first, and last for
+   *the blocks before it*/
+  uint64_t ngroups = group_count(image);
+  uint64_t goal_group = group_of_block(image, goal);
+  for(uint64_t n = 0; n <= ngroups; n++){
+    uint64_t g = (goal_group + n) % ngroups;
+    a1fs_group_desc *desc = group_desc(image, g);
+    if(desc && desc->free_blocks == 0){
+      continue;
+    }
+    a1fs_blk_t first, end;
+    group_blocks(image, g, &first, &end);
+    if(n == 0){
+      first = goal;
+    }
+    if(n == ngroups){
+      end = goal;
+    }
+    if(first == 0){
+      first = 1; // reserved
+    }
+    uint64_t i = first_clear_bit(image, LAZY_BLOCK_BITMAP, sb->datablock_bitmap, first, end);
+    if(i < end){
+      return i;
+    }
   }
   return 0;
 }
 
 int check_block_bitmap(char *image, a1fs_blk_t num){
   a1fs_superblock *sb = (a1fs_superblock *)image;
-  unsigned char *block_bitmap = (unsigned char *)(image + sb->datablock_bitmap *A1FS_BLOCK_SIZE);
+  unsigned char *block_bitmap = (unsigned char *)(image + sb->datablock_bitmap *block_size(image));
   a1fs_blk_t byte = num / 8;
   int bit = num % 8;
+  if(byte / block_size(image) >= lazy_initialized(image, LAZY_BLOCK_BITMAP)){
+    return 0; // not initialized yet, so all free
+  }
+  if(!csum_verify_block(image, sb->datablock_bitmap + byte / block_size(image))){
+    return 1; // treat corrupt bitmap blocks as in use
+  }
   return block_bitmap[byte]&(1<<bit);
 }
 
 
+int format_dir(char *image, a1fs_blk_t start){
+    // a reused block may still hold file data that would read as entries
+    memset(find_data_block(image, start), 0, block_size(image));
+    return 0;
+}
+
+
 int change_parent(char * image, a1fs_inode *parent, char *name, a1fs_ino_t inodeNo){
     a1fs_superblock *sb = (a1fs_superblock *) image;
     a1fs_blk_t freeDataBit;
-    a1fs_extent* lastExt;
+    a1fs_extent lastExt;
+    /*the new entry may go into the last block, which no lookup has read yet*/
+    if(parent->i_blocks != 0){
+        lastExt = inode_extent(image, parent, parent->i_blocks-1);
+        if(!csum_verify_block(image, sb->first_data_block + lastExt.start + lastExt.count-1)){
+            return -3;
+        }
+    }
     if(parent->i_blocks == 0){
-        parent->i_blocks++;
-        freeDataBit = empty_block_bitmap(image);
+        freeDataBit = empty_block_bitmap(image, group_block_goal(image, parent));
         if(freeDataBit == 0){
             return -1;
         }
-        lastExt = &(parent->i_block[parent->i_blocks-1]);
-        lastExt->start = freeDataBit;
-        lastExt->count = 1;
+        parent->i_blocks++;
+        lastExt.start = freeDataBit;
+        lastExt.count = 1;
+        set_inode_extent(image, parent, parent->i_blocks-1, lastExt);
         toggle_block_bit(image, freeDataBit);
+        format_dir(image, freeDataBit);
         }
-    else if((parent->size %A1FS_BLOCK_SIZE) == (2*sizeof(a1fs_dentry))){
-        lastExt = &(parent->i_block[parent->i_blocks-1]);
-        int result = check_block_bitmap(image, lastExt->count+lastExt->start);
+    else if((parent->size %block_size(image)) == (2*sizeof(a1fs_dentry))){
+        lastExt = inode_extent(image, parent, parent->i_blocks-1);
+        int result = check_block_bitmap(image, lastExt.count+lastExt.start);
         if(result == 0){
-            toggle_block_bit(image,lastExt->count+lastExt->start);
-            lastExt->count++;
+            toggle_block_bit(image,lastExt.count+lastExt.start);
+            format_dir(image, lastExt.count+lastExt.start);
+            lastExt.count++;
+            set_inode_extent(image, parent, parent->i_blocks-1, lastExt);
         }
         else{
-            if(parent->i_blocks == NUM_BLOCK){
+            if(parent->i_blocks == max_extents(image)){
                 return -1;
             }
-            parent->i_blocks++;
-            freeDataBit = empty_block_bitmap(image);
+            freeDataBit = empty_block_bitmap(image, group_block_goal(image, parent));
             if(freeDataBit == 0){
                 return -1;}
+            parent->i_blocks++;
             toggle_block_bit(image, freeDataBit);
+            format_dir(image, freeDataBit);
             a1fs_extent new = {freeDataBit,1};
-            parent->i_block[parent->i_blocks-1] = new;
+            set_inode_extent(image, parent, parent->i_blocks-1, new);
         }
     }
         parent->size += sizeof(a1fs_dentry);
-        lastExt = &(parent->i_block[parent->i_blocks-1]);
-        a1fs_dentry *entry = (a1fs_dentry *)(image + (sb->first_data_block + lastExt->start + lastExt->count-1) * A1FS_BLOCK_SIZE);
-        for(a1fs_ino_t i =0; i < A1FS_BLOCK_SIZE/(sizeof(a1fs_dentry)); i++){
+        lastExt = inode_extent(image, parent, parent->i_blocks-1);
+        a1fs_blk_t block = sb->first_data_block + lastExt.start + lastExt.count-1;
+        a1fs_dentry *entry = (a1fs_dentry *)(image + block * block_size(image));
+        for(a1fs_ino_t i =0; i < block_size(image)/(sizeof(a1fs_dentry)); i++){
             if(entry[i].ino == 0){
                 entry[i].ino = inodeNo;
                 strcpy(entry[i].name, name);
+                csum_touch_block(image, block);
                 return 0;
                 }
         }
@@ -216,15 +739,16 @@ int change_parent(char * image, a1fs_inode *parent, char *name, a1fs_ino_t inode
 int remove_entry(char *image, a1fs_inode *parent, char *name){
     a1fs_superblock *sb = (a1fs_superblock *)image;
     for(uint32_t i=0;i < parent->i_blocks;i++){
-        a1fs_extent extend = parent->i_block[i];
+        a1fs_extent extend = inode_extent(image, parent, i);
         a1fs_blk_t start = extend.start;
         a1fs_blk_t count = extend.count;
-        int numOfEntry = A1FS_BLOCK_SIZE/sizeof(a1fs_dentry);
-        a1fs_dentry *entry = (a1fs_dentry *) (image + (sb->first_data_block + start) * A1FS_BLOCK_SIZE);
+        int numOfEntry = block_size(image)/sizeof(a1fs_dentry);
+        a1fs_dentry *entry = (a1fs_dentry *) (image + (sb->first_data_block + start) * block_size(image));
         a1fs_blk_t j = 0;
         while(j < numOfEntry*count){
             if(strcmp(entry[j].name, name) == 0 && entry[j].ino != 0){
                 entry[j].ino = 0;
+                csum_touch_block(image, sb->first_data_block + start + j / numOfEntry);
                 break;
             }
             j++;
@@ -233,67 +757,434 @@ int remove_entry(char *image, a1fs_inode *parent, char *name){
     return 0;
 }
 
-char *find_data_block(char *image, a1fs_ino_t number) {
+char *find_data_block(char *image, a1fs_blk_t number) {
     a1fs_superblock *sb = (a1fs_superblock *)image;
-    return (image +(sb->first_data_block + number)*A1FS_BLOCK_SIZE);
+    return (image +(sb->first_data_block + number)*block_size(image));
 }
 
-char *get_block(char *image, a1fs_ino_t block_number) {
-    return (image + block_number*A1FS_BLOCK_SIZE);
+char *get_block(char *image, a1fs_blk_t block_number) {
+    return (image + block_number*block_size(image));
 }
 
-a1fs_extent *get_new_extent(a1fs_inode *inode) {
-    if (inode->i_blocks >= NUM_BLOCK) {
-        return NULL;
+int get_new_extent(char *image, a1fs_inode *inode) {
+    if (inode->i_blocks >= max_extents(image)) {
+        return -1;
     }
+    inode->i_unwritten &= ~(1u << inode->i_blocks);
+    set_inode_extent(image, inode, inode->i_blocks, (a1fs_extent){0, 0});
     inode->i_blocks++;
-    return &(inode->i_block[inode->i_blocks - 1]);
+    return inode->i_blocks - 1;
 
 }
 
-/*precondition is that the data blocks must be available consecutively within 
- * the size*/
-void null_padding_helper(char *image, int start_offset, a1fs_blk_t to_toggle_index, 
-        uint64_t current_size, uint64_t new_size, int free_indicator) {
-    
-    a1fs_blk_t i_toggle = to_toggle_index;
-    char *i_start; 
-    if (start_offset == 1) {
-        i_start = find_data_block(image, to_toggle_index) + current_size%A1FS_BLOCK_SIZE;
-    } else {
-        i_start = find_data_block(image, to_toggle_index);
-    }
-    uint64_t i_size = new_size - current_size;
-    int started = 0;
-    
-    while (i_size) {
-        if (started == 0) {
-            if (current_size % A1FS_BLOCK_SIZE > 0) {
-                if ((new_size - current_size) + (current_size % A1FS_BLOCK_SIZE) < A1FS_BLOCK_SIZE) {
-                    memset(i_start, 0, new_size - current_size);
-                    i_size -= (new_size - current_size);
-                } else {
-                    /*filling up rest of the block*/
-                    memset(i_start, 0, A1FS_BLOCK_SIZE - (current_size % A1FS_BLOCK_SIZE));
-                    i_start += A1FS_BLOCK_SIZE - (current_size % A1FS_BLOCK_SIZE);
-                    i_size -= A1FS_BLOCK_SIZE - (current_size % A1FS_BLOCK_SIZE);
-                }
+/* A data block can be allocated if it lies inside the data area and its bit
+ * is clear */
+static int block_available(char *image, a1fs_blk_t num){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    return num < sb->blocks_count - sb->first_data_block && check_block_bitmap(image, num) == 0;
+}
+
+a1fs_blk_t file_block(char *image, a1fs_inode *inode, a1fs_blk_t index, a1fs_blk_t *run){
+    for(uint32_t i = 0; i < inode->i_blocks; i++){
+        a1fs_extent ext = inode_extent(image, inode, i);
+        if(index < ext.count){
+            *run = ext.count - index;
+            return ext.start + index;
+        }
+        index -= ext.count;
+    }
+    *run = 0;
+    return 0;
+}
+
+/*file_span() for block size bs; a constant in the common cases, so that the
+ *divisions turn into shifts*/
+static inline char *file_span_bs(char *image, a1fs_inode *inode, uint64_t pos, uint64_t *len,
+                                 const size_t bs){
+    uint64_t ext_bytes = (uint64_t)total_datablock_for_inode(image, inode) * bs;
+    if(pos >= ext_bytes){
+        /*the rest of the file lives in the packed tail*/
+        *len = inode->tail.length - (pos - ext_bytes);
+        return tail_data(image, inode) + (pos - ext_bytes);
+    }
+    a1fs_blk_t run;
+    a1fs_blk_t block = file_block(image, inode, pos / bs, &run);
+    *len = (uint64_t)run * bs - pos % bs;
+    return find_data_block(image, block) + pos % bs;
+}
+
+char *file_span(char *image, a1fs_inode *inode, uint64_t pos, uint64_t *len){
+    switch(block_size(image)){
+    case 4096:
+        return file_span_bs(image, inode, pos, len, 4096);
+    case 65536:
+        return file_span_bs(image, inode, pos, len, 65536);
+    default:
+        return file_span_bs(image, inode, pos, len, block_size(image));
+    }
+}
+
+int alloc_blocks(char *image, a1fs_inode *inode, a1fs_blk_t count){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    reap_freed(image, false);
+    if(sb->free_blocks_count < count){
+        // some of the space may still be on its way back
+        reap_freed(image, true);
+        if(sb->free_blocks_count < count){
+            return -1;
+        }
+    }
+    a1fs_blk_t old_total = total_datablock_for_inode(image, inode);
+    while(count){
+        int e = -1;
+        a1fs_extent ext = {0, 0};
+        /*grow the last extent in place if the block after it is free*/
+        if(inode->i_blocks > 0){
+            e = inode->i_blocks - 1;
+            ext = inode_extent(image, inode, e);
+            if(!block_available(image, ext.start + ext.count)){
+                e = -1;
             }
-            if (free_indicator == 0) {
-                i_toggle++;
+        }
+        if(e < 0){
+            a1fs_blk_t start = empty_block_bitmap(image, group_block_goal(image, inode));
+            if(start == 0 || (e = get_new_extent(image, inode)) < 0){
+                trim_blocks(image, inode, old_total);
+                return -1;
             }
-            started = 1;
-        } else {
-            if (i_size < A1FS_BLOCK_SIZE) {
-                memset(i_start, 0, i_size);
-                i_size -= i_size;
-                toggle_block_bit(image, i_toggle);
-            } else {
-                memset(i_start, 0, A1FS_BLOCK_SIZE);
-                i_size -= A1FS_BLOCK_SIZE;
-                toggle_block_bit(image, i_toggle);
+            ext.start = start;
+            ext.count = 0;
+        }
+        while(count && block_available(image, ext.start + ext.count)){
+            toggle_block_bit(image, ext.start + ext.count);
+            memset(find_data_block(image, ext.start + ext.count), 0, block_size(image));
+            ext.count++;
+            count--;
+        }
+        set_inode_extent(image, inode, e, ext);
+    }
+    return 0;
+}
+
+void trim_blocks(char *image, a1fs_inode *inode, a1fs_blk_t keep){
+    a1fs_blk_t total = total_datablock_for_inode(image, inode);
+    while(total > keep && inode->i_blocks > 0){
+        a1fs_extent ext = inode_extent(image, inode, inode->i_blocks - 1);
+        a1fs_blk_t drop = ext.count < total - keep ? ext.count : total - keep;
+        ext.count -= drop;
+        total -= drop;
+        free_blocks(image, ext.start + ext.count, drop);
+        set_inode_extent(image, inode, inode->i_blocks - 1, ext);
+        if(ext.count == 0){
+            inode->i_blocks--;
+            inode->i_unwritten &= ~(1u << inode->i_blocks);
+        }
+    }
+}
+
+/*insert an extent at index i, moving the later ones (and their unwritten bits) up*/
+static void extent_insert(char *image, a1fs_inode *inode, uint32_t i, a1fs_extent ext, bool unwritten){
+    for(uint32_t j = inode->i_blocks; j > i; j--){
+        set_inode_extent(image, inode, j, inode_extent(image, inode, j - 1));
+    }
+    uint32_t low = inode->i_unwritten & ((1u << i) - 1);
+    uint32_t high = (inode->i_unwritten >> i) << (i + 1);
+    inode->i_unwritten = low | high | (unwritten ? 1u << i : 0);
+    set_inode_extent(image, inode, i, ext);
+    inode->i_blocks++;
+}
+
+/*remove the extent at index i, moving the later ones (and their unwritten bits) down*/
+static void extent_remove(char *image, a1fs_inode *inode, uint32_t i){
+    for(uint32_t j = i; j + 1 < inode->i_blocks; j++){
+        set_inode_extent(image, inode, j, inode_extent(image, inode, j + 1));
+    }
+    uint32_t low = inode->i_unwritten & ((1u << i) - 1);
+    uint32_t high = (inode->i_unwritten >> (i + 1)) << i;
+    inode->i_unwritten = low | high;
+    inode->i_blocks--;
+    set_inode_extent(image, inode, inode->i_blocks, (a1fs_extent){0, 0});
+}
+
+bool file_unwritten(char *image, a1fs_inode *inode, uint64_t pos){
+    a1fs_blk_t index = pos / block_size(image);
+    for(uint32_t i = 0; i < inode->i_blocks; i++){
+        a1fs_blk_t count = inode_extent(image, inode, i).count;
+        if(index < count){
+            return (inode->i_unwritten >> i) & 1;
+        }
+        index -= count;
+    }
+    return false;
+}
+
+void write_unwritten(char *image, a1fs_inode *inode, uint64_t pos, uint64_t len){
+    if(inode->i_unwritten == 0 || len == 0){
+        return;
+    }
+    a1fs_blk_t first = pos / block_size(image);
+    a1fs_blk_t last = (pos + len - 1) / block_size(image) + 1;
+    a1fs_blk_t base = 0;
+    for(uint32_t i = 0; i < inode->i_blocks && base < last; i++){
+        a1fs_extent ext = inode_extent(image, inode, i);
+        a1fs_blk_t from = base;
+        a1fs_blk_t to = base + ext.count;
+        base = to;
+        if(!((inode->i_unwritten >> i) & 1) || to <= first){
+            continue;
+        }
+        /*blocks [a, b) of the extent are written to*/
+        a1fs_blk_t a = (first > from ? first : from) - from;
+        a1fs_blk_t b = (last < to ? last : to) - from;
+        memset(find_data_block(image, ext.start + a), 0, (size_t)(b - a) * block_size(image));
+
+        /*sequential writers: grow the written extent just before this one*/
+        a1fs_extent prev = i > 0 ? inode_extent(image, inode, i - 1) : (a1fs_extent){0, 0};
+        if(a == 0 && i > 0 && !((inode->i_unwritten >> (i - 1)) & 1) &&
+           prev.start + prev.count == ext.start){
+            prev.count += b;
+            ext.start += b;
+            ext.count -= b;
+            set_inode_extent(image, inode, i - 1, prev);
+            set_inode_extent(image, inode, i, ext);
+            if(ext.count == 0){
+                extent_remove(image, inode, i);
+                i--;
             }
-            i_toggle++;
+            continue;
+        }
+        a1fs_extent whole = ext;
+        uint32_t pieces = (a > 0) + (b < whole.count);
+        if(inode->i_blocks + pieces > max_extents(image)){
+            /*no slots to split it; write out the whole extent instead*/
+            memset(find_data_block(image, whole.start), 0, (size_t)whole.count * block_size(image));
+            inode->i_unwritten &= ~(1u << i);
+            continue;
         }
+        if(b < whole.count){
+            a1fs_extent tail = {whole.start + b, whole.count - b};
+            extent_insert(image, inode, i + 1, tail, true);
+        }
+        set_inode_extent(image, inode, i, (a1fs_extent){whole.start + a, b - a});
+        inode->i_unwritten &= ~(1u << i);
+        if(a > 0){
+            a1fs_extent head = {whole.start, a};
+            extent_insert(image, inode, i, head, true);
+        }
+        i += pieces;
+    }
+}
+
+int reserve_blocks(char *image, a1fs_inode *inode, a1fs_blk_t count){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    reap_freed(image, false);
+    if(sb->free_blocks_count < count){
+        reap_freed(image, true);
+        if(sb->free_blocks_count < count){
+            return -1;
+        }
+    }
+    a1fs_blk_t old_total = total_datablock_for_inode(image, inode);
+    while(count){
+        a1fs_blk_t len = count;
+        a1fs_blk_t goal = group_block_goal(image, inode);
+        a1fs_blk_t start = find_free_run(image, count, goal);
+        if(start == 0){
+            /*no run long enough: take the first free run, whatever its length*/
+            start = empty_block_bitmap(image, goal);
+            for(len = 1; start != 0 && len < count && block_available(image, start + len); len++);
+        }
+        uint32_t last = inode->i_blocks - 1;
+        a1fs_extent ext = inode->i_blocks > 0 ? inode_extent(image, inode, last) : (a1fs_extent){0, 0};
+        int e;
+        if(start != 0 && inode->i_blocks > 0 && ((inode->i_unwritten >> last) & 1) &&
+           ext.start + ext.count == start){
+            ext.count += len;
+            set_inode_extent(image, inode, last, ext);
+        } else if(start != 0 && (e = get_new_extent(image, inode)) >= 0){
+            set_inode_extent(image, inode, e, (a1fs_extent){start, len});
+            inode->i_unwritten |= 1u << e;
+        } else {
+            trim_blocks(image, inode, old_total);
+            return -1;
+        }
+        set_block_range(image, start, len, true);
+        count -= len;
+    }
+    return 0;
+}
+
+char *tail_data(char *image, a1fs_inode *inode){
+    return find_data_block(image, inode->tail.block) + inode->tail.offset;
+}
+
+/*reserve length bytes in the open tail block, opening a new one if needed*/
+static int tail_alloc(char *image, uint16_t length, a1fs_blk_t goal, a1fs_tail *tail){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    if(length > block_size(image) - sizeof(a1fs_tail_header)){
+        return -1;
+    }
+    a1fs_tail_header *header = NULL;
+    if(sb->tail_block != 0){
+        header = (a1fs_tail_header *)find_data_block(image, sb->tail_block);
+        if(header->refs == 0){
+            header->used = sizeof(a1fs_tail_header);
+        }
+        else if(header->used + length > block_size(image)){
+            /*full; it is freed once its last tail is released*/
+            sb->tail_block = 0;
+            header = NULL;
+        }
+    }
+    if(header == NULL){
+        /*a1fs_tail holds a 32-bit block number*/
+        if(goal > UINT32_MAX){
+            goal = 1;
+        }
+        a1fs_blk_t block = empty_block_bitmap(image, goal);
+        if(block == 0 || block > UINT32_MAX){
+            return -1;
+        }
+        toggle_block_bit(image, block);
+        sb->tail_block = block;
+        header = (a1fs_tail_header *)find_data_block(image, block);
+        header->refs = 0;
+        header->used = sizeof(a1fs_tail_header);
+    }
+    tail->block = sb->tail_block;
+    tail->offset = header->used;
+    tail->length = length;
+    header->used += length;
+    header->refs++;
+    return 0;
+}
+
+void tail_release(char *image, a1fs_inode *inode){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    if(inode->tail.block == 0){
+        return;
+    }
+    a1fs_tail_header *header = (a1fs_tail_header *)find_data_block(image, inode->tail.block);
+    header->refs--;
+    if(header->refs == 0){
+        if(inode->tail.block == sb->tail_block){
+            header->used = sizeof(a1fs_tail_header);
+        }
+        else{
+            free_blocks(image, inode->tail.block, 1);
+        }
+    }
+    memset(&(inode->tail), 0, sizeof(a1fs_tail));
+}
+
+int tail_resize(char *image, a1fs_inode *inode, uint64_t length){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    if(length == 0 || length >= block_size(image)){
+        return -1;
+    }
+    if(length <= inode->tail.length){
+        inode->tail.length = length;
+        return 0;
+    }
+    /*can only grow if this is the last tail handed out from the open block*/
+    a1fs_tail_header *header = (a1fs_tail_header *)find_data_block(image, inode->tail.block);
+    if(inode->tail.block != sb->tail_block ||
+       inode->tail.offset + inode->tail.length != header->used ||
+       inode->tail.offset + length > block_size(image)){
+        return -1;
+    }
+    memset(tail_data(image, inode) + inode->tail.length, 0, length - inode->tail.length);
+    header->used = inode->tail.offset + length;
+    inode->tail.length = length;
+    return 0;
+}
+
+void tail_pack(char *image, a1fs_inode *inode){
+    uint64_t length = inode->size % block_size(image);
+    /*files with reserved blocks past the end keep them*/
+    if(inode->tail.block != 0 || !S_ISREG(inode->mode) || inode->i_unwritten != 0 ||
+       inode->size > A1FS_TAIL_FILE_BLOCKS * block_size(image) || length == 0){
+        return;
+    }
+    a1fs_blk_t run;
+    a1fs_blk_t last = file_block(image, inode, inode->size / block_size(image), &run);
+    a1fs_tail tail;
+    /*keeping the whole last block is always fine, so failures are ignored*/
+    if(last == 0 || tail_alloc(image, length, group_block_goal(image, inode), &tail) != 0){
+        return;
+    }
+    memcpy(find_data_block(image, tail.block) + tail.offset, find_data_block(image, last), length);
+    inode->tail = tail;
+    trim_blocks(image, inode, inode->size / block_size(image));
+}
+
+int tail_unpack(char *image, a1fs_inode *inode){
+    if(inode->tail.block == 0){
+        return 0;
+    }
+    a1fs_blk_t index = total_datablock_for_inode(image, inode);
+    if(alloc_blocks(image, inode, 1) != 0){
+        return -1;
     }
+    a1fs_blk_t run;
+    a1fs_blk_t block = file_block(image, inode, index, &run);
+    memcpy(find_data_block(image, block), tail_data(image, inode), inode->tail.length);
+    tail_release(image, inode);
+    return 0;
+}
+
+
+/*first block, size and initialization mark of a lazily initialized region*/
+static uint64_t *lazy_mark(char *image, lazy_region region, uint64_t *first, uint64_t *size){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    switch(region){
+    case LAZY_INODE_BITMAP:
+        *first = sb->inode_bitmap;
+        *size = sb->datablock_bitmap - sb->inode_bitmap;
+        return &(sb->inode_bitmap_init);
+    case LAZY_BLOCK_BITMAP:
+        *first = sb->datablock_bitmap;
+        *size = sb->csum_table - sb->datablock_bitmap;
+        return &(sb->block_bitmap_init);
+    case LAZY_CHUNK_MAP:
+        *first = sb->inode_chunk_map;
+        *size = sb->first_inode_block - sb->inode_chunk_map;
+        return &(sb->chunk_map_init);
+    default:
+        *first = sb->first_inode_block;
+        *size = sb->extent_table - sb->first_inode_block;
+        return &(sb->inode_table_init);
+    }
+}
+
+void lazy_init(char *image, lazy_region region, uint64_t index){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    if((sb->features & A1FS_FEATURE_LAZY_INIT) == 0){
+        return;
+    }
+    uint64_t first, size;
+    uint64_t *mark = lazy_mark(image, region, &first, &size);
+    for(; *mark <= index && *mark < size; (*mark)++){
+        memset(get_block(image, first + *mark), 0, block_size(image));
+        if(region != LAZY_INODE_TABLE){
+            csum_touch_block(image, first + *mark);
+        } else {
+            /*the extent records of the inodes in the block go along*/
+            memset(get_block(image, sb->extent_table + *mark * A1FS_EXTENT_TABLE_RATIO), 0,
+                   A1FS_EXTENT_TABLE_RATIO * block_size(image));
+        }
+    }
+    if(sb->inode_bitmap_init == sb->datablock_bitmap - sb->inode_bitmap &&
+       sb->block_bitmap_init == sb->csum_table - sb->datablock_bitmap &&
+       sb->inode_table_init == sb->extent_table - sb->first_inode_block &&
+       sb->chunk_map_init == sb->first_inode_block - sb->inode_chunk_map){
+        sb->features &= ~A1FS_FEATURE_LAZY_INIT;
+    }
+}
+
+uint64_t lazy_initialized(char *image, lazy_region region){
+    a1fs_superblock *sb = (a1fs_superblock *)image;
+    uint64_t first, size;
+    uint64_t *mark = lazy_mark(image, region, &first, &size);
+    return (sb->features & A1FS_FEATURE_LAZY_INIT) ? *mark : size;
 }
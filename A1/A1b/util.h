@@ -21,6 +21,8 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include "a1fs.h"
 
 #define FUSE_USE_VERSION 29
@@ -46,21 +48,192 @@ static inline size_t align_up(size_t x, size_t alignment)
 	return (x + alignment - 1) & (~alignment + 1);
 }
 
+/** Block size of an image in bytes; see a1fs_block_size(). */
+static inline size_t block_size(const char *image)
+{
+	return a1fs_block_size((const a1fs_superblock*)image);
+}
+
+/** Whether an image stores 64-bit extents; see A1FS_FEATURE_64BIT. */
+static inline bool is_64bit(const char *image)
+{
+	return (((const a1fs_superblock*)image)->features & A1FS_FEATURE_64BIT) != 0;
+}
+
+/** Number of extent slots in an inode. */
+static inline uint32_t max_extents(const char *image)
+{
+	return is_64bit(image) ? NUM_BLOCK_64 : NUM_BLOCK;
+}
+
+/** Whether an image allocates its inode table in chunks; see A1FS_FEATURE_DYN_INODES. */
+static inline bool dyn_inodes(const char *image)
+{
+	return (((const a1fs_superblock*)image)->features & A1FS_FEATURE_DYN_INODES) != 0;
+}
+
+/** Number of inodes in an inode chunk (a block of them). */
+static inline uint64_t inodes_per_chunk(const char *image)
+{
+	return block_size(image) / sizeof(a1fs_inode);
+}
+
+/** Extent record of an inode, at the inode's index in the extent table, or
+ * in the blocks after the inode's block in its inode chunk. */
+static inline a1fs_inode_extents *inode_extents(const char *image, const a1fs_inode *inode)
+{
+	const a1fs_superblock *sb = (const a1fs_superblock*)image;
+	size_t bs = block_size(image);
+	if (dyn_inodes(image)) {
+		size_t off = (const char*)inode - image;
+		return (a1fs_inode_extents*)(image + off - off % bs + bs) +
+		       off % bs / sizeof(a1fs_inode);
+	}
+	const a1fs_inode *table = (const a1fs_inode*)(image + sb->first_inode_block * bs);
+	return (a1fs_inode_extents*)(image + sb->extent_table * bs) + (inode - table);
+}
+
+/** Extent i of an inode, in either on-disk format. */
+static inline a1fs_extent inode_extent(const char *image, const a1fs_inode *inode, uint32_t i)
+{
+	const a1fs_inode_extents *rec = inode_extents(image, inode);
+	if (is_64bit(image)) {
+		const a1fs_extent48 *e = &rec->i_block64[i];
+		return (a1fs_extent){e->start_lo | (uint64_t)e->start_hi << 32,
+		                     e->count_lo | (uint64_t)e->count_hi << 32};
+	}
+	return (a1fs_extent){rec->i_block[i].start, rec->i_block[i].count};
+}
+
+/**
+ * Store extent i of an inode; ext must fit in the image's on-disk format.
+ * Keeps inode->i_nblocks up to date.
+ */
+static inline void set_inode_extent(const char *image, a1fs_inode *inode, uint32_t i,
+                                    a1fs_extent ext)
+{
+	a1fs_inode_extents *rec = inode_extents(image, inode);
+	inode->i_nblocks += ext.count - inode_extent(image, inode, i).count;
+	if (is_64bit(image)) {
+		assert(ext.start < A1FS_BLOCKS_MAX_64 && ext.count < A1FS_BLOCKS_MAX_64);
+		rec->i_block64[i] = (a1fs_extent48){(uint32_t)ext.start, ext.start >> 32,
+		                                    ext.count >> 32, (uint32_t)ext.count};
+	} else {
+		assert(ext.start <= UINT32_MAX && ext.count <= UINT32_MAX);
+		rec->i_block[i] = (a1fs_extent32){ext.start, ext.count};
+	}
+}
+
+/** Clear the extents of an inode. */
+static inline void clear_inode_extents(const char *image, a1fs_inode *inode)
+{
+	a1fs_inode_extents *rec = inode_extents(image, inode);
+	memset(rec->i_block, 0, sizeof(rec->i_block));
+	inode->i_blocks = 0;
+	inode->i_nblocks = 0;
+}
+
+/** Inode at path. Verifies every inode on the way and the extent records it
+ * walks, including the file's own, before anything reads them. Returns -1 if
+ * not found, -2 if a component is not a directory, -3 if a checksum fails. */
 int find_inode_path(const char *path, char *sb, a1fs_inode **inode);
+/** find_inode_path() for callers that only read the attributes in the inode
+ * itself, so the extent record of the file is not touched (nor verified). */
+int find_inode_attrs(const char *path, char *sb, a1fs_inode **inode);
 int find_inode_name(char *name, char *sb, a1fs_inode *inode);
+/** Inode with number num. NULL if it is in an inode chunk that is not
+ * allocated (A1FS_FEATURE_DYN_INODES). */
 a1fs_inode *find_inode_num(char *image, a1fs_ino_t num);
-a1fs_blk_t total_datablock_for_inode(a1fs_inode *inode);
+/** Inode bitmap index of an inode, from where it is in the image. With
+ * A1FS_FEATURE_DYN_INODES that is its inode_num, if it leads back to the same
+ * inode; otherwise inodes_count. */
+a1fs_ino_t inode_index(char *image, a1fs_inode *inode);
+/** Entry for inode chunk chunk in the inode chunk map, initializing its block
+ * if needed. The caller must verify and touch the block when changing it. */
+uint64_t *chunk_map_entry(char *image, uint64_t chunk);
+/** Allocate the inode chunk that holds inode bitmap index index, if it is not
+ * allocated yet, near the start of the inode's group. Returns -1 if there is
+ * no space (or the chunk map is corrupt). */
+int alloc_inode_chunk(char *image, a1fs_ino_t index);
+a1fs_blk_t total_datablock_for_inode(char *image, a1fs_inode *inode);
 int read_entries(fuse_fill_dir_t filler, char *image, a1fs_inode *inode, void *buf);
-a1fs_ino_t empty_inode_bitmap(char *image);
-a1fs_blk_t empty_block_bitmap(char *image);
+/** Bitmap index of a free inode for a new file (or directory, if dir) in
+ * parent, searching from the group chosen by group_find_inode(). 0 if none. */
+a1fs_ino_t empty_inode_bitmap(char *image, a1fs_inode *parent, bool dir);
+/** First free data block at or after goal (wrapping around). 0 if none. */
+a1fs_blk_t empty_block_bitmap(char *image, a1fs_blk_t goal);
 int toggle_inode_bit(char *image, a1fs_ino_t num);
 int toggle_block_bit(char *image, a1fs_blk_t num);
+/** Mark count data blocks from start as used or free, updating the free count
+ * once. The bits must all be in the other state. Returns -1 if corrupt. */
+int set_block_range(char *image, a1fs_blk_t start, a1fs_blk_t count, bool used);
+/** Free count data blocks from start. When mounted, the bits are cleared later
+ * by the reclaim queue (see reclaim.h). */
+void free_blocks(char *image, a1fs_blk_t start, a1fs_blk_t count);
+/** First run of count free data blocks at or after goal (first fit, wrapping
+ * around). Returns 0 if none. */
+a1fs_blk_t find_free_run(char *image, a1fs_blk_t count, a1fs_blk_t goal);
+/** Move up to limit blocks (0 for all) of a file so that it becomes one
+ * physical run: right after the blocks already in place when there is room,
+ * or else from the start into a free run that holds the whole file. The number
+ * of blocks copied goes into *moved. Returns -1 if no space. */
+int defrag_inode(char *image, a1fs_inode *inode, a1fs_blk_t limit, a1fs_blk_t *moved);
+/** Number of blocks at the start of a file that are already one run. */
+a1fs_blk_t defrag_placed(char *image, a1fs_inode *inode);
+/** Add an entry for inode inodeNo to a directory. Returns -1 if there is no
+ * space, -3 if the directory block it goes into is corrupt. */
 int change_parent(char * image, a1fs_inode *parent_inode, char *name, a1fs_ino_t inodeNo);
 int remove_entry(char *image, a1fs_inode *parent, char *name);
-char *find_data_block(char *image, a1fs_ino_t block_number);
-char *get_block(char *image, a1fs_ino_t block_number);
+char *find_data_block(char *image, a1fs_blk_t block_number);
+char *get_block(char *image, a1fs_blk_t block_number);
 int format_dir(char *image,  a1fs_blk_t start);
 int check_block_bitmap(char *image, a1fs_blk_t num);
-a1fs_extent *get_new_extent(a1fs_inode *inode);
-void null_padding_helper(char *image, int start_offset, a1fs_blk_t to_toggle_index, 
-uint64_t current_size, uint64_t new_size, int free_indicator);
+/** Append an empty extent to an inode (as written). Returns its index, or -1
+ * if there is no free extent slot. */
+int get_new_extent(char *image, a1fs_inode *inode);
+
+/** Data block holding the index-th block of a file; *run receives the number
+ * of blocks left in its extent. Returns 0 if the file is not that long. */
+a1fs_blk_t file_block(char *image, a1fs_inode *inode, a1fs_blk_t index, a1fs_blk_t *run);
+/** Pointer to byte pos of a file (in its extents or its packed tail); *len
+ * receives the number of contiguous bytes that follow in the image. */
+char *file_span(char *image, a1fs_inode *inode, uint64_t pos, uint64_t *len);
+/** Whether byte pos of a file lies in an unwritten (reserved) extent. */
+bool file_unwritten(char *image, a1fs_inode *inode, uint64_t pos);
+/** Turn the unwritten blocks under bytes [pos, pos + len) of a file into
+ * written (zeroed) ones, splitting extents as needed. Call before writing. */
+void write_unwritten(char *image, a1fs_inode *inode, uint64_t pos, uint64_t len);
+/** Append count blocks to a file as unwritten extents, in as few runs as
+ * possible and without touching the blocks. Returns -1 (allocating nothing)
+ * if there is no space or no free extent slot. */
+int reserve_blocks(char *image, a1fs_inode *inode, a1fs_blk_t count);
+/** Append count zeroed blocks to a file. Returns -1 (allocating nothing) if
+ * there is no space or no free extent slot. */
+int alloc_blocks(char *image, a1fs_inode *inode, a1fs_blk_t count);
+/** Free the blocks of a file past the first keep blocks. */
+void trim_blocks(char *image, a1fs_inode *inode, a1fs_blk_t keep);
+
+/** Pointer to the packed tail of a file. */
+char *tail_data(char *image, a1fs_inode *inode);
+/** Drop the packed tail of a file, freeing its tail block if it was the last. */
+void tail_release(char *image, a1fs_inode *inode);
+/** Resize a packed tail in place. Returns -1 if it can't grow where it is. */
+int tail_resize(char *image, a1fs_inode *inode, uint64_t length);
+/** Move the partial last block of a small file into a shared tail block. */
+void tail_pack(char *image, a1fs_inode *inode);
+/** Move a packed tail back into a block of its own. Returns -1 if no space. */
+int tail_unpack(char *image, a1fs_inode *inode);
+
+/** Metadata regions that mkfs leaves for lazy initialization. */
+typedef enum lazy_region {
+	LAZY_INODE_BITMAP,
+	LAZY_BLOCK_BITMAP,
+	LAZY_INODE_TABLE,
+	LAZY_CHUNK_MAP,
+} lazy_region;
+
+/** Zero the blocks of a region up to and including its index-th block, unless
+ * already done (A1FS_FEATURE_LAZY_INIT). */
+void lazy_init(char *image, lazy_region region, uint64_t index);
+/** Number of leading blocks of a region that are initialized. */
+uint64_t lazy_initialized(char *image, lazy_region region);